@@ -95,6 +95,12 @@ int verify_token(const char *token, char *error_msg, int error_size) {
 
 // Cleanup expired sessions
 void cleanup_expired_sessions() {
+    // Xoá theo lô để không khoá bảng quá lâu
+    while (cleanup_expired_sessions_batch(1000) == 1000) {
+    }
+}
+
+int cleanup_expired_sessions_batch(int limit) {
     char query[256];
     time_t now = time(NULL);
     char now_str[32];
@@ -102,8 +108,11 @@ void cleanup_expired_sessions() {
     strftime(now_str, sizeof(now_str), "%Y-%m-%d %H:%M:%S", tm_info);
     
     snprintf(query, sizeof(query),
-             "DELETE FROM user_sessions WHERE expires_at < '%s'",
-             now_str);
+             "DELETE FROM user_sessions WHERE expires_at < '%s' LIMIT %d",
+             now_str, limit);
     
-    mysql_query(conn, query);
+    if (mysql_query(conn, query) != 0) {
+        return -1;
+    }
+    return (int)mysql_affected_rows(conn);
 }
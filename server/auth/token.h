@@ -25,4 +25,7 @@ int verify_token(const char *token, char *error_msg, int error_size);
 // Delete expired sessions
 void cleanup_expired_sessions();
 
+// Delete at most limit expired sessions; returns rows deleted or -1
+int cleanup_expired_sessions_batch(int limit);
+
 #endif
@@ -0,0 +1,169 @@
+// base64_bench: so sánh các kernel base64 (utils/base64.c) với OpenSSL
+// EVP_EncodeBlock/EVP_DecodeBlock trên chunk FILE_CHUNK_SIZE byte của
+// giao thức. Trước khi đo, mọi đường phải cho cùng kết quả với OpenSSL.
+//
+//   make bench && ./base64_bench [rounds]
+//
+// Mã thoát: 0 = ok, 1 = các đường cho kết quả khác nhau
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include "utils/base64.h"
+
+#define FILE_CHUNK_SIZE 2048
+#define BENCH_ENCODED_SIZE (BASE64_ENCODED_LEN(FILE_CHUNK_SIZE) + 1)
+#define BENCH_DEFAULT_ROUNDS 200000
+#define BENCH_CHECK_INPUTS 2000
+
+static const char *impls[] = { "scalar", "ssse3", "avx2" };
+#define IMPL_COUNT ((int)(sizeof(impls) / sizeof(impls[0])))
+
+static volatile unsigned long sink;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void fill_random(unsigned char *buf, size_t len, unsigned int *seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (unsigned char)(rand_r(seed) >> 7);
+    }
+}
+
+// EVP_DecodeBlock trả về cả các byte 0 ứng với '=': trừ đi cho đúng độ dài
+static int openssl_decode(const char *in, size_t in_len, unsigned char *out) {
+    int n = EVP_DecodeBlock(out, (const unsigned char *)in, (int)in_len);
+    if (n < 0) return -1;
+    if (in_len >= 1 && in[in_len - 1] == '=') n--;
+    if (in_len >= 2 && in[in_len - 2] == '=') n--;
+    return n;
+}
+
+// Mọi độ dài 0..FILE_CHUNK_SIZE (và ngẫu nhiên thêm), mỗi kernel phải
+// mã hoá giống hệt OpenSSL và giải mã lại ra dữ liệu gốc
+static int check_impl(const char *name) {
+    unsigned char data[FILE_CHUNK_SIZE];
+    unsigned char decoded[FILE_CHUNK_SIZE];
+    char ours[BENCH_ENCODED_SIZE];
+    char ref[BENCH_ENCODED_SIZE];
+    unsigned int seed = 12345;
+
+    for (int t = 0; t < BENCH_CHECK_INPUTS + FILE_CHUNK_SIZE + 1; t++) {
+        size_t len = (t <= FILE_CHUNK_SIZE) ? (size_t)t : (size_t)(rand_r(&seed) % (FILE_CHUNK_SIZE + 1));
+        fill_random(data, len, &seed);
+
+        int ref_len = EVP_EncodeBlock((unsigned char *)ref, data, (int)len);
+        int our_len = base64_encode(data, len, ours, sizeof(ours));
+        if (our_len != ref_len || memcmp(ours, ref, (size_t)ref_len) != 0) {
+            fprintf(stderr, "%s: encode differs from OpenSSL (len %zu)\n", name, len);
+            return -1;
+        }
+
+        size_t out_len = 0;
+        if (base64_decode(ours, (size_t)our_len, decoded, sizeof(decoded), &out_len) != 0
+            || out_len != len || memcmp(decoded, data, len) != 0) {
+            fprintf(stderr, "%s: decode does not round-trip (len %zu)\n", name, len);
+            return -1;
+        }
+        if (len > 0 && openssl_decode(ref, (size_t)ref_len, decoded) != (int)len) {
+            fprintf(stderr, "OpenSSL decode length mismatch (len %zu)\n", len);
+            return -1;
+        }
+
+        // Ký tự lạ giữa chuỗi: mọi kernel phải từ chối như nhau
+        if (our_len >= 8) {
+            ours[our_len / 2] = '*';
+            if (base64_decode(ours, (size_t)our_len, decoded, sizeof(decoded), &out_len) == 0) {
+                fprintf(stderr, "%s: accepted invalid input (len %zu)\n", name, len);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void report(const char *name, const char *op, double secs, long rounds) {
+    double ns = secs * 1e9 / (double)rounds;
+    double mbps = (double)FILE_CHUNK_SIZE * (double)rounds / secs / (1024.0 * 1024.0);
+    printf("%-8s %-7s %9.1f ns/chunk %9.1f MiB/s\n", name, op, ns, mbps);
+}
+
+static void bench_ours(const char *name, const unsigned char *data, long rounds) {
+    char text[BENCH_ENCODED_SIZE];
+    unsigned char decoded[FILE_CHUNK_SIZE];
+    size_t out_len = 0;
+    int text_len = 0;
+
+    double t0 = now_sec();
+    for (long r = 0; r < rounds; r++) {
+        text_len = base64_encode(data, FILE_CHUNK_SIZE, text, sizeof(text));
+        sink += (unsigned long)text[r % text_len];
+    }
+    report(name, "encode", now_sec() - t0, rounds);
+
+    t0 = now_sec();
+    for (long r = 0; r < rounds; r++) {
+        base64_decode(text, (size_t)text_len, decoded, sizeof(decoded), &out_len);
+        sink += decoded[r % FILE_CHUNK_SIZE];
+    }
+    report(name, "decode", now_sec() - t0, rounds);
+}
+
+static void bench_openssl(const unsigned char *data, long rounds) {
+    char text[BENCH_ENCODED_SIZE];
+    unsigned char decoded[FILE_CHUNK_SIZE + 3];
+    int text_len = 0;
+
+    double t0 = now_sec();
+    for (long r = 0; r < rounds; r++) {
+        text_len = EVP_EncodeBlock((unsigned char *)text, data, FILE_CHUNK_SIZE);
+        sink += (unsigned long)text[r % text_len];
+    }
+    report("openssl", "encode", now_sec() - t0, rounds);
+
+    t0 = now_sec();
+    for (long r = 0; r < rounds; r++) {
+        openssl_decode(text, (size_t)text_len, decoded);
+        sink += decoded[r % FILE_CHUNK_SIZE];
+    }
+    report("openssl", "decode", now_sec() - t0, rounds);
+}
+
+int main(int argc, char **argv) {
+    long rounds = (argc > 1) ? atol(argv[1]) : BENCH_DEFAULT_ROUNDS;
+    if (rounds <= 0) {
+        fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    const char *detected = base64_impl_name();
+    int ok[IMPL_COUNT];
+    for (int i = 0; i < IMPL_COUNT; i++) {
+        ok[i] = base64_select_impl(impls[i]) == 0;
+        if (!ok[i]) {
+            printf("%-8s not supported on this CPU, skipped\n", impls[i]);
+            continue;
+        }
+        if (check_impl(impls[i]) != 0) return 1;
+    }
+    printf("all kernels match OpenSSL; runtime pick: %s\n", detected);
+    printf("%ld rounds of %d-byte chunks\n\n", rounds, FILE_CHUNK_SIZE);
+
+    unsigned char data[FILE_CHUNK_SIZE];
+    unsigned int seed = 42;
+    fill_random(data, sizeof(data), &seed);
+
+    bench_openssl(data, rounds);
+    for (int i = 0; i < IMPL_COUNT; i++) {
+        if (!ok[i]) continue;
+        base64_select_impl(impls[i]);
+        bench_ours(impls[i], data, rounds);
+    }
+    return 0;
+}
@@ -10,6 +10,13 @@
 #include <limits.h>
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <zstd.h>
+#include "utils/compress.h"
+#include "utils/base64.h"
+#include "utils/crc32c.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 1234
@@ -25,6 +32,10 @@
 #define UPLOAD_COMMAND_BUFFER (BASE64_ENCODED_SIZE + 512)
 #define DOWNLOAD_RESPONSE_BUFFER (BASE64_ENCODED_SIZE + 512)
 #define MAX_FILENAME_LEN 255
+#define MAX_BUSY_RETRIES 10
+#define LISTING_CACHE_SIZE 32
+#define BULK_MAX_FILES 1000          // file tối đa trong một phiên upload thư mục
+#define BULK_LINE_MAX 16000          // độ dài tối đa một dòng UPLOAD_BULK_ENTRY
 
 // Global token storage
 char current_token[TOKEN_LENGTH + 1] = {0};
@@ -32,6 +43,9 @@ char current_token[TOKEN_LENGTH + 1] = {0};
 // Global socket - persistent connection
 int global_sock = -1;
 
+// Codec nén thương lượng với server qua HELLO (bitmask CODEC_MASK)
+int negotiated_codecs = 0;
+
 // Forward declarations
 int connect_to_server();
 void handle_create_group();
@@ -45,7 +59,9 @@ void handle_view_pending_requests();
 void handle_approve_request();
 void handle_view_my_invitations();
 void handle_upload_file(int group_id);
+void handle_upload_folder(int group_id, int current_dir_id);
 void handle_download_file(int group_id);
+void handle_download_folder(int group_id, int current_dir_id);
 void handle_list_members(int group_id);
 void handle_list_folder_content(int group_id, int dir_id, int is_admin);
 void handle_create_folder(int group_id, int parent_dir_id);
@@ -53,6 +69,296 @@ void handle_delete_item(int group_id);
 void handle_rename_item(int group_id);
 void handle_move_item(int group_id);
 void handle_copy_item(int group_id);
+void handle_file_versions(int group_id);
+
+// Server quá tải trả "503 retry_after=<giây>": chờ rồi cho phép gửi lại
+// chunk đó, tối đa MAX_BUSY_RETRIES lần liên tiếp
+static int wait_if_server_busy(const char *response, int *retries) {
+    if (strncmp(response, "503", 3) != 0) return 0;
+    if (++(*retries) > MAX_BUSY_RETRIES) return 0;
+
+    int seconds = 1;
+    const char *hint = strstr(response, "retry_after=");
+    if (hint) {
+        seconds = atoi(hint + strlen("retry_after="));
+    }
+    if (seconds < 1) seconds = 1;
+    if (seconds > 30) seconds = 30;
+
+    printf("Server đang quá tải, thử lại sau %d giây...\n", seconds);
+    sleep(seconds);
+    return 1;
+}
+
+// Cache các bản liệt kê thư mục đã nhận, theo version server gửi kèm.
+// Khi mở lại thư mục, client gửi if_version=<n>; server trả 304 nếu
+// thư mục chưa đổi và client hiển thị lại bản trong cache.
+typedef struct {
+    int group_id;
+    int dir_id;                      // như lúc yêu cầu (0 = thư mục gốc)
+    unsigned long long version;
+    char *response;                  // dòng phản hồi 200, đã bỏ CRLF
+    unsigned long used;
+} CachedListing;
+
+static CachedListing listing_cache[LISTING_CACHE_SIZE];
+static unsigned long listing_cache_tick = 0;
+
+static CachedListing *listing_cache_find(int group_id, int dir_id) {
+    for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+        CachedListing *c = &listing_cache[i];
+        if (c->response && c->group_id == group_id && c->dir_id == dir_id) {
+            c->used = ++listing_cache_tick;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static void listing_cache_store(int group_id, int dir_id, const char *response) {
+    const char *v = strstr(response, " version=");
+    if (!v) return;                  // server cũ: không có version để so
+    unsigned long long version = strtoull(v + strlen(" version="), NULL, 10);
+
+    CachedListing *c = listing_cache_find(group_id, dir_id);
+    if (!c) {
+        // Chỗ trống, hoặc bản lâu nhất chưa dùng đến
+        c = &listing_cache[0];
+        for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+            if (!listing_cache[i].response) {
+                c = &listing_cache[i];
+                break;
+            }
+            if (listing_cache[i].used < c->used) c = &listing_cache[i];
+        }
+    }
+
+    char *copy = strdup(response);
+    if (!copy) return;
+    free(c->response);
+    c->group_id = group_id;
+    c->dir_id = dir_id;
+    c->version = version;
+    c->response = copy;
+    c->used = ++listing_cache_tick;
+}
+
+// Bỏ các bản liệt kê của thư mục dir_id (theo id thật trong phản hồi)
+static void listing_cache_drop(int group_id, int dir_id) {
+    for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+        CachedListing *c = &listing_cache[i];
+        int current_dir_id = 0;
+        if (!c->response || c->group_id != group_id) continue;
+        if (c->dir_id == dir_id ||
+            (sscanf(c->response, "%*d %d", &current_dir_id) == 1 && current_dir_id == dir_id)) {
+            free(c->response);
+            c->response = NULL;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Sự kiện server đẩy về: "EVENT <loại> <group_id> [dir_id]" xen giữa các
+// phản hồi trên chính global_sock (SUBSCRIBE_USER / SUBSCRIBE_GROUP).
+// Thay cho việc hỏi lại lời mời / yêu cầu tham gia / nội dung thư mục.
+//
+// Mọi phản hồi trên global_sock đọc qua recv_reply(): byte đã nhận nằm
+// trong main_buf, dòng bắt đầu bằng "EVENT " ở đầu dòng được xử lý và bỏ
+// đi, phần còn lại trả cho lệnh đang chờ. Server không chen sự kiện vào
+// giữa một phản hồi hay luồng archive.
+// ---------------------------------------------------------------------------
+
+static char main_buf[64 * 1024];     // đã nhận từ global_sock, chưa trả cho ai
+static size_t main_len = 0;
+static int main_line_start = 1;      // byte đầu main_buf mở đầu một dòng
+static unsigned int main_conn_gen = 0;   // tăng mỗi lần global_sock được mở lại
+static unsigned int events_gen = 0;      // kết nối đã gửi SUBSCRIBE (0 = chưa)
+static int watched_group = 0;
+
+// global_sock vừa được mở lại: bỏ dữ liệu cũ, đăng ký sự kiện lại từ đầu
+static void main_conn_reset(void) {
+    main_len = 0;
+    main_line_start = 1;
+    main_conn_gen++;
+}
+
+static void handle_event_line(const char *line) {
+    char type[32] = {0};
+    int group_id = 0, dir_id = 0;
+    if (sscanf(line, "EVENT %31s %d %d", type, &group_id, &dir_id) < 1) return;
+
+    if (strcmp(type, "DIR_CHANGED") == 0) {
+        listing_cache_drop(group_id, dir_id);
+    } else if (strcmp(type, "OVERFLOW") == 0) {
+        for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+            free(listing_cache[i].response);
+            listing_cache[i].response = NULL;
+        }
+    } else if (strcmp(type, "INVITATION") == 0) {
+        printf("\n[Thông báo] Bạn có lời mời tham gia nhóm #%d\n", group_id);
+    } else if (strcmp(type, "JOIN_REQUEST") == 0) {
+        printf("\n[Thông báo] Có yêu cầu mới xin vào nhóm #%d\n", group_id);
+    } else if (strcmp(type, "REQUEST_HANDLED") == 0) {
+        printf("\n[Thông báo] Yêu cầu tham gia nhóm #%d đã được xét duyệt\n", group_id);
+    } else if (strcmp(type, "REMOVED") == 0) {
+        printf("\n[Thông báo] Bạn đã bị xóa khỏi nhóm #%d\n", group_id);
+    } else if (strcmp(type, "MEMBERS_CHANGED") == 0) {
+        printf("\n[Thông báo] Danh sách thành viên nhóm #%d đã thay đổi\n", group_id);
+    }
+}
+
+static void main_buf_consume(size_t n) {
+    main_line_start = (main_buf[n - 1] == '\n');
+    main_len -= n;
+    memmove(main_buf, main_buf + n, main_len);
+}
+
+// Số byte đầu main_buf thuộc về phản hồi: tới dòng đầu tiên là (hoặc còn
+// có thể thành) một dòng EVENT
+static size_t reply_prefix(void) {
+    size_t pos = 0;
+    int at_start = main_line_start;
+    while (pos < main_len) {
+        if (at_start) {
+            size_t n = (main_len - pos < 6) ? main_len - pos : 6;
+            if (memcmp(main_buf + pos, "EVENT ", n) == 0) break;
+        }
+        char *nl = memchr(main_buf + pos, '\n', main_len - pos);
+        if (!nl) return main_len;
+        pos = (size_t)(nl - main_buf) + 1;
+        at_start = 1;
+    }
+    return pos;
+}
+
+// Xử lý một dòng EVENT đủ ở đầu main_buf. 1 nếu đã xử lý, 0 nếu chưa có
+static int take_event_line(void) {
+    if (!main_line_start || main_len < 6 || memcmp(main_buf, "EVENT ", 6) != 0) return 0;
+    char *nl = memchr(main_buf, '\n', main_len);
+    if (!nl) return 0;
+
+    char line[256];
+    size_t len = (size_t)(nl - main_buf);
+    if (len > 0 && main_buf[len - 1] == '\r') len--;
+    if (len >= sizeof(line)) len = sizeof(line) - 1;
+    memcpy(line, main_buf, len);
+    line[len] = '\0';
+    main_buf_consume((size_t)(nl - main_buf) + 1);
+    handle_event_line(line);
+    return 1;
+}
+
+// Thay cho recv_reply(sock, buf, size) khi chờ phản hồi: trên global_sock,
+// các dòng EVENT được xử lý và không bao giờ lọt vào buf
+static int recv_reply(int sock, char *buf, size_t size) {
+    if (sock != global_sock) return (int)recv(sock, buf, size, 0);
+
+    for (;;) {
+        size_t n = reply_prefix();
+        if (n > 0) {
+            if (n > size) n = size;
+            memcpy(buf, main_buf, n);
+            main_buf_consume(n);
+            return (int)n;
+        }
+        if (take_event_line()) continue;
+
+        if (main_len == sizeof(main_buf)) main_len = 0;   // không thể xảy ra: bỏ
+        ssize_t got = recv(sock, main_buf + main_len, sizeof(main_buf) - main_len, 0);
+        if (got <= 0) return (int)got;
+        main_len += (size_t)got;
+    }
+}
+
+// Dữ liệu nhị phân (luồng archive) sau dòng phản hồi: trả phần còn trong
+// main_buf trước, không tách dòng EVENT
+static int recv_raw(int sock, char *buf, size_t size) {
+    if (sock == global_sock && main_len > 0) {
+        size_t n = (main_len < size) ? main_len : size;
+        memcpy(buf, main_buf, n);
+        main_buf_consume(n);
+        return (int)n;
+    }
+    return (int)recv(sock, buf, size, 0);
+}
+
+// Gửi lệnh SUBSCRIBE/UNSUBSCRIBE trên global_sock, trả mã trạng thái (-1 nếu lỗi)
+static int events_command(const char *command) {
+    int sock = global_sock;
+    if (sock < 0 || send(sock, command, strlen(command), 0) < 0) return -1;
+
+    char reply[64];
+    size_t len = 0;
+    while (len == 0 || reply[len - 1] != '\n') {
+        if (len == sizeof(reply) - 1) break;
+        int n = recv_reply(sock, reply + len, sizeof(reply) - 1 - len);
+        if (n <= 0) return -1;
+        len += (size_t)n;
+    }
+    reply[len] = '\0';
+    return atoi(reply);
+}
+
+// Đăng ký sự kiện trên kết nối hiện tại sau khi đăng nhập (và lại sau mỗi
+// lần global_sock được mở lại)
+static void events_start(void) {
+    if (current_token[0] == '\0' || connect_to_server() < 0) return;
+    if (events_gen == main_conn_gen) return;
+    events_gen = main_conn_gen;
+
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "SUBSCRIBE_USER %s\r\n", current_token);
+    events_command(command);
+    if (watched_group > 0) {
+        snprintf(command, sizeof(command), "SUBSCRIBE_GROUP %s %d\r\n", current_token, watched_group);
+        if (events_command(command) != 200) watched_group = 0;
+    }
+}
+
+// Huỷ mọi đăng ký trên kết nối (đổi tài khoản trên cùng global_sock)
+static void events_stop(void) {
+    if (events_gen == main_conn_gen && global_sock >= 0 && current_token[0] != '\0') {
+        char command[BUFFER_SIZE];
+        snprintf(command, sizeof(command), "UNSUBSCRIBE %s\r\n", current_token);
+        events_command(command);
+    }
+    watched_group = 0;
+    events_gen = 0;
+}
+
+// Theo dõi nhóm đang mở (một nhóm tại một thời điểm)
+static void events_watch_group(int group_id) {
+    events_start();
+    if (events_gen != main_conn_gen || watched_group == group_id) return;
+
+    char command[BUFFER_SIZE];
+    if (watched_group > 0) {
+        snprintf(command, sizeof(command), "UNSUBSCRIBE %s %d\r\n", current_token, watched_group);
+        events_command(command);
+    }
+    snprintf(command, sizeof(command), "SUBSCRIBE_GROUP %s %d\r\n", current_token, group_id);
+    watched_group = (events_command(command) == 200) ? group_id : 0;
+}
+
+// Xử lý các sự kiện đã đến, không chờ. Giữa hai lệnh không còn phản hồi
+// nào đang chờ, nên dòng khác EVENT (nếu có) là thừa và bị bỏ
+static void events_poll(void) {
+    events_start();
+    if (events_gen != main_conn_gen) return;
+
+    for (;;) {
+        while (main_len > 0) {
+            if (take_event_line()) continue;
+            char *nl = memchr(main_buf, '\n', main_len);
+            if (!nl) break;
+            main_buf_consume((size_t)(nl - main_buf) + 1);
+        }
+        if (main_len == sizeof(main_buf)) main_len = 0;
+        ssize_t n = recv(global_sock, main_buf + main_len, sizeof(main_buf) - main_len, MSG_DONTWAIT);
+        if (n <= 0) break;
+        main_len += (size_t)n;
+    }
+}
 
 // Lấy đường dẫn file trong thư mục Downloads, xử lý trùng tên kiểu "file(1).ext"
 static void build_download_path(const char *filename, char *out_path, size_t out_size) {
@@ -118,7 +424,7 @@ int is_token_valid() {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     // KHÔNG đóng socket vì dùng chung global_sock
 
     if (bytes > 0) {
@@ -162,6 +468,9 @@ void get_password(char *password, int size) {
 
 void print_menu() {
     int logged_in = is_token_valid();
+    if (logged_in) {
+        events_poll();
+    }
 
     printf("\n========== FILE SHARING CLIENT ==========\n");
     if (logged_in) {
@@ -213,7 +522,14 @@ int create_new_connection() {
 int connect_to_server() {
     // Nếu đã có kết nối, trả về luôn
     if (global_sock >= 0) {
-        return global_sock;
+        // Server ngắt kết nối rảnh quá lâu: thấy EOF/lỗi thì kết nối lại
+        char probe;
+        ssize_t n = recv(global_sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            return global_sock;
+        }
+        close(global_sock);
+        global_sock = -1;
     }
 
     // Tạo kết nối mới
@@ -241,6 +557,25 @@ int connect_to_server() {
     }
 
     global_sock = sock;  // Lưu vào global_sock
+    main_conn_reset();
+
+    // Thương lượng codec nén cho các lần upload/download trên kết nối này.
+    // Server cũ trả ERR UNKNOWN_COMMAND -> không nén.
+    char hello[64];
+    snprintf(hello, sizeof(hello), "HELLO codecs=zstd,lz4\r\n");
+    negotiated_codecs = 0;
+    if (send(sock, hello, strlen(hello), 0) > 0) {
+        char reply[128];
+        int bytes = recv_reply(sock, reply, sizeof(reply) - 1);
+        if (bytes > 0) {
+            reply[bytes] = '\0';
+            reply[strcspn(reply, "\r\n")] = '\0';
+            if (strncmp(reply, "200 codecs=", 11) == 0) {
+                negotiated_codecs = codec_parse_list(reply + 11);
+            }
+        }
+    }
+
     return sock;
 }
 
@@ -270,7 +605,7 @@ void handle_register() {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes > 0) {
         response[bytes] = '\0';
         // Remove trailing CRLF
@@ -325,7 +660,7 @@ void handle_login() {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes > 0) {
         response[bytes] = '\0';
         // Remove trailing CRLF
@@ -339,6 +674,8 @@ void handle_login() {
             strncpy(current_token, token, TOKEN_LENGTH);
             current_token[TOKEN_LENGTH] = '\0';
             printf("✓ Đăng nhập thành công!\n");
+            events_stop();
+            events_start();
         } else if (status_code == 404) {
             printf("✗ Username không tồn tại hoặc sai password!\n");
         } else if (status_code == 500) {
@@ -372,7 +709,7 @@ void handle_logout() {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes > 0) {
         response[bytes] = '\0';
         char *crlf = strstr(response, "\r\n");
@@ -382,6 +719,7 @@ void handle_logout() {
         if (sscanf(response, "%d", &status_code) == 1 && status_code == 200) {
             // Clear token
             memset(current_token, 0, sizeof(current_token));
+            events_stop();
             printf("✓ Đăng xuất thành công!\n");
         } else {
             printf("✗ Đăng xuất thất bại!\n");
@@ -404,117 +742,6 @@ void sanitize_pipe(char *str) {
     }
 }
 
-static const char base64_table[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-static int base64_encode(const unsigned char *data, size_t len,
-                         char *out, size_t out_size) {
-    if (!out || out_size == 0) return -1;
-
-    size_t encoded_len = ((len + 2) / 3) * 4;
-    if (encoded_len + 1 > out_size) return -1;
-
-    size_t i = 0;
-    size_t j = 0;
-    while (i + 2 < len) {
-        out[j++] = base64_table[(data[i] >> 2) & 0x3F];
-        out[j++] = base64_table[((data[i] & 0x3) << 4) |
-                                ((data[i + 1] >> 4) & 0xF)];
-        out[j++] = base64_table[((data[i + 1] & 0xF) << 2) |
-                                ((data[i + 2] >> 6) & 0x3)];
-        out[j++] = base64_table[data[i + 2] & 0x3F];
-        i += 3;
-    }
-
-    if (i < len) {
-        out[j++] = base64_table[(data[i] >> 2) & 0x3F];
-        if (i + 1 == len) {
-            out[j++] = base64_table[(data[i] & 0x3) << 4];
-            out[j++] = '=';
-            out[j++] = '=';
-        } else {
-            out[j++] = base64_table[((data[i] & 0x3) << 4) |
-                                    ((data[i + 1] >> 4) & 0xF)];
-            out[j++] = base64_table[((data[i + 1] & 0xF) << 2) & 0x3F];
-            out[j++] = '=';
-        }
-    }
-
-    out[j] = '\0';
-    return (int)encoded_len;
-}
-
-static int base64_value(char c) {
-    if (c >= 'A' && c <= 'Z') return c - 'A';
-    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
-    if (c >= '0' && c <= '9') return c - '0' + 52;
-    if (c == '+') return 62;
-    if (c == '/') return 63;
-    if (c == '=') return -2; // padding
-    return -1;
-}
-
-// static int base64_decode(const char *input,
-//                          unsigned char *output,
-//                          size_t out_size,
-//                          size_t *out_len) {
-//     if (!input || !output || !out_len) return -1;
-
-//     size_t len = strlen(input);
-//     if (len == 0) {
-//         *out_len = 0;
-//         return 0;
-//     }
-//     if (len % 4 != 0) {
-//         return -1;
-//     }
-
-//     size_t decoded_max = (len / 4) * 3;
-//     if (decoded_max > out_size) {
-//         return -1;
-//     }
-
-//     size_t out_index = 0;
-//     for (size_t i = 0; i < len; i += 4) {
-//         int vals[4];
-//         for (int j = 0; j < 4; ++j) {
-//             int v = base64_value(input[i + j]);
-//             if (v == -1) {
-//                 return -1;
-//             }
-//             vals[j] = v;
-//         }
-
-//         if (input[i] == '=' || input[i + 1] == '=') {
-//             return -1;
-//         }
-
-//         int pad2 = (input[i + 2] == '=');
-//         int pad3 = (input[i + 3] == '=');
-//         int v2 = (pad2 || vals[2] < 0) ? 0 : vals[2];
-//         int v3 = (pad3 || vals[3] < 0) ? 0 : vals[3];
-
-//         int triple = ((vals[0] & 0x3F) << 18) |
-//                      ((vals[1] & 0x3F) << 12) |
-//                      ((v2 & 0x3F) << 6) |
-//                      (v3 & 0x3F);
-
-//         output[out_index++] = (unsigned char)((triple >> 16) & 0xFF);
-
-//         if (input[i + 2] != '=') {
-//             if (out_index >= out_size) return -1;
-//             output[out_index++] = (unsigned char)((triple >> 8) & 0xFF);
-//         }
-//         if (input[i + 3] != '=') {
-//             if (out_index >= out_size) return -1;
-//             output[out_index++] = (unsigned char)(triple & 0xFF);
-//         }
-//     }
-
-//     *out_len = out_index;
-//     return 0;
-// }
-
 static void extract_filename(const char *path, char *out, size_t size) {
     if (!out || size == 0) return;
     out[0] = '\0';
@@ -598,7 +825,7 @@ void handle_create_group() {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
         return;
@@ -636,7 +863,7 @@ void handle_list_groups() {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
         return;
@@ -786,7 +1013,11 @@ void handle_group_access(int group_id, const char *user_role) {
            user_role);
     printf("└────────────────────────────────────────────┘\n");
 
+    // Nhận sự kiện của nhóm này thay vì hỏi lại server
+    events_watch_group(group_id);
+
     while (1) {
+        events_poll();
         printf("\n┌─────────────────────────────────────────┐\n");
         printf("│         QUẢN LÝ NHÓM - MENU             │\n");
         printf("├─────────────────────────────────────────┤\n");
@@ -896,7 +1127,7 @@ int handle_leave_group(int group_id) {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
         return 0;
@@ -960,7 +1191,7 @@ void handle_remove_user_from_group(int group_id) {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
         return;
@@ -992,7 +1223,7 @@ void handle_remove_user_from_group(int group_id) {
     send(sock, command, strlen(command), 0);
 
     memset(response, 0, sizeof(response));
-    bytes = recv(sock, response, sizeof(response) - 1, 0);
+    bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
         return;
@@ -1059,7 +1290,7 @@ void handle_invite_user(int group_id) {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
     // Connection kept open (using global_sock)
@@ -1103,7 +1334,7 @@ void handle_invite_user(int group_id) {
 
     // Nhận response
     memset(response, 0, sizeof(response));
-    bytes = recv(sock, response, sizeof(response) - 1, 0);
+    bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
     // Connection kept open (using global_sock)
@@ -1153,12 +1384,125 @@ void handle_invite_user(int group_id) {
     // Connection kept open (using global_sock)
 }
 
+// Xóa / di chuyển / sao chép nhiều item trong một lệnh:
+// DELETE_ITEMS | MOVE_ITEMS | COPY_ITEMS, danh sách dạng F:12,D:7,...
+// Server trả "200|207 <thành công>/<tổng> <mã 1>,<mã 2>,..." theo thứ tự gửi.
+static void handle_batch_items(int group_id, const char *cmd_name, const char *action) {
+    printf(" Danh sách item (vd: F:12,D:7,F:30; trống để quay lại): ");
+    char items[BUFFER_SIZE];
+    if (!fgets(items, sizeof(items), stdin)) return;
+    items[strcspn(items, "\r\n")] = '\0';
+    if (items[0] == '\0') {
+        printf(" Quay lại menu nhóm...\n");
+        return;
+    }
+    if (strchr(items, ' ')) {
+        printf("Danh sách không được chứa khoảng trắng!\n");
+        return;
+    }
+
+    int target_dir_id = 0;
+    if (strcmp(cmd_name, "DELETE_ITEMS") != 0) {
+        printf(" ID thư mục đích: ");
+        if (scanf("%d", &target_dir_id) != 1) {
+            while (getchar() != '\n');
+            printf("ID không hợp lệ!\n");
+            return;
+        }
+        while (getchar() != '\n');
+    }
+
+    int sock = connect_to_server();
+    if (sock < 0) {
+        printf("Không thể kết nối đến server!\n");
+        return;
+    }
+
+    char command[BUFFER_SIZE + 128];
+    if (target_dir_id > 0) {
+        snprintf(command, sizeof(command), "%s %s %d %d %s\r\n",
+                 cmd_name, current_token, group_id, target_dir_id, items);
+    } else {
+        snprintf(command, sizeof(command), "%s %s %d %s\r\n",
+                 cmd_name, current_token, group_id, items);
+    }
+    send(sock, command, strlen(command), 0);
+
+    // Phản hồi có thể dài (một mã cho mỗi item): đọc đến hết dòng
+    char response[2 * BUFFER_SIZE] = {0};
+    int total = 0;
+    while (total < (int)sizeof(response) - 1 && !strstr(response, "\r\n")) {
+        int bytes = recv_reply(sock, response + total, sizeof(response) - 1 - total);
+        if (bytes <= 0) break;
+        total += bytes;
+        response[total] = '\0';
+    }
+    char *crlf = strstr(response, "\r\n");
+    if (!crlf) {
+        printf("Không nhận được phản hồi từ server.\n");
+        global_sock = -1;
+        return;
+    }
+    *crlf = '\0';
+
+    int status_code = 0, ok = 0, count = 0, offset = 0;
+    if (sscanf(response, "%d", &status_code) != 1) {
+        printf("Phản hồi không hợp lệ: %s\n", response);
+        global_sock = -1;
+        return;
+    }
+
+    if (status_code == 200 || status_code == 207) {
+        sscanf(response, "%*d %d/%d %n", &ok, &count, &offset);
+        printf("%s thành công %d/%d item.\n", action, ok, count);
+        if (status_code == 207 && offset > 0) {
+            // Ghép mã trả về với danh sách đã gửi để chỉ ra item lỗi
+            char *item_save = NULL, *code_save = NULL;
+            char *item = strtok_r(items, ",", &item_save);
+            char *code = strtok_r(response + offset, ",", &code_save);
+            while (item && code) {
+                int c = atoi(code);
+                if (c != 200) {
+                    printf("  %-12s %s\n", item,
+                           c == 400 ? "bị lặp lại / không hợp lệ" :
+                           c == 404 ? "không tìm thấy trong nhóm" :
+                           c == 409 ? "không thể chuyển thư mục vào chính nó" : "thất bại");
+                }
+                item = strtok_r(NULL, ",", &item_save);
+                code = strtok_r(NULL, ",", &code_save);
+            }
+        }
+    } else {
+        switch (status_code) {
+            case 400:
+                printf("Danh sách không hợp lệ (tối đa 1000 item, dạng F:<id>,D:<id>)!\n");
+                break;
+            case 401:
+                printf("Token không hợp lệ hoặc đã hết hạn!\n");
+                break;
+            case 403:
+                printf("Bạn không có quyền (chỉ admin) hoặc thư mục đích không thuộc nhóm!\n");
+                break;
+            case 500:
+                printf("Lỗi server!\n");
+                break;
+            case 507:
+                printf("Vượt quá dung lượng cho phép: %s\n", response);
+                break;
+            default:
+                printf("Lỗi không xác định (code: %d)\n", status_code);
+        }
+    }
+
+    global_sock = -1;
+}
+
 void handle_delete_item(int group_id) {
     printf("\n┌────────────────────────────────────────────┐\n");
     printf("│          XÓA FILE/THƯ MỤC                  │\n");
     printf("└────────────────────────────────────────────┘\n");
 
-    printf("\n Loại (F=File, D=Directory): ");
+    printf("\n Loại (F=File, D=Directory, L=Nhiều item): ");
     char type[10];
     if (scanf("%9s", type) != 1) {
         while (getchar() != '\n');
@@ -1167,6 +1511,11 @@ void handle_delete_item(int group_id) {
     }
     while (getchar() != '\n');
 
+    if (strcasecmp(type, "L") == 0) {
+        handle_batch_items(group_id, "DELETE_ITEMS", "Xóa");
+        return;
+    }
+
     if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
         printf("Loại phải là 'F' hoặc 'D'!\n");
         return;
@@ -1199,7 +1548,7 @@ void handle_delete_item(int group_id) {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
     // Connection kept open (using global_sock)
@@ -1265,7 +1614,7 @@ void handle_list_members(int group_id) {
 
     // Nhận response
     char response[BUFFER_SIZE * 4] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
         return;
@@ -1432,7 +1781,7 @@ void handle_create_folder(int group_id, int parent_dir_id) {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
     // Connection kept open (using global_sock)
@@ -1486,21 +1835,29 @@ void handle_list_folder_content(int group_id, int dir_id, int is_admin) {
     }
 
     while (1) {
+        events_poll();
+
         int sock = connect_to_server();
         if (sock < 0) {
             printf("Không thể kết nối đến server!\n");
             return;
         }
 
-        // Gửi lệnh LIST_FOLDER_CONTENT
+        // Gửi lệnh LIST_FOLDER_CONTENT (kèm version đang có trong cache)
+        CachedListing *cached = listing_cache_find(group_id, dir_id);
         char command[BUFFER_SIZE];
-        snprintf(command, sizeof(command), "LIST_FOLDER_CONTENT %s %d %d\r\n",
-                 current_token, group_id, dir_id);
+        if (cached) {
+            snprintf(command, sizeof(command), "LIST_FOLDER_CONTENT %s %d %d if_version=%llu\r\n",
+                     current_token, group_id, dir_id, cached->version);
+        } else {
+            snprintf(command, sizeof(command), "LIST_FOLDER_CONTENT %s %d %d\r\n",
+                     current_token, group_id, dir_id);
+        }
         send(sock, command, strlen(command), 0);
 
         // Nhận response
         char response[BUFFER_SIZE * 8] = {0};
-        int bytes = recv(sock, response, sizeof(response) - 1, 0);
+        int bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("Không nhận được phản hồi từ server.\n");
             return;
@@ -1511,6 +1868,13 @@ void handle_list_folder_content(int group_id, int dir_id, int is_admin) {
         char *crlf = strstr(response, "\r\n");
         if (crlf) *crlf = '\0';
 
+        // 304: thư mục chưa đổi, dùng lại bản trong cache
+        if (cached && strncmp(response, "304", 3) == 0) {
+            snprintf(response, sizeof(response), "%s", cached->response);
+        } else if (strncmp(response, "200", 3) == 0) {
+            listing_cache_store(group_id, dir_id, response);
+        }
+
         int status_code = 0;
         int current_dir_id = 0;
         int parent_dir_id = 0;
@@ -1675,7 +2039,10 @@ void handle_list_folder_content(int group_id, int dir_id, int is_admin) {
         printf("│ ────────────────────────────────────────────  │\n");
         printf("│ U               Upload file                   │\n");
         printf("│ D               Download file                 │\n");
+        printf("│ B              Upload cả thư mục              │\n");
+        printf("│ T              Tải cả thư mục (.tar)          │\n");
         printf("│ N              Tạo thư mục mới                │\n");
+        printf("│ V              Phiên bản của file             │\n");
         if (is_admin) {
             printf("│ X               Xóa item (Admin)              │\n");
             printf("│ R               Đổi tên (Admin)               │\n");
@@ -1727,9 +2094,18 @@ void handle_list_folder_content(int group_id, int dir_id, int is_admin) {
         else if (strcasecmp(action, "D") == 0) {
             handle_download_file(group_id);
         }
+        else if (strcasecmp(action, "B") == 0) {
+            handle_upload_folder(group_id, dir_id);
+        }
+        else if (strcasecmp(action, "T") == 0) {
+            handle_download_folder(group_id, dir_id);
+        }
         else if (strcasecmp(action, "N") == 0) {
             handle_create_folder(group_id, dir_id);
         }
+        else if (strcasecmp(action, "V") == 0) {
+            handle_file_versions(group_id);
+        }
         else if (strcasecmp(action, "X") == 0 && is_admin) {
             handle_delete_item(group_id);
         }
@@ -1803,7 +2179,7 @@ void handle_rename_item(int group_id) {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
     // Connection kept open (using global_sock)
@@ -1854,7 +2230,7 @@ void handle_move_item(int group_id) {
     printf("│       DI CHUYỂN FILE/THƯ MỤC           │\n");
     printf("└────────────────────────────────────────────┘\n");
 
-    printf("\n Loại (F=File, D=Directory): ");
+    printf("\n Loại (F=File, D=Directory, L=Nhiều item): ");
     char type[10];
     if (scanf("%9s", type) != 1) {
         while (getchar() != '\n');
@@ -1863,6 +2239,11 @@ void handle_move_item(int group_id) {
     }
     while (getchar() != '\n');
 
+    if (strcasecmp(type, "L") == 0) {
+        handle_batch_items(group_id, "MOVE_ITEMS", "Di chuyển");
+        return;
+    }
+
     if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
         printf("Loại phải là 'F' hoặc 'D'!\n");
         return;
@@ -1911,7 +2292,7 @@ void handle_move_item(int group_id) {
     }
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
 
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
@@ -1947,6 +2328,9 @@ void handle_move_item(int group_id) {
             printf("Không tìm thấy %s hoặc thư mục đích!\n",
                    strcasecmp(type, "F") == 0 ? "file" : "thư mục");
             break;
+        case 409:
+            printf("Không thể di chuyển thư mục vào chính nó hoặc thư mục con của nó!\n");
+            break;
         case 500:
             printf("Lỗi server!\n");
             break;
@@ -1963,7 +2347,7 @@ void handle_copy_item(int group_id) {
     printf("│            SAO CHÉP FILE/THƯ MỤC           │\n");
     printf("└────────────────────────────────────────────┘\n");
 
-    printf("\n Loại (F=File, D=Directory): ");
+    printf("\n Loại (F=File, D=Directory, L=Nhiều item): ");
     char type[10];
     if (scanf("%9s", type) != 1) {
         while (getchar() != '\n');
@@ -1972,6 +2356,11 @@ void handle_copy_item(int group_id) {
     }
     while (getchar() != '\n');
 
+    if (strcasecmp(type, "L") == 0) {
+        handle_batch_items(group_id, "COPY_ITEMS", "Sao chép");
+        return;
+    }
+
     if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
         printf("Loại phải là 'F' hoặc 'D'!\n");
         return;
@@ -2013,7 +2402,7 @@ void handle_copy_item(int group_id) {
     send(sock, command, strlen(command), 0);
 
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("Không nhận được phản hồi từ server.\n");
     // Connection kept open (using global_sock)
@@ -2059,6 +2448,198 @@ void handle_copy_item(int group_id) {
     global_sock = -1;
 }
 
+// Gửi một lệnh, nhận một dòng phản hồi (đã bỏ CRLF). Mã trạng thái, hoặc -1
+static int send_version_command(const char *command, char *response, size_t size) {
+    int sock = connect_to_server();
+    if (sock < 0) {
+        printf("Không thể kết nối đến server!\n");
+        return -1;
+    }
+    send(sock, command, strlen(command), 0);
+
+    int bytes = recv_reply(sock, response, size - 1);
+    if (bytes <= 0) {
+        printf("Không nhận được phản hồi từ server.\n");
+        global_sock = -1;
+        return -1;
+    }
+    response[bytes] = '\0';
+
+    char *crlf = strstr(response, "\r\n");
+    if (crlf) *crlf = '\0';
+
+    int status_code;
+    if (sscanf(response, "%d", &status_code) != 1) {
+        printf("Phản hồi không hợp lệ: %s\n", response);
+        global_sock = -1;
+        return -1;
+    }
+    return status_code;
+}
+
+static void format_version_size(long long size, char *out, size_t out_size) {
+    if (size < 1024) {
+        snprintf(out, out_size, "%lld B", size);
+    } else if (size < 1024 * 1024) {
+        snprintf(out, out_size, "%.2f KB", size / 1024.0);
+    } else if (size < 1024 * 1024 * 1024) {
+        snprintf(out, out_size, "%.2f MB", size / (1024.0 * 1024.0));
+    } else {
+        snprintf(out, out_size, "%.2f GB", size / (1024.0 * 1024.0 * 1024.0));
+    }
+}
+
+// Xem các phiên bản cũ của một file (LIST_VERSIONS) và khôi phục một
+// phiên bản (RESTORE_VERSION)
+void handle_file_versions(int group_id) {
+    (void)group_id;
+    printf("\n┌────────────────────────────────────────────┐\n");
+    printf("│            PHIÊN BẢN CỦA FILE              │\n");
+    printf("└────────────────────────────────────────────┘\n");
+
+    printf("\n Nhập ID của file (hoặc 0 để quay lại): ");
+    int file_id;
+    if (scanf("%d", &file_id) != 1) {
+        while (getchar() != '\n');
+        printf("ID không hợp lệ!\n");
+        return;
+    }
+    while (getchar() != '\n');
+
+    if (file_id == 0) {
+        printf("Quay lại menu nhóm...\n");
+        return;
+    }
+
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE] = {0};
+    snprintf(command, sizeof(command), "LIST_VERSIONS %s %d\r\n", current_token, file_id);
+    int status_code = send_version_command(command, response, sizeof(response));
+    if (status_code < 0) return;
+
+    switch (status_code) {
+        case 200:
+            break;
+        case 401:
+            printf("Token không hợp lệ hoặc đã hết hạn!\n");
+            global_sock = -1;
+            return;
+        case 403:
+            printf("Bạn không thuộc nhóm chứa file này!\n");
+            global_sock = -1;
+            return;
+        case 404:
+            printf("Không tìm thấy file!\n");
+            global_sock = -1;
+            return;
+        case 500:
+            printf("Lỗi server!\n");
+            global_sock = -1;
+            return;
+        default:
+            printf("Lỗi không xác định (code: %d)\n", status_code);
+            global_sock = -1;
+            return;
+    }
+
+    // "200 file_id current_no size V|version_no|file_size|created_at|uploader|storage ..."
+    int current_no = 0;
+    long long current_size = 0;
+    int consumed = 0;
+    if (sscanf(response, "%*d %*d %d %lld%n", &current_no, &current_size, &consumed) != 2) {
+        printf("Phản hồi không hợp lệ: %s\n", response);
+        global_sock = -1;
+        return;
+    }
+
+    char size_str[20];
+    format_version_size(current_size, size_str, sizeof(size_str));
+    printf("\n┌────────┬──────────────┬─────────────────────┬────────────────┬────────┐\n");
+    printf("│ %-6s │ %-12s │ %-19s │ %-14s │ %-6s │\n",
+           "Bản", "Kích thước", "Thời gian", "Người upload", "Lưu");
+    printf("├────────┼──────────────┼─────────────────────┼────────────────┼────────┤\n");
+    printf("│ %-6d │ %-12s │ %-19s │ %-14s │ %-6s │\n",
+           current_no, size_str, "(hiện tại)", "-", "full");
+
+    int version_count = 0;
+    char *saveptr = NULL;
+    for (char *entry = strtok_r(response + consumed, " ", &saveptr); entry;
+         entry = strtok_r(NULL, " ", &saveptr)) {
+        int version_no = 0;
+        long long size = 0;
+        long long created = 0;
+        char uploader[64] = "?";
+        char storage[16] = "?";
+        if (sscanf(entry, "V|%d|%lld|%lld|%63[^|]|%15s",
+                   &version_no, &size, &created, uploader, storage) < 3) {
+            continue;
+        }
+
+        char time_str[32] = "-";
+        time_t t = (time_t)created;
+        struct tm *tm_info = created > 0 ? localtime(&t) : NULL;
+        if (tm_info) strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+        format_version_size(size, size_str, sizeof(size_str));
+        printf("│ %-6d │ %-12s │ %-19s │ %-14s │ %-6s │\n",
+               version_no, size_str, time_str, uploader, storage);
+        version_count++;
+    }
+    printf("└────────┴──────────────┴─────────────────────┴────────────────┴────────┘\n");
+
+    if (version_count == 0) {
+        printf("File chưa có phiên bản cũ nào.\n");
+        global_sock = -1;
+        return;
+    }
+
+    printf("\n Nhập số phiên bản cần khôi phục (hoặc 0 để quay lại): ");
+    int version_no;
+    if (scanf("%d", &version_no) != 1) {
+        while (getchar() != '\n');
+        printf("Số phiên bản không hợp lệ!\n");
+        global_sock = -1;
+        return;
+    }
+    while (getchar() != '\n');
+
+    if (version_no == 0) {
+        global_sock = -1;
+        return;
+    }
+
+    snprintf(command, sizeof(command), "RESTORE_VERSION %s %d %d\r\n",
+             current_token, file_id, version_no);
+    status_code = send_version_command(command, response, sizeof(response));
+    if (status_code < 0) return;
+
+    switch (status_code) {
+        case 200:
+            printf("Đã khôi phục phiên bản %d, nội dung cũ được lưu thành phiên bản %d.\n",
+                   version_no, current_no);
+            break;
+        case 401:
+            printf("Token không hợp lệ hoặc đã hết hạn!\n");
+            break;
+        case 403:
+            printf("Bạn không thuộc nhóm chứa file này!\n");
+            break;
+        case 404:
+            printf("Không tìm thấy file hoặc phiên bản!\n");
+            break;
+        case 507:
+            printf("Vượt quá dung lượng cho phép: %s\n", response);
+            break;
+        case 500:
+            printf("Lỗi server!\n");
+            break;
+        default:
+            printf("Lỗi không xác định (code: %d)\n", status_code);
+    }
+
+    // Connection kept open (using global_sock)
+    global_sock = -1;
+}
+
 void handle_request_join_group() {
     if (!is_token_valid()) {
         printf("Bạn cần đăng nhập để gửi yêu cầu tham gia nhóm!\n");
@@ -2081,7 +2662,7 @@ void handle_request_join_group() {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("✗ Không nhận được phản hồi từ server.\n");
         return;
@@ -2189,7 +2770,7 @@ void handle_request_join_group() {
 
     // Nhận response
     memset(response, 0, sizeof(response));
-    bytes = recv(sock, response, sizeof(response) - 1, 0);
+    bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("✗ Không nhận được phản hồi từ server.\n");
         return;
@@ -2262,7 +2843,7 @@ void handle_view_pending_requests() {
 
         // Nhận response
         char response[BUFFER_SIZE] = {0};
-        int bytes = recv(sock, response, sizeof(response) - 1, 0);
+        int bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("✗ Không nhận được phản hồi từ server.\n");
             return;
@@ -2416,7 +2997,7 @@ void handle_view_pending_requests() {
 
         // Nhận response
         memset(response, 0, sizeof(response));
-        bytes = recv(sock, response, sizeof(response) - 1, 0);
+        bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("✗ Không nhận được phản hồi từ server.\n");
             continue;
@@ -2537,7 +3118,7 @@ void handle_approve_request() {
 
     // Nhận response
     char response[BUFFER_SIZE] = {0};
-    int bytes = recv(sock, response, sizeof(response) - 1, 0);
+    int bytes = recv_reply(sock, response, sizeof(response) - 1);
     if (bytes <= 0) {
         printf("✗ Không nhận được phản hồi từ server.\n");
         return;
@@ -2616,7 +3197,7 @@ void handle_view_my_invitations() {
 
         // Nhận response
         char response[BUFFER_SIZE] = {0};
-        int bytes = recv(sock, response, sizeof(response) - 1, 0);
+        int bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("Không nhận được phản hồi từ server.\n");
             return;
@@ -2806,7 +3387,7 @@ void handle_view_my_invitations() {
 
         // Nhận response
         memset(response, 0, sizeof(response));
-        bytes = recv(sock, response, sizeof(response) - 1, 0);
+        bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("Không nhận được phản hồi từ server.\n");
             return;
@@ -2912,6 +3493,7 @@ void handle_upload_file(int group_id) {
                            : 1;
 
     unsigned char buffer[FILE_CHUNK_SIZE];
+    unsigned char packed[FILE_CHUNK_SIZE];
     char base64_buf[BASE64_ENCODED_SIZE];
     char command[UPLOAD_COMMAND_BUFFER];
 
@@ -2926,6 +3508,8 @@ void handle_upload_file(int group_id) {
     }
 
     int success = 1;
+    int busy_retries = 0;
+    CodecType upload_codec = CODEC_NONE;
     for (int chunk_idx = 1; chunk_idx <= total_chunks; ++chunk_idx) {
         size_t bytes_read = 0;
         if (file_size > 0) {
@@ -2937,17 +3521,50 @@ void handle_upload_file(int group_id) {
             }
         }
 
-        int enc_len = base64_encode(buffer, bytes_read, base64_buf, sizeof(base64_buf));
+        // Lấy mẫu entropy chunk đầu tiên để quyết định nén cả lần upload
+        if (chunk_idx == 1 && codec_should_compress(buffer, bytes_read)) {
+            upload_codec = codec_pick(negotiated_codecs);
+        }
+
+        // Chỉ gửi bản nén khi nhỏ hơn dữ liệu gốc
+        const unsigned char *payload = buffer;
+        size_t payload_len = bytes_read;
+        CodecType chunk_codec = CODEC_NONE;
+        if (upload_codec != CODEC_NONE && bytes_read > 0) {
+            int n = codec_compress(upload_codec, buffer, bytes_read, packed, sizeof(packed));
+            if (n > 0 && (size_t)n < bytes_read) {
+                payload = packed;
+                payload_len = (size_t)n;
+                chunk_codec = upload_codec;
+            }
+        }
+
+        int enc_len = base64_encode(payload, payload_len, base64_buf, sizeof(base64_buf));
         if (enc_len < 0) {
             printf("Lỗi mã hoá chunk %d.\n", chunk_idx);
             success = 0;
             break;
         }
 
+        char codec_opt[32] = "";
+        if (chunk_codec != CODEC_NONE) {
+            snprintf(codec_opt, sizeof(codec_opt), " codec=%s", codec_name(chunk_codec));
+        }
+
+        // CRC32C của dữ liệu gốc để server kiểm tra chunk sau khi giải mã/giải nén
+        uint32_t chunk_crc = crc32c(0, buffer, bytes_read);
+
+        // Khai báo kích thước file ở chunk đầu để server kiểm tra quota trước
+        char size_opt[32] = "";
+        if (chunk_idx == 1) {
+            snprintf(size_opt, sizeof(size_opt), " size=%lld", file_size);
+        }
+
         int cmd_len = snprintf(command, sizeof(command),
-                               "UPLOAD_FILE %s %d %d %s %d %d %s\r\n",
+                               "UPLOAD_FILE %s %d %d %s %d %d %s%s crc=%08x%s\r\n",
                                current_token, group_id, dir_id, filename,
-                               chunk_idx, total_chunks, base64_buf);
+                               chunk_idx, total_chunks, base64_buf, codec_opt,
+                               (unsigned int)chunk_crc, size_opt);
         if (cmd_len < 0 || cmd_len >= (int)sizeof(command)) {
             printf("Chunk %d quá lớn để gửi.\n", chunk_idx);
             success = 0;
@@ -2961,7 +3578,7 @@ void handle_upload_file(int group_id) {
         }
 
         char response[256];
-        int bytes = recv(sock, response, sizeof(response) - 1, 0);
+        int bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("Không nhận được phản hồi cho chunk %d.\n", chunk_idx);
             success = 0;
@@ -2969,12 +3586,33 @@ void handle_upload_file(int group_id) {
         }
         response[bytes] = '\0';
 
+        if (wait_if_server_busy(response, &busy_retries)) {
+            // Đọc lại đúng chunk này ở vòng lặp sau
+            if (fseek(fp, -(long)bytes_read, SEEK_CUR) != 0) {
+                success = 0;
+                break;
+            }
+            chunk_idx--;
+            continue;
+        }
+        busy_retries = 0;
+
         if (strncmp(response, "500", 3) == 0) {
             printf("Server trả lỗi 500 ở chunk %d.\n", chunk_idx);
             success = 0;
             break;
         }
 
+        if (strncmp(response, "507", 3) == 0) {
+            char kind[16] = "";
+            long long limit = 0, used = 0;
+            sscanf(response, "507 quota=%15s limit=%lld used=%lld", kind, &limit, &used);
+            printf("Vượt quota %s: đã dùng %lld / %lld bytes, file cần %lld bytes.\n",
+                   strcmp(kind, "user") == 0 ? "người dùng" : "nhóm", used, limit, file_size);
+            success = 0;
+            break;
+        }
+
         int status = 0;
         int resp_chunk = 0;
         int resp_total = 0;
@@ -3003,47 +3641,546 @@ void handle_upload_file(int group_id) {
     }
 }
 
-static int base64_decode(const char *input, unsigned char *output, size_t out_size, size_t *out_len) {
-    if (!input || !output || !out_len) return -1;
+// Đọc đệm trên socket cho luồng archive của DOWNLOAD_FOLDER
+typedef struct {
+    int sock;
+    int raw;                         // sau dòng phản hồi: dữ liệu archive, không tách EVENT
+    char buf[64 * 1024];
+    int len;
+    int pos;
+} SockReader;
+
+static int sock_reader_fill(SockReader *r) {
+    if (r->pos == r->len) {
+        r->pos = r->len = 0;
+    }
+    size_t space = sizeof(r->buf) - r->len;
+    int n = r->raw ? recv_raw(r->sock, r->buf + r->len, space)
+                   : recv_reply(r->sock, r->buf + r->len, space);
+    if (n <= 0) return -1;
+    r->len += (int)n;
+    return 0;
+}
+
+// Một dòng (bỏ CRLF) vào out; -1 nếu mất kết nối hoặc dòng quá dài
+static int sock_reader_line(SockReader *r, char *out, size_t out_size) {
+    for (;;) {
+        for (int i = r->pos; i + 1 < r->len; i++) {
+            if (r->buf[i] == '\r' && r->buf[i + 1] == '\n') {
+                size_t n = (size_t)(i - r->pos);
+                if (n >= out_size) return -1;
+                memcpy(out, r->buf + r->pos, n);
+                out[n] = '\0';
+                r->pos = i + 2;
+                return 0;
+            }
+        }
+        if (r->pos > 0) {
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+        if (r->len == (int)sizeof(r->buf) || sock_reader_fill(r) != 0) return -1;
+    }
+}
+
+// Tối đa max byte đã nhận (chờ nếu chưa có); trả số byte, -1 nếu mất kết nối
+static int sock_reader_take(SockReader *r, const char **data, int max) {
+    if (r->pos == r->len && sock_reader_fill(r) != 0) return -1;
+    int n = r->len - r->pos;
+    if (n > max) n = max;
+    *data = r->buf + r->pos;
+    r->pos += n;
+    return n;
+}
 
-    size_t len = strlen(input);
-    if (len == 0) {
-        *out_len = 0;
-        return 0;
+// Tải cả thư mục (kèm thư mục con) thành một file .tar trong Downloads.
+// Server gửi archive thành các đoạn "<len>\r\n<dữ liệu>", kết thúc "0 <mã>";
+// nếu đã thương lượng zstd thì archive được nén và client giải nén khi ghi.
+void handle_download_folder(int group_id, int current_dir_id) {
+    if (!is_token_valid()) {
+        printf("Bạn cần đăng nhập để download thư mục!\n");
+        return;
+    }
+
+    printf("\n--- DOWNLOAD THƯ MỤC (TAR) ---\n");
+    printf("Nhập ID thư mục (0 = thư mục đang xem): ");
+    int dir_id = 0;
+    if (scanf("%d", &dir_id) != 1 || dir_id < 0) {
+        printf("ID thư mục không hợp lệ.\n");
+        while (getchar() != '\n');
+        return;
     }
+    while (getchar() != '\n');
+    if (dir_id == 0) dir_id = current_dir_id;
 
-    size_t decoded_len = 0;
-    for (size_t i = 0; i < len; i += 4) {
-        if (i + 3 >= len) break;
+    int sock = connect_to_server();
+    if (sock < 0) {
+        printf("Không thể kết nối đến server!\n");
+        return;
+    }
 
-        int v1 = base64_value(input[i]);
-        int v2 = base64_value(input[i + 1]);
-        if (v1 < 0 || v2 < 0) return -1;
+    int use_zstd = (negotiated_codecs & CODEC_MASK(CODEC_ZSTD)) != 0;
+    char command[256];
+    snprintf(command, sizeof(command), "DOWNLOAD_FOLDER %s %d %d%s\r\n",
+             current_token, group_id, dir_id, use_zstd ? " codec=zstd" : "");
+    send(sock, command, strlen(command), 0);
 
-        if (decoded_len + 1 > out_size) return -1;
-        output[decoded_len++] = (unsigned char)((v1 << 2) | (v2 >> 4));
+    static SockReader reader;
+    reader.sock = sock;
+    reader.len = reader.pos = 0;
+    reader.raw = 0;
 
-        if (input[i + 2] != '=') {
-            int v3 = base64_value(input[i + 2]);
-            if (v3 < 0) return -1;
+    char line[512];
+    if (sock_reader_line(&reader, line, sizeof(line)) != 0) {
+        printf("Không nhận được phản hồi từ server.\n");
+        close(sock);
+        global_sock = -1;
+        return;
+    }
 
-            if (decoded_len + 1 > out_size) return -1;
-            output[decoded_len++] = (unsigned char)(((v2 & 0x0F) << 4) | (v3 >> 2));
+    int status_code = 0;
+    char archive_name[256] = {0};
+    int file_count = 0;
+    long long total_bytes = 0;
+    if (sscanf(line, "%d %255s files=%d bytes=%lld", &status_code, archive_name,
+               &file_count, &total_bytes) < 1) {
+        printf("Phản hồi không hợp lệ: %s\n", line);
+        return;
+    }
+    if (status_code != 200) {
+        switch (status_code) {
+            case 400: printf("Yêu cầu không hợp lệ!\n"); break;
+            case 401: printf("Token không hợp lệ hoặc đã hết hạn!\n"); break;
+            case 403: printf("Bạn không thuộc nhóm này!\n"); break;
+            case 404: printf("Không tìm thấy thư mục với ID: %d!\n", dir_id); break;
+            case 503: printf("Server đang quá tải, thử lại sau.\n"); break;
+            default: printf("Lỗi server (code: %d)\n", status_code);
+        }
+        return;
+    }
+    int compressed = (strstr(line, " codec=zstd") != NULL);
+    reader.raw = 1;
 
-            if (input[i + 3] != '=') {
-                int v4 = base64_value(input[i + 3]);
-                if (v4 < 0) return -1;
+    char file_path[PATH_MAX];
+    build_download_path(archive_name, file_path, sizeof(file_path));
+    FILE *fp = fopen(file_path, "wb");
+
+    ZSTD_DCtx *dctx = compressed ? ZSTD_createDCtx() : NULL;
+    static unsigned char plain[64 * 1024];
+
+    printf("Đang tải %s (%d file, %lld byte)...\n", archive_name, file_count, total_bytes);
+
+    // Luôn đọc hết luồng (kể cả khi không ghi được) để kết nối còn dùng tiếp
+    int ok = (fp != NULL) && (!compressed || dctx != NULL);
+    int end_status = -1;
+    long long received = 0;
+    while (end_status < 0) {
+        if (sock_reader_line(&reader, line, sizeof(line)) != 0) break;
+        long long seg_len = atoll(line);
+        if (seg_len == 0) {
+            end_status = 0;
+            sscanf(line, "%*d %d", &end_status);
+            break;
+        }
 
-                if (decoded_len + 1 > out_size) return -1;
-                output[decoded_len++] = (unsigned char)(((v3 & 0x03) << 6) | v4);
+        while (seg_len > 0) {
+            const char *data;
+            int n = sock_reader_take(&reader, &data, seg_len < (long long)sizeof(reader.buf)
+                                                         ? (int)seg_len : (int)sizeof(reader.buf));
+            if (n < 0) break;
+            seg_len -= n;
+            received += n;
+
+            if (!ok) continue;
+            if (!compressed) {
+                ok = (fwrite(data, 1, (size_t)n, fp) == (size_t)n);
+                continue;
+            }
+            ZSTD_inBuffer in = { data, (size_t)n, 0 };
+            while (ok && in.pos < in.size) {
+                ZSTD_outBuffer out = { plain, sizeof(plain), 0 };
+                size_t rc = ZSTD_decompressStream(dctx, &out, &in);
+                ok = !ZSTD_isError(rc) && fwrite(plain, 1, out.pos, fp) == out.pos;
             }
         }
+        if (seg_len > 0) break;      // mất kết nối giữa đoạn
+    }
+
+    if (dctx) ZSTD_freeDCtx(dctx);
+    if (fp) fclose(fp);
+
+    if (end_status < 0) {
+        // Luồng bị cắt: không biết kết nối đang ở đâu, mở lại lần sau
+        close(sock);
+        global_sock = -1;
+    }
+    if (end_status == 200 && ok) {
+        printf("Đã lưu %s (%lld byte nhận qua mạng)\n", file_path, received);
+    } else {
+        if (fp) remove(file_path);
+        if (!ok) {
+            printf("Không ghi được file %s!\n", file_path);
+        } else {
+            printf("Tải thư mục thất bại, archive không đầy đủ.\n");
+        }
     }
+}
 
-    *out_len = decoded_len;
+// Một file của thư mục cục bộ sắp upload theo lô
+typedef struct {
+    char rel_path[512];              // bắt đầu bằng tên thư mục được chọn
+    long long size;
+} BulkEntry;
+
+// Duyệt đệ quy local_dir (rel là đường dẫn tương đối của nó), thêm các
+// file thường vào entries. Thư mục rỗng không được tạo trên server.
+// Trả -1 nếu có hơn BULK_MAX_FILES file
+static int collect_bulk_files(const char *local_dir, const char *rel,
+                              BulkEntry *entries, int *count) {
+    DIR *d = opendir(local_dir);
+    if (!d) {
+        printf("Không mở được thư mục %s: %s\n", local_dir, strerror(errno));
+        return 0;
+    }
+
+    int rc = 0;
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        char local[PATH_MAX];
+        char child_rel[sizeof(entries[0].rel_path)];
+        if (snprintf(local, sizeof(local), "%s/%s", local_dir, de->d_name) >= (int)sizeof(local) ||
+            snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, de->d_name) >= (int)sizeof(child_rel)) {
+            printf("Bỏ qua (đường dẫn quá dài): %s/%s\n", local_dir, de->d_name);
+            continue;
+        }
+
+        struct stat st;
+        if (lstat(local, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            rc = collect_bulk_files(local, child_rel, entries, count);
+        } else if (S_ISREG(st.st_mode)) {
+            if (*count == BULK_MAX_FILES) {
+                rc = -1;
+                break;
+            }
+            strcpy(entries[*count].rel_path, child_rel);
+            entries[*count].size = (long long)st.st_size;
+            (*count)++;
+        }
+    }
+    closedir(d);
+    return rc;
+}
+
+// Đường dẫn trong manifest: ' ', ',', '%' và ký tự điều khiển mã hoá %XX
+static int escape_manifest_path(const char *in, char *out, size_t size) {
+    size_t n = 0;
+    for (; *in; in++) {
+        unsigned char c = (unsigned char)*in;
+        if (c <= ' ' || c == ',' || c == '%' || c == 0x7f) {
+            if (n + 3 >= size) return -1;
+            n += (size_t)snprintf(out + n, size - n, "%%%02X", c);
+        } else {
+            if (n + 1 >= size) return -1;
+            out[n++] = (char)c;
+        }
+    }
+    out[n] = '\0';
+    return (int)n;
+}
+
+static int send_all(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, 0);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
     return 0;
 }
 
+// Upload cả một thư mục cục bộ (kèm thư mục con) trong một phiên
+// UPLOAD_BULK_*: gửi manifest trước để server tạo sẵn các thư mục, rồi
+// gửi dữ liệu các file nối tiếp nhau, không chờ phản hồi từng chunk.
+void handle_upload_folder(int group_id, int current_dir_id) {
+    if (!is_token_valid()) {
+        printf("Bạn cần đăng nhập để upload thư mục!\n");
+        return;
+    }
+
+    printf("\n--- UPLOAD THƯ MỤC ---\n");
+    printf("Nhập ID thư mục đích (0 = thư mục đang xem): ");
+    int dir_id = 0;
+    if (scanf("%d", &dir_id) != 1 || dir_id < 0) {
+        printf("ID thư mục không hợp lệ.\n");
+        while (getchar() != '\n');
+        return;
+    }
+    while (getchar() != '\n');
+    if (dir_id == 0) dir_id = current_dir_id;
+
+    char local_dir[PATH_MAX];
+    printf("Đường dẫn thư mục: ");
+    if (!fgets(local_dir, sizeof(local_dir), stdin)) {
+        printf("Không đọc được đường dẫn.\n");
+        return;
+    }
+    local_dir[strcspn(local_dir, "\n")] = '\0';
+    size_t dir_len = strlen(local_dir);
+    while (dir_len > 1 && local_dir[dir_len - 1] == '/') {
+        local_dir[--dir_len] = '\0';
+    }
+
+    struct stat st;
+    if (dir_len == 0 || stat(local_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("Không phải thư mục: %s\n", local_dir);
+        return;
+    }
+
+    char base[PATH_MAX];
+    extract_filename(local_dir, base, sizeof(base));
+
+    BulkEntry *entries = malloc(sizeof(BulkEntry) * BULK_MAX_FILES);
+    if (!entries) {
+        printf("Không đủ bộ nhớ.\n");
+        return;
+    }
+    int count = 0;
+    if (collect_bulk_files(local_dir, base, entries, &count) != 0) {
+        printf("Thư mục có hơn %d file, hãy chia nhỏ để upload.\n", BULK_MAX_FILES);
+        free(entries);
+        return;
+    }
+    if (count == 0) {
+        printf("Thư mục không có file nào.\n");
+        free(entries);
+        return;
+    }
+
+    long long total_bytes = 0;
+    for (int i = 0; i < count; i++) {
+        total_bytes += entries[i].size;
+    }
+
+    int sock = connect_to_server();
+    if (sock < 0) {
+        free(entries);
+        return;
+    }
+
+    static SockReader reader;
+    reader.sock = sock;
+    reader.len = reader.pos = 0;
+    reader.raw = 0;
+
+    char line[BULK_LINE_MAX];
+    char command[UPLOAD_COMMAND_BUFFER];
+    int busy_retries = 0;
+    for (;;) {
+        int n = snprintf(command, sizeof(command), "UPLOAD_BULK_BEGIN %s %d %d %d\r\n",
+                         current_token, group_id, dir_id, count);
+        if (send_all(sock, command, (size_t)n) != 0 ||
+            sock_reader_line(&reader, line, sizeof(line)) != 0) {
+            printf("Mất kết nối tới server.\n");
+            close(sock);
+            global_sock = -1;
+            free(entries);
+            return;
+        }
+        if (!wait_if_server_busy(line, &busy_retries)) break;
+    }
+
+    int status = atoi(line);
+    if (status != 200) {
+        switch (status) {
+            case 400: printf("Yêu cầu không hợp lệ!\n"); break;
+            case 401: printf("Token không hợp lệ hoặc đã hết hạn!\n"); break;
+            case 403: printf("Bạn không thuộc nhóm này!\n"); break;
+            case 404: printf("Không tìm thấy thư mục với ID: %d!\n", dir_id); break;
+            case 503: printf("Server đang quá tải, thử lại sau.\n"); break;
+            default: printf("Lỗi server (code: %d)\n", status);
+        }
+        free(entries);
+        return;
+    }
+
+    // Manifest: gửi liền các dòng UPLOAD_BULK_ENTRY rồi mới đọc phản hồi
+    static char out[64 * 1024];
+    int out_len = 0;
+    int entry_lines = 0;
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        char escaped[3 * sizeof(entries[0].rel_path)];
+        escape_manifest_path(entries[i].rel_path, escaped, sizeof(escaped));
+
+        char item[sizeof(escaped) + 32];
+        int n = snprintf(item, sizeof(item), "%lld:-:%s", entries[i].size, escaped);
+
+        // Dòng hiện tại đã đầy: kết thúc dòng
+        if (out_len > 0 && out_len + 1 + n + 2 > BULK_LINE_MAX) {
+            memcpy(out + out_len, "\r\n", 2);
+            ok = send_all(sock, out, (size_t)out_len + 2) == 0;
+            entry_lines++;
+            out_len = 0;
+        }
+        if (out_len == 0) {
+            out_len = snprintf(out, sizeof(out), "UPLOAD_BULK_ENTRY ");
+        } else {
+            out[out_len++] = ',';
+        }
+        memcpy(out + out_len, item, (size_t)n);
+        out_len += n;
+    }
+    if (ok && out_len > 0) {
+        memcpy(out + out_len, "\r\n", 2);
+        ok = send_all(sock, out, (size_t)out_len + 2) == 0;
+        entry_lines++;
+    }
+    out_len = 0;
+
+    // Mỗi dòng một phản hồi: 202 khi chưa đủ, phản hồi đầu tiên khác 202
+    // (hoặc của dòng cuối) là kết quả của cả manifest
+    char verdict[256] = "";
+    for (int k = 0; ok && k < entry_lines; k++) {
+        ok = sock_reader_line(&reader, line, sizeof(line)) == 0;
+        if (ok && !verdict[0] && (atoi(line) != 202 || k == entry_lines - 1)) {
+            snprintf(verdict, sizeof(verdict), "%s", line);
+        }
+    }
+    if (!ok) {
+        printf("Mất kết nối tới server.\n");
+        close(sock);
+        global_sock = -1;
+        free(entries);
+        return;
+    }
+    status = atoi(verdict);
+    if (status == 507) {
+        char kind[16] = "";
+        long long limit = 0, used = 0;
+        sscanf(verdict, "507 quota=%15s limit=%lld used=%lld", kind, &limit, &used);
+        printf("Vượt quota %s: đã dùng %lld / %lld bytes, thư mục cần %lld bytes.\n",
+               strcmp(kind, "user") == 0 ? "người dùng" : "nhóm", used, limit, total_bytes);
+        free(entries);
+        return;
+    }
+    if (status != 200) {
+        printf("Server từ chối manifest (code: %d)\n", status);
+        free(entries);
+        return;
+    }
+    int dirs_created = 0;
+    const char *dirs = strstr(verdict, "dirs=");
+    if (dirs) dirs_created = atoi(dirs + 5);
+    printf("Đã tạo %d thư mục, đang gửi %d file (%lld bytes)...\n",
+           dirs_created, count, total_bytes);
+
+    // Dữ liệu: các dòng UPLOAD_BULK_DATA gom vào out, gửi mỗi khi đầy
+    unsigned char buffer[FILE_CHUNK_SIZE];
+    unsigned char packed[FILE_CHUNK_SIZE];
+    char base64_buf[BASE64_ENCODED_SIZE];
+    for (int i = 0; i < count && ok; i++) {
+        if (entries[i].size == 0) continue;     // server tự tạo file rỗng
+
+        char local[PATH_MAX];
+        snprintf(local, sizeof(local), "%s%s", local_dir, entries[i].rel_path + strlen(base));
+        FILE *fp = fopen(local, "rb");
+        if (!fp) {
+            printf("Không mở được %s: %s\n", local, strerror(errno));
+            continue;                           // server báo lỗi file này ở cuối phiên
+        }
+
+        CodecType file_codec = CODEC_NONE;
+        long long left = entries[i].size;
+        int first = 1;
+        while (left > 0 && ok) {
+            size_t want = left < FILE_CHUNK_SIZE ? (size_t)left : FILE_CHUNK_SIZE;
+            size_t bytes_read = fread(buffer, 1, want, fp);
+            if (bytes_read == 0) break;         // file bị thu nhỏ giữa chừng
+
+            // Lấy mẫu entropy chunk đầu của mỗi file để quyết định nén
+            if (first && codec_should_compress(buffer, bytes_read)) {
+                file_codec = codec_pick(negotiated_codecs);
+            }
+            first = 0;
+
+            const unsigned char *payload = buffer;
+            size_t payload_len = bytes_read;
+            CodecType chunk_codec = CODEC_NONE;
+            if (file_codec != CODEC_NONE) {
+                int n = codec_compress(file_codec, buffer, bytes_read, packed, sizeof(packed));
+                if (n > 0 && (size_t)n < bytes_read) {
+                    payload = packed;
+                    payload_len = (size_t)n;
+                    chunk_codec = file_codec;
+                }
+            }
+            if (base64_encode(payload, payload_len, base64_buf, sizeof(base64_buf)) < 0) {
+                break;
+            }
+
+            char codec_opt[32] = "";
+            if (chunk_codec != CODEC_NONE) {
+                snprintf(codec_opt, sizeof(codec_opt), " codec=%s", codec_name(chunk_codec));
+            }
+
+            if (out_len + UPLOAD_COMMAND_BUFFER > (int)sizeof(out)) {
+                ok = send_all(sock, out, (size_t)out_len) == 0;
+                out_len = 0;
+            }
+            out_len += snprintf(out + out_len, sizeof(out) - out_len,
+                                "UPLOAD_BULK_DATA %d %s%s crc=%08x\r\n", i + 1, base64_buf,
+                                codec_opt, (unsigned int)crc32c(0, buffer, bytes_read));
+            left -= (long long)bytes_read;
+        }
+        fclose(fp);
+    }
+
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "UPLOAD_BULK_END\r\n");
+    if (!ok || send_all(sock, out, (size_t)out_len) != 0 ||
+        sock_reader_line(&reader, line, sizeof(line)) != 0) {
+        printf("Mất kết nối tới server.\n");
+        close(sock);
+        global_sock = -1;
+        free(entries);
+        return;
+    }
+
+    int stored = 0;
+    int total = 0;
+    int consumed = 0;
+    if (sscanf(line, "%d %d/%d%n", &status, &stored, &total, &consumed) < 3) {
+        printf("Phản hồi không hợp lệ: %s\n", line);
+        free(entries);
+        return;
+    }
+
+    if (status == 200) {
+        printf("✓ Upload hoàn tất %d/%d file.\n", stored, total);
+    } else if (status == 207) {
+        printf("Upload xong %d/%d file, các file lỗi:\n", stored, total);
+        const char *codes = line + consumed;
+        for (int i = 0; i < count && *codes; i++) {
+            int code = atoi(codes);
+            if (code != 200) {
+                const char *reason = code == 409 ? "trùng tên"
+                                   : code == 400 ? "dữ liệu thiếu hoặc sai"
+                                   : "lỗi server";
+                printf("  ✗ %s (%d: %s)\n", entries[i].rel_path, code, reason);
+            }
+            const char *comma = strchr(codes, ',');
+            if (!comma) break;
+            codes = comma + 1;
+        }
+    } else {
+        printf("✗ Upload thư mục thất bại (code: %d)\n", status);
+    }
+    free(entries);
+}
+
 void handle_download_file(int group_id) {
     if( !is_token_valid()) {
         printf("Bạn cần đăng nhập để download file!\n");
@@ -3077,13 +4214,19 @@ void handle_download_file(int group_id) {
     char file_path[PATH_MAX];
     FILE *fp = NULL;
     int file_opened = 0;
+    int busy_retries = 0;
 
     while (chunk_idx <= total_chunks) {
         // Gửi yêu cầu chunk
         char command[256];
+        char codec_opt[32] = "";
+        if (negotiated_codecs) {
+            snprintf(codec_opt, sizeof(codec_opt), " codec=%s",
+                     codec_name(codec_pick(negotiated_codecs)));
+        }
         int cmd_len = snprintf(command, sizeof(command),
-                               "DOWNLOAD_FILE %s %d %d\r\n",
-                               current_token, file_id, chunk_idx);
+                               "DOWNLOAD_FILE %s %d %d%s crc=1\r\n",
+                               current_token, file_id, chunk_idx, codec_opt);
         if (cmd_len < 0 || cmd_len >= (int)sizeof(command)) {
             printf("Lỗi tạo lệnh cho chunk %d.\n", chunk_idx);
             success = 0;
@@ -3097,7 +4240,7 @@ void handle_download_file(int group_id) {
         }
 
         // Nhận phản hồi
-        int bytes = recv(sock, response, sizeof(response) - 1, 0);
+        int bytes = recv_reply(sock, response, sizeof(response) - 1);
         if (bytes <= 0) {
             printf("Không nhận được phản hồi cho chunk %d.\n", chunk_idx);
             success = 0;
@@ -3105,6 +4248,11 @@ void handle_download_file(int group_id) {
         }
         response[bytes] = '\0';
 
+        if (wait_if_server_busy(response, &busy_retries)) {
+            continue;   // yêu cầu lại cùng chunk
+        }
+        busy_retries = 0;
+
         // Kiểm tra lỗi
         if (strncmp(response, "500", 3) == 0) {
             printf("Server trả lỗi 500 ở chunk %d.\n", chunk_idx);
@@ -3162,6 +4310,31 @@ void handle_download_file(int group_id) {
             file_opened = 1;
         }
 
+        // Sau payload có thể có: tên codec (chunk đã nén) và crc=<hex>
+        int chunk_codec = CODEC_NONE;
+        int have_crc = 0;
+        uint32_t expected_crc = 0;
+        int bad_suffix = 0;
+        char *suffix = strchr(token_base64, ' ');
+        if (suffix) {
+            *suffix++ = '\0';
+            for (char *tok = strtok(suffix, " "); tok; tok = strtok(NULL, " ")) {
+                if (strncmp(tok, "crc=", 4) == 0) {
+                    have_crc = (crc32c_parse(tok + 4, &expected_crc) == 0);
+                    if (!have_crc) bad_suffix = 1;
+                } else {
+                    int c = codec_from_name(tok);
+                    if (c < 0) bad_suffix = 1;
+                    else chunk_codec = c;
+                }
+            }
+        }
+        if (bad_suffix) {
+            printf("Codec/CRC không hợp lệ ở chunk %d.\n", chunk_idx);
+            success = 0;
+            break;
+        }
+
         base64_data = token_base64;
 
         // Cập nhật total_chunks từ response đầu tiên
@@ -3171,12 +4344,31 @@ void handle_download_file(int group_id) {
 
         // Decode base64
         size_t decoded_len = 0;
-        if (base64_decode(base64_data, buffer, sizeof(buffer), &decoded_len) != 0) {
+        if (base64_decode(base64_data, strlen(base64_data), buffer, sizeof(buffer), &decoded_len) != 0) {
             printf("Lỗi giải mã chunk %d.\n", chunk_idx);
             success = 0;
             break;
         }
 
+        if (chunk_codec != CODEC_NONE) {
+            unsigned char packed[FILE_CHUNK_SIZE];
+            memcpy(packed, buffer, decoded_len);
+            int n = codec_decompress((CodecType)chunk_codec, packed, decoded_len,
+                                     buffer, sizeof(buffer));
+            if (n < 0) {
+                printf("Lỗi giải nén chunk %d.\n", chunk_idx);
+                success = 0;
+                break;
+            }
+            decoded_len = (size_t)n;
+        }
+
+        if (have_crc && crc32c(0, buffer, decoded_len) != expected_crc) {
+            printf("CRC chunk %d không khớp, dữ liệu bị hỏng trên đường truyền.\n", chunk_idx);
+            success = 0;
+            break;
+        }
+
         // Ghi chunk vào file
         if (decoded_len > 0) {
             size_t written = fwrite(buffer, 1, decoded_len, fp);
@@ -0,0 +1,352 @@
+#include "activity_journal.h"
+#include "db.h"
+#include "../utils/crc32c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_REPLAY_PATH JOURNAL_SPILL_PATH ".replay"
+#define SPILL_LINE_MAX 512
+
+// Server errors worth retrying rather than dropping the rows for
+#define ER_LOCK_WAIT_TIMEOUT 1205
+#define ER_LOCK_DEADLOCK 1213
+#define CR_MIN_ERROR 2000             // client / connection errors start here
+
+typedef struct {
+    long long ts;
+    int user_id;
+    int group_id;
+    char desc[JOURNAL_DESC_MAX + 1];
+} JournalEvent;
+
+static JournalEvent ring[JOURNAL_RING_SIZE];
+static int ring_head = 0;             // oldest queued event
+static int ring_count = 0;
+static int running = 0;
+static int stopping = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flush_thread;
+
+// Both the event loop (ring full) and the flush thread append to the spill
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static int spill_dirty = 0;           // spill file may hold events
+
+// Owned by the flush thread
+static MYSQL *db = NULL;
+static JournalEvent batch[JOURNAL_BATCH_ROWS];
+static char query[128 + JOURNAL_BATCH_ROWS * (2 * JOURNAL_DESC_MAX + 80)];
+
+// Control characters would break the one-line-per-event spill format, and
+// the cut made by vsnprintf may land inside a UTF-8 sequence
+static void clean_desc(char *s) {
+    size_t len = strlen(s);
+
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)s[i] < 0x20 || s[i] == 0x7f) s[i] = ' ';
+    }
+
+    size_t lead = len;
+    while (lead > 0 && ((unsigned char)s[lead - 1] & 0xC0) == 0x80) lead--;
+    if (lead == 0) return;
+
+    unsigned char c = (unsigned char)s[lead - 1];
+    size_t need = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+    if (len - (lead - 1) < need) s[lead - 1] = '\0';
+}
+
+// ---------------------------------------------------------------------------
+// Spill file: "<crc32c> <unix ts> <user_id> <group_id> <description>\n",
+// the checksum covering everything after the first space. A line torn by
+// a crash fails the check and is skipped on replay.
+// ---------------------------------------------------------------------------
+
+static int format_spill_line(char *out, size_t size, const JournalEvent *ev) {
+    char body[SPILL_LINE_MAX];
+    int n = snprintf(body, sizeof(body), "%lld %d %d %s",
+                     ev->ts, ev->user_id, ev->group_id, ev->desc);
+    if (n < 0 || (size_t)n >= sizeof(body)) return -1;
+
+    int len = snprintf(out, size, "%08x %s\n", crc32c(0, body, (size_t)n), body);
+    return (len > 0 && (size_t)len < size) ? len : -1;
+}
+
+static int parse_spill_line(char *line, JournalEvent *ev) {
+    size_t len = strlen(line);
+    if (len < 10 || line[len - 1] != '\n' || line[8] != ' ') return -1;
+    line[len - 1] = '\0';
+    line[8] = '\0';
+
+    uint32_t want;
+    const char *body = line + 9;
+    if (crc32c_parse(line, &want) != 0 || crc32c(0, body, len - 10) != want) return -1;
+
+    int off = 0;
+    if (sscanf(body, "%lld %d %d%n", &ev->ts, &ev->user_id, &ev->group_id, &off) != 3) return -1;
+    if (body[off] == ' ') off++;
+
+    snprintf(ev->desc, sizeof(ev->desc), "%s", body + off);
+    return 0;
+}
+
+// sync: fdatasync before returning. The event loop passes 0: the data is
+// still in the page cache when the process dies, only a power cut loses it.
+static void spill_events(const JournalEvent *ev, int n, int sync) {
+    pthread_mutex_lock(&spill_lock);
+
+    int fd = open(JOURNAL_SPILL_PATH, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[JOURNAL] Cannot open %s: %s, %d event(s) lost\n",
+                JOURNAL_SPILL_PATH, strerror(errno), n);
+        pthread_mutex_unlock(&spill_lock);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        char line[SPILL_LINE_MAX + 16];
+        int len = format_spill_line(line, sizeof(line), &ev[i]);
+        if (len < 0 || write(fd, line, (size_t)len) != len) {
+            fprintf(stderr, "[JOURNAL] Spill write failed, event lost\n");
+        }
+    }
+    if (sync) fdatasync(fd);
+    close(fd);
+
+    spill_dirty = 1;
+    pthread_mutex_unlock(&spill_lock);
+}
+
+// ---------------------------------------------------------------------------
+// Database side (flush thread only)
+// ---------------------------------------------------------------------------
+
+// 0 inserted, -1 database unavailable (retry later), 1 rejected rows
+static int run_insert(const JournalEvent *ev, int n) {
+    if (!db) {
+        db = db_connect();
+        if (!db) return -1;
+    }
+
+    int len = snprintf(query, sizeof(query),
+                       "INSERT INTO activity_log (user_id, description, group_id, timestamp) VALUES ");
+    for (int i = 0; i < n; i++) {
+        char escaped[2 * JOURNAL_DESC_MAX + 1];
+        mysql_real_escape_string(db, escaped, ev[i].desc, strlen(ev[i].desc));
+        len += snprintf(query + len, sizeof(query) - len, "%s(%d, '%s', %d, FROM_UNIXTIME(%lld))",
+                        i ? ", " : "", ev[i].user_id, escaped, ev[i].group_id, ev[i].ts);
+    }
+
+    if (mysql_real_query(db, query, (unsigned long)len) == 0) return 0;
+
+    unsigned int err = mysql_errno(db);
+    if (err >= CR_MIN_ERROR || err == ER_LOCK_WAIT_TIMEOUT || err == ER_LOCK_DEADLOCK) {
+        fprintf(stderr, "[JOURNAL] MySQL unavailable: %s\n", mysql_error(db));
+        if (err >= CR_MIN_ERROR) {
+            mysql_close(db);
+            db = NULL;
+        }
+        return -1;
+    }
+    return 1;
+}
+
+// Returns how many events from the front of ev are done with (inserted,
+// or dropped as invalid); the rest still have to be kept
+static int insert_events(const JournalEvent *ev, int n) {
+    int rc = run_insert(ev, n);
+    if (rc == 0) return n;
+    if (rc < 0) return 0;
+
+    // One bad row (e.g. a user deleted meanwhile, FK) fails the whole
+    // statement: retry row by row and drop only the rows that fail alone
+    for (int i = 0; i < n; i++) {
+        rc = run_insert(&ev[i], 1);
+        if (rc < 0) return i;
+        if (rc > 0) {
+            fprintf(stderr, "[JOURNAL] Dropping event user=%d group=%d '%s': %s\n",
+                    ev[i].user_id, ev[i].group_id, ev[i].desc, mysql_error(db));
+        }
+    }
+    return n;
+}
+
+static int take_spill_dirty(void) {
+    pthread_mutex_lock(&spill_lock);
+    int dirty = spill_dirty;
+    spill_dirty = 0;
+    pthread_mutex_unlock(&spill_lock);
+    return dirty;
+}
+
+static void mark_spill_dirty(void) {
+    pthread_mutex_lock(&spill_lock);
+    spill_dirty = 1;
+    pthread_mutex_unlock(&spill_lock);
+}
+
+// Move the spill aside and insert it. A .replay left by an interrupted
+// replay is finished first; it may already be partly in the table.
+static int replay_spill(void) {
+    pthread_mutex_lock(&spill_lock);
+    if (access(JOURNAL_REPLAY_PATH, F_OK) != 0 &&
+        rename(JOURNAL_SPILL_PATH, JOURNAL_REPLAY_PATH) != 0) {
+        int missing = (errno == ENOENT);
+        pthread_mutex_unlock(&spill_lock);
+        return missing ? 0 : -1;
+    }
+    pthread_mutex_unlock(&spill_lock);
+
+    FILE *f = fopen(JOURNAL_REPLAY_PATH, "r");
+    if (!f) return -1;
+
+    char line[SPILL_LINE_MAX + 16];
+    int n = 0, total = 0, skipped = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (parse_spill_line(line, &batch[n]) != 0) {
+            skipped++;
+            continue;
+        }
+        if (++n == JOURNAL_BATCH_ROWS) {
+            if (insert_events(batch, n) < n) goto fail;
+            total += n;
+            n = 0;
+        }
+    }
+    if (n > 0 && insert_events(batch, n) < n) goto fail;
+    total += n;
+
+    fclose(f);
+    unlink(JOURNAL_REPLAY_PATH);
+    fprintf(stderr, "[JOURNAL] Replayed %d spilled event(s), %d corrupt line(s) skipped\n",
+            total, skipped);
+    return 0;
+
+fail:
+    fclose(f);
+    return -1;
+}
+
+static void *flush_main(void *arg) {
+    (void)arg;
+    mysql_thread_init();
+
+    pthread_mutex_lock(&ring_lock);
+    for (;;) {
+        if (!stopping && ring_count < JOURNAL_BATCH_ROWS) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += JOURNAL_FLUSH_MS / 1000;
+            deadline.tv_nsec += (long)(JOURNAL_FLUSH_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (!stopping && ring_count < JOURNAL_BATCH_ROWS) {
+                if (pthread_cond_timedwait(&ring_cond, &ring_lock, &deadline) == ETIMEDOUT) break;
+            }
+        }
+
+        int n = 0;
+        while (n < JOURNAL_BATCH_ROWS && ring_count > 0) {
+            batch[n++] = ring[ring_head];
+            ring_head = (ring_head + 1) % JOURNAL_RING_SIZE;
+            ring_count--;
+        }
+        pthread_mutex_unlock(&ring_lock);
+
+        int healthy = 1;
+        if (n > 0) {
+            int done = insert_events(batch, n);
+            if (done < n) {
+                spill_events(batch + done, n - done, 1);
+                healthy = 0;
+            }
+        }
+        // Older events waiting on disk go in once the database takes writes
+        if (healthy && take_spill_dirty() && replay_spill() != 0) {
+            mark_spill_dirty();
+        }
+
+        pthread_mutex_lock(&ring_lock);
+        if (stopping && ring_count == 0) break;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (db) {
+        mysql_close(db);
+        db = NULL;
+    }
+    mysql_thread_end();
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+
+int journal_start(void) {
+    mark_spill_dirty();               // a previous run may have left a spill
+
+    pthread_mutex_lock(&ring_lock);
+    stopping = 0;
+    int rc = pthread_create(&flush_thread, NULL, flush_main, NULL);
+    running = (rc == 0);
+    pthread_mutex_unlock(&ring_lock);
+
+    if (rc != 0) {
+        fprintf(stderr, "[JOURNAL] Cannot start flush thread: %s\n", strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+void journal_stop(void) {
+    pthread_mutex_lock(&ring_lock);
+    if (!running) {
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+    stopping = 1;
+    pthread_cond_signal(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+
+    pthread_join(flush_thread, NULL);
+
+    pthread_mutex_lock(&ring_lock);
+    running = 0;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+void journal_log(int user_id, int group_id, const char *fmt, ...) {
+    JournalEvent ev;
+    ev.ts = (long long)time(NULL);
+    ev.user_id = user_id;
+    ev.group_id = group_id;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(ev.desc, sizeof(ev.desc), fmt, args);
+    va_end(args);
+    clean_desc(ev.desc);
+
+    pthread_mutex_lock(&ring_lock);
+    if (running && ring_count < JOURNAL_RING_SIZE) {
+        ring[(ring_head + ring_count) % JOURNAL_RING_SIZE] = ev;
+        ring_count++;
+        if (ring_count == JOURNAL_BATCH_ROWS) pthread_cond_signal(&ring_cond);
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    // Ring full (database far behind) or no flush thread: keep the event
+    // on disk rather than drop it or wait for MySQL here
+    spill_events(&ev, 1, 0);
+}
@@ -0,0 +1,32 @@
+#ifndef ACTIVITY_JOURNAL_H
+#define ACTIVITY_JOURNAL_H
+
+// Write-behind journal for activity_log. journal_log() only copies the
+// event into an in-memory ring; a background thread with its own MySQL
+// connection drains the ring with multi-row INSERTs once
+// JOURNAL_BATCH_ROWS events are queued or JOURNAL_FLUSH_MS has passed.
+//
+// While MySQL is unreachable (or the ring is full) events go to a local
+// spill file, one checksummed line per event, which is replayed once the
+// database answers again and at the next start. Delivery is at least
+// once: a crash in the middle of a replay inserts part of it twice.
+#define JOURNAL_RING_SIZE 4096
+#define JOURNAL_BATCH_ROWS 256
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_DESC_MAX 100          // activity_log.description VARCHAR(100)
+#define JOURNAL_SPILL_PATH "./activity_journal.spill"
+
+// Start the flush thread (replays any spill left by an earlier run).
+// Returns 0, or -1 if the thread could not be created; journal_log then
+// writes every event straight to the spill file.
+int journal_start(void);
+
+// Flush what is queued and stop the thread
+void journal_stop(void);
+
+// Queue one event. Never blocks on the database; the description is
+// printf-formatted and cut to JOURNAL_DESC_MAX bytes.
+void journal_log(int user_id, int group_id, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif
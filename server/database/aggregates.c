@@ -0,0 +1,344 @@
+#include "aggregates.h"
+#include "db.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int agg_item_totals(int is_file, int item_id, int *parent_dir_id, AggTotals *out) {
+    char query[256];
+
+    if (is_file) {
+        snprintf(query, sizeof(query),
+                 "SELECT dir_id, file_size, 1, 0 FROM files WHERE file_id=%d AND is_deleted=0",
+                 item_id);
+    } else {
+        // The directory itself counts as one more for its ancestors
+        snprintf(query, sizeof(query),
+                 "SELECT COALESCE(parent_dir_id, 0), total_bytes, file_count, dir_count + 1 "
+                 "FROM directories WHERE dir_id=%d AND is_deleted=0",
+                 item_id);
+    }
+
+    if (mysql_query(conn, query) != 0) return -1;
+
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (!row) {
+        mysql_free_result(res);
+        return -1;
+    }
+
+    *parent_dir_id = row[0] ? atoi(row[0]) : 0;
+    out->bytes = row[1] ? atoll(row[1]) : 0;
+    out->files = row[2] ? atoi(row[2]) : 0;
+    out->dirs = row[3] ? atoi(row[3]) : 0;
+    mysql_free_result(res);
+    return 0;
+}
+
+int agg_apply(int group_id, int dir_id, const AggTotals *t, int sign) {
+    if (t->bytes == 0 && t->files == 0 && t->dirs == 0) return 0;
+
+    char dir[16] = "NULL";
+    if (dir_id > 0) snprintf(dir, sizeof(dir), "%d", dir_id);
+
+    char query[256];
+    snprintf(query, sizeof(query), "CALL apply_dir_delta(%d, %s, %lld, %d, %d)",
+             group_id, dir, sign * t->bytes, sign * t->files, sign * t->dirs);
+    if (mysql_query(conn, query) != 0) {
+        fprintf(stderr, "MySQL Error (apply_dir_delta): %s\n", mysql_error(conn));
+        return -1;
+    }
+
+    do {
+        MYSQL_RES *res = mysql_store_result(conn);
+        if (res) mysql_free_result(res);
+    } while (mysql_next_result(conn) == 0);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Reconciler
+//
+// Each group is read inside one consistent snapshot, the expected totals
+// are rebuilt from the live files and directories, and the difference to
+// what the snapshot stored is *added* to the rows. Deltas committed by the
+// event loop after the snapshot are in both the stored value and (once
+// visible) the expected one, so the correction is right without locking
+// the group against writers.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int dir_id;
+    int parent_id;                    // 0 = group root
+    int parent;                       // index in the array, -1 if not live
+    long long stored_bytes;
+    int stored_files;
+    int stored_dirs;
+    long long direct_bytes;           // files directly inside
+    int direct_files;
+    long long bytes;                  // expected subtree totals
+    int files;
+    int dirs;
+} DirAgg;
+
+static pthread_t reconcile_thread;
+static pthread_mutex_t reconcile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reconcile_cond = PTHREAD_COND_INITIALIZER;
+static int reconcile_running = 0;
+static int reconcile_stopping = 0;
+
+static int should_stop(void) {
+    pthread_mutex_lock(&reconcile_lock);
+    int stop = reconcile_stopping;
+    pthread_mutex_unlock(&reconcile_lock);
+    return stop;
+}
+
+static int find_dir(const DirAgg *dirs, int n, int dir_id) {
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (dirs[mid].dir_id == dir_id) return mid;
+        if (dirs[mid].dir_id < dir_id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+static MYSQL_RES *query_rows(MYSQL *db, const char *query) {
+    if (mysql_query(db, query) != 0) {
+        fprintf(stderr, "[AGG] Query failed: %s\n", mysql_error(db));
+        return NULL;
+    }
+    return mysql_store_result(db);
+}
+
+// Loads the group's snapshot; returns the number of directories or -1
+static int load_group(MYSQL *db, int group_id, DirAgg **out, AggTotals *group_stored) {
+    char query[512];
+    *out = NULL;
+
+    snprintf(query, sizeof(query),
+             "SELECT dir_id, COALESCE(parent_dir_id, 0), total_bytes, file_count, dir_count "
+             "FROM directories WHERE group_id=%d AND is_deleted=0 ORDER BY dir_id",
+             group_id);
+    MYSQL_RES *res = query_rows(db, query);
+    if (!res) return -1;
+
+    int n = (int)mysql_num_rows(res);
+    DirAgg *dirs = (DirAgg *)calloc(n > 0 ? n : 1, sizeof(DirAgg));
+    if (!dirs) {
+        mysql_free_result(res);
+        return -1;
+    }
+
+    MYSQL_ROW row;
+    for (int i = 0; i < n && (row = mysql_fetch_row(res)); i++) {
+        dirs[i].dir_id = atoi(row[0]);
+        dirs[i].parent_id = atoi(row[1]);
+        dirs[i].stored_bytes = atoll(row[2]);
+        dirs[i].stored_files = atoi(row[3]);
+        dirs[i].stored_dirs = atoi(row[4]);
+    }
+    mysql_free_result(res);
+
+    snprintf(query, sizeof(query),
+             "SELECT dir_id, SUM(file_size), COUNT(*) FROM files "
+             "WHERE group_id=%d AND is_deleted=0 GROUP BY dir_id",
+             group_id);
+    res = query_rows(db, query);
+    if (!res) {
+        free(dirs);
+        return -1;
+    }
+    while ((row = mysql_fetch_row(res))) {
+        int i = find_dir(dirs, n, atoi(row[0]));
+        if (i < 0) continue;          // files left in a deleted directory
+        dirs[i].direct_bytes = row[1] ? atoll(row[1]) : 0;
+        dirs[i].direct_files = atoi(row[2]);
+    }
+    mysql_free_result(res);
+
+    snprintf(query, sizeof(query),
+             "SELECT total_bytes, file_count, dir_count FROM `groups` WHERE group_id=%d",
+             group_id);
+    res = query_rows(db, query);
+    if (!res) {
+        free(dirs);
+        return -1;
+    }
+    row = mysql_fetch_row(res);
+    group_stored->bytes = row ? atoll(row[0]) : 0;
+    group_stored->files = row ? atoi(row[1]) : 0;
+    group_stored->dirs = row ? atoi(row[2]) : 0;
+    mysql_free_result(res);
+
+    *out = dirs;
+    return n;
+}
+
+// Expected totals. Only directories that reach a root count towards the
+// group, the same as the deltas do when a parent is deleted.
+static void compute_expected(DirAgg *dirs, int n, AggTotals *group) {
+    memset(group, 0, sizeof(*group));
+
+    for (int i = 0; i < n; i++) {
+        dirs[i].parent = dirs[i].parent_id ? find_dir(dirs, n, dirs[i].parent_id) : -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        dirs[i].bytes += dirs[i].direct_bytes;
+        dirs[i].files += dirs[i].direct_files;
+
+        int j = i, depth = 0;
+        while (dirs[j].parent >= 0 && depth++ < n) {
+            j = dirs[j].parent;
+            dirs[j].bytes += dirs[i].direct_bytes;
+            dirs[j].files += dirs[i].direct_files;
+            dirs[j].dirs += 1;
+        }
+
+        if (dirs[j].parent_id == 0) {
+            group->bytes += dirs[i].direct_bytes;
+            group->files += dirs[i].direct_files;
+            if (dirs[i].parent_id != 0) group->dirs += 1;
+        }
+    }
+}
+
+static int reconcile_group(MYSQL *db, int group_id) {
+    if (mysql_query(db, "START TRANSACTION WITH CONSISTENT SNAPSHOT, READ ONLY") != 0) {
+        fprintf(stderr, "[AGG] Cannot start snapshot: %s\n", mysql_error(db));
+        return -1;
+    }
+
+    DirAgg *dirs;
+    AggTotals stored;
+    int n = load_group(db, group_id, &dirs, &stored);
+    mysql_query(db, "COMMIT");
+    if (n < 0) return -1;
+
+    AggTotals expected;
+    compute_expected(dirs, n, &expected);
+
+    int fixed = 0;
+    char query[512];
+    for (int i = 0; i < n; i++) {
+        long long d_bytes = dirs[i].bytes - dirs[i].stored_bytes;
+        int d_files = dirs[i].files - dirs[i].stored_files;
+        int d_dirs = dirs[i].dirs - dirs[i].stored_dirs;
+        if (d_bytes == 0 && d_files == 0 && d_dirs == 0) continue;
+
+        snprintf(query, sizeof(query),
+                 "UPDATE directories SET total_bytes = total_bytes + %lld, "
+                 "file_count = file_count + %d, dir_count = dir_count + %d, "
+                 "updated_at = updated_at WHERE dir_id=%d",
+                 d_bytes, d_files, d_dirs, dirs[i].dir_id);
+        if (mysql_query(db, query) == 0) fixed++;
+    }
+
+    if (expected.bytes != stored.bytes || expected.files != stored.files ||
+        expected.dirs != stored.dirs) {
+        snprintf(query, sizeof(query),
+                 "UPDATE `groups` SET total_bytes = total_bytes + %lld, "
+                 "file_count = file_count + %d, dir_count = dir_count + %d WHERE group_id=%d",
+                 expected.bytes - stored.bytes, expected.files - stored.files,
+                 expected.dirs - stored.dirs, group_id);
+        if (mysql_query(db, query) == 0) fixed++;
+    }
+
+    free(dirs);
+    return fixed;
+}
+
+static void reconcile_all(void) {
+    MYSQL *db = db_connect();
+    if (!db) return;
+
+    MYSQL_RES *res = query_rows(db, "SELECT group_id FROM `groups` ORDER BY group_id");
+    if (!res) {
+        mysql_close(db);
+        return;
+    }
+
+    int n = (int)mysql_num_rows(res);
+    int *groups = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    MYSQL_ROW row;
+    int count = 0;
+    while (groups && count < n && (row = mysql_fetch_row(res))) {
+        groups[count++] = atoi(row[0]);
+    }
+    mysql_free_result(res);
+
+    int fixed = 0, failed = 0;
+    for (int i = 0; i < count && !should_stop(); i++) {
+        int rc = reconcile_group(db, groups[i]);
+        if (rc < 0) failed++;
+        else fixed += rc;
+    }
+    free(groups);
+    mysql_close(db);
+
+    if (fixed > 0 || failed > 0) {
+        fprintf(stderr, "[AGG] Reconciled %d group(s): %d row(s) corrected, %d group(s) failed\n",
+                count, fixed, failed);
+    }
+}
+
+static void *reconcile_main(void *arg) {
+    (void)arg;
+    mysql_thread_init();
+
+    pthread_mutex_lock(&reconcile_lock);
+    while (!reconcile_stopping) {
+        pthread_mutex_unlock(&reconcile_lock);
+        reconcile_all();
+        pthread_mutex_lock(&reconcile_lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += AGG_RECONCILE_INTERVAL_S;
+        while (!reconcile_stopping) {
+            if (pthread_cond_timedwait(&reconcile_cond, &reconcile_lock, &deadline) == ETIMEDOUT) break;
+        }
+    }
+    pthread_mutex_unlock(&reconcile_lock);
+
+    mysql_thread_end();
+    return NULL;
+}
+
+int agg_reconciler_start(void) {
+    pthread_mutex_lock(&reconcile_lock);
+    reconcile_stopping = 0;
+    int rc = pthread_create(&reconcile_thread, NULL, reconcile_main, NULL);
+    reconcile_running = (rc == 0);
+    pthread_mutex_unlock(&reconcile_lock);
+
+    if (rc != 0) {
+        fprintf(stderr, "[AGG] Cannot start reconciler thread: %s\n", strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+void agg_reconciler_stop(void) {
+    pthread_mutex_lock(&reconcile_lock);
+    if (!reconcile_running) {
+        pthread_mutex_unlock(&reconcile_lock);
+        return;
+    }
+    reconcile_stopping = 1;
+    pthread_cond_signal(&reconcile_cond);
+    pthread_mutex_unlock(&reconcile_lock);
+
+    pthread_join(reconcile_thread, NULL);
+    reconcile_running = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef AGGREGATES_H
+#define AGGREGATES_H
+
+// Materialized size/count rollups on directories and groups:
+//   directories.total_bytes / file_count: every live file in the subtree
+//   directories.dir_count: live directories below it (any depth)
+//   groups.*: the same for the whole group (root directory not counted)
+//
+// Handlers apply deltas inside the same transaction as the change they
+// describe (apply_dir_delta walks the ancestor chain in the database).
+// A background reconciler recomputes everything from files/directories
+// and corrects drift; it also fills the columns in after an upgrade.
+#define AGG_RECONCILE_INTERVAL_S 3600
+
+typedef struct {
+    long long bytes;
+    int files;
+    int dirs;
+} AggTotals;
+
+// What an item adds to its ancestors: a file is (size, 1, 0), a directory
+// its subtree plus itself. *parent_dir_id is the directory holding it
+// (0 for a group root). Returns 0, or -1 if the item is gone / DB error.
+int agg_item_totals(int is_file, int item_id, int *parent_dir_id, AggTotals *out);
+
+// Add sign * t to dir_id, its ancestors and the group. dir_id 0 updates
+// only the group. Call inside the caller's transaction.
+int agg_apply(int group_id, int dir_id, const AggTotals *t, int sign);
+
+// Start / stop the reconciler thread (first pass runs right away)
+int agg_reconciler_start(void);
+void agg_reconciler_stop(void);
+
+#endif
@@ -4,19 +4,29 @@
 
 MYSQL *conn = NULL;
 
-void init_mysql() {
-    conn = mysql_init(NULL);
+MYSQL *db_connect() {
+    MYSQL *c = mysql_init(NULL);
 
-    if (conn == NULL) {
+    if (c == NULL) {
         fprintf(stderr, "mysql_init() failed\n");
-        exit(1);
+        return NULL;
     }
 
     // Thay your_password bằng password của bạn
-    if (mysql_real_connect(conn, "localhost", "root", "your_new_password",
+    if (mysql_real_connect(c, "localhost", "root", "your_new_password",
                           "file_sharing_system", 0, NULL, 0) == NULL) {
-        fprintf(stderr, "mysql_real_connect() failed: %s\n", mysql_error(conn));
-        mysql_close(conn);
+        fprintf(stderr, "mysql_real_connect() failed: %s\n", mysql_error(c));
+        mysql_close(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+void init_mysql() {
+    conn = db_connect();
+
+    if (conn == NULL) {
         exit(1);
     }
 
@@ -29,3 +39,17 @@ void close_mysql() {
         printf("MySQL connection closed.\n");
     }
 }
+
+// Giao dịch trên kết nối chính: các thay đổi file/thư mục và số liệu tổng hợp
+// đi cùng nhau hoặc không gì cả
+int db_begin() {
+    return mysql_query(conn, "START TRANSACTION") == 0 ? 0 : -1;
+}
+
+int db_commit() {
+    return mysql_query(conn, "COMMIT") == 0 ? 0 : -1;
+}
+
+void db_rollback() {
+    mysql_query(conn, "ROLLBACK");
+}
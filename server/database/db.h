@@ -5,7 +5,14 @@
 
 extern MYSQL *conn;
 
+// Kết nối mới tới CSDL; NULL nếu thất bại (luồng nền dùng kết nối riêng)
+MYSQL *db_connect();
 void init_mysql();
 void close_mysql();
 
+// START TRANSACTION / COMMIT / ROLLBACK trên kết nối chính
+int db_begin();
+int db_commit();
+void db_rollback();
+
 #endif
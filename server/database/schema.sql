@@ -27,6 +27,9 @@ CREATE TABLE IF NOT EXISTS `groups` (
     description TEXT,
     created_by INT NOT NULL,       -- ID người tạo nhóm
     root_dir_id INT DEFAULT NULL,  -- ID thư mục gốc của nhóm
+    total_bytes BIGINT NOT NULL DEFAULT 0,  -- Tổng dung lượng file (chưa xoá) của nhóm
+    file_count INT NOT NULL DEFAULT 0,      -- Số file của nhóm
+    dir_count INT NOT NULL DEFAULT 0,       -- Số thư mục (không tính thư mục gốc)
     created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
     FOREIGN KEY (created_by) REFERENCES users(user_id)
 );
@@ -65,9 +68,13 @@ CREATE TABLE IF NOT EXISTS directories (
     group_id INT NOT NULL,
     created_by INT NOT NULL,
     is_deleted BOOLEAN DEFAULT FALSE,  -- Soft delete
+    total_bytes BIGINT NOT NULL DEFAULT 0,  -- Tổng dung lượng file trong cả cây con
+    file_count INT NOT NULL DEFAULT 0,      -- Số file trong cả cây con
+    dir_count INT NOT NULL DEFAULT 0,       -- Số thư mục con (mọi cấp, không tính chính nó)
     created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
     updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,
     deleted_at TIMESTAMP NULL,
+    KEY idx_dirs_purge (is_deleted, deleted_at),  -- GC tìm dòng đã xóa quá hạn
     FOREIGN KEY (parent_dir_id) REFERENCES directories(dir_id),
     FOREIGN KEY (group_id) REFERENCES `groups`(group_id),
     FOREIGN KEY (created_by) REFERENCES users(user_id)
@@ -83,15 +90,42 @@ CREATE TABLE IF NOT EXISTS files (
     dir_id INT NOT NULL,
     group_id INT NOT NULL,
     uploaded_by INT NOT NULL,           -- ID người upload file
+    content_sha256 CHAR(64) NULL,       -- SHA-256 (hex) tính khi upload, dùng để kiểm tra khi đọc
+    pack_segment INT NULL,              -- File nhỏ: segment trong storage/packs (NULL = file riêng tại file_path)
+    pack_offset BIGINT NULL,            -- Vị trí dữ liệu trong segment, độ dài là file_size
     is_deleted BOOLEAN DEFAULT FALSE,  -- Soft delete
     uploaded_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
     updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,
     deleted_at TIMESTAMP NULL,
+    KEY idx_files_pack (pack_segment, pack_offset),
+    KEY idx_files_purge (is_deleted, deleted_at),  -- GC tìm dòng đã xóa quá hạn
+    KEY idx_files_path (file_path(191)),           -- GC kiểm tra blob còn được dùng chung không
     FOREIGN KEY (dir_id) REFERENCES directories(dir_id),
     FOREIGN KEY (group_id) REFERENCES `groups`(group_id),
     FOREIGN KEY (uploaded_by) REFERENCES users(user_id)
 );
 
+-- Bảng phiên bản cũ của file (upload trùng tên vào cùng thư mục, RESTORE_VERSION)
+-- Nội dung hiện tại nằm ở bảng files; mỗi lần thay nội dung, bản cũ thành một dòng ở đây
+CREATE TABLE IF NOT EXISTS file_versions (
+    version_id INT AUTO_INCREMENT PRIMARY KEY,
+    file_id INT NOT NULL,
+    version_no INT NOT NULL,            -- Số thứ tự phiên bản của file, tăng dần từ 1
+    storage ENUM('full', 'delta') NOT NULL DEFAULT 'full',  -- delta: mã hoá theo phiên bản mới hơn kế tiếp
+    delta_tried BOOLEAN NOT NULL DEFAULT FALSE,  -- Đã thử mã hoá delta (không lợi thì giữ nguyên)
+    file_path VARCHAR(500) NOT NULL,    -- Blob nguyên vẹn hoặc file delta
+    file_size BIGINT NOT NULL,          -- Kích thước nội dung của phiên bản (không phải của delta)
+    content_sha256 CHAR(64) NULL,
+    uploaded_by INT NOT NULL,
+    created_at TIMESTAMP NULL,          -- Thời điểm nội dung này được upload
+    archived_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,  -- Thời điểm bị thay bằng nội dung mới
+    UNIQUE KEY uq_file_version (file_id, version_no),
+    KEY idx_versions_delta (storage, delta_tried),
+    KEY idx_versions_path (file_path(191)),     -- GC kiểm tra blob còn được dùng không
+    FOREIGN KEY (file_id) REFERENCES files(file_id),
+    FOREIGN KEY (uploaded_by) REFERENCES users(user_id)
+);
+
 -- Bảng log hoạt động của nhóm
 CREATE TABLE IF NOT EXISTS activity_log (
     log_id INT AUTO_INCREMENT PRIMARY KEY,
@@ -378,4 +412,101 @@ BEGIN
     RETURN result;  -- Nếu không có thì trả NULL
 END$$
 
+DROP PROCEDURE IF EXISTS apply_dir_delta$$
+CREATE PROCEDURE apply_dir_delta(
+    IN p_group_id INT,
+    IN p_dir_id INT,       -- Thư mục nhận thay đổi; NULL = chỉ cập nhật nhóm
+    IN p_bytes BIGINT,
+    IN p_files INT,
+    IN p_dirs INT
+)
+BEGIN
+    DECLARE cur_dir INT DEFAULT p_dir_id;
+    DECLARE depth INT DEFAULT 0;
+
+    -- Cộng dồn lên mọi thư mục tổ tiên; giới hạn độ sâu phòng cây bị vòng
+    WHILE cur_dir IS NOT NULL AND depth < 1000 DO
+        UPDATE directories
+        SET total_bytes = total_bytes + p_bytes,
+            file_count = file_count + p_files,
+            dir_count = dir_count + p_dirs,
+            updated_at = updated_at  -- Không coi là sửa thư mục
+        WHERE dir_id = cur_dir;
+
+        SET cur_dir = (SELECT parent_dir_id FROM directories WHERE dir_id = cur_dir);
+        SET depth = depth + 1;
+    END WHILE;
+
+    UPDATE `groups`
+    SET total_bytes = total_bytes + p_bytes,
+        file_count = file_count + p_files,
+        dir_count = dir_count + p_dirs
+    WHERE group_id = p_group_id;
+END$$
+
+-- Thêm cột vào bảng của database tạo từ schema cũ (CREATE TABLE IF NOT EXISTS
+-- bỏ qua bảng đã có); không làm gì nếu cột đã tồn tại
+DROP PROCEDURE IF EXISTS add_column_if_missing$$
+CREATE PROCEDURE add_column_if_missing(
+    IN p_table VARCHAR(64),
+    IN p_column VARCHAR(64),
+    IN p_definition VARCHAR(255)  -- Kiểu, mặc định, vị trí (vd 'INT NOT NULL DEFAULT 0 AFTER x')
+)
+BEGIN
+    IF NOT EXISTS (
+        SELECT 1 FROM information_schema.COLUMNS
+        WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = p_table AND COLUMN_NAME = p_column
+    ) THEN
+        SET @ddl = CONCAT('ALTER TABLE `', p_table, '` ADD COLUMN `', p_column, '` ', p_definition);
+        PREPARE stmt FROM @ddl;
+        EXECUTE stmt;
+        DEALLOCATE PREPARE stmt;
+    END IF;
+END$$
+
+-- Như add_column_if_missing, cho chỉ mục
+DROP PROCEDURE IF EXISTS add_index_if_missing$$
+CREATE PROCEDURE add_index_if_missing(
+    IN p_table VARCHAR(64),
+    IN p_index VARCHAR(64),
+    IN p_columns VARCHAR(255)  -- Danh sách cột trong ngoặc, vd '(a, b)'
+)
+BEGIN
+    IF NOT EXISTS (
+        SELECT 1 FROM information_schema.STATISTICS
+        WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = p_table AND INDEX_NAME = p_index
+    ) THEN
+        SET @ddl = CONCAT('ALTER TABLE `', p_table, '` ADD INDEX `', p_index, '` ', p_columns);
+        PREPARE stmt FROM @ddl;
+        EXECUTE stmt;
+        DEALLOCATE PREPARE stmt;
+    END IF;
+END$$
+
 DELIMITER ;
+
+-- ============================================
+-- Nâng cấp database đã có (chạy lại file này là đủ, mỗi bước idempotent)
+-- ============================================
+
+-- Tổng hợp dung lượng / số lượng: để 0, reconciler (database/aggregates.c)
+-- tính lại toàn bộ ở lượt chạy đầu sau khi server khởi động
+CALL add_column_if_missing('groups', 'total_bytes', 'BIGINT NOT NULL DEFAULT 0 AFTER root_dir_id');
+CALL add_column_if_missing('groups', 'file_count', 'INT NOT NULL DEFAULT 0 AFTER total_bytes');
+CALL add_column_if_missing('groups', 'dir_count', 'INT NOT NULL DEFAULT 0 AFTER file_count');
+CALL add_column_if_missing('directories', 'total_bytes', 'BIGINT NOT NULL DEFAULT 0 AFTER is_deleted');
+CALL add_column_if_missing('directories', 'file_count', 'INT NOT NULL DEFAULT 0 AFTER total_bytes');
+CALL add_column_if_missing('directories', 'dir_count', 'INT NOT NULL DEFAULT 0 AFTER file_count');
+
+-- SHA-256 của nội dung: file upload trước đó để NULL, đọc ra không kiểm tra
+CALL add_column_if_missing('files', 'content_sha256', 'CHAR(64) NULL AFTER uploaded_by');
+
+-- Gói file nhỏ vào segment: file đã có giữ NULL (file riêng tại file_path)
+CALL add_column_if_missing('files', 'pack_segment', 'INT NULL AFTER content_sha256');
+CALL add_column_if_missing('files', 'pack_offset', 'BIGINT NULL AFTER pack_segment');
+CALL add_index_if_missing('files', 'idx_files_pack', '(pack_segment, pack_offset)');
+
+-- Chỉ mục cho GC
+CALL add_index_if_missing('directories', 'idx_dirs_purge', '(is_deleted, deleted_at)');
+CALL add_index_if_missing('files', 'idx_files_purge', '(is_deleted, deleted_at)');
+CALL add_index_if_missing('files', 'idx_files_path', '(file_path(191))');
@@ -8,6 +8,7 @@ SET FOREIGN_KEY_CHECKS = 0;
 TRUNCATE TABLE activity_log;
 TRUNCATE TABLE group_requests;
 TRUNCATE TABLE user_sessions;
+TRUNCATE TABLE file_versions;
 TRUNCATE TABLE files;
 TRUNCATE TABLE directories;
 TRUNCATE TABLE user_groups;
@@ -1,8 +1,15 @@
+#define _GNU_SOURCE     // accept4
 #include "io_multiplexing.h"
 #include "../net/client.h"
 #include "../net/stream.h"
 #include "../protocol/command.h"
 #include "../utils/logger.h"
+#include "server_timers.h"
+#include "../net/scheduler.h"
+#include "../net/admission.h"
+#include "../net/event_bus.h"
+#include "../protocol/archive.h"
+#include "../storage/fsck.h"
 
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -11,27 +18,146 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
-#include <fcntl.h>
-
-// Hàm đặt socket ở chế độ non-blocking (bản cục bộ cho module này)
-static void set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl F_GETFL");
-        return;
+
+// Timer wheel hết hạn kết nối thì ngắt như lỗi đọc/ghi
+static void drop_client(int idx, const char *reason) {
+    log_disc(idx, "%s", reason);
+    remove_client_index(idx);
+}
+
+// Nhận hết kết nối đang chờ trong hàng đợi listen (tối đa ADMIT_ACCEPT_BATCH).
+// Quá tải hoặc hết slot thì trả 503 kèm retry_after rồi đóng ngay.
+static void accept_pending(int server_sock) {
+    for (int n = 0; n < ADMIT_ACCEPT_BATCH; n++) {
+        struct sockaddr_in client_addr;
+        socklen_t len = sizeof(client_addr);
+        int client_sock = accept4(server_sock, (struct sockaddr *)&client_addr, &len,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+
+        int retry_after = admission_check_accept();
+        int idx = (retry_after == 0) ? add_client(client_sock) : -1;
+        if (idx < 0) {
+            log_info(-1, 0, "Rejected connection from %s:%d (%s)",
+                     client_ip, ntohs(client_addr.sin_port),
+                     retry_after ? "overloaded" : "client table full");
+            admission_reject_socket(client_sock,
+                                    retry_after ? retry_after : ADMIT_RETRY_REJECT_SECONDS);
+            continue;
+        }
+
+        log_conn(idx, "New connection from %s:%d (fd=%d)",
+                 client_ip, ntohs(client_addr.sin_port), client_sock);
+    }
+}
+
+// Chạy các dòng lệnh đã nhận đủ trong recv_buf. Dừng lại (THROTTLED) khi
+// hàng đợi gửi vượt high-water; phần còn lại chạy tiếp khi client đọc bớt.
+static void process_pending_input(int idx) {
+    Client *c = &clients[idx];
+
+    conn_update_state(idx);
+    if (c->state == CONN_THROTTLED || c->state == CONN_DRAINING ||
+        c->state == CONN_STREAMING || c->state == CONN_WAITING) return;
+    c->state = CONN_PROCESSING;
+
+    int pos;
+    while (c->state == CONN_PROCESSING &&
+           conn_pending_output(idx) < SEND_HIGH_WATER &&
+           (pos = find_crlf(c->recv_buf, c->recv_len)) >= 0)
+    {
+        // Quá tải: từ chối sớm bằng 503 thay vì xử lý (bulk bị từ chối trước)
+        int retry_after = admission_check_command(c->recv_buf, pos);
+        if (retry_after > 0) {
+            char busy[64];
+            int n = admission_busy_reply(busy, sizeof(busy), retry_after);
+            enqueue_send(idx, busy, n);
+        } else {
+            uint64_t started = admission_now_us();
+            process_command(idx, c->recv_buf, pos);
+            admission_record_command(admission_now_us() - started);
+        }
+
+        int tail = c->recv_len - (pos + 2);
+        if (tail > 0) {
+            memmove(c->recv_buf, c->recv_buf + pos + 2, tail);
+        }
+        c->recv_len = tail;
+    }
+
+    conn_update_state(idx);
+}
+
+int handle_client_data(int idx, const char *data, int len) {
+    Client *c = &clients[idx];
+    if (len > conn_recv_space(idx)) {
+        return -1;
+    }
+
+    memcpy(c->recv_buf + c->recv_len, data, len);
+    c->recv_len += len;
+
+    process_pending_input(idx);
+
+    // Đầy bộ đệm mà không có dòng lệnh hoàn chỉnh: báo lỗi rồi đóng sau khi gửi xong
+    if (c->recv_len == BUFFER_SIZE && find_crlf(c->recv_buf, c->recv_len) < 0) {
+        const char *err = "ERR LINE_TOO_LONG\r\n";
+        log_error(idx, c->user_id, "Command line longer than %d bytes", BUFFER_SIZE);
+        c->recv_len = 0;
+        enqueue_send(idx, err, strlen(err));
+        conn_start_draining(idx);
     }
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl F_SETFL");
+    return 0;
+}
+
+int handle_client_output(int idx) {
+    Client *c = &clients[idx];
+    if (c->state == CONN_DRAINING) {
+        return (conn_pending_output(idx) > 0) ? 0 : -1;
     }
+
+    // Ra khỏi THROTTLED thì chạy tiếp các lệnh đang chờ trong recv_buf
+    process_pending_input(idx);
+    return 0;
 }
 
 void run_server_loop(int server_sock) {
     fd_set readfds, writefds;
     int max_fd;
+    int order[MAX_CLIENTS];
 
     printf("Using I/O Multiplexing with select()...\n");
+    server_timers_init(drop_client);
 
     while (1) {
+        sched_poll_reload();
+        fsck_poll_request();
+
+        // Đóng kết nối DRAINING đã gửi hết, chạy tiếp lệnh của kết nối hết THROTTLED
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].sock > 0 && handle_client_output(i) < 0) {
+                log_disc(i, "Client disconnected (closed after draining output)");
+                remove_client_index(i);
+            }
+        }
+
+        // Sự kiện đang chờ của các kết nối đã đăng ký (khi hàng đợi gửi đủ trống)
+        event_bus_deliver();
+
+        // Phần tiếp theo của các archive DOWNLOAD_FOLDER (thân file qua sendfile)
+        archive_pump(1);
+
+        int n_order = sched_begin_round(order);
+
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
@@ -41,48 +167,59 @@ void run_server_loop(int server_sock) {
         for (int i = 0; i < MAX_CLIENTS; i++) {
             int sd = clients[i].sock;
             if (sd > 0) {
-                FD_SET(sd, &readfds);
-                if (clients[i].send_len > clients[i].send_offset)
+                // Hàng đợi gửi trên high-water (THROTTLED) hoặc đang đóng: ngừng đọc
+                if (conn_wants_read(i))
+                    FD_SET(sd, &readfds);
+                // Client bị giới hạn tốc độ thì chưa chờ ghi
+                if (sched_send_budget(i) > 0)
                     FD_SET(sd, &writefds);
 
                 if (sd > max_fd) max_fd = sd;
             }
         }
 
+        // Ngủ tới timer gần nhất (timeout kết nối, job định kỳ) hoặc
+        // tới khi token bucket của client đang bị giới hạn hồi lại
+        long wait_ms = server_timers_next_ms();
+        long sched_ms = sched_next_ms();
+        if (sched_ms >= 0 && (wait_ms < 0 || sched_ms < wait_ms)) {
+            wait_ms = sched_ms;
+        }
+        struct timeval tick = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+        struct timeval *timeout = (wait_ms >= 0) ? &tick : NULL;
+
+        admission_loop_end();
         int activity =
-            select(max_fd + 1, &readfds, &writefds, NULL, NULL);
+            select(max_fd + 1, &readfds, &writefds, NULL, timeout);
+        admission_loop_begin();
+
+        server_timers_run();
 
         if (activity < 0 && errno != EINTR) {
             perror("select");
             continue;
         }
+        if (activity <= 0) {
+            continue;
+        }
 
         // ACCEPT
         if (FD_ISSET(server_sock, &readfds)) {
-            struct sockaddr_in client_addr;
-            socklen_t len = sizeof(client_addr);
-            int client_sock =
-                accept(server_sock, (struct sockaddr *)&client_addr, &len);
-                set_nonblocking(client_sock);
-            if (client_sock >= 0) {
-                int idx = add_client(client_sock);
-                if (idx < 0) {
-                    close(client_sock);
-                } else {
-                    char client_ip[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-                    log_conn(idx, "New connection from %s:%d (fd=%d)", 
-                            client_ip, ntohs(client_addr.sin_port), client_sock);
-                }
-            }
+            accept_pending(server_sock);
         }
 
-        // WRITE
-        for (int i = 0; i < MAX_CLIENTS; i++) {
+        // WRITE (thứ tự do scheduler quyết định: control trước, bulk xoay vòng)
+        for (int k = 0; k < n_order; k++) {
+            int i = order[k];
             if (clients[i].sock > 0 && FD_ISSET(clients[i].sock, &writefds)) {
+                int before = conn_pending_output(i);
                 if (flush_send(i) < 0) {
                     log_disc(i, "Client disconnected (send error)");
                     remove_client_index(i);
+                    continue;
+                }
+                if (conn_pending_output(i) < before) {
+                    server_timers_on_send(i);
                 }
             }
         }
@@ -91,36 +228,20 @@ void run_server_loop(int server_sock) {
         for (int i = 0; i < MAX_CLIENTS; i++) {
             int sd = clients[i].sock;
 
-            if (sd > 0 && FD_ISSET(sd, &readfds)) {
+            if (sd > 0 && FD_ISSET(sd, &readfds) && conn_wants_read(i)) {
                 char tmpbuf[2048];
-                ssize_t bytes = recv(sd, tmpbuf, sizeof(tmpbuf), 0);
+                // Không đọc quá chỗ trống còn lại trong recv_buf
+                size_t want = sizeof(tmpbuf);
+                if ((int)want > conn_recv_space(i)) want = (size_t)conn_recv_space(i);
+                ssize_t bytes = recv(sd, tmpbuf, want, 0);
 
                 if (bytes > 0) {
-                    if (clients[i].recv_len + bytes > BUFFER_SIZE) {
+                    server_timers_on_recv(i);
+                    if (handle_client_data(i, tmpbuf, (int)bytes) < 0) {
                         log_disc(i, "Client disconnected (buffer overflow)");
                         remove_client_index(i);
                         continue;
                     }
-
-                    memcpy(clients[i].recv_buf + clients[i].recv_len,
-                           tmpbuf, bytes);
-                    clients[i].recv_len += bytes;
-
-                    int pos;
-                    while ((pos = find_crlf(
-                                clients[i].recv_buf,
-                                clients[i].recv_len)) >= 0)
-                    {
-                        process_command(i, clients[i].recv_buf, pos);
-
-                        int tail = clients[i].recv_len - (pos + 2);
-                        if (tail > 0) {
-                            memmove(clients[i].recv_buf,
-                                    clients[i].recv_buf + pos + 2,
-                                    tail);
-                        }
-                        clients[i].recv_len = tail;
-                    }
                 }
                 else if (bytes == 0) {
                     // bytes == 0 means connection closed by client
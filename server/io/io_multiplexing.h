@@ -3,4 +3,13 @@
 
 void run_server_loop(int server_sock);
 
+// Append received bytes to the client's buffer and run the complete
+// command lines, pausing while the output queue is above high-water.
+// len must fit in conn_recv_space(); returns -1 otherwise (caller drops the client)
+int handle_client_data(int idx, const char *data, int len);
+
+// Call after output went out: resumes a throttled connection. Returns -1
+// when a draining connection has sent everything and should be closed.
+int handle_client_output(int idx);
+
 #endif
@@ -0,0 +1,329 @@
+#include "io_uring_loop.h"
+
+#ifdef USE_IO_URING
+
+#include "io_multiplexing.h"
+#include "../net/client.h"
+#include "../net/stream.h"
+#include "../utils/logger.h"
+#include "server_timers.h"
+#include "../net/scheduler.h"
+#include "../net/admission.h"
+#include "../net/event_bus.h"
+#include "../protocol/archive.h"
+#include "../storage/fsck.h"
+
+#include <liburing.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define URING_ENTRIES 256
+#define URING_RECV_SIZE 2048
+#define LISTEN_SLOT MAX_CLIENTS     // fixed-file index of the listening socket
+
+enum { OP_ACCEPT = 1, OP_RECV = 2, OP_SEND = 3 };
+
+// Completions can arrive after the connection in a slot is gone (and the
+// slot reused); the generation in user_data tells them apart.
+typedef struct {
+    unsigned int gen;
+    int recv_pending;
+    int send_pending;
+} UringSlot;
+
+static struct io_uring ring;
+static UringSlot slots[MAX_CLIENTS];
+static char recv_bufs[MAX_CLIENTS][URING_RECV_SIZE];   // registered buffers
+static struct sockaddr_in accept_addr;
+static socklen_t accept_len;
+
+static uint64_t pack_data(int op, int idx, unsigned int gen) {
+    return ((uint64_t)op << 56) | ((uint64_t)(gen & 0xFFFFFF) << 32) | (uint32_t)idx;
+}
+
+static void unpack_data(uint64_t data, int *op, int *idx, unsigned int *gen) {
+    *op = (int)(data >> 56);
+    *gen = (unsigned int)((data >> 32) & 0xFFFFFF);
+    *idx = (int)(uint32_t)data;
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+        // SQ full: push what we have and retry
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+static void arm_accept(void) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+
+    accept_len = sizeof(accept_addr);
+    io_uring_prep_accept(sqe, LISTEN_SLOT, (struct sockaddr *)&accept_addr, &accept_len, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, pack_data(OP_ACCEPT, 0, 0));
+}
+
+static void arm_recv(int idx) {
+    // Never read more than recv_buf can take
+    int len = conn_recv_space(idx);
+    if (len > URING_RECV_SIZE) len = URING_RECV_SIZE;
+    if (len <= 0) return;
+
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+
+    io_uring_prep_read_fixed(sqe, idx, recv_bufs[idx], (unsigned)len, 0, idx);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, pack_data(OP_RECV, idx, slots[idx].gen));
+    slots[idx].recv_pending = 1;
+}
+
+static void arm_send(int idx, int len) {
+    Client *c = &clients[idx];
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+
+    io_uring_prep_send(sqe, idx, c->send_buf + c->send_offset, (size_t)len, MSG_NOSIGNAL);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, pack_data(OP_SEND, idx, slots[idx].gen));
+    slots[idx].send_pending = 1;
+    c->send_inflight = 1;
+}
+
+static void drop_client(int idx, const char *reason) {
+    log_disc(idx, "%s", reason);
+
+    // Wake any recv still queued on the socket; its completion is stale from here on
+    shutdown(clients[idx].sock, SHUT_RDWR);
+    int none = -1;
+    io_uring_register_files_update(&ring, idx, &none, 1);
+
+    slots[idx].gen++;
+    slots[idx].recv_pending = 0;
+    slots[idx].send_pending = 0;
+    remove_client_index(idx);
+}
+
+static void on_accept(int res) {
+    arm_accept();
+
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR) {
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        }
+        return;
+    }
+
+    int client_sock = res;
+    int retry_after = admission_check_accept();
+    int idx = (retry_after == 0) ? add_client(client_sock) : -1;
+    if (idx < 0) {
+        log_info(-1, 0, "Rejected connection (fd=%d, %s)", client_sock,
+                 retry_after ? "overloaded" : "client table full");
+        admission_reject_socket(client_sock,
+                                retry_after ? retry_after : ADMIT_RETRY_REJECT_SECONDS);
+        return;
+    }
+
+    if (io_uring_register_files_update(&ring, idx, &client_sock, 1) < 0) {
+        remove_client_index(idx);
+        return;
+    }
+
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &accept_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    log_conn(idx, "New connection from %s:%d (fd=%d)",
+             client_ip, ntohs(accept_addr.sin_port), client_sock);
+}
+
+static void on_recv(int idx, int res) {
+    slots[idx].recv_pending = 0;
+
+    if (res == 0) {
+        drop_client(idx, "Client disconnected (connection closed)");
+        return;
+    }
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EINTR) {
+            return;     // re-armed by the loop
+        }
+        char reason[128];
+        snprintf(reason, sizeof(reason), "Client disconnected (read error: %s)", strerror(-res));
+        drop_client(idx, reason);
+        return;
+    }
+
+    server_timers_on_recv(idx);
+    if (handle_client_data(idx, recv_bufs[idx], res) < 0) {
+        drop_client(idx, "Client disconnected (buffer overflow)");
+    }
+}
+
+static void on_send(int idx, int res) {
+    Client *c = &clients[idx];
+    slots[idx].send_pending = 0;
+    c->send_inflight = 0;
+
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EINTR) return;   // re-queued below
+        drop_client(idx, "Client disconnected (send error)");
+        return;
+    }
+
+    c->send_offset += res;
+    if (res > 0) {
+        server_timers_on_send(idx);
+        sched_on_sent(idx, res);
+    }
+    if (c->send_offset >= c->send_len) {
+        c->send_len = 0;
+        c->send_offset = 0;
+    } else {
+        compact_send(idx);     // nothing in flight now, safe to move
+    }
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe) {
+    int op, idx;
+    unsigned int gen;
+    unpack_data(io_uring_cqe_get_data64(cqe), &op, &idx, &gen);
+
+    if (op == OP_ACCEPT) {
+        on_accept(cqe->res);
+        return;
+    }
+
+    if (idx < 0 || idx >= MAX_CLIENTS || gen != (slots[idx].gen & 0xFFFFFF)) {
+        return;     // connection already gone
+    }
+
+    if (op == OP_RECV) {
+        on_recv(idx, cqe->res);
+    } else if (op == OP_SEND) {
+        on_send(idx, cqe->res);
+    }
+}
+
+static int setup_ring(int server_sock) {
+    if (io_uring_queue_init(URING_ENTRIES, &ring, 0) < 0) {
+        return -1;
+    }
+
+    struct iovec iov[MAX_CLIENTS];
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        iov[i].iov_base = recv_bufs[i];
+        iov[i].iov_len = URING_RECV_SIZE;
+    }
+
+    if (io_uring_register_buffers(&ring, iov, MAX_CLIENTS) < 0 ||
+        io_uring_register_files_sparse(&ring, MAX_CLIENTS + 1) < 0 ||
+        io_uring_register_files_update(&ring, LISTEN_SLOT, &server_sock, 1) < 0) {
+        io_uring_queue_exit(&ring);
+        return -1;
+    }
+
+    memset(slots, 0, sizeof(slots));
+    return 0;
+}
+
+int run_uring_server_loop(int server_sock) {
+    if (setup_ring(server_sock) != 0) {
+        return -1;
+    }
+
+    printf("Using I/O with io_uring...\n");
+    server_timers_init(drop_client);
+    arm_accept();
+
+    int order[MAX_CLIENTS];
+    while (1) {
+        sched_poll_reload();
+        fsck_poll_request();
+
+        // Drained connections are closed, throttled ones resume, and every
+        // connection that wants input (not throttled/draining) has a recv armed
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].sock <= 0) continue;
+            if (handle_client_output(i) < 0) {
+                drop_client(i, "Client disconnected (closed after draining output)");
+                continue;
+            }
+            if (!slots[i].recv_pending && conn_wants_read(i)) {
+                arm_recv(i);
+            }
+        }
+
+        // Pending push events go out with this round's sends
+        event_bus_deliver();
+
+        // Folder archives are refilled through send_buf: sendfile() does
+        // not mix with the sends in flight on the ring
+        archive_pump(0);
+
+        // Queue a send for every client the scheduler lets through this
+        // round, control replies first, bulk sends capped at its credit
+        int n_order = sched_begin_round(order);
+        for (int k = 0; k < n_order; k++) {
+            int i = order[k];
+            if (slots[i].send_pending) continue;
+            int budget = sched_send_budget(i);
+            if (budget > 0) {
+                arm_send(i, budget);
+            }
+        }
+
+        admission_loop_end();
+
+        struct io_uring_cqe *cqe;
+        int rc;
+        long wait_ms = server_timers_next_ms();
+        long sched_ms = sched_next_ms();
+        if (sched_ms >= 0 && (wait_ms < 0 || sched_ms < wait_ms)) {
+            wait_ms = sched_ms;
+        }
+        if (wait_ms >= 0) {
+            struct __kernel_timespec ts = { wait_ms / 1000, (wait_ms % 1000) * 1000000 };
+            rc = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+        } else {
+            rc = io_uring_submit_and_wait(&ring, 1);
+        }
+
+        admission_loop_begin();
+        server_timers_run();
+
+        if (rc < 0 && rc != -ETIME && rc != -EINTR) {
+            fprintf(stderr, "io_uring wait: %s\n", strerror(-rc));
+            continue;
+        }
+
+        unsigned int head;
+        unsigned int seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            handle_cqe(cqe);
+            seen++;
+        }
+        io_uring_cq_advance(&ring, seen);
+    }
+
+    io_uring_queue_exit(&ring);
+    return 0;
+}
+
+#else
+
+int run_uring_server_loop(int server_sock) {
+    (void)server_sock;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef IO_URING_LOOP_H
+#define IO_URING_LOOP_H
+
+// Completion-based alternative to run_server_loop (Linux, build with
+// USE_IO_URING=1). Accept, recv and send for every connection are
+// queued on one ring and submitted together, one io_uring_enter per
+// loop iteration. Returns -1 without serving anything if the ring
+// cannot be set up, so the caller can fall back to select().
+int run_uring_server_loop(int server_sock);
+
+#endif
@@ -0,0 +1,216 @@
+#include "server_timers.h"
+#include "../net/client.h"
+#include "../net/stream.h"
+#include "../auth/token.h"
+#include "../protocol/transfer.h"
+#include "../storage/fd_cache.h"
+#include "../storage/pack_store.h"
+#include "../storage/gc.h"
+#include "../storage/blob_clone.h"
+#include "../storage/versions.h"
+#include "../utils/timer_wheel.h"
+#include "../utils/logger.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    Timer timer;
+    uint64_t last_recv_ms;
+    uint64_t last_send_ms;
+} ConnTimers;
+
+static TimerWheel wheel;
+static int timers_ready = 0;
+static drop_client_fn drop_client = NULL;
+
+static ConnTimers conns[MAX_CLIENTS];
+static Timer session_purge_timer;
+static Timer part_gc_timer;
+static Timer fd_sweep_timer;
+static Timer pack_compact_timer;
+static Timer storage_gc_timer;
+static Timer clone_timer;
+static Timer version_delta_timer;
+
+// Re-evaluated at least this often, so a deadline that appears after
+// the timer was armed (e.g. a partial line arriving) is never overshot
+#define CONN_CHECK_MAX_MS (CONN_READ_TIMEOUT_MS < CONN_WRITE_TIMEOUT_MS \
+                               ? CONN_READ_TIMEOUT_MS : CONN_WRITE_TIMEOUT_MS)
+
+static void on_conn_timer(Timer *t, void *arg) {
+    (void)t;
+    int idx = (int)(intptr_t)arg;
+    Client *c = &clients[idx];
+    ConnTimers *ct = &conns[idx];
+    if (c->sock <= 0) return;
+
+    uint64_t now = timer_now_ms();
+    uint64_t last = (ct->last_recv_ms > ct->last_send_ms) ? ct->last_recv_ms : ct->last_send_ms;
+
+    uint64_t idle_deadline = last + ((c->user_id > 0) ? CONN_IDLE_TIMEOUT_MS
+                                                      : CONN_ANON_IDLE_TIMEOUT_MS);
+    uint64_t deadline = idle_deadline;
+    const char *reason = "Client disconnected (idle timeout)";
+
+    // Only a partial line we are still reading counts; lines parked while
+    // the connection is throttled are waiting on us, not on the client
+    int reading = (c->state != CONN_THROTTLED && c->state != CONN_DRAINING &&
+                   c->state != CONN_STREAMING && c->state != CONN_WAITING);
+    if (reading && c->recv_len > 0 && ct->last_recv_ms + CONN_READ_TIMEOUT_MS < deadline) {
+        deadline = ct->last_recv_ms + CONN_READ_TIMEOUT_MS;
+        reason = "Client disconnected (read timeout)";
+    }
+    // Output is queued in reply to a request, so count from the last activity
+    if (conn_pending_output(idx) > 0 && last + CONN_WRITE_TIMEOUT_MS < deadline) {
+        deadline = last + CONN_WRITE_TIMEOUT_MS;
+        reason = "Client disconnected (write timeout)";
+    }
+
+    if (now >= deadline) {
+        if (drop_client) {
+            drop_client(idx, reason);
+        }
+        return;
+    }
+
+    uint64_t wait = deadline - now;
+    if (wait > CONN_CHECK_MAX_MS) wait = CONN_CHECK_MAX_MS;
+    timer_wheel_add(&wheel, &ct->timer, wait);
+}
+
+static void on_session_purge(Timer *t, void *arg) {
+    (void)arg;
+    int removed = cleanup_expired_sessions_batch(SESSION_PURGE_BATCH);
+    if (removed > 0) {
+        log_info(-1, 0, "Purged %d expired sessions", removed);
+    }
+
+    // Full batch: more are waiting, come back soon instead of in a minute
+    uint64_t next = (removed == SESSION_PURGE_BATCH) ? 1000 : SESSION_PURGE_INTERVAL_MS;
+    timer_wheel_add(&wheel, t, next);
+}
+
+// Background cleanup gets a small budget while anyone is transferring
+static int gc_budget(void) {
+    int busy = transfer_active_uploads() > 0 || transfer_active_downloads() > 0;
+    return busy ? GC_BUSY_BUDGET : GC_BUDGET;
+}
+
+static void on_part_gc(Timer *t, void *arg) {
+    (void)arg;
+    int budget = gc_budget();
+    int removed = transfer_gc_stale_parts(STORAGE_ROOT, PART_GC_MAX_AGE_SECONDS, budget);
+    if (removed > 0) {
+        log_info(-1, 0, "Removed %d stale partial uploads", removed);
+    }
+    // Budget used up: the rest are picked up in a second, not in ten minutes
+    timer_wheel_add(&wheel, t, (removed == budget) ? 1000 : PART_GC_INTERVAL_MS);
+}
+
+static void on_fd_sweep(Timer *t, void *arg) {
+    (void)arg;
+    fd_cache_close_idle(time(NULL));
+    timer_wheel_add(&wheel, t, FD_SWEEP_INTERVAL_MS);
+}
+
+static void on_pack_compact(Timer *t, void *arg) {
+    (void)arg;
+    // A segment is being emptied: keep at it instead of waiting a minute
+    uint64_t next = (pack_store_compact_step() == 1) ? 1000 : PACK_COMPACT_INTERVAL_MS;
+    timer_wheel_add(&wheel, t, next);
+}
+
+static void on_storage_gc(Timer *t, void *arg) {
+    (void)arg;
+    uint64_t next = (gc_step(gc_budget()) == 1) ? 1000 : STORAGE_GC_INTERVAL_MS;
+    timer_wheel_add(&wheel, t, next);
+}
+
+static void on_clone(Timer *t, void *arg) {
+    (void)arg;
+    // Copies are queued by COPY_ITEM(S); check back often only while there are some
+    uint64_t next = (clone_poll() == 1) ? CLONE_INTERVAL_MS : CLONE_IDLE_INTERVAL_MS;
+    timer_wheel_add(&wheel, t, next);
+}
+
+static void on_version_delta(Timer *t, void *arg) {
+    (void)arg;
+    // One version encoded at a time; back soon while one is in progress,
+    // every tick while a client waits on a rebuild
+    int rc = version_poll();
+    uint64_t next = (rc == 2) ? VERSION_RESTORE_INTERVAL_MS
+                  : (rc == 1) ? VERSION_DELTA_INTERVAL_MS : VERSION_DELTA_IDLE_INTERVAL_MS;
+    timer_wheel_add(&wheel, t, next);
+}
+
+void server_timers_init(drop_client_fn drop) {
+    timer_wheel_init(&wheel, TIMER_TICK_MS, timer_now_ms());
+    drop_client = drop;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        memset(&conns[i], 0, sizeof(conns[i]));
+        timer_init(&conns[i].timer, on_conn_timer, (void *)(intptr_t)i);
+    }
+
+    timer_init(&session_purge_timer, on_session_purge, NULL);
+    timer_init(&part_gc_timer, on_part_gc, NULL);
+    timer_init(&fd_sweep_timer, on_fd_sweep, NULL);
+    timer_init(&pack_compact_timer, on_pack_compact, NULL);
+    timer_init(&storage_gc_timer, on_storage_gc, NULL);
+    timer_init(&clone_timer, on_clone, NULL);
+    timer_init(&version_delta_timer, on_version_delta, NULL);
+
+    // First purge / GC shortly after startup to clear what piled up while down
+    timer_wheel_add(&wheel, &session_purge_timer, 1000);
+    timer_wheel_add(&wheel, &part_gc_timer, 5000);
+    timer_wheel_add(&wheel, &fd_sweep_timer, FD_SWEEP_INTERVAL_MS);
+    timer_wheel_add(&wheel, &pack_compact_timer, PACK_COMPACT_INTERVAL_MS);
+    timer_wheel_add(&wheel, &storage_gc_timer, STORAGE_GC_INTERVAL_MS);
+    timer_wheel_add(&wheel, &clone_timer, CLONE_IDLE_INTERVAL_MS);
+    timer_wheel_add(&wheel, &version_delta_timer, VERSION_DELTA_IDLE_INTERVAL_MS);
+
+    timers_ready = 1;
+}
+
+void server_timers_client_opened(int idx) {
+    if (!timers_ready || idx < 0 || idx >= MAX_CLIENTS) return;
+
+    uint64_t now = timer_now_ms();
+    conns[idx].last_recv_ms = now;
+    conns[idx].last_send_ms = now;
+    timer_wheel_add(&wheel, &conns[idx].timer, CONN_CHECK_MAX_MS);
+}
+
+void server_timers_client_closed(int idx) {
+    if (!timers_ready || idx < 0 || idx >= MAX_CLIENTS) return;
+    timer_wheel_cancel(&wheel, &conns[idx].timer);
+}
+
+void server_timers_on_recv(int idx) {
+    if (idx >= 0 && idx < MAX_CLIENTS) {
+        conns[idx].last_recv_ms = timer_now_ms();
+    }
+}
+
+void server_timers_on_send(int idx) {
+    if (idx >= 0 && idx < MAX_CLIENTS) {
+        conns[idx].last_send_ms = timer_now_ms();
+    }
+}
+
+long server_timers_next_ms(void) {
+    if (!timers_ready) return -1;
+    return timer_wheel_next_ms(&wheel, timer_now_ms());
+}
+
+void server_timers_run(void) {
+    if (!timers_ready) return;
+    timer_wheel_advance(&wheel, timer_now_ms());
+}
+
+void server_timers_version_wanted(void) {
+    if (!timers_ready) return;
+    timer_wheel_add(&wheel, &version_delta_timer, VERSION_RESTORE_INTERVAL_MS);
+}
@@ -0,0 +1,54 @@
+#ifndef SERVER_TIMERS_H
+#define SERVER_TIMERS_H
+
+// Everything the server does on a clock, driven by one timer wheel
+// that the event loop advances: per-connection read/write/idle
+// deadlines and the periodic background jobs (expired-session purge,
+// stale .part GC, idle fd sweep, pack segment compaction, purge of
+// soft-deleted rows and their blobs, unsharing copied blobs, delta
+// encoding of old file versions).
+
+#define TIMER_TICK_MS 100
+
+#define CONN_READ_TIMEOUT_MS (60 * 1000)         // partial command line pending
+#define CONN_WRITE_TIMEOUT_MS (60 * 1000)        // queued output not drained
+#define CONN_ANON_IDLE_TIMEOUT_MS (2 * 60 * 1000)
+#define CONN_IDLE_TIMEOUT_MS (30 * 60 * 1000)    // logged-in connection
+
+#define SESSION_PURGE_INTERVAL_MS (60 * 1000)
+#define SESSION_PURGE_BATCH 500
+#define PART_GC_INTERVAL_MS (10 * 60 * 1000)
+#define PART_GC_MAX_AGE_SECONDS (24 * 60 * 60)
+#define FD_SWEEP_INTERVAL_MS (5 * 1000)
+#define PACK_COMPACT_INTERVAL_MS (60 * 1000)
+#define STORAGE_GC_INTERVAL_MS (60 * 1000)
+#define CLONE_INTERVAL_MS 250
+#define CLONE_IDLE_INTERVAL_MS (5 * 1000)
+#define VERSION_DELTA_INTERVAL_MS 500
+#define VERSION_DELTA_IDLE_INTERVAL_MS (30 * 1000)
+#define VERSION_RESTORE_INTERVAL_MS TIMER_TICK_MS  // a client waits on a rebuild
+
+// How the event loop in use disconnects a client
+typedef void (*drop_client_fn)(int idx, const char *reason);
+
+void server_timers_init(drop_client_fn drop);
+
+// Connection lifecycle (called from add_client / remove_client_index)
+void server_timers_client_opened(int idx);
+void server_timers_client_closed(int idx);
+
+// Traffic on a connection pushes its deadlines back
+void server_timers_on_recv(int idx);
+void server_timers_on_send(int idx);
+
+// Milliseconds the event loop may sleep, -1 = no limit
+long server_timers_next_ms(void);
+
+// Fire everything that is due
+void server_timers_run(void);
+
+// A version rebuild was queued (RESTORE_VERSION): poll for it from the
+// next tick on instead of at the idle interval
+void server_timers_version_wanted(void);
+
+#endif
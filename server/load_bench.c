@@ -0,0 +1,333 @@
+// load_bench: tạo tải lên server đang chạy để so sánh hai vòng lặp sự kiện
+// (select và io_uring, chọn bằng ./server --loop ...). Mỗi client là một
+// luồng với một kết nối, đăng nhập rồi gửi tuần tự -n round-trip
+// LIST_FOLDER_CONTENT / DOWNLOAD_FILE (đợi phản hồi mới gửi lệnh kế tiếp).
+// In ra throughput và phân vị độ trễ của từng round-trip.
+//
+//   ./server --loop select        ./server --loop io_uring
+//   ./load_bench -u user -P pass -g group_id -f file_id [-c clients]
+//                [-n requests] [-w warmup] [-m mixed|list|download]
+//                [-H host] [-p port]
+//
+// Số client không vượt quá MAX_CLIENTS (30) của server; tăng các giới hạn
+// trong rate_limits.conf nếu muốn đo vòng lặp chứ không đo token bucket.
+// Mã thoát: 0 = ok, 1 = lỗi kết nối/đăng nhập hoặc có phản hồi lỗi
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BENCH_MAX_CLIENTS 30
+#define BENCH_LINE_SIZE 65536
+#define BENCH_TOKEN_SIZE 256
+
+typedef enum { MIX_MIXED, MIX_LIST, MIX_DOWNLOAD } BenchMix;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *user;
+    const char *pass;
+    int group_id;
+    int file_id;
+    int clients;
+    long requests;               // đo, mỗi client
+    long warmup;                 // bỏ qua, mỗi client
+    BenchMix mix;
+} BenchConfig;
+
+typedef struct {
+    int fd;
+    char buf[BENCH_LINE_SIZE];
+    size_t start;
+    size_t end;
+} LineConn;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    double *latency_us;          // requests phần tử
+    long done;
+    long errors;
+    unsigned long long bytes_in;
+    double measure_start;        // sau warmup
+    double measure_end;
+    int failed;                  // không kết nối/đăng nhập được
+} Worker;
+
+static BenchConfig cfg;
+static pthread_barrier_t start_barrier;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void) {
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(cfg.host, cfg.port, &hints, &res) != 0) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Một dòng phản hồi (bỏ "\r\n", kết thúc NUL) trỏ vào buffer của kết nối.
+// Độ dài dòng, hoặc -1 khi kết nối đóng / dòng quá dài
+static long read_line(LineConn *c, char **line) {
+    for (;;) {
+        char *nl = memchr(c->buf + c->start, '\n', c->end - c->start);
+        if (nl) {
+            char *begin = c->buf + c->start;
+            size_t len = (size_t)(nl - begin);
+            c->start += len + 1;
+            if (len > 0 && begin[len - 1] == '\r') len--;
+            begin[len] = '\0';
+            *line = begin;
+            return (long)len;
+        }
+        if (c->start > 0) {
+            memmove(c->buf, c->buf + c->start, c->end - c->start);
+            c->end -= c->start;
+            c->start = 0;
+        }
+        if (c->end >= sizeof(c->buf) - 1) return -1;
+        ssize_t n = recv(c->fd, c->buf + c->end, sizeof(c->buf) - 1 - c->end, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c->end += (size_t)n;
+    }
+}
+
+// Gửi một lệnh và đợi dòng phản hồi. Mã trạng thái, hoặc -1
+static int round_trip(LineConn *c, const char *cmd, char **line, long *line_len) {
+    if (send_all(c->fd, cmd, strlen(cmd)) != 0) return -1;
+    *line_len = read_line(c, line);
+    if (*line_len < 0) return -1;
+    return atoi(*line);
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    LineConn *c = (LineConn *)calloc(1, sizeof(LineConn));
+    char token[BENCH_TOKEN_SIZE] = "";
+    char cmd[512];
+    char *line;
+    long line_len;
+
+    if (c) c->fd = connect_server();
+    if (c && c->fd >= 0) {
+        snprintf(cmd, sizeof(cmd), "LOGIN %s %s\r\n", cfg.user, cfg.pass);
+        if (round_trip(c, cmd, &line, &line_len) == 200 && line_len > 4) {
+            snprintf(token, sizeof(token), "%s", line + 4);
+        }
+    }
+    if (!token[0]) w->failed = 1;
+
+    // Mọi client bắt đầu cùng lúc sau khi đăng nhập
+    pthread_barrier_wait(&start_barrier);
+    if (w->failed) goto done;
+
+    long chunk = 1;
+    long total_chunks = 1;
+    w->measure_start = now_sec();
+    for (long r = 0; r < cfg.warmup + cfg.requests; r++) {
+        if (r == cfg.warmup) w->measure_start = now_sec();
+        int list = cfg.mix == MIX_LIST || (cfg.mix == MIX_MIXED && (r + w->id) % 2 == 0);
+        if (list) {
+            snprintf(cmd, sizeof(cmd), "LIST_FOLDER_CONTENT %s %d 0\r\n", token, cfg.group_id);
+        } else {
+            snprintf(cmd, sizeof(cmd), "DOWNLOAD_FILE %s %d %ld\r\n", token, cfg.file_id, chunk);
+        }
+
+        double t0 = now_sec();
+        int status = round_trip(c, cmd, &line, &line_len);
+        double t1 = now_sec();
+        if (status < 0) {
+            fprintf(stderr, "client %d: connection closed\n", w->id);
+            w->errors++;
+            break;
+        }
+
+        // DOWNLOAD_FILE: "202 i/total ..." rồi "200 total/total ..."; tải lại từ đầu
+        if (!list && (status == 200 || status == 202)) {
+            long idx = 0;
+            if (sscanf(line + 4, "%ld/%ld", &idx, &total_chunks) == 2 && total_chunks > 0) {
+                chunk = (idx >= total_chunks) ? 1 : idx + 1;
+            }
+        }
+        int ok = list ? (status == 200 || status == 304) : (status == 200 || status == 202);
+
+        if (r < cfg.warmup) continue;
+        if (!ok) {
+            if (w->errors++ == 0) {
+                fprintf(stderr, "client %d: %.80s\n", w->id, line);
+            }
+        }
+        w->latency_us[w->done++] = (t1 - t0) * 1e6;
+        w->bytes_in += (unsigned long long)line_len + 2;
+    }
+    w->measure_end = now_sec();
+
+done:
+    if (c && c->fd >= 0) close(c->fd);
+    free(c);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, long count, double p) {
+    if (count == 0) return 0;
+    long i = (long)(p / 100.0 * (double)(count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -u user -P pass -g group_id -f file_id [-c clients] [-n requests]\n"
+            "          [-w warmup] [-m mixed|list|download] [-H host] [-p port]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    cfg.host = "127.0.0.1";
+    cfg.port = "1234";
+    cfg.clients = 16;
+    cfg.requests = 2000;
+    cfg.warmup = 100;
+    cfg.mix = MIX_MIXED;
+
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!val) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+        if (strcmp(opt, "-H") == 0) cfg.host = val;
+        else if (strcmp(opt, "-p") == 0) cfg.port = val;
+        else if (strcmp(opt, "-u") == 0) cfg.user = val;
+        else if (strcmp(opt, "-P") == 0) cfg.pass = val;
+        else if (strcmp(opt, "-g") == 0) cfg.group_id = atoi(val);
+        else if (strcmp(opt, "-f") == 0) cfg.file_id = atoi(val);
+        else if (strcmp(opt, "-c") == 0) cfg.clients = atoi(val);
+        else if (strcmp(opt, "-n") == 0) cfg.requests = atol(val);
+        else if (strcmp(opt, "-w") == 0) cfg.warmup = atol(val);
+        else if (strcmp(opt, "-m") == 0) {
+            if (strcmp(val, "mixed") == 0) cfg.mix = MIX_MIXED;
+            else if (strcmp(val, "list") == 0) cfg.mix = MIX_LIST;
+            else if (strcmp(val, "download") == 0) cfg.mix = MIX_DOWNLOAD;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!cfg.user || !cfg.pass || cfg.clients <= 0 || cfg.clients > BENCH_MAX_CLIENTS ||
+        cfg.requests <= 0 || cfg.warmup < 0 ||
+        (cfg.mix != MIX_DOWNLOAD && cfg.group_id <= 0) ||
+        (cfg.mix != MIX_LIST && cfg.file_id <= 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Worker *workers = (Worker *)calloc((size_t)cfg.clients, sizeof(Worker));
+    double *all = (double *)malloc(sizeof(double) * (size_t)cfg.clients * (size_t)cfg.requests);
+    if (!workers || !all) {
+        perror("malloc");
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)cfg.clients + 1);
+    for (int i = 0; i < cfg.clients; i++) {
+        workers[i].id = i;
+        workers[i].latency_us = all + (size_t)i * (size_t)cfg.requests;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    long done = 0;
+    long errors = 0;
+    int failed = 0;
+    unsigned long long bytes_in = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Khoảng đo: từ client đầu tiên hết warmup đến client cuối cùng xong
+    double first = 0, last = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        if (workers[i].failed) continue;
+        if (first == 0 || workers[i].measure_start < first) first = workers[i].measure_start;
+        if (workers[i].measure_end > last) last = workers[i].measure_end;
+    }
+    double elapsed = last - first;
+
+    // Gom độ trễ của mọi client về đầu mảng rồi sắp xếp
+    for (int i = 0; i < cfg.clients; i++) {
+        memmove(all + done, workers[i].latency_us, sizeof(double) * (size_t)workers[i].done);
+        done += workers[i].done;
+        errors += workers[i].errors;
+        failed += workers[i].failed;
+        bytes_in += workers[i].bytes_in;
+    }
+    qsort(all, (size_t)done, sizeof(double), cmp_double);
+
+    static const char *mix_names[] = { "mixed", "list", "download" };
+    printf("%d clients (%d failed to log in), %s, %ld warmup + %ld requests each\n",
+           cfg.clients, failed, mix_names[cfg.mix], cfg.warmup, cfg.requests);
+    printf("requests   %ld in %.2f s, %ld errors\n", done, elapsed, errors);
+    printf("throughput %.0f req/s, %.1f MiB/s received\n",
+           elapsed > 0 ? (double)done / elapsed : 0,
+           elapsed > 0 ? (double)bytes_in / elapsed / (1024.0 * 1024.0) : 0);
+    printf("latency us p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+           percentile(all, done, 50), percentile(all, done, 90),
+           percentile(all, done, 99), done ? all[done - 1] : 0);
+
+    pthread_barrier_destroy(&start_barrier);
+    free(all);
+    free(workers);
+    return (failed || errors) ? 1 : 0;
+}
@@ -3,14 +3,27 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "io/io_multiplexing.h"
+#include "io/io_uring_loop.h"
 #include "net/client.h"
 #include "database/db.h"
+#include "database/activity_journal.h"
+#include "database/aggregates.h"
+#include "storage/file_cache.h"
+#include "storage/fd_cache.h"
+#include "storage/pack_store.h"
+#include "storage/fsck.h"
+#include "storage/blob_clone.h"
+#include "storage/versions.h"
+#include "net/scheduler.h"
+#include "storage/quota.h"
+#include "storage/dir_tree.h"
 #define PORT 1234
-#define BACKLOG 10
+#define BACKLOG 128
 
 void set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -21,7 +34,56 @@ void set_nonblocking(int fd) {
     fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-int main() {
+// SIGHUP: đọc lại file cấu hình giới hạn tốc độ và quota ở vòng lặp kế tiếp
+static void on_sighup(int sig) {
+    (void)sig;
+    sched_request_reload();
+    quota_request_reload();
+}
+
+// SIGUSR1: kiểm tra nhất quán storage/ ở luồng nền, ghi plan ra FSCK_PLAN_PATH
+static void on_sigusr1(int sig) {
+    (void)sig;
+    fsck_request();
+}
+
+// ./server [--loop select|io_uring]: chọn vòng lặp sự kiện lúc khởi động
+// để so sánh hai backend (load_bench.c). Mặc định io_uring nếu build với
+// USE_IO_URING=1, ngược lại select()
+static int parse_loop_arg(int argc, char **argv) {
+#ifdef USE_IO_URING
+    int use_uring = 1;
+#else
+    int use_uring = 0;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "select") == 0) {
+                use_uring = 0;
+            } else if (strcmp(name, "io_uring") == 0) {
+                use_uring = 1;
+            } else {
+                fprintf(stderr, "Unknown loop: %s (select|io_uring)\n", name);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--loop select|io_uring]\n", argv[0]);
+            exit(1);
+        }
+    }
+#ifndef USE_IO_URING
+    if (use_uring) {
+        fprintf(stderr, "Built without USE_IO_URING=1, using select()\n");
+        use_uring = 0;
+    }
+#endif
+    return use_uring;
+}
+
+int main(int argc, char **argv) {
+    int use_uring = parse_loop_arg(argc, argv);
+
     init_mysql();
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) {
@@ -50,11 +112,44 @@ int main() {
     }
 
     init_clients();
+    file_cache_init();
+    fd_cache_init();
+    pack_store_init();
+    dir_tree_init();
+    sched_init();
+    quota_init();
+    journal_start();
+    agg_reconciler_start();
+    clone_start();
+    version_start();
 
-    printf("Server listening on port %d...\n", PORT);
+    // Không đặt SA_RESTART để select()/io_uring thức dậy ngay khi nhận tín hiệu
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sighup;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
 
+    printf("Server listening on port %d (%s loop)...\n", PORT, use_uring ? "io_uring" : "select");
+
+#ifdef USE_IO_URING
+    // Kernel cũ / không cho phép io_uring: quay về select()
+    if (!use_uring || run_uring_server_loop(server_sock) != 0) {
+        run_server_loop(server_sock);
+    }
+#else
+    (void)use_uring;
     run_server_loop(server_sock);
+#endif
 
+    // Đẩy nốt nhật ký hoạt động còn trong hàng đợi trước khi đóng kết nối
+    journal_stop();
+    agg_reconciler_stop();
+    fsck_stop();
+    clone_stop();
+    version_stop();
     close_mysql();
     
     return 0;
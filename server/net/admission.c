@@ -0,0 +1,171 @@
+#include "admission.h"
+#include "../utils/logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define EWMA_SHIFT 3            // new sample weighs 1/8
+#define RSS_CHECK_INTERVAL_US 1000000
+#define DECAY_PERIOD_US 10000   // quiet time that counts as one zero sample
+
+static uint64_t loop_start_us = 0;
+static uint64_t loop_lag_us = 0;       // EWMA
+static uint64_t loop_sample_us = 0;
+static uint64_t cmd_time_us = 0;       // EWMA
+static uint64_t cmd_sample_us = 0;
+static long rss_kb = 0;
+static uint64_t rss_checked_us = 0;
+static AdmitLevel level = ADMIT_OK;
+
+static const char *level_name(AdmitLevel l) {
+    switch (l) {
+        case ADMIT_OK:        return "ok";
+        case ADMIT_SHED_BULK: return "shedding bulk";
+        case ADMIT_REJECT:    return "rejecting";
+        default:              return "?";
+    }
+}
+
+static void ewma_update(uint64_t *avg, uint64_t sample) {
+    if (sample >= *avg) {
+        *avg += (sample - *avg) >> EWMA_SHIFT;
+    } else {
+        *avg -= (*avg - sample) >> EWMA_SHIFT;
+    }
+}
+
+// A signal nobody samples (idle loop, commands all rejected) must still
+// come back down: every DECAY_PERIOD_US without a sample counts as 0
+static void ewma_decay(uint64_t *avg, uint64_t *last_sample, uint64_t now) {
+    if (now < *last_sample + DECAY_PERIOD_US) return;
+
+    uint64_t periods = (now - *last_sample) / DECAY_PERIOD_US;
+    if (periods > 64) periods = 64;     // (7/8)^64: nothing left worth tracking
+    for (uint64_t i = 0; i < periods && *avg > 0; i++) {
+        ewma_update(avg, 0);
+    }
+    *last_sample = now;
+}
+
+static long read_rss_kb(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+
+    long size, resident;
+    int ok = fscanf(f, "%ld %ld", &size, &resident) == 2;
+    fclose(f);
+    if (!ok) return 0;
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static AdmitLevel signal_level(uint64_t value, uint64_t shed, uint64_t reject) {
+    if (value >= reject) return ADMIT_REJECT;
+    if (value >= shed) return ADMIT_SHED_BULK;
+    return ADMIT_OK;
+}
+
+static void recompute_level(uint64_t now) {
+    if (now - rss_checked_us >= RSS_CHECK_INTERVAL_US) {
+        rss_kb = read_rss_kb();
+        rss_checked_us = now;
+    }
+
+    AdmitLevel next = signal_level(loop_lag_us, ADMIT_LAG_SHED_US, ADMIT_LAG_REJECT_US);
+    AdmitLevel l = signal_level(cmd_time_us, ADMIT_CMD_SHED_US, ADMIT_CMD_REJECT_US);
+    if (l > next) next = l;
+    l = signal_level((uint64_t)rss_kb, ADMIT_RSS_SHED_KB, ADMIT_RSS_REJECT_KB);
+    if (l > next) next = l;
+
+    if (next != level) {
+        log_info(-1, 0, "Admission: %s -> %s (loop lag %lu us, command %lu us, rss %ld KB)",
+                 level_name(level), level_name(next),
+                 (unsigned long)loop_lag_us, (unsigned long)cmd_time_us, rss_kb);
+        level = next;
+    }
+}
+
+uint64_t admission_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void admission_loop_begin(void) {
+    loop_start_us = admission_now_us();
+    ewma_decay(&loop_lag_us, &loop_sample_us, loop_start_us);
+}
+
+void admission_loop_end(void) {
+    uint64_t now = admission_now_us();
+    if (loop_start_us) {
+        ewma_update(&loop_lag_us, now - loop_start_us);
+        loop_sample_us = now;
+    }
+    ewma_decay(&cmd_time_us, &cmd_sample_us, now);
+    recompute_level(now);
+}
+
+AdmitLevel admission_level(void) {
+    return level;
+}
+
+int admission_check_accept(void) {
+    return (level >= ADMIT_REJECT) ? ADMIT_RETRY_REJECT_SECONDS : 0;
+}
+
+static int command_in(const char *line, int len, const char *const *names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int n = (int)strlen(names[i]);
+        if (len >= n && strncasecmp(line, names[i], n) == 0 &&
+            (len == n || line[n] == ' ')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_bulk_command(const char *line, int len) {
+    static const char *bulk[] = { "UPLOAD_FILE", "DOWNLOAD_FILE", "DOWNLOAD_FOLDER",
+                                  "UPLOAD_BULK_BEGIN" };
+    return command_in(line, len, bulk, sizeof(bulk) / sizeof(bulk[0]));
+}
+
+// Data lines of a bulk upload already admitted at UPLOAD_BULK_BEGIN get
+// no reply of their own: a 503 would fail one of its files and put an
+// unexpected line in front of the session's summary
+static int is_continuation(const char *line, int len) {
+    static const char *cont[] = { "UPLOAD_BULK_DATA" };
+    return command_in(line, len, cont, sizeof(cont) / sizeof(cont[0]));
+}
+
+int admission_check_command(const char *line, int len) {
+    if (is_continuation(line, len)) return 0;
+    if (level >= ADMIT_REJECT) return ADMIT_RETRY_REJECT_SECONDS;
+    if (level >= ADMIT_SHED_BULK && is_bulk_command(line, len)) return ADMIT_RETRY_BULK_SECONDS;
+    return 0;
+}
+
+void admission_record_command(uint64_t elapsed_us) {
+    ewma_update(&cmd_time_us, elapsed_us);
+    cmd_sample_us = admission_now_us();
+}
+
+int admission_busy_reply(char *buf, int size, int retry_after) {
+    int n = snprintf(buf, size, "503 retry_after=%d\r\n", retry_after);
+    return (n > 0 && n < size) ? n : 0;
+}
+
+void admission_reject_socket(int sock, int retry_after) {
+    char reply[64];
+    int n = admission_busy_reply(reply, sizeof(reply), retry_after);
+    if (n > 0) {
+        // Fresh socket: the reply fits in the send buffer or is dropped
+        send(sock, reply, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(sock);
+}
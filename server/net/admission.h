@@ -0,0 +1,58 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+// Admission control. Three load signals are tracked:
+//   - event-loop lag: EWMA of how long an iteration keeps the loop busy
+//   - command service time: EWMA per command; the DB calls are made
+//     synchronously from the loop, so this is where a slow or queued
+//     database shows up
+//   - resident memory of the process
+// and turned into a load level. Under load, bulk transfer chunks are
+// turned away first; past the second threshold every new connection
+// and command gets "503 retry_after=<seconds>". The data of a bulk
+// upload session is never turned away: the session as a whole is
+// admitted (or shed) at UPLOAD_BULK_BEGIN.
+#define ADMIT_LAG_SHED_US 20000
+#define ADMIT_LAG_REJECT_US 100000
+#define ADMIT_CMD_SHED_US 20000
+#define ADMIT_CMD_REJECT_US 100000
+#define ADMIT_RSS_SHED_KB (512 * 1024)
+#define ADMIT_RSS_REJECT_KB (1024 * 1024)
+
+#define ADMIT_RETRY_BULK_SECONDS 1
+#define ADMIT_RETRY_REJECT_SECONDS 5
+
+// Connections taken from the listen queue per wakeup
+#define ADMIT_ACCEPT_BATCH 64
+
+typedef enum {
+    ADMIT_OK = 0,
+    ADMIT_SHED_BULK = 1,
+    ADMIT_REJECT = 2
+} AdmitLevel;
+
+// Bracket the work of one event loop iteration (wakeup .. next wait)
+void admission_loop_begin(void);
+void admission_loop_end(void);
+
+AdmitLevel admission_level(void);
+
+// 0 to accept a new connection, otherwise the retry-after hint in seconds
+int admission_check_accept(void);
+
+// 0 to run the command line, otherwise the retry-after hint in seconds
+int admission_check_command(const char *line, int len);
+void admission_record_command(uint64_t elapsed_us);
+
+// Monotonic clock in microseconds
+uint64_t admission_now_us(void);
+
+// "503 retry_after=<n>\r\n" into buf; returns its length
+int admission_busy_reply(char *buf, int size, int retry_after);
+
+// Best-effort 503 to a connection that is not admitted, then close it
+void admission_reject_socket(int sock, int retry_after);
+
+#endif
@@ -1,4 +1,10 @@
 #include "client.h"
+#include "../protocol/transfer.h"
+#include "../protocol/archive.h"
+#include "../io/server_timers.h"
+#include "../storage/versions.h"
+#include "scheduler.h"
+#include "event_bus.h"
 #include <string.h>
 #include <unistd.h>
 
@@ -10,9 +16,18 @@ void init_clients() {
         clients[i].recv_len = 0;
         clients[i].send_len = 0;
         clients[i].send_offset = 0;
+        clients[i].send_inflight = 0;
+        clients[i].tail_fd = -1;
+        clients[i].tail_offset = 0;
+        clients[i].tail_len = 0;
+        clients[i].state = CONN_READING;
         clients[i].authenticated = 0;
         clients[i].user_id = 0;
+        clients[i].codec_mask = 0;
     }
+    transfer_init();
+    archive_init();
+    event_bus_init();
 }
 
 int add_client(int sock) {
@@ -22,8 +37,16 @@ int add_client(int sock) {
             clients[i].recv_len = 0;
             clients[i].send_len = 0;
             clients[i].send_offset = 0;
+            clients[i].send_inflight = 0;
+            clients[i].tail_fd = -1;
+            clients[i].tail_offset = 0;
+            clients[i].tail_len = 0;
+            clients[i].state = CONN_READING;
             clients[i].authenticated = 0;
             clients[i].user_id = 0;
+            clients[i].codec_mask = 0;
+            sched_client_reset(i);
+            server_timers_client_opened(i);
             return i;
         }
     }
@@ -38,6 +61,18 @@ void remove_client_index(int idx) {
     clients[idx].recv_len = 0;
     clients[idx].send_len = 0;
     clients[idx].send_offset = 0;
+    clients[idx].send_inflight = 0;
+    clients[idx].state = CONN_READING;
     clients[idx].authenticated = 0;
     clients[idx].user_id = 0;
+    clients[idx].codec_mask = 0;
+    archive_release(idx);
+    clients[idx].tail_fd = -1;
+    clients[idx].tail_offset = 0;
+    clients[idx].tail_len = 0;
+    transfer_release(idx);
+    event_bus_release(idx);
+    version_restore_cancel(idx);
+    server_timers_client_closed(idx);
+    sched_client_reset(idx);
 }
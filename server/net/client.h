@@ -2,11 +2,29 @@
 #define CLIENT_H
 
 #include <sys/socket.h>
+#include <sys/types.h>
 
 #define BUFFER_SIZE 24576
 #define SEND_BUFFER_SIZE 32768
 #define MAX_CLIENTS 30
 
+// Output queue water marks: above HIGH the connection stops reading and
+// running commands until the peer has drained it below LOW
+#define SEND_HIGH_WATER (SEND_BUFFER_SIZE / 2)
+#define SEND_LOW_WATER (SEND_BUFFER_SIZE / 8)
+
+typedef enum {
+    CONN_READING = 0,   // nothing queued, waiting for a command
+    CONN_PROCESSING,    // running the command lines in recv_buf
+    CONN_WRITING,       // replies queued, still reading
+    CONN_THROTTLED,     // output above high-water: no reads, no commands
+    CONN_DRAINING,      // closing: send what is queued, then disconnect
+    CONN_STREAMING,     // DOWNLOAD_FOLDER archive owns the output: no reads,
+                        // no commands, no events until it ends
+    CONN_WAITING        // reply comes from a worker thread (RESTORE_VERSION):
+                        // no reads, no commands until it is queued
+} ConnState;
+
 typedef struct {
     int sock;
     char recv_buf[BUFFER_SIZE];
@@ -15,9 +33,20 @@ typedef struct {
     char send_buf[SEND_BUFFER_SIZE];
     int send_len;
     int send_offset;
+    int send_inflight;  // io_uring send in flight: send_buf must not move
+
+    // File bytes sent with sendfile() once send_buf is empty (DOWNLOAD_FOLDER);
+    // tail_len = 0: none. The fd belongs to the archive stream.
+    int tail_fd;
+    off_t tail_offset;
+    int tail_len;
+
+    ConnState state;
 
     int authenticated;
     int user_id;
+
+    int codec_mask;     // codecs negotiated with HELLO (CODEC_MASK bits)
 } Client;
 
 extern Client clients[MAX_CLIENTS];
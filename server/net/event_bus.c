@@ -0,0 +1,199 @@
+#include "event_bus.h"
+#include "client.h"
+#include "stream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    EventType type;
+    int group_id;
+    int dir_id;                      // DIR_CHANGED only
+} PendingEvent;
+
+typedef struct {
+    int group_id;
+    int is_admin;
+} GroupSub;
+
+typedef struct {
+    int user_id;                     // user events go here when user_events
+    int user_events;
+    GroupSub groups[EVENT_BUS_MAX_GROUPS];
+    int group_count;
+
+    PendingEvent queue[EVENT_BUS_QUEUE_LEN];
+    int queued;
+    int overflow;                    // events were dropped since the last delivery
+} Subscriber;
+
+static Subscriber subs[MAX_CLIENTS];
+
+static const char *event_name(EventType type) {
+    switch (type) {
+        case EVENT_DIR_CHANGED: return "DIR_CHANGED";
+        case EVENT_MEMBERS_CHANGED: return "MEMBERS_CHANGED";
+        case EVENT_JOIN_REQUEST: return "JOIN_REQUEST";
+        case EVENT_INVITATION: return "INVITATION";
+        case EVENT_REQUEST_HANDLED: return "REQUEST_HANDLED";
+        case EVENT_REMOVED: return "REMOVED";
+    }
+    return "UNKNOWN";
+}
+
+static int subscribed(const Subscriber *s) {
+    return s->user_events || s->group_count > 0;
+}
+
+static GroupSub *find_group(Subscriber *s, int group_id) {
+    for (int i = 0; i < s->group_count; i++) {
+        if (s->groups[i].group_id == group_id) return &s->groups[i];
+    }
+    return NULL;
+}
+
+static void enqueue(Subscriber *s, EventType type, int group_id, int dir_id) {
+    if (s->overflow) return;         // everything gets re-read anyway
+
+    for (int i = 0; i < s->queued; i++) {
+        const PendingEvent *e = &s->queue[i];
+        if (e->type == type && e->group_id == group_id && e->dir_id == dir_id) return;
+    }
+
+    if (s->queued == EVENT_BUS_QUEUE_LEN) {
+        s->queued = 0;
+        s->overflow = 1;
+        return;
+    }
+
+    PendingEvent *e = &s->queue[s->queued++];
+    e->type = type;
+    e->group_id = group_id;
+    e->dir_id = dir_id;
+}
+
+void event_bus_init(void) {
+    memset(subs, 0, sizeof(subs));
+}
+
+int event_bus_subscribe_group(int idx, int user_id, int group_id, int is_admin) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return -1;
+    Subscriber *s = &subs[idx];
+
+    // A connection belongs to one user: start over if that changed
+    if (s->user_id != user_id) {
+        memset(s, 0, sizeof(*s));
+        s->user_id = user_id;
+    }
+
+    GroupSub *g = find_group(s, group_id);
+    if (!g) {
+        if (s->group_count == EVENT_BUS_MAX_GROUPS) return -1;
+        g = &s->groups[s->group_count++];
+        g->group_id = group_id;
+    }
+    g->is_admin = is_admin;
+    return 0;
+}
+
+void event_bus_subscribe_user(int idx, int user_id) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    Subscriber *s = &subs[idx];
+
+    if (s->user_id != user_id) {
+        memset(s, 0, sizeof(*s));
+        s->user_id = user_id;
+    }
+    s->user_events = 1;
+}
+
+void event_bus_unsubscribe(int idx, int group_id) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    Subscriber *s = &subs[idx];
+
+    if (group_id == 0) {
+        memset(s, 0, sizeof(*s));
+        return;
+    }
+
+    GroupSub *g = find_group(s, group_id);
+    if (g) {
+        *g = s->groups[--s->group_count];
+    }
+}
+
+void event_bus_release(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    memset(&subs[idx], 0, sizeof(subs[idx]));
+}
+
+void event_bus_drop_member(int user_id, int group_id) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (subs[i].user_id == user_id) {
+            event_bus_unsubscribe(i, group_id);
+        }
+    }
+}
+
+void event_bus_publish_group(EventType type, int group_id, int dir_id) {
+    if (group_id <= 0) return;
+    if (type != EVENT_DIR_CHANGED) dir_id = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Subscriber *s = &subs[i];
+        if (s->group_count == 0) continue;
+
+        const GroupSub *g = find_group(s, group_id);
+        if (!g || (type == EVENT_JOIN_REQUEST && !g->is_admin)) continue;
+        enqueue(s, type, group_id, dir_id);
+    }
+}
+
+void event_bus_publish_user(EventType type, int user_id, int group_id) {
+    if (user_id <= 0) return;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Subscriber *s = &subs[i];
+        if (s->user_events && s->user_id == user_id) {
+            enqueue(s, type, group_id, 0);
+        }
+    }
+}
+
+void event_bus_deliver(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Subscriber *s = &subs[i];
+        if (!subscribed(s) || (s->queued == 0 && !s->overflow)) continue;
+
+        const Client *c = &clients[i];
+        if (c->sock <= 0) {
+            memset(s, 0, sizeof(*s));
+            continue;
+        }
+        // Still busy with earlier output, or an archive owns it: keep merging
+        if (c->state == CONN_DRAINING || c->state == CONN_STREAMING ||
+            conn_pending_output(i) >= SEND_LOW_WATER) continue;
+
+        char frames[EVENT_BUS_QUEUE_LEN * 64];
+        int len = 0;
+        if (s->overflow) {
+            len = snprintf(frames, sizeof(frames), "EVENT OVERFLOW\r\n");
+        }
+        for (int k = 0; k < s->queued; k++) {
+            const PendingEvent *e = &s->queue[k];
+            if (e->type == EVENT_DIR_CHANGED) {
+                len += snprintf(frames + len, sizeof(frames) - len, "EVENT %s %d %d\r\n",
+                                event_name(e->type), e->group_id, e->dir_id);
+            } else {
+                len += snprintf(frames + len, sizeof(frames) - len, "EVENT %s %d\r\n",
+                                event_name(e->type), e->group_id);
+            }
+        }
+        s->queued = 0;
+        s->overflow = 0;
+
+        if (enqueue_send(i, frames, len) == 0) {
+            conn_update_state(i);
+        }
+    }
+}
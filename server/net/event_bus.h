@@ -0,0 +1,61 @@
+#ifndef EVENT_BUS_H
+#define EVENT_BUS_H
+
+// In-process fan-out of change notifications to subscribed connections.
+//
+// A connection subscribes to groups (SUBSCRIBE_GROUP) and to its own
+// user (SUBSCRIBE_USER). Handlers publish after their change is
+// committed; each matching subscriber gets the event in a bounded queue
+// of its own, where a repeat of an event still waiting is merged into
+// it. The event loop delivers queued events as unsolicited lines
+//
+//   EVENT DIR_CHANGED <group_id> <dir_id>
+//   EVENT MEMBERS_CHANGED <group_id>
+//   EVENT JOIN_REQUEST <group_id>        (group admins only)
+//   EVENT INVITATION <group_id>          (user)
+//   EVENT REQUEST_HANDLED <group_id>     (user: their join request was answered)
+//   EVENT REMOVED <group_id>             (user: no longer a member)
+//   EVENT OVERFLOW                       (events were lost: re-read everything)
+//
+// only while the connection's output is below SEND_LOW_WATER, so a slow
+// reader never holds up the server; what piles up meanwhile is merged,
+// and a queue that still fills up collapses into one OVERFLOW.
+#define EVENT_BUS_MAX_GROUPS 16      // groups one connection may watch
+#define EVENT_BUS_QUEUE_LEN 32       // distinct events waiting per connection
+
+typedef enum {
+    EVENT_DIR_CHANGED = 0,
+    EVENT_MEMBERS_CHANGED,
+    EVENT_JOIN_REQUEST,
+    EVENT_INVITATION,
+    EVENT_REQUEST_HANDLED,
+    EVENT_REMOVED
+} EventType;
+
+void event_bus_init(void);
+
+// Watch group_id on connection idx (admins also get JOIN_REQUEST).
+// 0 on success, -1 if the connection already watches too many groups.
+int event_bus_subscribe_group(int idx, int user_id, int group_id, int is_admin);
+
+// Watch events addressed to user_id on connection idx
+void event_bus_subscribe_user(int idx, int user_id);
+
+// Stop watching group_id (0 = everything) on connection idx
+void event_bus_unsubscribe(int idx, int group_id);
+
+// Connection closed
+void event_bus_release(int idx);
+
+// user_id left or was removed from group_id: drop their subscriptions to it
+void event_bus_drop_member(int user_id, int group_id);
+
+// A change was committed
+void event_bus_publish_group(EventType type, int group_id, int dir_id);
+void event_bus_publish_user(EventType type, int user_id, int group_id);
+
+// Move queued events into the output of connections ready for them
+// (called once per event loop iteration)
+void event_bus_deliver(void);
+
+#endif
@@ -0,0 +1,349 @@
+#include "scheduler.h"
+#include "client.h"
+#include "../utils/token_bucket.h"
+#include "../utils/timer_wheel.h"
+#include "../utils/logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+
+typedef struct {
+    int id;
+    double rate;
+    double burst;
+} RatePolicy;
+
+typedef struct {
+    double default_rate;
+    double default_burst;
+    RatePolicy entries[SCHED_MAX_POLICIES];
+    int count;
+} PolicyTable;
+
+typedef struct {
+    int quantum;
+    int max_uploads;
+    PolicyTable users;
+    PolicyTable groups;
+} SchedConfig;
+
+typedef struct {
+    int id;
+    TokenBucket bucket;
+} Bucket;
+
+typedef struct {
+    Bucket items[SCHED_MAX_BUCKETS];
+    int count;
+} BucketTable;
+
+typedef struct {
+    int bulk;           // pending output is transfer data
+    int admitted;       // token buckets already charged for it
+    int extra_cost;
+    int user_id;
+    int group_id;
+    int deficit;        // DRR sending credit
+} SchedState;
+
+static SchedConfig config;
+static BucketTable user_buckets;
+static BucketTable group_buckets;
+static SchedState states[MAX_CLIENTS];
+static int rr_cursor = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
+static int pending_bytes(int idx) {
+    const Client *c = &clients[idx];
+    return (c->sock > 0) ? c->send_len - c->send_offset + c->tail_len : 0;
+}
+
+static void config_defaults(SchedConfig *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->quantum = SCHED_DEFAULT_QUANTUM;
+    cfg->max_uploads = SCHED_DEFAULT_MAX_UPLOADS;
+}
+
+static int add_policy(PolicyTable *t, int id, double rate, double burst) {
+    for (int i = 0; i < t->count; i++) {
+        if (t->entries[i].id == id) {
+            t->entries[i].rate = rate;
+            t->entries[i].burst = burst;
+            return 0;
+        }
+    }
+    if (t->count >= SCHED_MAX_POLICIES) return -1;
+
+    t->entries[t->count].id = id;
+    t->entries[t->count].rate = rate;
+    t->entries[t->count].burst = burst;
+    t->count++;
+    return 0;
+}
+
+static void lookup_policy(const PolicyTable *t, int id, double *rate, double *burst) {
+    for (int i = 0; i < t->count; i++) {
+        if (t->entries[i].id == id) {
+            *rate = t->entries[i].rate;
+            *burst = t->entries[i].burst;
+            return;
+        }
+    }
+    *rate = t->default_rate;
+    *burst = t->default_burst;
+}
+
+// Returns 0 on success, -1 if the file cannot be read, or the number of
+// the first malformed line
+static int parse_config(const char *path, SchedConfig *cfg) {
+    config_defaults(cfg);
+
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char line[256];
+    int line_no = 0;
+    int bad_line = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char key[32], kind[32];
+        int id;
+        double rate, burst = 0;
+        int n;
+
+        if (sscanf(line, " %31s", key) != 1) continue;   // blank / comment
+
+        if (strcasecmp(key, "quantum") == 0 && sscanf(line, " %*s %d", &n) == 1 && n > 0) {
+            cfg->quantum = n;
+        } else if (strcasecmp(key, "max_concurrent_uploads") == 0 &&
+                   sscanf(line, " %*s %d", &n) == 1 && n > 0) {
+            cfg->max_uploads = n;
+        } else if (strcasecmp(key, "default") == 0 &&
+                   sscanf(line, " %*s %31s %lf %lf", kind, &rate, &burst) >= 2 && rate >= 0) {
+            PolicyTable *t = (strcasecmp(kind, "user") == 0) ? &cfg->users
+                           : (strcasecmp(kind, "group") == 0) ? &cfg->groups : NULL;
+            if (!t) {
+                if (!bad_line) bad_line = line_no;
+                continue;
+            }
+            t->default_rate = rate;
+            t->default_burst = burst;
+        } else if ((strcasecmp(key, "user") == 0 || strcasecmp(key, "group") == 0) &&
+                   sscanf(line, " %*s %d %lf %lf", &id, &rate, &burst) >= 2 &&
+                   id > 0 && rate >= 0) {
+            PolicyTable *t = (strcasecmp(key, "user") == 0) ? &cfg->users : &cfg->groups;
+            if (add_policy(t, id, rate, burst) != 0 && !bad_line) {
+                bad_line = line_no;
+            }
+        } else if (!bad_line) {
+            bad_line = line_no;
+        }
+    }
+
+    fclose(f);
+    return bad_line;
+}
+
+// Bucket for id, created on first use; NULL when its rate is unlimited
+static TokenBucket *get_bucket(BucketTable *t, const PolicyTable *p, int id, uint64_t now) {
+    if (id <= 0) return NULL;
+
+    for (int i = 0; i < t->count; i++) {
+        if (t->items[i].id == id) {
+            return (t->items[i].bucket.rate > 0) ? &t->items[i].bucket : NULL;
+        }
+    }
+
+    double rate, burst;
+    lookup_policy(p, id, &rate, &burst);
+    if (rate <= 0) return NULL;
+
+    Bucket *slot;
+    if (t->count < SCHED_MAX_BUCKETS) {
+        slot = &t->items[t->count++];
+    } else {
+        // Table full: recycle the bucket that has been quiet longest
+        slot = &t->items[0];
+        for (int i = 1; i < t->count; i++) {
+            if (t->items[i].bucket.last_ms < slot->bucket.last_ms) {
+                slot = &t->items[i];
+            }
+        }
+    }
+
+    slot->id = id;
+    token_bucket_init(&slot->bucket, rate, burst, now);
+    return &slot->bucket;
+}
+
+// Apply the current policies to buckets that already exist
+static void rebase_buckets(BucketTable *t, const PolicyTable *p, uint64_t now) {
+    for (int i = 0; i < t->count; i++) {
+        double rate, burst;
+        lookup_policy(p, t->items[i].id, &rate, &burst);
+        token_bucket_set(&t->items[i].bucket, rate, burst, now);
+    }
+}
+
+static void load_config(void) {
+    SchedConfig cfg;
+    int rc = parse_config(SCHED_CONFIG_PATH, &cfg);
+    if (rc < 0 && errno != ENOENT) {
+        log_error(-1, 0, "Cannot read %s (%s), keeping current rate policies",
+                  SCHED_CONFIG_PATH, strerror(errno));
+        return;
+    }
+    if (rc > 0) {
+        log_error(-1, 0, "%s:%d: invalid rate policy line ignored", SCHED_CONFIG_PATH, rc);
+    }
+
+    config = cfg;
+    uint64_t now = timer_now_ms();
+    rebase_buckets(&user_buckets, &config.users, now);
+    rebase_buckets(&group_buckets, &config.groups, now);
+
+    log_info(-1, 0, "Rate policies loaded: quantum=%d max_uploads=%d users=%d groups=%d",
+             config.quantum, config.max_uploads, config.users.count, config.groups.count);
+}
+
+void sched_init(void) {
+    memset(&user_buckets, 0, sizeof(user_buckets));
+    memset(&group_buckets, 0, sizeof(group_buckets));
+    memset(states, 0, sizeof(states));
+    rr_cursor = 0;
+    load_config();
+}
+
+void sched_request_reload(void) {
+    reload_requested = 1;
+}
+
+void sched_poll_reload(void) {
+    if (!reload_requested) return;
+    reload_requested = 0;
+    load_config();
+}
+
+int sched_max_uploads(void) {
+    return config.max_uploads;
+}
+
+void sched_client_reset(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    memset(&states[idx], 0, sizeof(states[idx]));
+}
+
+void sched_mark_bulk(int idx, int user_id, int group_id, int extra_cost) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+
+    SchedState *s = &states[idx];
+    if (!s->bulk) {
+        s->bulk = 1;
+        s->admitted = 0;
+        s->deficit = 0;
+    }
+    s->user_id = user_id;
+    s->group_id = group_id;
+    s->extra_cost += (extra_cost > 0) ? extra_cost : 0;
+}
+
+int sched_begin_round(int *order) {
+    int n = 0;
+
+    // Control replies go first; they are small and someone is waiting on them
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (pending_bytes(i) > 0 && !states[i].bulk) {
+            order[n++] = i;
+        }
+    }
+
+    for (int k = 0; k < MAX_CLIENTS; k++) {
+        int i = (rr_cursor + k) % MAX_CLIENTS;
+        if (pending_bytes(i) <= 0 || !states[i].bulk) continue;
+
+        SchedState *s = &states[i];
+        s->deficit += config.quantum;
+        // Credit unused because the socket was full does not pile up
+        if (s->deficit > 2 * config.quantum) {
+            s->deficit = 2 * config.quantum;
+        }
+        order[n++] = i;
+    }
+
+    rr_cursor = (rr_cursor + 1) % MAX_CLIENTS;
+    return n;
+}
+
+int sched_send_budget(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return 0;
+
+    int pending = pending_bytes(idx);
+    if (pending <= 0) return 0;
+
+    SchedState *s = &states[idx];
+    if (!s->bulk) return pending;
+
+    if (!s->admitted) {
+        uint64_t now = timer_now_ms();
+        TokenBucket *ub = get_bucket(&user_buckets, &config.users, s->user_id, now);
+        TokenBucket *gb = get_bucket(&group_buckets, &config.groups, s->group_id, now);
+        if ((ub && !token_bucket_ready(ub, now)) || (gb && !token_bucket_ready(gb, now))) {
+            return 0;
+        }
+
+        double cost = (double)pending + s->extra_cost;
+        if (ub) token_bucket_charge(ub, cost);
+        if (gb) token_bucket_charge(gb, cost);
+        s->admitted = 1;
+    }
+
+    return (s->deficit < pending) ? (s->deficit > 0 ? s->deficit : 0) : pending;
+}
+
+void sched_on_sent(int idx, int bytes) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+
+    SchedState *s = &states[idx];
+    if (s->bulk) {
+        s->deficit -= bytes;
+    }
+    if (clients[idx].send_offset >= clients[idx].send_len && clients[idx].tail_len == 0) {
+        // Queue drained: the next reply is classified afresh
+        s->bulk = 0;
+        s->admitted = 0;
+        s->extra_cost = 0;
+        s->deficit = 0;
+    }
+}
+
+long sched_next_ms(void) {
+    long best = -1;
+    uint64_t now = timer_now_ms();
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        SchedState *s = &states[i];
+        if (!s->bulk || s->admitted || pending_bytes(i) <= 0) continue;
+
+        long wait = 0;
+        TokenBucket *ub = get_bucket(&user_buckets, &config.users, s->user_id, now);
+        TokenBucket *gb = get_bucket(&group_buckets, &config.groups, s->group_id, now);
+        if (ub) {
+            long w = token_bucket_wait_ms(ub, now);
+            if (w > wait) wait = w;
+        }
+        if (gb) {
+            long w = token_bucket_wait_ms(gb, now);
+            if (w > wait) wait = w;
+        }
+
+        if (best < 0 || wait < best) best = wait;
+    }
+    return best;
+}
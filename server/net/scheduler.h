@@ -0,0 +1,60 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Output scheduling between connections.
+//
+// Pending output is either control (replies to listing, auth, ... —
+// sent first and in full) or bulk (UPLOAD_FILE / DOWNLOAD_FILE replies,
+// DOWNLOAD_FOLDER archives).
+// Bulk connections share the link by deficit round robin: every round
+// each one earns `quantum` bytes of sending credit. Before a bulk
+// reply may start, the per-user and per-group token buckets of its
+// transfer must be out of debt; the reply (plus the inbound chunk it
+// acknowledges) is then charged to both.
+//
+// Rate policies come from SCHED_CONFIG_PATH and are re-read on SIGHUP:
+//
+//   quantum <bytes>
+//   max_concurrent_uploads <n>
+//   default user|group <bytes/s> [burst]
+//   user <user_id> <bytes/s> [burst]
+//   group <group_id> <bytes/s> [burst]
+//
+// A rate of 0 means unlimited.
+#define SCHED_CONFIG_PATH "./rate_limits.conf"
+#define SCHED_DEFAULT_QUANTUM (16 * 1024)
+#define SCHED_DEFAULT_MAX_UPLOADS 3
+#define SCHED_MAX_POLICIES 64        // explicit user/group entries
+#define SCHED_MAX_BUCKETS 128        // live buckets per kind
+
+void sched_init(void);
+
+// Async-signal-safe: ask the event loop to reload the config
+void sched_request_reload(void);
+// Reload if requested (called once per event loop iteration)
+void sched_poll_reload(void);
+
+int sched_max_uploads(void);
+
+// Connection opened / closed
+void sched_client_reset(int idx);
+
+// The output queued by the current command is transfer data for
+// user_id in group_id; extra_cost is inbound bytes to charge with it
+void sched_mark_bulk(int idx, int user_id, int group_id, int extra_cost);
+
+// Start a scheduling round. Fills order with every connection that has
+// output pending, control first, then bulk in round robin order, and
+// returns how many there are.
+int sched_begin_round(int *order);
+
+// Bytes idx may send right now (0 = throttled or out of credit)
+int sched_send_budget(int idx);
+
+// bytes of idx's output went out (send_offset already advanced)
+void sched_on_sent(int idx, int bytes);
+
+// Milliseconds until a throttled connection may send, -1 if none is waiting
+long sched_next_ms(void);
+
+#endif
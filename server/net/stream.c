@@ -1,7 +1,9 @@
 #include "stream.h"
 #include "client.h"
+#include "scheduler.h"
 #include <string.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <stdio.h>
 
@@ -10,7 +12,15 @@ int enqueue_send(int idx, const char *data, int len) {
     if (len <= 0) return 0;
     Client *c = &clients[idx];
 
-    if (c->send_len + len > SEND_BUFFER_SIZE) return -1;
+    if (c->send_len + len > SEND_BUFFER_SIZE && !c->send_inflight) {
+        compact_send(idx);
+    }
+    if (c->send_len + len > SEND_BUFFER_SIZE) {
+        // Dropping a reply would desync the protocol: finish sending what
+        // is queued and close instead
+        conn_start_draining(idx);
+        return -1;
+    }
 
     memcpy(c->send_buf + c->send_len, data, len);
     c->send_len += len;
@@ -25,8 +35,8 @@ int flush_send(int idx) {
     
     Client *c = &clients[idx];
     
-    // Limit bytes per iteration to prevent blocking other clients
-    int max_bytes_per_call = 32 * 1024;  // 32KB max per iteration
+    // The scheduler decides how much this client may send this round
+    int max_bytes_per_call = sched_send_budget(idx);
     int bytes_sent_this_call = 0;
 
     while (c->send_offset < c->send_len && bytes_sent_this_call < max_bytes_per_call) {
@@ -46,6 +56,7 @@ int flush_send(int idx) {
         if (n > 0) {
             c->send_offset += n;
             bytes_sent_this_call += n;
+            sched_on_sent(idx, (int)n);
         } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             return 0;  // Socket buffer full, will continue next iteration
         } else {
@@ -61,9 +72,74 @@ int flush_send(int idx) {
     // All data sent, reset buffer
     c->send_len = 0;
     c->send_offset = 0;
+
+    // Then the file tail, straight from the page cache
+    while (c->tail_len > 0 && bytes_sent_this_call < max_bytes_per_call) {
+        size_t to_send = (size_t)c->tail_len;
+        if (to_send > (size_t)(max_bytes_per_call - bytes_sent_this_call)) {
+            to_send = (size_t)(max_bytes_per_call - bytes_sent_this_call);
+        }
+
+        ssize_t n = sendfile(c->sock, c->tail_fd, &c->tail_offset, to_send);
+        if (n > 0) {
+            c->tail_len -= (int)n;
+            bytes_sent_this_call += n;
+            sched_on_sent(idx, (int)n);
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;  // n == 0: the file shrank below what was announced
+        }
+    }
     return 0;
 }
 
+void compact_send(int idx) {
+    Client *c = &clients[idx];
+    if (c->send_offset == 0) return;
+
+    int pending = c->send_len - c->send_offset;
+    if (pending > 0) {
+        memmove(c->send_buf, c->send_buf + c->send_offset, pending);
+    }
+    c->send_len = (pending > 0) ? pending : 0;
+    c->send_offset = 0;
+}
+
+int conn_pending_output(int idx) {
+    return clients[idx].send_len - clients[idx].send_offset + clients[idx].tail_len;
+}
+
+int conn_recv_space(int idx) {
+    return BUFFER_SIZE - clients[idx].recv_len;
+}
+
+int conn_wants_read(int idx) {
+    const Client *c = &clients[idx];
+    return c->sock > 0 &&
+           c->state != CONN_THROTTLED && c->state != CONN_DRAINING &&
+           c->state != CONN_STREAMING && c->state != CONN_WAITING &&
+           conn_recv_space(idx) > 0;
+}
+
+void conn_update_state(int idx) {
+    Client *c = &clients[idx];
+    if (c->sock <= 0 || c->state == CONN_DRAINING || c->state == CONN_STREAMING ||
+        c->state == CONN_WAITING) return;
+
+    int pending = conn_pending_output(idx);
+    if (pending >= SEND_HIGH_WATER ||
+        (c->state == CONN_THROTTLED && pending > SEND_LOW_WATER)) {
+        c->state = CONN_THROTTLED;
+    } else {
+        c->state = (pending > 0) ? CONN_WRITING : CONN_READING;
+    }
+}
+
+void conn_start_draining(int idx) {
+    clients[idx].state = CONN_DRAINING;
+}
+
 int find_crlf(const char *buf, int len) {
     for (int i = 0; i + 1 < len; i++) {
         if (buf[i] == '\r' && buf[i+1] == '\n') return i;
@@ -5,4 +5,14 @@ int enqueue_send(int idx, const char *data, int len);
 int flush_send(int idx);
 int find_crlf(const char *buf, int len);
 
+// Move unsent output to the front of send_buf
+void compact_send(int idx);
+
+// Connection state machine (see ConnState in client.h)
+int conn_pending_output(int idx);
+int conn_recv_space(int idx);
+int conn_wants_read(int idx);
+void conn_update_state(int idx);
+void conn_start_draining(int idx);
+
 #endif
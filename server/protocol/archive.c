@@ -0,0 +1,559 @@
+#include "archive.h"
+#include "../net/client.h"
+#include "../net/stream.h"
+#include "../net/scheduler.h"
+#include "../database/db.h"
+#include "../database/aggregates.h"
+#include "../storage/dir_tree.h"
+#include "../storage/frame_store.h"
+#include "../storage/pack_store.h"
+#include "../utils/logger.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define ARCHIVE_ZSTD_LEVEL 3
+#define TAR_BLOCK 512
+#define TAR_NAME_MAX (PATH_MAX + 512)   // directory path + file name
+
+typedef struct {
+    int file_id;
+    long long size;
+    long mtime;
+    char name[256];
+    char path[512];
+    int pack_segment;                // 0 = own blob at path
+    long long pack_offset;
+} ArchiveFile;
+
+typedef struct {
+    int active;
+    int user_id;
+    int group_id;
+    int dir_id;                      // directory being downloaded
+    time_t started;
+
+    int *dirs;                       // its subtree, parents first
+    int dir_count;
+    int dir_pos;                     // directory whose files are being sent
+    int prefix_len;                  // part of dir_tree_path() left out of entry names
+    char dir_name[TAR_NAME_MAX];     // entry name of dirs[dir_pos], ends in '/'
+
+    ArchiveFile *page;               // files of dirs[dir_pos], a page at a time
+    int page_count;
+    int page_pos;
+    int page_full;                   // the last page was full: there may be more
+    int last_file_id;
+
+    int body_fd;                     // plain blob of the current file (-1 = none)
+    int reader_open;                 // 1 = compressed blob, read through reader
+    FrameReader reader;
+    long long body_offset;           // in the blob, or in the pack segment
+    long long body_left;
+    int pad;                         // zero bytes after the body up to a block
+
+    unsigned char *raw;              // generated tar bytes not yet queued
+    size_t raw_len;
+    size_t raw_pos;
+    int tar_done;                    // end-of-archive blocks generated
+
+    ZSTD_CCtx *zc;                   // NULL = uncompressed
+    unsigned char *zout;             // compressed bytes not yet queued
+    size_t zout_cap;
+    size_t zout_len;
+    size_t zout_pos;
+    int zc_done;                     // zstd frame closed
+
+    int files_sent;
+    long long bytes_sent;            // file body bytes
+} ArchiveStream;
+
+static ArchiveStream streams[MAX_CLIENTS];
+
+// ---------------------------------------------------------------------------
+// tar headers
+// ---------------------------------------------------------------------------
+
+static void tar_octal(unsigned char *field, size_t width, unsigned long long value) {
+    snprintf((char *)field, width, "%0*llo", (int)(width - 1), value);
+}
+
+static void tar_size(unsigned char *field, unsigned long long value) {
+    if (value <= 077777777777ULL) {
+        tar_octal(field, 12, value);
+        return;
+    }
+    // 8 GiB and up: GNU base-256
+    for (int i = 11; i > 0; i--) {
+        field[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+    field[0] = 0x80;
+}
+
+static void tar_fill(unsigned char *b, const char *name, size_t name_len,
+                     const char *prefix, size_t prefix_len,
+                     char type, unsigned long long size, long mtime, int gnu) {
+    memset(b, 0, TAR_BLOCK);
+    memcpy(b, name, name_len);
+    memcpy(b + 345, prefix, prefix_len);
+    tar_octal(b + 100, 8, (type == '5') ? 0755 : 0644);
+    tar_octal(b + 108, 8, 0);
+    tar_octal(b + 116, 8, 0);
+    tar_size(b + 124, size);
+    tar_octal(b + 136, 12, (mtime > 0) ? (unsigned long long)mtime : 0);
+    b[156] = (unsigned char)type;
+    if (gnu) {
+        memcpy(b + 257, "ustar  ", 8);          // GNU magic and version
+    } else {
+        memcpy(b + 257, "ustar", 6);            // POSIX magic, NUL included
+        memcpy(b + 263, "00", 2);
+    }
+
+    memset(b + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += b[i];
+    snprintf((char *)b + 148, 7, "%06o", sum);
+}
+
+// Header block(s) of one entry into out. Names over 100 bytes are split
+// into ustar prefix/name when possible, otherwise preceded by a GNU
+// long-name entry. Returns the bytes written, 0 if the name is too long.
+static size_t tar_header(unsigned char *out, const char *name, char type,
+                         unsigned long long size, long mtime) {
+    size_t len = strlen(name);
+    if (len <= 100) {
+        tar_fill(out, name, len, "", 0, type, size, mtime, 0);
+        return TAR_BLOCK;
+    }
+
+    for (size_t p = (len - 2 < 155) ? len - 2 : 155; p > 0; p--) {
+        if (name[p] == '/' && len - p - 1 <= 100) {
+            tar_fill(out, name + p + 1, len - p - 1, name, p, type, size, mtime, 0);
+            return TAR_BLOCK;
+        }
+    }
+
+    if (len >= TAR_NAME_MAX) return 0;
+    size_t body = ((len + 1 + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+    tar_fill(out, "././@LongLink", 13, "", 0, 'L', len + 1, 0, 1);
+    memset(out + TAR_BLOCK, 0, body);
+    memcpy(out + TAR_BLOCK, name, len);
+    tar_fill(out + TAR_BLOCK + body, name, 100, "", 0, type, size, mtime, 0);
+    return 2 * TAR_BLOCK + body;
+}
+
+// ---------------------------------------------------------------------------
+// Walking the folder
+// ---------------------------------------------------------------------------
+
+static void close_body(ArchiveStream *a) {
+    if (a->body_fd >= 0) {
+        close(a->body_fd);
+        a->body_fd = -1;
+    }
+    if (a->reader_open) {
+        frame_reader_close(&a->reader);
+        a->reader_open = 0;
+    }
+    a->body_left = 0;
+    a->pad = 0;
+}
+
+static void stream_free(int idx) {
+    ArchiveStream *a = &streams[idx];
+    close_body(a);
+    free(a->dirs);
+    free(a->page);
+    free(a->raw);
+    free(a->zout);
+    if (a->zc) ZSTD_freeCCtx(a->zc);
+    memset(a, 0, sizeof(*a));
+    a->body_fd = -1;
+}
+
+// Next page of live files in dirs[dir_pos]. 0, or -1 on DB error
+static int fetch_page(ArchiveStream *a) {
+    char query[448];
+    snprintf(query, sizeof(query),
+             "SELECT file_id, file_name, file_path, file_size, UNIX_TIMESTAMP(updated_at), "
+             "pack_segment, pack_offset FROM files WHERE dir_id=%d AND group_id=%d AND is_deleted=0 AND file_id>%d "
+             "ORDER BY file_id LIMIT %d",
+             a->dirs[a->dir_pos], a->group_id, a->last_file_id, ARCHIVE_PAGE_FILES);
+
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    a->page_count = 0;
+    a->page_pos = 0;
+    MYSQL_ROW row;
+    while (a->page_count < ARCHIVE_PAGE_FILES && (row = mysql_fetch_row(res))) {
+        ArchiveFile *f = &a->page[a->page_count++];
+        f->file_id = row[0] ? atoi(row[0]) : 0;
+        snprintf(f->name, sizeof(f->name), "%s", row[1] ? row[1] : "");
+        snprintf(f->path, sizeof(f->path), "%s", row[2] ? row[2] : "");
+        f->size = row[3] ? atoll(row[3]) : 0;
+        f->mtime = row[4] ? atol(row[4]) : 0;
+        f->pack_segment = row[5] ? atoi(row[5]) : 0;
+        f->pack_offset = row[6] ? atoll(row[6]) : 0;
+        a->last_file_id = f->file_id;
+    }
+    mysql_free_result(res);
+
+    a->page_full = (a->page_count == ARCHIVE_PAGE_FILES);
+    return 0;
+}
+
+// Move to the next directory of the subtree still inside it and generate
+// its header. 1 if there was one, 0 when the walk is over.
+static int next_dir(ArchiveStream *a) {
+    char path[TAR_NAME_MAX];
+    while (++a->dir_pos < a->dir_count) {
+        int dir_id = a->dirs[a->dir_pos];
+        // Removed or moved out since the walk started
+        if (dir_tree_is_within(a->group_id, dir_id, a->dir_id) != 1) continue;
+
+        int len = dir_tree_path(a->group_id, dir_id, path, sizeof(path));
+        if (len <= a->prefix_len) continue;
+        int w = snprintf(a->dir_name, sizeof(a->dir_name), "%s/", path + a->prefix_len);
+        if (w < 0 || (size_t)w >= sizeof(a->dir_name)) continue;
+
+        size_t n = tar_header(a->raw, a->dir_name, '5', 0, (long)a->started);
+        if (n == 0) continue;
+        a->raw_len = n;
+
+        a->page_count = 0;
+        a->page_pos = 0;
+        a->page_full = 1;            // first page read on demand
+        a->last_file_id = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Open the blob of f and generate its header. 1 if started, 0 if the
+// file is skipped (blob unreadable, name too long)
+static int start_file(int idx, ArchiveStream *a, const ArchiveFile *f) {
+    long long size;
+    long long base = 0;
+    if (f->pack_segment > 0) {
+        // Packed: a range of the segment, read like a plain blob
+        char seg[256];
+        pack_segment_path(f->pack_segment, seg, sizeof(seg));
+        a->body_fd = open(seg, O_RDONLY | O_CLOEXEC);
+        if (a->body_fd < 0) {
+            log_error(idx, a->user_id, "DOWNLOAD_FOLDER: cannot open file_id=%d, skipped", f->file_id);
+            return 0;
+        }
+        size = f->size;
+        base = f->pack_offset;
+    } else if (frame_store_is_compressed(f->path)) {
+        if (frame_reader_open(&a->reader, f->path) != 0) {
+            log_error(idx, a->user_id, "DOWNLOAD_FOLDER: cannot open file_id=%d, skipped", f->file_id);
+            return 0;
+        }
+        a->reader_open = 1;
+        size = (long long)a->reader.raw_size;
+    } else {
+        struct stat st;
+        a->body_fd = open(f->path, O_RDONLY | O_CLOEXEC);
+        if (a->body_fd < 0 || fstat(a->body_fd, &st) != 0) {
+            log_error(idx, a->user_id, "DOWNLOAD_FOLDER: cannot open file_id=%d, skipped", f->file_id);
+            close_body(a);
+            return 0;
+        }
+        size = (long long)st.st_size;
+    }
+    // The header must carry what will actually be read
+    if (size != f->size) {
+        log_error(idx, a->user_id, "DOWNLOAD_FOLDER: file_id=%d is %lld bytes on disk, %lld recorded",
+                  f->file_id, size, f->size);
+    }
+
+    char name[TAR_NAME_MAX];
+    int w = snprintf(name, sizeof(name), "%s%s", a->dir_name, f->name);
+    size_t n = (w > 0 && (size_t)w < sizeof(name))
+                   ? tar_header(a->raw, name, '0', (unsigned long long)size, f->mtime)
+                   : 0;
+    if (n == 0) {
+        close_body(a);
+        return 0;
+    }
+
+    a->raw_len = n;
+    a->body_offset = base;
+    a->body_left = size;
+    a->pad = (int)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    a->files_sent++;
+    return 1;
+}
+
+// Generate the next stretch of the tar into raw (fully queued on entry).
+// 0, or -1 if the archive cannot be continued.
+static int generate(int idx, ArchiveStream *a) {
+    a->raw_len = 0;
+    a->raw_pos = 0;
+
+    if (a->body_left > 0) {
+        size_t want = (a->body_left < ARCHIVE_IO_SIZE) ? (size_t)a->body_left : ARCHIVE_IO_SIZE;
+        long n = a->reader_open
+                     ? frame_reader_pread(&a->reader, a->raw, want, (uint64_t)a->body_offset)
+                     : (long)pread(a->body_fd, a->raw, want, (off_t)a->body_offset);
+        if (n <= 0) {
+            // The header already promised these bytes
+            log_error(idx, a->user_id, "DOWNLOAD_FOLDER: read failed at offset %lld", a->body_offset);
+            return -1;
+        }
+        a->raw_len = (size_t)n;
+        a->body_offset += n;
+        a->body_left -= n;
+        a->bytes_sent += n;
+        return 0;
+    }
+
+    if (a->pad > 0) {
+        memset(a->raw, 0, (size_t)a->pad);
+        a->raw_len = (size_t)a->pad;
+        a->pad = 0;
+        return 0;
+    }
+
+    close_body(a);
+    for (;;) {
+        if (a->dir_pos >= 0 && a->dir_pos < a->dir_count) {
+            if (a->page_pos < a->page_count) {
+                if (start_file(idx, a, &a->page[a->page_pos++])) return 0;
+                continue;
+            }
+            if (a->page_full) {
+                if (fetch_page(a) != 0) {
+                    log_error(idx, a->user_id, "DOWNLOAD_FOLDER: listing files failed: %s",
+                              mysql_error(conn));
+                    return -1;
+                }
+                continue;
+            }
+        }
+        if (next_dir(a)) return 0;
+
+        // End of archive: two zero blocks
+        memset(a->raw, 0, 2 * TAR_BLOCK);
+        a->raw_len = 2 * TAR_BLOCK;
+        a->tar_done = 1;
+        return 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Output
+// ---------------------------------------------------------------------------
+
+static int queue_segment(int idx, const void *data, size_t len) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%zu\r\n", len);
+    if (enqueue_send(idx, head, n) != 0) return -1;
+    return enqueue_send(idx, (const char *)data, (int)len);
+}
+
+// Queue as much of the stream as fits below SEND_HIGH_WATER.
+// 0 = more to come, 1 = everything queued, -1 = failed
+static int pump_stream(int idx, ArchiveStream *a, int zero_copy) {
+    Client *c = &clients[idx];
+
+    while (c->tail_len == 0) {
+        int room = SEND_HIGH_WATER - conn_pending_output(idx) - 32;
+        if (room <= 0) return 0;
+
+        if (a->zout_pos < a->zout_len) {
+            size_t n = a->zout_len - a->zout_pos;
+            if (n > (size_t)room) n = (size_t)room;
+            if (queue_segment(idx, a->zout + a->zout_pos, n) != 0) return -1;
+            a->zout_pos += n;
+            continue;
+        }
+
+        if (a->raw_pos < a->raw_len) {
+            if (a->zc) {
+                ZSTD_inBuffer in = { a->raw, a->raw_len, a->raw_pos };
+                ZSTD_outBuffer out = { a->zout, a->zout_cap, 0 };
+                if (ZSTD_isError(ZSTD_compressStream2(a->zc, &out, &in, ZSTD_e_continue))) {
+                    return -1;
+                }
+                a->raw_pos = in.pos;
+                a->zout_len = out.pos;
+                a->zout_pos = 0;
+            } else {
+                size_t n = a->raw_len - a->raw_pos;
+                if (n > (size_t)room) n = (size_t)room;
+                if (queue_segment(idx, a->raw + a->raw_pos, n) != 0) return -1;
+                a->raw_pos += n;
+            }
+            continue;
+        }
+
+        if (a->tar_done) {
+            if (!a->zc || a->zc_done) return 1;
+            ZSTD_inBuffer in = { NULL, 0, 0 };
+            ZSTD_outBuffer out = { a->zout, a->zout_cap, 0 };
+            size_t left = ZSTD_compressStream2(a->zc, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(left)) return -1;
+            a->zc_done = (left == 0);
+            a->zout_len = out.pos;
+            a->zout_pos = 0;
+            continue;
+        }
+
+        // Plain blob into an uncompressed archive: the kernel copies the
+        // body straight from the page cache to the socket
+        if (zero_copy && !a->zc && a->body_fd >= 0 && a->body_left >= ARCHIVE_SENDFILE_MIN) {
+            int n = (a->body_left < ARCHIVE_SENDFILE_MAX) ? (int)a->body_left : ARCHIVE_SENDFILE_MAX;
+            char head[32];
+            int hn = snprintf(head, sizeof(head), "%d\r\n", n);
+            if (enqueue_send(idx, head, hn) != 0) return -1;
+            c->tail_fd = a->body_fd;
+            c->tail_offset = (off_t)a->body_offset;
+            c->tail_len = n;
+            a->body_offset += n;
+            a->body_left -= n;
+            a->bytes_sent += n;
+            return 0;
+        }
+
+        if (generate(idx, a) != 0) return -1;
+    }
+    return 0;
+}
+
+static void finish_stream(int idx, int status) {
+    ArchiveStream *a = &streams[idx];
+    if (status == 200) {
+        log_info(idx, a->user_id, "DOWNLOAD_FOLDER: dir_id=%d sent, %d files, %lld bytes",
+                 a->dir_id, a->files_sent, a->bytes_sent);
+    } else {
+        log_error(idx, a->user_id, "DOWNLOAD_FOLDER: dir_id=%d aborted after %d files",
+                  a->dir_id, a->files_sent);
+    }
+    stream_free(idx);
+
+    Client *c = &clients[idx];
+    if (c->state == CONN_STREAMING) {
+        c->state = CONN_WRITING;
+    }
+    char end[32];
+    int n = snprintf(end, sizeof(end), "0 %d\r\n", status);
+    enqueue_send(idx, end, n);
+    conn_update_state(idx);
+}
+
+void archive_init(void) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        memset(&streams[i], 0, sizeof(streams[i]));
+        streams[i].body_fd = -1;
+    }
+}
+
+int archive_start(int idx, int user_id, int group_id, int dir_id, CodecType codec) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return -1;
+    archive_release(idx);
+    ArchiveStream *a = &streams[idx];
+
+    DirInfo info;
+    if (dir_tree_lookup(group_id, dir_id, &info) != 1) return -1;
+    char folder[256];
+    snprintf(folder, sizeof(folder), "%s", info.name);
+
+    // Entry names start at the folder itself: "<folder>/sub/file"
+    char path[TAR_NAME_MAX];
+    int len = dir_tree_path(group_id, dir_id, path, sizeof(path));
+    const char *slash = (len > 0) ? strrchr(path, '/') : NULL;
+    int count = dir_tree_subtree(group_id, dir_id, NULL, 0);
+    if (!slash || count <= 0) return -1;
+
+    // Totals are only announced to the client, a failure here is not fatal
+    AggTotals totals = {0, 0, 0};
+    int parent_id;
+    agg_item_totals(0, dir_id, &parent_id, &totals);
+
+    a->dirs = (int *)malloc((size_t)count * sizeof(int));
+    a->page = (ArchiveFile *)malloc(ARCHIVE_PAGE_FILES * sizeof(ArchiveFile));
+    a->raw = (unsigned char *)malloc(ARCHIVE_IO_SIZE);
+    if (!a->dirs || !a->page || !a->raw) goto fail;
+    a->dir_count = dir_tree_subtree(group_id, dir_id, a->dirs, count);
+    if (a->dir_count > count) a->dir_count = count;
+
+    if (codec == CODEC_ZSTD) {
+        a->zc = ZSTD_createCCtx();
+        a->zout_cap = ZSTD_CStreamOutSize();
+        a->zout = (unsigned char *)malloc(a->zout_cap);
+        if (!a->zc || !a->zout ||
+            ZSTD_isError(ZSTD_CCtx_setParameter(a->zc, ZSTD_c_compressionLevel, ARCHIVE_ZSTD_LEVEL))) {
+            goto fail;
+        }
+    }
+
+    a->active = 1;
+    a->user_id = user_id;
+    a->group_id = group_id;
+    a->dir_id = dir_id;
+    a->started = time(NULL);
+    a->dir_pos = -1;
+    a->prefix_len = (int)(slash - path) + 1;
+
+    char reply[384];
+    int n = snprintf(reply, sizeof(reply), "200 %s.tar files=%d bytes=%lld%s\r\n",
+                     folder, totals.files, totals.bytes, a->zc ? " codec=zstd" : "");
+    if (n <= 0 || n >= (int)sizeof(reply) || enqueue_send(idx, reply, n) != 0) goto fail;
+
+    clients[idx].state = CONN_STREAMING;
+    sched_mark_bulk(idx, user_id, group_id, 0);
+    return 0;
+
+fail:
+    stream_free(idx);
+    return -1;
+}
+
+void archive_pump(int zero_copy) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ArchiveStream *a = &streams[i];
+        if (!a->active) continue;
+
+        Client *c = &clients[i];
+        if (c->sock <= 0 || c->state != CONN_STREAMING) {
+            archive_release(i);      // closed, or closing after an error
+            continue;
+        }
+        // Refill in batches, and never move send_buf under an io_uring send
+        if (c->send_inflight || c->tail_len > 0 || conn_pending_output(i) >= SEND_LOW_WATER) {
+            continue;
+        }
+
+        int rc = pump_stream(i, a, zero_copy);
+        sched_mark_bulk(i, a->user_id, a->group_id, 0);
+        if (rc != 0) {
+            finish_stream(i, (rc > 0) ? 200 : 500);
+        }
+    }
+}
+
+void archive_release(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    if (streams[idx].active) {
+        // The sendfile() tail reads from the blob about to be closed
+        clients[idx].tail_len = 0;
+        clients[idx].tail_fd = -1;
+    }
+    stream_free(idx);
+}
@@ -0,0 +1,45 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "../utils/compress.h"
+
+// DOWNLOAD_FOLDER: a directory and everything below it sent as one tar
+// archive (ustar, GNU long names), generated while it goes out and
+// optionally compressed into a single zstd stream. Nothing is staged on
+// disk and a stream holds the same memory whatever the folder size:
+// directories come from the in-memory tree, files are read from the DB
+// a page at a time, and each body is copied from its blob a buffer at a
+// time or, for plain blobs in the select loop, handed to sendfile()
+// (see Client.tail_*).
+//
+// After the "200 ..." reply the connection carries only the archive,
+// cut into segments
+//
+//   <len>\r\n<len bytes>
+//   ...
+//   0 <status>\r\n        200 = complete, 500 = aborted (archive incomplete)
+//
+// No other replies or events are sent until it ends; commands that
+// arrive meanwhile wait in recv_buf.
+#define ARCHIVE_PAGE_FILES 64               // files read from the DB per query
+#define ARCHIVE_IO_SIZE (16 * 1024)         // raw tar bytes generated at a time
+#define ARCHIVE_SENDFILE_MIN (16 * 1024)    // smaller bodies are copied
+#define ARCHIVE_SENDFILE_MAX (1024 * 1024)  // body bytes per sendfile() segment
+
+void archive_init(void);
+
+// Start streaming dir_id of group_id on connection idx (access already
+// checked). Queues the reply line and switches the connection to
+// CONN_STREAMING. Returns 0, or -1 if the stream could not be set up
+// (nothing queued).
+int archive_start(int idx, int user_id, int group_id, int dir_id, CodecType codec);
+
+// Queue the next part of every stream whose output has drained below
+// SEND_LOW_WATER (called once per event loop iteration). zero_copy:
+// plain blob bodies may go out through sendfile() instead of send_buf.
+void archive_pump(int zero_copy);
+
+// Connection closed
+void archive_release(int idx);
+
+#endif
@@ -10,25 +10,50 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
-#include <openssl/evp.h>
 #include "../auth/auth.h"
 #include "../auth/token.h"
 #include "../database/db.h"
+#include "../database/activity_journal.h"
+#include "../database/aggregates.h"
 #include "../utils/logger.h"
+#include "../utils/compress.h"
+#include "../utils/base64.h"
+#include "../utils/crc32c.h"
+#include "../utils/arena.h"
+#include "../storage/frame_store.h"
+#include "../storage/file_cache.h"
+#include "../storage/fd_cache.h"
+#include "../storage/quota.h"
+#include "../storage/pack_store.h"
+#include "../storage/blob_clone.h"
+#include "../storage/versions.h"
+#include "../storage/dir_tree.h"
+#include "../io/server_timers.h"
+#include "../net/scheduler.h"
+#include "../net/event_bus.h"
+#include "transfer.h"
+#include "archive.h"
 #include <mysql/mysql.h>
 
 #define BUFFER_SIZE 4096
-#define MAX_CONCURRENT_UPLOADS 3
-
-// Rate limiting: Track active uploads globally
-static int active_uploads = 0;
-#define STORAGE_ROOT "./storage"
-#define TMP_SUFFIX ".part"
+#define RESPONSE_SIZE BUFFER_SIZE
+#define FOLDER_CONTENT_SIZE (BUFFER_SIZE * 8)
 #define MAX_FILENAME_LEN 255
 #define FILE_CHUNK_SIZE 2048
+#define DIR_BATCH 500              // directories per IN (...) when deleting a subtree
+#define BATCH_MAX_ITEMS 1000       // items per DELETE_ITEMS / MOVE_ITEMS / COPY_ITEMS
+#define VERSION_LIST_MAX 50        // versions per LIST_VERSIONS reply, newest first
 #define BASE64_CHUNK_SIZE (((FILE_CHUNK_SIZE + 2) / 3) * 4 + 4)
 
+// Uploads sent with a codec are kept compressed on disk (framed, see frame_store.h)
+#define COMPRESS_AT_REST 1
+
+// Re-hash files served from chunk 1 in order and refuse the last chunk
+// if the result differs from files.content_sha256
+#define VERIFY_ON_READ 1
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
@@ -185,23 +210,8 @@ static int user_in_group(int user_id, int group_id) {
 }
 
 static int dir_belongs_to_group(int dir_id, int group_id) {
-    char query[256];
-    snprintf(query, sizeof(query),
-             "SELECT 1 FROM directories WHERE dir_id=%d AND group_id=%d AND is_deleted=0 LIMIT 1",
-             dir_id, group_id);
-
-    if (mysql_query(conn, query) != 0) {
-        return -1;
-    }
-
-    MYSQL_RES *res = mysql_store_result(conn);
-    if (!res) {
-        return -1;
-    }
-
-    int exists = mysql_num_rows(res) > 0;
-    mysql_free_result(res);
-    return exists;
+    // Tra trong cây thư mục của group (nạp từ DB một lần)
+    return dir_tree_lookup(group_id, dir_id, NULL);
 }
 
 static int is_user_admin_of_group(int user_id, int group_id) {
@@ -244,164 +254,503 @@ static int file_belongs_to_group(int file_id, int group_id) {
     return exists;
 }
 
-// Recursive delete directory and all its contents
-static int delete_directory_recursive(int dir_id) {
-    char query[512];
-
-    // Delete all files in this directory
-    snprintf(query, sizeof(query),
-             "UPDATE files SET is_deleted=1, deleted_at=NOW() WHERE dir_id=%d AND is_deleted=0",
-             dir_id);
-    if (mysql_query(conn, query) != 0) {
+// Soft delete a directory and everything below it. The subtree comes from
+// the in-memory tree: two UPDATEs per DIR_BATCH directories instead of
+// three queries for every directory.
+static int delete_directory_tree(int group_id, int dir_id) {
+    int count = dir_tree_subtree(group_id, dir_id, NULL, 0);
+    if (count <= 0) {
         return -1;
     }
 
-    // Get all subdirectories
-    snprintf(query, sizeof(query),
-             "SELECT dir_id FROM directories WHERE parent_dir_id=%d AND is_deleted=0",
-             dir_id);
-    if (mysql_query(conn, query) != 0) {
+    int *ids = (int *)malloc((size_t)count * sizeof(int));
+    char *list = (char *)malloc(DIR_BATCH * 12);
+    char *query = (char *)malloc(DIR_BATCH * 12 + 128);
+    if (!ids || !list || !query) {
+        free(ids);
+        free(list);
+        free(query);
         return -1;
     }
+    dir_tree_subtree(group_id, dir_id, ids, count);
 
-    MYSQL_RES *res = mysql_store_result(conn);
-    if (!res) {
-        return -1;
-    }
+    int rc = 0;
+    for (int start = 0; start < count && rc == 0; start += DIR_BATCH) {
+        int n = (count - start < DIR_BATCH) ? count - start : DIR_BATCH;
+        int len = 0;
+        for (int i = 0; i < n; i++) {
+            len += sprintf(list + len, "%s%d", i ? "," : "", ids[start + i]);
+        }
 
-    // Recursively delete subdirectories
-    MYSQL_ROW row;
-    while ((row = mysql_fetch_row(res))) {
-        int subdir_id = atoi(row[0]);
-        if (delete_directory_recursive(subdir_id) < 0) {
-            mysql_free_result(res);
-            return -1;
+        snprintf(query, DIR_BATCH * 12 + 128,
+                 "UPDATE files SET is_deleted=1, deleted_at=NOW() WHERE dir_id IN (%s) AND is_deleted=0",
+                 list);
+        if (mysql_query(conn, query) != 0) {
+            rc = -1;
+            break;
         }
-    }
-    mysql_free_result(res);
 
-    // Finally delete this directory itself
-    snprintf(query, sizeof(query),
-             "UPDATE directories SET is_deleted=1, deleted_at=NOW() WHERE dir_id=%d",
-             dir_id);
-    if (mysql_query(conn, query) != 0) {
-        return -1;
+        snprintf(query, DIR_BATCH * 12 + 128,
+                 "UPDATE directories SET is_deleted=1, deleted_at=NOW() WHERE dir_id IN (%s)",
+                 list);
+        if (mysql_query(conn, query) != 0) {
+            rc = -1;
+        }
     }
 
-    return 0;
+    free(ids);
+    free(list);
+    free(query);
+    return rc;
 }
 
-// Recursive copy directory and all its contents
-static int copy_directory_recursive(int src_dir_id, int target_parent_id, int user_id) {
-    char query[1024];
+typedef struct {
+    int src_id;
+    int new_id;
+    int new_parent_id;
+} DirCopy;
 
-    // Copy the directory itself first
-    snprintf(query, sizeof(query),
-             "INSERT INTO directories (dir_name, parent_dir_id, group_id, created_by) "
-             "SELECT dir_name, %d, group_id, %d "
-             "FROM directories WHERE dir_id=%d",
-             target_parent_id, user_id, src_dir_id);
+static int dir_copy_by_src(const void *a, const void *b) {
+    int x = ((const DirCopy *)a)->src_id;
+    int y = ((const DirCopy *)b)->src_id;
+    return (x > y) - (x < y);
+}
 
-    if (mysql_query(conn, query) != 0) {
+// Copy a directory and everything below it under target_parent_id. The
+// subtree is taken from the in-memory tree before anything is inserted,
+// so copying a directory into itself terminates. On success *out holds
+// one DirCopy per directory created (caller frees) and the count is
+// returned; -1 on error.
+static int copy_directory_tree(int group_id, int src_dir_id, int target_parent_id,
+                               int user_id, DirCopy **out) {
+    int count = dir_tree_subtree(group_id, src_dir_id, NULL, 0);
+    if (count <= 0) {
         return -1;
     }
 
-    // Get the new directory ID
-    int new_dir_id = mysql_insert_id(conn);
+    int *src_ids = (int *)malloc((size_t)count * sizeof(int));
+    DirCopy *copies = (DirCopy *)malloc((size_t)count * sizeof(DirCopy));
+    DirCopy *by_src = (DirCopy *)malloc((size_t)count * sizeof(DirCopy));
+    if (!src_ids || !copies || !by_src) {
+        free(src_ids);
+        free(copies);
+        free(by_src);
+        return -1;
+    }
+    dir_tree_subtree(group_id, src_dir_id, src_ids, count);
 
-    // Copy all files in this directory
-    snprintf(query, sizeof(query),
-             "INSERT INTO files (file_name, file_path, file_size, file_type, dir_id, group_id, uploaded_by) "
-             "SELECT file_name, file_path, file_size, file_type, %d, group_id, %d "
-             "FROM files WHERE dir_id=%d AND is_deleted=0",
-             new_dir_id, user_id, src_dir_id);
+    char query[1024];
+    int done = 0;
+    for (int i = 0; i < count; i++) {
+        // Parents come before their children: the copy of the parent exists
+        int new_parent_id = target_parent_id;
+        if (i > 0) {
+            DirInfo info;
+            if (dir_tree_lookup(group_id, src_ids[i], &info) != 1) break;
+
+            DirCopy key = { info.parent_id, 0, 0 };
+            DirCopy *parent = (DirCopy *)bsearch(&key, by_src, (size_t)done,
+                                                 sizeof(DirCopy), dir_copy_by_src);
+            if (!parent) break;
+            new_parent_id = parent->new_id;
+        }
+
+        // Copy the directory itself first (bản sao có cùng nội dung nên giữ nguyên số liệu tổng hợp)
+        snprintf(query, sizeof(query),
+                 "INSERT INTO directories (dir_name, parent_dir_id, group_id, created_by, "
+                 "total_bytes, file_count, dir_count) "
+                 "SELECT dir_name, %d, group_id, %d, total_bytes, file_count, dir_count "
+                 "FROM directories WHERE dir_id=%d",
+                 new_parent_id, user_id, src_ids[i]);
+        if (mysql_query(conn, query) != 0) break;
+        int new_dir_id = (int)mysql_insert_id(conn);
 
-    if (mysql_query(conn, query) != 0) {
+        // Copy all files in this directory
+        snprintf(query, sizeof(query),
+                 "INSERT INTO files (file_name, file_path, file_size, file_type, dir_id, group_id, uploaded_by, content_sha256, pack_segment, pack_offset) "
+                 "SELECT file_name, file_path, file_size, file_type, %d, group_id, %d, content_sha256, pack_segment, pack_offset "
+                 "FROM files WHERE dir_id=%d AND is_deleted=0",
+                 new_dir_id, user_id, src_ids[i]);
+        if (mysql_query(conn, query) != 0) break;
+
+        DirCopy c = { src_ids[i], new_dir_id, new_parent_id };
+        copies[i] = c;
+
+        // Keep by_src sorted for the parent lookups (ids mostly arrive in order)
+        int j = done++;
+        while (j > 0 && by_src[j - 1].src_id > c.src_id) {
+            by_src[j] = by_src[j - 1];
+            j--;
+        }
+        by_src[j] = c;
+    }
+
+    free(src_ids);
+    free(by_src);
+    if (done < count) {
+        free(copies);
         return -1;
     }
+    *out = copies;
+    return count;
+}
 
-    // Get all subdirectories
-    snprintf(query, sizeof(query),
-             "SELECT dir_id FROM directories WHERE parent_dir_id=%d AND is_deleted=0",
-             src_dir_id);
+// ---------------------------------------------------------------------------
+// Batch item operations (DELETE_ITEMS / MOVE_ITEMS / COPY_ITEMS)
+//
+// Items are checked against the group in bulk (one query for the files,
+// the in-memory tree for the directories) and applied in one transaction.
+// Files go first, grouped so each affected directory's aggregates are
+// updated once; directories follow one by one, reading their totals when
+// they are applied, so an item inside another item of the same batch is
+// counted exactly as if the single commands had been sent in turn.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int is_file;
+    int item_id;
+    int status;                     // per-item reply code, 0 = still to apply
+    int parent_id;                  // directory holding the item (0 = none)
+    long long bytes;                // files only
+} BatchItem;
+
+typedef struct {
+    DirCopy *copies;                // COPY_ITEMS: directories created per item
+    int count;
+} BatchCopy;
+
+// "F:12,D:7,..." into items. Returns the count, -1 if malformed or longer
+// than max. Repeats of an item are marked 400 (they would apply twice).
+static int parse_batch_items(char *list, BatchItem *items, int max) {
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char type = (char)toupper((unsigned char)tok[0]);
+        int id = (tok[1] == ':') ? atoi(tok + 2) : 0;
+        if (n == max || (type != 'F' && type != 'D') || id <= 0) {
+            return -1;
+        }
 
-    if (mysql_query(conn, query) != 0) {
-        return -1;
+        BatchItem *it = &items[n];
+        memset(it, 0, sizeof(*it));
+        it->is_file = (type == 'F');
+        it->item_id = id;
+        for (int k = 0; k < n; k++) {
+            if (items[k].is_file == it->is_file && items[k].item_id == id) {
+                it->status = 400;
+                break;
+            }
+        }
+        n++;
     }
+    return n;
+}
 
-    MYSQL_RES *res = mysql_store_result(conn);
-    if (!res) {
+// Ids of the pending files (is_file = 1) or directories as "12,13,..."
+// into buf, which holds n * 12 bytes. Returns how many were written.
+static int batch_id_list(const BatchItem *items, int n, int is_file, char *buf) {
+    int len = 0, count = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        if (items[i].status != 0 || items[i].is_file != is_file) continue;
+        len += sprintf(buf + len, "%s%d", count ? "," : "", items[i].item_id);
+        count++;
+    }
+    return count;
+}
+
+// Fills parent_id (and bytes) of every pending item of the group; items
+// that are not live in it get 404. 0 on success, -1 on DB error.
+static int batch_resolve(int group_id, BatchItem *items, int n) {
+    for (int i = 0; i < n; i++) {
+        if (items[i].status != 0 || items[i].is_file) continue;
+
+        DirInfo info;
+        int rc = dir_tree_lookup(group_id, items[i].item_id, &info);
+        if (rc < 0) return -1;
+        if (rc == 0) {
+            items[i].status = 404;
+        } else {
+            items[i].parent_id = info.parent_id;
+        }
+    }
+
+    char *ids = (char *)malloc((size_t)n * 12 + 1);
+    char *query = (char *)malloc((size_t)n * 12 + 256);
+    if (!ids || !query) {
+        free(ids);
+        free(query);
         return -1;
     }
 
-    // Recursively copy subdirectories
-    MYSQL_ROW row;
-    while ((row = mysql_fetch_row(res))) {
-        int subdir_id = atoi(row[0]);
-        if (copy_directory_recursive(subdir_id, new_dir_id, user_id) < 0) {
+    int rc = 0;
+    if (batch_id_list(items, n, 1, ids) > 0) {
+        snprintf(query, (size_t)n * 12 + 256,
+                 "SELECT file_id, dir_id, file_size FROM files "
+                 "WHERE group_id=%d AND is_deleted=0 AND file_id IN (%s)",
+                 group_id, ids);
+
+        MYSQL_RES *res = NULL;
+        if (mysql_query(conn, query) != 0 || !(res = mysql_store_result(conn))) {
+            rc = -1;
+        } else {
+            MYSQL_ROW row;
+            while ((row = mysql_fetch_row(res))) {
+                int file_id = atoi(row[0]);
+                for (int i = 0; i < n; i++) {
+                    if (items[i].is_file && items[i].status == 0 && items[i].item_id == file_id) {
+                        items[i].parent_id = row[1] ? atoi(row[1]) : 0;
+                        items[i].bytes = row[2] ? atoll(row[2]) : 0;
+                        break;
+                    }
+                }
+            }
             mysql_free_result(res);
-            return -1;
+
+            for (int i = 0; i < n; i++) {
+                if (items[i].is_file && items[i].status == 0 && items[i].parent_id == 0) {
+                    items[i].status = 404;
+                }
+            }
         }
     }
-    mysql_free_result(res);
 
-    return 0;
+    free(ids);
+    free(query);
+    return rc;
 }
 
-static int decode_base64_chunk(const char *input, unsigned char **output, size_t *out_len) {
-    if (!input || !output || !out_len) {
-        return -1;
+// Adds (sign 1) or removes (-1) the pending files' totals at the
+// directories holding them, one apply_dir_delta per directory
+static int batch_apply_file_parents(int group_id, const BatchItem *items, int n, int sign) {
+    for (int i = 0; i < n; i++) {
+        if (!items[i].is_file || items[i].status != 0) continue;
+
+        int seen = 0;
+        for (int k = 0; k < i && !seen; k++) {
+            seen = items[k].is_file && items[k].status == 0 &&
+                   items[k].parent_id == items[i].parent_id;
+        }
+        if (seen) continue;
+
+        AggTotals t = { 0, 0, 0 };
+        for (int k = i; k < n; k++) {
+            if (items[k].is_file && items[k].status == 0 &&
+                items[k].parent_id == items[i].parent_id) {
+                t.bytes += items[k].bytes;
+                t.files++;
+            }
+        }
+        if (agg_apply(group_id, items[i].parent_id, &t, sign) != 0) return -1;
     }
+    return 0;
+}
 
-    size_t in_len = strlen(input);
-    if (in_len == 0) {
-        *output = NULL;
-        *out_len = 0;
+// Runs "<prefix>(<pending file ids>)<suffix>" if there are pending files
+static int batch_files_query(const BatchItem *items, int n, const char *prefix, const char *suffix) {
+    char *ids = (char *)malloc((size_t)n * 12 + 1);
+    if (!ids) return -1;
+    if (batch_id_list(items, n, 1, ids) == 0) {
+        free(ids);
         return 0;
     }
 
-    size_t max_len = (in_len / 4) * 3 + 3;
-    unsigned char *buffer = (unsigned char *)malloc(max_len);
-    if (!buffer) {
+    size_t size = strlen(prefix) + strlen(ids) + strlen(suffix) + 4;
+    char *query = (char *)malloc(size);
+    int rc = -1;
+    if (query) {
+        snprintf(query, size, "%s(%s)%s", prefix, ids, suffix);
+        rc = (mysql_query(conn, query) == 0) ? 0 : -1;
+    }
+    free(query);
+    free(ids);
+    return rc;
+}
+
+// Soft delete the pending items. *removed_bytes gets what left the group.
+static int batch_delete(int group_id, BatchItem *items, int n, long long *removed_bytes) {
+    *removed_bytes = 0;
+    for (int i = 0; i < n; i++) {
+        if (items[i].is_file && items[i].status == 0) *removed_bytes += items[i].bytes;
+    }
+
+    if (batch_files_query(items, n, "UPDATE files SET is_deleted=1, deleted_at=NOW() WHERE file_id IN ", "") != 0 ||
+        batch_apply_file_parents(group_id, items, n, -1) != 0) {
         return -1;
     }
 
-    int decoded_len = EVP_DecodeBlock(buffer, (const unsigned char *)input, (int)in_len);
-    if (decoded_len < 0) {
-        free(buffer);
+    for (int i = 0; i < n; i++) {
+        if (items[i].is_file || items[i].status != 0) continue;
+
+        // Below a directory deleted earlier in this batch: already gone
+        int covered = 0;
+        for (int k = 0; k < i && !covered; k++) {
+            if (!items[k].is_file && items[k].status == 200 &&
+                dir_tree_is_within(group_id, items[i].item_id, items[k].item_id) == 1) {
+                covered = 1;
+            }
+        }
+        if (!covered) {
+            int parent_id = 0;
+            AggTotals t;
+            if (agg_item_totals(0, items[i].item_id, &parent_id, &t) != 0 ||
+                delete_directory_tree(group_id, items[i].item_id) != 0 ||
+                agg_apply(group_id, parent_id, &t, -1) != 0) {
+                return -1;
+            }
+            *removed_bytes += t.bytes;
+        }
+        items[i].status = 200;
+    }
+    return 0;
+}
+
+// Move the pending items into target_dir_id
+static int batch_move(int group_id, BatchItem *items, int n, int target_dir_id) {
+    char prefix[128];
+    snprintf(prefix, sizeof(prefix),
+             "UPDATE files SET dir_id=%d, updated_at=NOW() WHERE file_id IN ", target_dir_id);
+
+    AggTotals moved = { 0, 0, 0 };
+    for (int i = 0; i < n; i++) {
+        if (items[i].is_file && items[i].status == 0) {
+            moved.bytes += items[i].bytes;
+            moved.files++;
+        }
+    }
+    if (batch_apply_file_parents(group_id, items, n, -1) != 0 ||
+        batch_files_query(items, n, prefix, "") != 0 ||
+        agg_apply(group_id, target_dir_id, &moved, 1) != 0) {
         return -1;
     }
 
-    while (in_len > 0 && input[in_len - 1] == '=') {
-        decoded_len--;
-        in_len--;
+    char query[256];
+    for (int i = 0; i < n; i++) {
+        if (items[i].is_file || items[i].status != 0) continue;
+
+        int parent_id = 0;
+        AggTotals t;
+        snprintf(query, sizeof(query),
+                 "UPDATE directories SET parent_dir_id=%d, updated_at=NOW() WHERE dir_id=%d",
+                 target_dir_id, items[i].item_id);
+        if (agg_item_totals(0, items[i].item_id, &parent_id, &t) != 0 ||
+            mysql_query(conn, query) != 0 ||
+            agg_apply(group_id, parent_id, &t, -1) != 0 ||
+            agg_apply(group_id, target_dir_id, &t, 1) != 0) {
+            return -1;
+        }
+        items[i].parent_id = parent_id;
+        items[i].status = 200;
+    }
+    return 0;
+}
+
+// Copy the pending items into target_dir_id for user_id. copies[i] gets
+// the directories created for item i. *copied_bytes gets what was added.
+static int batch_copy(int group_id, BatchItem *items, int n, int target_dir_id, int user_id,
+                      BatchCopy *copies, long long *copied_bytes) {
+    char prefix[512];
+    snprintf(prefix, sizeof(prefix),
+             "INSERT INTO files (file_name, file_path, file_size, file_type, dir_id, group_id, uploaded_by, content_sha256, pack_segment, pack_offset) "
+             "SELECT file_name, file_path, file_size, file_type, %d, group_id, %d, content_sha256, pack_segment, pack_offset "
+             "FROM files WHERE file_id IN ",
+             target_dir_id, user_id);
+
+    AggTotals added = { 0, 0, 0 };
+    for (int i = 0; i < n; i++) {
+        if (items[i].is_file && items[i].status == 0) {
+            added.bytes += items[i].bytes;
+            added.files++;
+        }
+    }
+    if (batch_files_query(items, n, prefix, "") != 0 ||
+        agg_apply(group_id, target_dir_id, &added, 1) != 0) {
+        return -1;
     }
+    *copied_bytes = added.bytes;
+
+    for (int i = 0; i < n; i++) {
+        if (items[i].is_file || items[i].status != 0) continue;
 
-    *output = buffer;
-    *out_len = (size_t)decoded_len;
+        int parent_id = 0;
+        AggTotals t;
+        if (agg_item_totals(0, items[i].item_id, &parent_id, &t) != 0) return -1;
+
+        copies[i].count = copy_directory_tree(group_id, items[i].item_id, target_dir_id,
+                                              user_id, &copies[i].copies);
+        if (copies[i].count < 0) {
+            copies[i].count = 0;
+            return -1;
+        }
+        if (agg_apply(group_id, target_dir_id, &t, 1) != 0) return -1;
+        *copied_bytes += t.bytes;
+        items[i].status = 200;
+    }
     return 0;
 }
 
-static int write_chunk_file(const char *path, const unsigned char *data, size_t len, int chunk_index) {
-    if (!path) return -1;
-    const char *mode = (chunk_index <= 1) ? "wb" : "ab";
-    FILE *fp = fopen(path, mode);
-    if (!fp) {
+// Giải mã base64 vào buffer của caller (không cấp phát); chunk lớn hơn out_size bị từ chối
+static int decode_base64_chunk(const char *input, unsigned char *output, size_t out_size, size_t *out_len) {
+    if (!input || !output || !out_len) {
         return -1;
     }
 
+    return base64_decode(input, strlen(input), output, out_size, out_len);
+}
+
+// Ghi chunk qua fd giữ trong UploadState (mở một lần cho cả lượt upload)
+static int write_chunk_file(UploadState *up, const char *path,
+                            const unsigned char *data, size_t len, int chunk_index) {
+    if (!up || !path) return -1;
+
+    // Đổi file giữa chừng (chỉ xảy ra với upload không có trạng thái): mở lại
+    if (up->fdh >= 0 && strcmp(up->temp_path, path) != 0) {
+        fd_cache_close(up->fdh);
+        up->fdh = -1;
+    }
+
+    if (up->fdh < 0) {
+        int flags = O_WRONLY | O_CREAT | ((chunk_index <= 1) ? O_TRUNC : 0);
+        up->fdh = fd_cache_open(path, flags, 0644);
+        if (up->fdh < 0) {
+            return -1;
+        }
+        strcpy(up->temp_path, path);
+
+        // Tiếp nối file tạm sẵn có như chế độ "ab" trước đây
+        long existing = (chunk_index <= 1) ? 0 : fd_cache_size(up->fdh);
+        if (existing < 0) {
+            return -1;
+        }
+        up->offset = (uint64_t)existing;
+    }
+
     if (len > 0 && data) {
-        size_t written = fwrite(data, 1, len, fp);
-        if (written != len) {
-            fclose(fp);
+        if (fd_cache_pwrite(up->fdh, data, len, up->offset) != 0) {
             return -1;
         }
+        up->offset += len;
     }
 
-    fclose(fp);
     return 0;
 }
 
+// Finished temp blob of a small upload: append it to the pack store and
+// remove the temp file. 1 if packed (*pack set), 0 if it is to become a
+// file of its own (too big, or the pack store failed)
+static int pack_small_blob(const char *temp_path, int compressed, long size, PackRef *pack) {
+    if (size < 0 || size > PACK_MAX_FILE) return 0;
+    if (pack_store_append_file(temp_path, compressed, (uint64_t)size, pack) != 0) {
+        pack->segment = 0;
+        return 0;
+    }
+    unlink(temp_path);
+    if (compressed) {
+        frame_store_drop_index(temp_path);
+    }
+    return 1;
+}
+
 static long get_file_size(const char *path) {
     struct stat st;
     if (stat(path, &st) != 0) {
@@ -415,7 +764,9 @@ static int insert_file_metadata(const char *file_name,
                                 long file_size,
                                 int group_id,
                                 int dir_id,
-                                int user_id) {
+                                int user_id,
+                                const char *sha256_hex,
+                                const PackRef *pack) {
     if (!file_name || !file_path) {
         return -1;
     }
@@ -425,11 +776,27 @@ static int insert_file_metadata(const char *file_name,
     mysql_real_escape_string(conn, escaped_name, file_name, strlen(file_name));
     mysql_real_escape_string(conn, escaped_path, file_path, strlen(file_path));
 
+    // Hash là chuỗi hex do server tự tính, không cần escape; thiếu hash thì lưu NULL
+    char sha_value[SHA256_HEX_LEN + 2] = "NULL";
+    if (sha256_hex && sha256_hex[0]) {
+        snprintf(sha_value, sizeof(sha_value), "'%s'", sha256_hex);
+    }
+
+    // File nhỏ nằm trong pack segment: file_path chỉ còn là tên logic
+    char pack_segment[16] = "NULL";
+    char pack_offset[32] = "NULL";
+    if (pack && pack->segment > 0) {
+        snprintf(pack_segment, sizeof(pack_segment), "%d", pack->segment);
+        snprintf(pack_offset, sizeof(pack_offset), "%llu", (unsigned long long)pack->offset);
+    }
+
     char query[2048];
     snprintf(query, sizeof(query),
-             "INSERT INTO files (file_name, file_path, file_size, dir_id, group_id, uploaded_by) "
-             "VALUES ('%s','%s',%ld,%d,%d,%d)",
-             escaped_name, escaped_path, file_size, dir_id, group_id, user_id);
+             "INSERT INTO files (file_name, file_path, file_size, dir_id, group_id, uploaded_by, "
+             "content_sha256, pack_segment, pack_offset) "
+             "VALUES ('%s','%s',%ld,%d,%d,%d,%s,%s,%s)",
+             escaped_name, escaped_path, file_size, dir_id, group_id, user_id, sha_value,
+             pack_segment, pack_offset);
 
     if (mysql_query(conn, query) != 0) {
         return -1;
@@ -461,26 +828,12 @@ static int encode_base64_chunk(const unsigned char *input, size_t len,
     if (!input && len > 0) return -1;
     if (!output || out_size == 0) return -1;
 
-    if (len == 0) {
-        if (out_size < 1) return -1;
-        output[0] = '\0';
-        return 0;
-    }
-
-    if (out_size < BASE64_CHUNK_SIZE) {
+    if (len > FILE_CHUNK_SIZE || out_size < BASE64_CHUNK_SIZE) {
         // Ensure buffer large enough for max chunk
         return -1;
     }
 
-    int encoded = EVP_EncodeBlock((unsigned char *)output, input, (int)len);
-    if (encoded < 0) {
-        return -1;
-    }
-    if (encoded >= (int)out_size) {
-        return -1;
-    }
-    output[encoded] = '\0';
-    return encoded;
+    return base64_encode(input, len, output, out_size);
 }
 
 static int fetch_file_metadata(int file_id,
@@ -488,14 +841,18 @@ static int fetch_file_metadata(int file_id,
                                char *path_out, size_t path_size,
                                long *size_out,
                                int *dir_id_out,
-                               int *group_id_out) {
-    if (!name_out || !path_out || !size_out || !dir_id_out || !group_id_out) {
+                               int *group_id_out,
+                               char *sha_out, size_t sha_size,
+                               PackRef *pack_out) {
+    if (!name_out || !path_out || !size_out || !dir_id_out || !group_id_out ||
+        !sha_out || sha_size == 0 || !pack_out) {
         return -1;
     }
 
     char query[256];
     snprintf(query, sizeof(query),
-             "SELECT file_name, file_path, file_size, dir_id, group_id "
+             "SELECT file_name, file_path, file_size, dir_id, group_id, content_sha256, "
+             "pack_segment, pack_offset "
              "FROM files "
              "WHERE file_id=%d AND is_deleted=0 LIMIT 1",
              file_id);
@@ -520,6 +877,7 @@ static int fetch_file_metadata(int file_id,
     const char *size_str = row[2] ? row[2] : "0";
     const char *dir_str = row[3] ? row[3] : "0";
     const char *group_str = row[4] ? row[4] : "0";
+    const char *sha = row[5] ? row[5] : "";
 
     strncpy(name_out, name, name_size - 1);
     name_out[name_size - 1] = '\0';
@@ -530,120 +888,716 @@ static int fetch_file_metadata(int file_id,
     *dir_id_out = atoi(dir_str);
     *group_id_out = atoi(group_str);
 
+    strncpy(sha_out, sha, sha_size - 1);
+    sha_out[sha_size - 1] = '\0';
+
+    pack_out->segment = row[6] ? atoi(row[6]) : 0;
+    pack_out->offset = row[7] ? strtoull(row[7], NULL, 10) : 0;
+
     mysql_free_result(res);
     return 1;
 }
 
-// Hàm tách token an toàn
-static char *next_token(char **ptr) {
-    char *tok = strtok(*ptr, " \r\n");
-    *ptr = NULL;  // để gọi tiếp strtok(NULL, ...)
-    return tok;
-}
-// Helper function: Send response and log
-static void send_response(int idx, const char *response) {
-    enqueue_send(idx, response, strlen(response));
-    
-    // Create a copy for logging (without \r\n)
-    // For long responses, log first 2000 chars with "..." indicator
-    char log_buf[2048];
-    size_t len = strlen(response);
-    size_t max_log = sizeof(log_buf) - 10;  // Reserve space for "..." and null
-    
-    if (len > max_log) {
-        memcpy(log_buf, response, max_log);
-        strcpy(log_buf + max_log, "...");
-        len = max_log + 3;
-    } else {
-        memcpy(log_buf, response, len);
-    }
-    log_buf[len] = '\0';
-    
-    // Remove trailing \r\n for cleaner logging
-    char *end = log_buf + len - 1;
-    while (end >= log_buf && (*end == '\r' || *end == '\n')) {
-        *end = '\0';
-        end--;
+// ---------------------------------------------------------------------------
+// Bulk upload session (UPLOAD_BULK_BEGIN / _ENTRY / _DATA / _END)
+//
+// The manifest is resolved once: every directory it names is created in
+// one transaction and each file gets its blob path. Data then arrives
+// file after file with no reply per chunk; a finished blob waits under
+// its temp name and the `files` rows are inserted BULK_FLUSH_FILES at a
+// time (one INSERT, one transaction) and at UPLOAD_BULK_END. A file named
+// like a live file of its directory is not a new row: it becomes that
+// file's next version, as with UPLOAD_FILE.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int dir_id;
+    int parent_id;
+    char name[101];                 // directories.dir_name is VARCHAR(100)
+} BulkDir;
+
+typedef struct {
+    BulkDir *items;
+    int count;
+    int cap;
+} BulkDirList;
+
+// "%XX" escapes of a manifest path (the client escapes ' ', ',', '%' and
+// control bytes). 0, or -1 if malformed or too long.
+static int bulk_unescape(const char *in, char *out, size_t size) {
+    size_t n = 0;
+    for (const char *p = in; *p; p++) {
+        char c = *p;
+        if (c == '%') {
+            if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])) return -1;
+            char hex[3] = { p[1], p[2], '\0' };
+            c = (char)strtol(hex, NULL, 16);
+            p += 2;
+        }
+        if (c == '\0' || n + 1 >= size) return -1;
+        out[n++] = c;
     }
-    
-    log_send(idx, clients[idx].user_id, "%s", log_buf);
+    out[n] = '\0';
+    return 0;
 }
 
-void process_command(int idx, const char *line, int line_len) {
-    char buffer[BUFFER_SIZE];
-    int copy_len = (line_len < BUFFER_SIZE) ? line_len : (BUFFER_SIZE - 1);
-
-    memcpy(buffer, line, copy_len);
-    buffer[copy_len] = '\0';
+// One manifest entry "<size>:<sha256 hex|->:<path>". 0 or -1.
+static int bulk_parse_entry(char *entry, BulkFile *f) {
+    char *sep = strchr(entry, ':');
+    if (!sep) return -1;
+    *sep = '\0';
 
-    // Tạo log an toàn - ẩn password
-    char safe_log[BUFFER_SIZE];
-    strncpy(safe_log, buffer, sizeof(safe_log) - 1);
-    safe_log[sizeof(safe_log) - 1] = '\0';
+    char *end;
+    errno = 0;
+    long long size = strtoll(entry, &end, 10);
+    if (end == entry || *end != '\0' || size < 0 || errno != 0) return -1;
 
-    // Skip logging for internal VERIFY_TOKEN requests
-    int should_log = (strncasecmp(safe_log, "VERIFY_TOKEN ", 13) != 0);
+    char *sha = sep + 1;
+    sep = strchr(sha, ':');
+    if (!sep) return -1;
+    *sep = '\0';
 
-    if (should_log) {
-        // Nếu là LOGIN hoặc REGISTER, ẩn password
-        if (strncasecmp(safe_log, "LOGIN ", 6) == 0 || strncasecmp(safe_log, "REGISTER ", 9) == 0) {
-            char *first_space = strchr(safe_log, ' ');
-            if (first_space) {
-                char *second_space = strchr(first_space + 1, ' ');
-                if (second_space) {
-                    // Thay password bằng ***
-                    snprintf(second_space + 1, safe_log + sizeof(safe_log) - (second_space + 1), "***");
-                }
-            }
+    if (strcmp(sha, "-") == 0) {
+        f->sha256[0] = '\0';
+    } else {
+        if (strlen(sha) != SHA256_HEX_LEN - 1) return -1;
+        for (char *p = sha; *p; p++) {
+            if (!isxdigit((unsigned char)*p)) return -1;
+            *p = (char)tolower((unsigned char)*p);
         }
-        log_recv(idx, clients[idx].user_id, "%s", safe_log);
+        strcpy(f->sha256, sha);
     }
 
-    char response[BUFFER_SIZE];
-    char raw_line[BUFFER_SIZE];
-    memcpy(raw_line, buffer, copy_len);
-    raw_line[copy_len] = '\0';
-    trim_crlf(raw_line);
+    if (bulk_unescape(sep + 1, f->rel_path, sizeof(f->rel_path)) != 0 || !f->rel_path[0]) {
+        return -1;
+    }
+    f->size = size;
+    return 0;
+}
 
-    // ============================
-    // Parse command
-    // ============================
-    char *ptr = buffer;
-    char *cmd = next_token(&ptr);
+// Child directory `name` of parent_id: one that exists (in the tree or
+// created earlier by this manifest) or a new row inserted now, inside the
+// caller's transaction. Returns its id, -1 on error.
+static int bulk_child_dir(int group_id, int user_id, int parent_id, const char *name,
+                          BulkDirList *made) {
+    int parent_is_new = 0;
+    for (int i = 0; i < made->count; i++) {
+        const BulkDir *d = &made->items[i];
+        if (d->parent_id == parent_id && strcasecmp(d->name, name) == 0) return d->dir_id;
+        if (d->dir_id == parent_id) parent_is_new = 1;
+    }
 
-    if (!cmd) {
-        snprintf(response, sizeof(response), "ERR EMPTY_COMMAND\r\n");
-        send_response(idx, response);
-        return;
+    // A directory created by this manifest is not in the tree yet, and has
+    // no children other than the ones in made
+    if (!parent_is_new) {
+        int n = dir_tree_children(group_id, parent_id, NULL, 0);
+        if (n < 0) return -1;
+        if (n > 0) {
+            DirInfo *kids = malloc(sizeof(DirInfo) * n);
+            if (!kids) return -1;
+            n = dir_tree_children(group_id, parent_id, kids, n);
+            int found = 0;
+            for (int i = 0; i < n && !found; i++) {
+                if (strcasecmp(kids[i].name, name) == 0) found = kids[i].dir_id;
+            }
+            free(kids);
+            if (found) return found;
+        }
     }
 
-    // ============================
-    // 2️⃣ REGISTER username password
-    // ============================
-    if (strcasecmp(cmd, "REGISTER") == 0) {
-        char *username = next_token(&ptr);
-        char *password = next_token(&ptr);
+    char escaped[2 * sizeof(made->items[0].name) + 1];
+    mysql_real_escape_string(conn, escaped, name, strlen(name));
 
-        if (!username || !password) {
-            snprintf(response, sizeof(response), "400\r\n");
-            send_response(idx, response);
-            return;
-        }
+    char query[512];
+    snprintf(query, sizeof(query),
+             "INSERT INTO directories (dir_name, parent_dir_id, group_id, created_by) "
+             "VALUES ('%s', %d, %d, %d)",
+             escaped, parent_id, group_id, user_id);
+    if (mysql_query(conn, query) != 0) {
+        fprintf(stderr, "MySQL Error (bulk upload folder): %s\n", mysql_error(conn));
+        return -1;
+    }
+    int dir_id = (int)mysql_insert_id(conn);
 
-        char resp[256];
-        int user_id = handle_register(username, password, resp, sizeof(resp));
-        
-        if (user_id > 0) {
-            clients[idx].user_id = user_id;
-            log_info(idx, user_id, "User registered: username=%s", username);
-        }
+    AggTotals added = { 0, 0, 1 };
+    if (agg_apply(group_id, parent_id, &added, 1) != 0) return -1;
 
-        snprintf(response, sizeof(response), "%s\r\n", resp);
-        send_response(idx, response);
-        return;
+    if (made->count == made->cap) {
+        int cap = made->cap ? made->cap * 2 : 16;
+        BulkDir *grown = realloc(made->items, sizeof(BulkDir) * cap);
+        if (!grown) return -1;
+        made->items = grown;
+        made->cap = cap;
     }
+    BulkDir *d = &made->items[made->count++];
+    d->dir_id = dir_id;
+    d->parent_id = parent_id;
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    return dir_id;
+}
 
-    // ============================
+// Directory of one manifest path below base_id, created where missing.
+// Returns its id, 0 if the path is unusable ("..", name too long), -1 on
+// error.
+static int bulk_resolve_dir(int group_id, int user_id, int base_id, const char *dir_part,
+                            BulkDirList *made) {
+    char buf[BULK_PATH_LEN];
+    snprintf(buf, sizeof(buf), "%s", dir_part);
+
+    int dir_id = base_id;
+    char *save = NULL;
+    for (char *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        if (strcmp(comp, ".") == 0) continue;
+        if (strcmp(comp, "..") == 0 || strlen(comp) >= sizeof(made->items[0].name)) return 0;
+
+        dir_id = bulk_child_dir(group_id, user_id, dir_id, comp, made);
+        if (dir_id < 0) return -1;
+    }
+    return dir_id;
+}
+
+// Manifest complete: create the directories it names (one transaction)
+// and give every file its directory, name and blob path. A file named
+// like a live file of its directory is marked to replace it, as
+// UPLOAD_FILE does. Files whose path is unusable get 400. Returns the
+// number of directories created, -1 on error.
+static int bulk_resolve_manifest(BulkUpload *b) {
+    BulkDirList made = { NULL, 0, 0 };
+    char last_dir[BULK_PATH_LEN] = "";
+    int last_dir_id = b->dir_id;
+    char dir_path[PATH_MAX] = "";
+
+    if (db_begin() != 0) return -1;
+
+    for (int i = 0; i < b->file_count; i++) {
+        BulkFile *f = &b->files[i];
+        char *slash = strrchr(f->rel_path, '/');
+        const char *name = slash ? slash + 1 : f->rel_path;
+        if (!name[0]) {
+            f->status = 400;
+            continue;
+        }
+
+        // Manifests list a directory's files together: resolve each run once
+        char dir_part[BULK_PATH_LEN] = "";
+        if (slash) {
+            snprintf(dir_part, sizeof(dir_part), "%.*s", (int)(slash - f->rel_path), f->rel_path);
+        }
+        if (!dir_path[0] || strcmp(dir_part, last_dir) != 0) {
+            int dir_id = bulk_resolve_dir(b->group_id, b->user_id, b->dir_id, dir_part, &made);
+            if (dir_id < 0) goto fail;
+            if (dir_id == 0) {
+                f->status = 400;
+                continue;
+            }
+            if (prepare_storage_directory(b->group_id, dir_id, dir_path, sizeof(dir_path)) != 0) {
+                goto fail;
+            }
+            strcpy(last_dir, dir_part);
+            last_dir_id = dir_id;
+        }
+
+        sanitize_filename(name, f->name, MAX_FILENAME_LEN);
+        int written = snprintf(f->path, sizeof(f->path), "%s/%s", dir_path, f->name);
+        if (written <= 0 || written >= (int)sizeof(f->path)) {
+            f->path[0] = '\0';
+            f->status = 400;
+            continue;
+        }
+        // Thư mục đã có file cùng tên: nội dung mới thành phiên bản mới của file đó
+        FileHead head;
+        f->replaces = version_find_head(last_dir_id, f->name, &head);
+        if (f->replaces < 0) goto fail;
+        // Blob mà một file / phiên bản khác còn dùng thì không ghi đè
+        // (file thay nội dung chỉ dùng tên này cho file tạm)
+        if (version_free_path(f->path, f->path, sizeof(f->path)) != 0) goto fail;
+        f->dir_id = last_dir_id;
+    }
+
+    if (db_commit() != 0) goto fail;
+
+    // Parents were created before their children
+    for (int i = 0; i < made.count; i++) {
+        dir_tree_added(b->group_id, made.items[i].dir_id, made.items[i].parent_id,
+                       made.items[i].name);
+        event_bus_publish_group(EVENT_DIR_CHANGED, b->group_id, made.items[i].parent_id);
+    }
+    int created = made.count;
+    free(made.items);
+    return created;
+
+fail:
+    db_rollback();
+    free(made.items);
+    return -1;
+}
+
+// Same blob path, then manifest order
+static int bulk_path_cmp(const void *a, const void *b) {
+    const BulkFile *fa = *(const BulkFile *const *)a;
+    const BulkFile *fb = *(const BulkFile *const *)b;
+    int c = strcmp(fa->path, fb->path);
+    if (c != 0) return c;
+    return (fa > fb) - (fa < fb);
+}
+
+// Two entries naming the same blob: every one after the first gets 409
+static void bulk_refuse_duplicates(BulkUpload *b) {
+    BulkFile **sorted = malloc(sizeof(BulkFile *) * b->file_count);
+    if (!sorted) return;
+
+    int n = 0;
+    for (int i = 0; i < b->file_count; i++) {
+        if (b->files[i].status == 0) sorted[n++] = &b->files[i];
+    }
+    qsort(sorted, n, sizeof(sorted[0]), bulk_path_cmp);
+    for (int i = 1; i < n; i++) {
+        if (strcmp(sorted[i - 1]->path, sorted[i]->path) == 0) {
+            sorted[i]->status = 409;
+        }
+    }
+    free(sorted);
+}
+
+// Empty files get no data lines: stored as soon as the manifest is resolved
+static void bulk_store_empty(BulkUpload *b, BulkFile *f) {
+    EVP_MD_CTX *sha = NULL;
+    char sha_hex[SHA256_HEX_LEN];
+    if (transfer_hash_start(&sha) != 0 || transfer_hash_hex(&sha, sha_hex) != 0) {
+        f->status = 500;
+        return;
+    }
+    if (f->sha256[0] && strcmp(f->sha256, sha_hex) != 0) {
+        f->status = 400;
+        return;
+    }
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", f->path, TMP_SUFFIX);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        f->status = 500;
+        return;
+    }
+    close(fd);
+
+    strcpy(f->sha256, sha_hex);
+    f->status = 202;
+    b->stored++;
+}
+
+// Drop the file whose data was arriving, with its partial blob
+static void bulk_fail_current(int idx, BulkUpload *b, int status) {
+    BulkFile *f = &b->files[b->current];
+    transfer_reset_upload(idx);
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", f->path, TMP_SUFFIX);
+    unlink(temp_path);
+
+    f->status = status;
+    b->current = -1;
+}
+
+// File i failed: if its data was arriving, drop that too
+static void bulk_fail_file(int idx, BulkUpload *b, int i, int status) {
+    if (i == b->current) {
+        bulk_fail_current(idx, b, status);
+    } else {
+        b->files[i].status = status;
+    }
+}
+
+// First chunk of file i: open its temp blob, compressed at rest when the
+// client compresses its chunks. 0 or -1.
+static int bulk_start_file(int idx, BulkUpload *b, int i, int codec) {
+    UploadState *up = &upload_states[idx];
+    BulkFile *f = &b->files[i];
+
+    transfer_reset_upload(idx);
+    b->current = i;
+    up->active = 1;
+    up->next_chunk = 1;
+    snprintf(up->temp_path, sizeof(up->temp_path), "%s%s", f->path, TMP_SUFFIX);
+    if (transfer_hash_start(&up->sha) != 0) return -1;
+
+    if (COMPRESS_AT_REST && codec != CODEC_NONE) {
+        if (frame_writer_open(&up->writer, up->temp_path, (CodecType)codec) != 0) return -1;
+        up->at_rest = 1;
+        f->at_rest = 1;
+    }
+    return 0;
+}
+
+// Last byte of the current file arrived: seal its blob under the temp
+// name and check it against the manifest. 0, or -1 if the file failed.
+static int bulk_finish_file(int idx, BulkUpload *b) {
+    UploadState *up = &upload_states[idx];
+    BulkFile *f = &b->files[b->current];
+
+    char sha_hex[SHA256_HEX_LEN] = "";
+    if (!up->sha || transfer_hash_hex(&up->sha, sha_hex) != 0) {
+        bulk_fail_current(idx, b, 500);
+        return -1;
+    }
+    if (f->sha256[0] && strcmp(f->sha256, sha_hex) != 0) {
+        bulk_fail_current(idx, b, 400);
+        return -1;
+    }
+    if (up->at_rest) {
+        if (frame_writer_finish(&up->writer) != 0) {
+            bulk_fail_current(idx, b, 500);
+            return -1;
+        }
+        up->at_rest = 0;
+    }
+    transfer_reset_upload(idx);
+
+    strcpy(f->sha256, sha_hex);
+    f->status = 202;
+    b->stored++;
+    b->current = -1;
+    return 0;
+}
+
+// Stored file replacing head: archive head's content as a version and
+// give the row the new blob (storage/versions.h), in a transaction of
+// its own. 200, or 500 with the temp blob removed
+static int bulk_commit_version(int idx, BulkUpload *b, BulkFile *f, const FileHead *head) {
+    char temp_path[PATH_MAX];
+    char dir_path[BULK_PATH_LEN];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", f->path, TMP_SUFFIX);
+    snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(strrchr(f->path, '/') - f->path), f->path);
+
+    pack_small_blob(temp_path, f->at_rest, (long)f->size, &f->pack);
+    VersionContent content = { f->pack.segment > 0 ? NULL : temp_path, f->at_rest, NULL,
+                               f->pack, f->size, f->sha256, b->user_id };
+    int archived = version_replace_content(head, dir_path, &content);
+    if (archived < 0) {
+        log_error(idx, b->user_id, "UPLOAD_BULK: ghi phiên bản mới của %s thất bại", f->name);
+        return 500;
+    }
+
+    // Bản cũ có thể của người upload khác: đọc lại dung lượng user khi cần
+    quota_charge(0, b->group_id, f->size - head->size);
+    quota_invalidate_users();
+    quota_shrink(idx, f->size);
+    journal_log(b->user_id, b->group_id, "upload_file %s (version %d)", f->name, archived + 1);
+    dir_tree_touch(b->group_id, f->dir_id);
+    event_bus_publish_group(EVENT_DIR_CHANGED, b->group_id, f->dir_id);
+    return 200;
+}
+
+// Commit every stored file of the session. Files replacing a live file
+// become its next version one by one; for the others blobs move to their
+// final name, then one multi-row INSERT plus the aggregates of the
+// directories involved go in a single transaction. Files that fail get 500.
+static void bulk_flush(int idx, BulkUpload *b) {
+    if (b->stored == 0) return;
+
+    BulkFile **batch = malloc(sizeof(BulkFile *) * b->stored);
+    size_t cap = 256 + (size_t)b->stored * (2 * BULK_NAME_LEN + 2 * BULK_PATH_LEN + 160);
+    char *query = malloc(cap);
+    struct { int dir_id; AggTotals t; } *dirs = malloc(sizeof(*dirs) * b->stored);
+    if (!batch || !query || !dirs) {
+        free(batch);
+        free(query);
+        free(dirs);
+        return;                     // retried at the next flush
+    }
+
+    int n = 0;
+    for (int i = 0; i < b->file_count; i++) {
+        BulkFile *f = &b->files[i];
+        if (f->status != 202) continue;
+        b->stored--;
+
+        char temp_path[PATH_MAX];
+        snprintf(temp_path, sizeof(temp_path), "%s%s", f->path, TMP_SUFFIX);
+
+        // The file it replaces may have gone since the manifest: then it is a new row
+        if (f->replaces) {
+            FileHead head;
+            f->replaces = version_find_head(f->dir_id, f->name, &head);
+            if (f->replaces != 0) {
+                if (f->replaces > 0) {
+                    f->status = bulk_commit_version(idx, b, f, &head);
+                } else {
+                    unlink(temp_path);
+                    frame_store_drop_index(temp_path);
+                    f->status = 500;
+                }
+                continue;
+            }
+        }
+
+        int rc;
+        if (pack_small_blob(temp_path, f->at_rest, (long)f->size, &f->pack)) {
+            rc = 0;
+        } else if (f->at_rest) {
+            rc = frame_store_commit(temp_path, f->path);
+        } else {
+            rc = rename(temp_path, f->path);
+            // an older blob of the same name may have been stored compressed
+            if (rc == 0) frame_store_drop_index(f->path);
+        }
+        if (rc != 0) {
+            log_error(idx, b->user_id, "UPLOAD_BULK: không đổi tên được %s", temp_path);
+            unlink(temp_path);
+            f->status = 500;
+            continue;
+        }
+        batch[n++] = f;
+    }
+
+    int len = snprintf(query, cap,
+                       "INSERT INTO files (file_name, file_path, file_size, dir_id, group_id, "
+                       "uploaded_by, content_sha256, pack_segment, pack_offset) VALUES ");
+    int dir_count = 0;
+    long long bytes = 0;
+    for (int k = 0; k < n; k++) {
+        const BulkFile *f = batch[k];
+
+        char escaped_name[2 * BULK_NAME_LEN + 1];
+        char escaped_path[2 * BULK_PATH_LEN + 1];
+        mysql_real_escape_string(conn, escaped_name, f->name, strlen(f->name));
+        mysql_real_escape_string(conn, escaped_path, f->path, strlen(f->path));
+        char pack_cols[48] = "NULL,NULL";
+        if (f->pack.segment > 0) {
+            snprintf(pack_cols, sizeof(pack_cols), "%d,%llu",
+                     f->pack.segment, (unsigned long long)f->pack.offset);
+        }
+        len += snprintf(query + len, cap - len, "%s('%s','%s',%lld,%d,%d,%d,'%s',%s)",
+                        k ? "," : "", escaped_name, escaped_path, f->size,
+                        f->dir_id, b->group_id, b->user_id, f->sha256, pack_cols);
+
+        int d = 0;
+        while (d < dir_count && dirs[d].dir_id != f->dir_id) d++;
+        if (d == dir_count) {
+            dirs[dir_count].dir_id = f->dir_id;
+            dirs[dir_count].t = (AggTotals){ 0, 0, 0 };
+            dir_count++;
+        }
+        dirs[d].t.bytes += f->size;
+        dirs[d].t.files++;
+        bytes += f->size;
+    }
+
+    int ok = n > 0 && db_begin() == 0 && mysql_query(conn, query) == 0;
+    for (int d = 0; ok && d < dir_count; d++) {
+        ok = agg_apply(b->group_id, dirs[d].dir_id, &dirs[d].t, 1) == 0;
+    }
+    if (ok) ok = db_commit() == 0;
+
+    if (!ok && n > 0) {
+        db_rollback();
+        log_error(idx, b->user_id, "UPLOAD_BULK: ghi metadata %d file vào DB thất bại", n);
+
+        // The blobs already sit under their final names with no row to
+        // point at them, and GC only reclaims blobs of deleted rows:
+        // remove them now. Packed bytes have no row either, so compaction
+        // counts them as dead space.
+        for (int k = 0; k < n; k++) {
+            if (batch[k]->pack.segment > 0) continue;
+            unlink(batch[k]->path);
+            frame_store_drop_index(batch[k]->path);
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        batch[k]->status = ok ? 200 : 500;
+        if (ok) {
+            journal_log(b->user_id, b->group_id, "upload_file %s", batch[k]->name);
+        }
+    }
+    if (ok) {
+        quota_charge(b->user_id, b->group_id, bytes);
+        quota_shrink(idx, bytes);
+        for (int d = 0; d < dir_count; d++) {
+            dir_tree_touch(b->group_id, dirs[d].dir_id);
+            event_bus_publish_group(EVENT_DIR_CHANGED, b->group_id, dirs[d].dir_id);
+        }
+    }
+
+    free(batch);
+    free(query);
+    free(dirs);
+}
+
+// Hàm tách token an toàn
+static char *next_token(char **ptr) {
+    char *tok = strtok(*ptr, " \r\n");
+    *ptr = NULL;  // để gọi tiếp strtok(NULL, ...)
+    return tok;
+}
+// Helper function: Send response and log
+static void send_response(int idx, const char *response) {
+    enqueue_send(idx, response, strlen(response));
+    
+    // Create a copy for logging (without \r\n)
+    // For long responses, log first 2000 chars with "..." indicator
+    char log_buf[2048];
+    size_t len = strlen(response);
+    size_t max_log = sizeof(log_buf) - 10;  // Reserve space for "..." and null
+    
+    if (len > max_log) {
+        memcpy(log_buf, response, max_log);
+        strcpy(log_buf + max_log, "...");
+        len = max_log + 3;
+    } else {
+        memcpy(log_buf, response, len);
+    }
+    log_buf[len] = '\0';
+    
+    // Remove trailing \r\n for cleaner logging
+    char *end = log_buf + len - 1;
+    while (end >= log_buf && (*end == '\r' || *end == '\n')) {
+        *end = '\0';
+        end--;
+    }
+    
+    log_send(idx, clients[idx].user_id, "%s", log_buf);
+}
+
+// RESTORE_VERSION of a delta version, waiting for the versions thread
+// to rebuild it (the connection is CONN_WAITING meanwhile)
+typedef struct {
+    int file_id;
+    int version_no;
+    int user_id;
+    long long size;
+    char sha256[SHA256_HEX_LEN];
+    char dir_path[PATH_MAX];
+    char temp_path[PATH_MAX];
+} PendingRestore;
+
+static PendingRestore pending_restores[MAX_CLIENTS];
+
+// The version's content becomes the file's: reply "200 current_no"
+static void restore_commit(int idx, const FileHead *head, const char *dir_path,
+                           const VersionContent *content, int version_no) {
+    char response[64];
+    int archived = version_replace_content(head, dir_path, content);
+    if (archived < 0) {
+        snprintf(response, sizeof(response), "500\r\n");
+        send_response(idx, response);
+        return;
+    }
+    quota_charge(0, head->group_id, content->size - head->size);
+    quota_invalidate_users();
+    dir_tree_touch(head->group_id, head->dir_id);
+    event_bus_publish_group(EVENT_DIR_CHANGED, head->group_id, head->dir_id);
+
+    journal_log(content->user_id, head->group_id, "restore_version %d %d", head->file_id, version_no);
+    snprintf(response, sizeof(response), "200 %d\r\n", archived + 1);
+    send_response(idx, response);
+}
+
+// version_poll(): idx's delta version is rebuilt at its temp path (rc 0)
+static void restore_rebuilt(int idx, int rc) {
+    PendingRestore *r = &pending_restores[idx];
+    clients[idx].state = CONN_READING;
+
+    // The file may have changed while it was rebuilt: replace what it is now
+    FileHead head;
+    int found = (rc == 0) ? version_load_head(r->file_id, &head) : -1;
+    if (found <= 0) {
+        if (rc == 0) unlink(r->temp_path);
+        log_error(idx, r->user_id, "RESTORE_VERSION: không dựng lại được phiên bản %d của file %d",
+                  r->version_no, r->file_id);
+        send_response(idx, found == 0 ? "404\r\n" : "500\r\n");
+    } else {
+        VersionContent content = { NULL, 0, NULL, { 0, 0 }, r->size, r->sha256, r->user_id };
+        if (!pack_small_blob(r->temp_path, 0, (long)r->size, &content.pack)) {
+            content.temp_path = r->temp_path;
+        }
+        restore_commit(idx, &head, r->dir_path, &content, r->version_no);
+    }
+    conn_update_state(idx);
+}
+
+static void run_command(int idx, const char *line, int line_len, Arena *arena) {
+    // Bộ đệm tạm của lệnh nằm trong arena, giải phóng khi lệnh xử lý xong
+    char *buffer = (char *)arena_alloc(arena, BUFFER_SIZE);
+    char *safe_log = (char *)arena_alloc(arena, BUFFER_SIZE);
+    char *response = (char *)arena_alloc(arena, RESPONSE_SIZE);
+    char *raw_line = (char *)arena_alloc(arena, BUFFER_SIZE);
+    if (!buffer || !safe_log || !response || !raw_line) {
+        log_error(idx, clients[idx].user_id, "Out of memory handling command");
+        const char *err = "500\r\n";
+        enqueue_send(idx, err, strlen(err));
+        return;
+    }
+
+    int copy_len = (line_len < BUFFER_SIZE) ? line_len : (BUFFER_SIZE - 1);
+
+    memcpy(buffer, line, copy_len);
+    buffer[copy_len] = '\0';
+
+    // Tạo log an toàn - ẩn password
+    strncpy(safe_log, buffer, BUFFER_SIZE - 1);
+    safe_log[BUFFER_SIZE - 1] = '\0';
+
+    // Skip logging for internal VERIFY_TOKEN requests
+    int should_log = (strncasecmp(safe_log, "VERIFY_TOKEN ", 13) != 0);
+
+    if (should_log) {
+        // Nếu là LOGIN hoặc REGISTER, ẩn password
+        if (strncasecmp(safe_log, "LOGIN ", 6) == 0 || strncasecmp(safe_log, "REGISTER ", 9) == 0) {
+            char *first_space = strchr(safe_log, ' ');
+            if (first_space) {
+                char *second_space = strchr(first_space + 1, ' ');
+                if (second_space) {
+                    // Thay password bằng ***
+                    snprintf(second_space + 1, safe_log + BUFFER_SIZE - (second_space + 1), "***");
+                }
+            }
+        }
+        log_recv(idx, clients[idx].user_id, "%s", safe_log);
+    }
+
+    memcpy(raw_line, buffer, copy_len);
+    raw_line[copy_len] = '\0';
+    trim_crlf(raw_line);
+
+    // ============================
+    // Parse command
+    // ============================
+    char *ptr = buffer;
+    char *cmd = next_token(&ptr);
+
+    if (!cmd) {
+        snprintf(response, RESPONSE_SIZE, "ERR EMPTY_COMMAND\r\n");
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
+    // 2️⃣ REGISTER username password
+    // ============================
+    if (strcasecmp(cmd, "REGISTER") == 0) {
+        char *username = next_token(&ptr);
+        char *password = next_token(&ptr);
+
+        if (!username || !password) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char resp[256];
+        int user_id = handle_register(username, password, resp, sizeof(resp));
+        
+        if (user_id > 0) {
+            clients[idx].user_id = user_id;
+            log_info(idx, user_id, "User registered: username=%s", username);
+        }
+
+        snprintf(response, RESPONSE_SIZE, "%s\r\n", resp);
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
     // 3️⃣ LOGIN username password
     // ============================
     if (strcasecmp(cmd, "LOGIN") == 0) {
@@ -651,7 +1605,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *password = next_token(&ptr);
 
         if (!username || !password) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -664,7 +1618,7 @@ void process_command(int idx, const char *line, int line_len) {
             log_info(idx, user_id, "User authenticated: username=%s", username);
         }
 
-        snprintf(response, sizeof(response), "%s\r\n", resp);
+        snprintf(response, RESPONSE_SIZE, "%s\r\n", resp);
         send_response(idx, response);
         return;
     }
@@ -676,7 +1630,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *token = next_token(&ptr);
 
         if (!token) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             enqueue_send(idx, response, strlen(response));
             return;
         }
@@ -686,9 +1640,9 @@ void process_command(int idx, const char *line, int line_len) {
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
 
         if (user_id > 0) {
-            snprintf(response, sizeof(response), "200\r\n");  // Token hợp lệ
+            snprintf(response, RESPONSE_SIZE, "200\r\n");  // Token hợp lệ
         } else {
-            snprintf(response, sizeof(response), "401\r\n");  // Token không hợp lệ hoặc hết hạn
+            snprintf(response, RESPONSE_SIZE, "401\r\n");  // Token không hợp lệ hoặc hết hạn
         }
 
         // Không log VERIFY_TOKEN response vì đây là internal check
@@ -696,6 +1650,35 @@ void process_command(int idx, const char *line, int line_len) {
         return;
     }
 
+    // ============================
+    // HELLO codecs=zstd,lz4
+    // Thương lượng codec nén lúc mở phiên; mỗi lần upload/download
+    // sau đó chọn một codec trong tập này (hoặc gửi thô)
+    // ============================
+    if (strcasecmp(cmd, "HELLO") == 0) {
+        int mask = 0;
+        char *opt;
+        while ((opt = next_token(&ptr))) {
+            if (strncasecmp(opt, "codecs=", 7) == 0) {
+                mask = codec_parse_list(opt + 7);
+            }
+        }
+
+        clients[idx].codec_mask = mask;
+
+        char list[64] = "";
+        for (int c = CODEC_ZSTD; c > CODEC_NONE; c--) {
+            if (mask & CODEC_MASK(c)) {
+                if (list[0]) strcat(list, ",");
+                strcat(list, codec_name((CodecType)c));
+            }
+        }
+
+        snprintf(response, RESPONSE_SIZE, "200 codecs=%s\r\n", list[0] ? list : "none");
+        send_response(idx, response);
+        return;
+    }
+
     // ============================
     // 5️⃣ LOGOUT token
     // ============================
@@ -703,7 +1686,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *token = next_token(&ptr);
 
         if (!token) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -719,11 +1702,11 @@ void process_command(int idx, const char *line, int line_len) {
                  escaped_token);
 
         if (mysql_query(conn, query) == 0 && mysql_affected_rows(conn) > 0) {
-            snprintf(response, sizeof(response), "200\r\n");
+            snprintf(response, RESPONSE_SIZE, "200\r\n");
             log_info(idx, old_user_id, "User logged out");
             clients[idx].user_id = 0;  // Clear user_id
         } else {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             log_error(idx, old_user_id, "Logout failed");
         }
 
@@ -742,7 +1725,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (!parse_create_group_args(raw_line, token, sizeof(token),
                                      group_name, sizeof(group_name),
                                      description, sizeof(description))) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -750,12 +1733,12 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -773,9 +1756,9 @@ void process_command(int idx, const char *line, int line_len) {
         if (mysql_query(conn, query) != 0) {
             unsigned int errnum = mysql_errno(conn);
             if (errnum == 1062) {
-                snprintf(response, sizeof(response), "409\r\n");
+                snprintf(response, RESPONSE_SIZE, "409\r\n");
             } else {
-                snprintf(response, sizeof(response), "500\r\n");
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
             }
             send_response(idx, response);
             return;
@@ -794,9 +1777,10 @@ void process_command(int idx, const char *line, int line_len) {
         } while (mysql_next_result(conn) == 0);
 
         if (new_group_id > 0) {
-            snprintf(response, sizeof(response), "200 %d\r\n", new_group_id);
+            journal_log(user_id, new_group_id, "create_group");
+            snprintf(response, RESPONSE_SIZE, "200 %d\r\n", new_group_id);
         } else {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
         }
 
         send_response(idx, response);
@@ -809,7 +1793,7 @@ void process_command(int idx, const char *line, int line_len) {
     if (strcasecmp(cmd, "LIST_GROUPS_JOINED") == 0) {
         char *token = next_token(&ptr);
         if (!token) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -817,12 +1801,12 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -831,7 +1815,7 @@ void process_command(int idx, const char *line, int line_len) {
         snprintf(query, sizeof(query), "CALL get_user_groups(%d)", user_id);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -875,7 +1859,7 @@ void process_command(int idx, const char *line, int line_len) {
             mysql_free_result(res);
         } while (mysql_next_result(conn) == 0);
 
-        snprintf(response, sizeof(response), "200 %d\r\n%s", group_count, groups_buffer);
+        snprintf(response, RESPONSE_SIZE, "200 %d\r\n%s", group_count, groups_buffer);
         send_response(idx, response);
         return;
     }
@@ -888,7 +1872,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *group_id_str = next_token(&ptr);
 
         if (!token || !group_id_str) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -897,19 +1881,19 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
 
         int group_id = atoi(group_id_str);
         if (group_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -921,7 +1905,7 @@ void process_command(int idx, const char *line, int line_len) {
                  user_id, group_id);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -936,14 +1920,14 @@ void process_command(int idx, const char *line, int line_len) {
 
         // Lấy result_code
         if (mysql_query(conn, "SELECT @result_code") != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -955,8 +1939,12 @@ void process_command(int idx, const char *line, int line_len) {
         }
         mysql_free_result(res);
 
+        if (result_code == 200) {
+            event_bus_publish_group(EVENT_JOIN_REQUEST, group_id, 0);
+        }
+
         // Trả về response theo mã trạng thái
-        snprintf(response, sizeof(response), "%d\r\n",
+        snprintf(response, RESPONSE_SIZE, "%d\r\n",
                  result_code);
         send_response(idx, response);
         return;
@@ -970,7 +1958,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *group_id_str = next_token(&ptr);
 
         if (!token || !group_id_str) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -979,19 +1967,19 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
 
         int group_id = atoi(group_id_str);
         if (group_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1003,7 +1991,7 @@ void process_command(int idx, const char *line, int line_len) {
                  user_id, group_id);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1018,14 +2006,14 @@ void process_command(int idx, const char *line, int line_len) {
 
         // Lấy result_code
         if (mysql_query(conn, "SELECT @result_code") != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res2 = mysql_store_result(conn);
         if (!res2) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1038,7 +2026,7 @@ void process_command(int idx, const char *line, int line_len) {
         mysql_free_result(res2);
 
         // Trả về response theo mã trạng thái
-        snprintf(response, sizeof(response), "%d CHECK_ADMIN %s\r\n",
+        snprintf(response, RESPONSE_SIZE, "%d CHECK_ADMIN %s\r\n",
                  result_code2, group_id_str);
                  send_response(idx, response);
         return;
@@ -1051,7 +2039,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *option = next_token(&ptr);
 
         if (!token || !request_id_str || !option) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1060,26 +2048,26 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
 
         int request_id = atoi(request_id_str);
         if (request_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         // Kiểm tra option hợp lệ
         if (strcasecmp(option, "accepted") != 0 && strcasecmp(option, "rejected") != 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1095,7 +2083,7 @@ void process_command(int idx, const char *line, int line_len) {
                  user_id, request_id, escaped_option);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1110,14 +2098,14 @@ void process_command(int idx, const char *line, int line_len) {
 
         // Lấy result_code
         if (mysql_query(conn, "SELECT @result_code") != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res3 = mysql_store_result(conn);
         if (!res3) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1129,8 +2117,28 @@ void process_command(int idx, const char *line, int line_len) {
         }
         mysql_free_result(res3);
 
+        // Báo cho người gửi yêu cầu và các thành viên đang theo dõi nhóm
+        if (result_code3 == 200) {
+            snprintf(query, sizeof(query),
+                     "SELECT user_id, group_id FROM group_requests WHERE request_id=%d",
+                     request_id);
+            if (mysql_query(conn, query) == 0) {
+                MYSQL_RES *req = mysql_store_result(conn);
+                MYSQL_ROW req_row = req ? mysql_fetch_row(req) : NULL;
+                if (req_row) {
+                    int req_user_id = atoi(req_row[0]);
+                    int req_group_id = atoi(req_row[1]);
+                    event_bus_publish_user(EVENT_REQUEST_HANDLED, req_user_id, req_group_id);
+                    if (strcasecmp(option, "accepted") == 0) {
+                        event_bus_publish_group(EVENT_MEMBERS_CHANGED, req_group_id, 0);
+                    }
+                }
+                if (req) mysql_free_result(req);
+            }
+        }
+
         // Trả về response theo mã trạng thái
-        snprintf(response, sizeof(response), "%d\r\n",
+        snprintf(response, RESPONSE_SIZE, "%d\r\n",
                  result_code3);
         send_response(idx, response);
         return;
@@ -1142,7 +2150,7 @@ void process_command(int idx, const char *line, int line_len) {
     if (strcasecmp(cmd, "LIST_GROUPS_NOT_JOINED") == 0) {
         char *token = next_token(&ptr);
         if (!token) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1150,12 +2158,12 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -1164,7 +2172,7 @@ void process_command(int idx, const char *line, int line_len) {
         snprintf(query, sizeof(query), "CALL get_groups_not_joined(%d)", user_id);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1207,7 +2215,7 @@ void process_command(int idx, const char *line, int line_len) {
             mysql_free_result(res);
         } while (mysql_next_result(conn) == 0);
 
-        snprintf(response, sizeof(response), "200 %d\r\n%s", group_count, groups_buffer);
+        snprintf(response, RESPONSE_SIZE, "200 %d\r\n%s", group_count, groups_buffer);
         send_response(idx, response);
         return;
     }
@@ -1216,7 +2224,7 @@ void process_command(int idx, const char *line, int line_len) {
     if (strcasecmp(cmd, "GET_PENDING_REQUESTS") == 0) {
         char *token = next_token(&ptr);
         if (!token) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1224,12 +2232,12 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -1238,7 +2246,7 @@ void process_command(int idx, const char *line, int line_len) {
         snprintf(query, sizeof(query), "CALL get_pending_requests_for_admin(%d)", user_id);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1282,7 +2290,7 @@ void process_command(int idx, const char *line, int line_len) {
             mysql_free_result(res);
         } while (mysql_next_result(conn) == 0);
 
-        snprintf(response, sizeof(response), "200 %d\r\n%s", request_count, requests_buffer);
+        snprintf(response, RESPONSE_SIZE, "200 %d\r\n%s", request_count, requests_buffer);
         send_response(idx, response);
         return;
     }
@@ -1296,7 +2304,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *invited_user_id_str = next_token(&ptr);
 
         if (!token || !group_id_str || !invited_user_id_str) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1305,12 +2313,12 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int admin_user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (admin_user_id < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (admin_user_id == 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -1319,7 +2327,7 @@ void process_command(int idx, const char *line, int line_len) {
         int invited_user_id = atoi(invited_user_id_str);
 
         if (group_id <= 0 || invited_user_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1331,14 +2339,14 @@ void process_command(int idx, const char *line, int line_len) {
                  admin_user_id, group_id);
 
         if (mysql_query(conn, check_query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *check_res = mysql_store_result(conn);
         if (!check_res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1347,7 +2355,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (!check_row) {
             // User không thuộc nhóm
             mysql_free_result(check_res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -1356,7 +2364,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (strcmp(role, "admin") != 0) {
             // User không phải admin
             mysql_free_result(check_res);
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -1368,7 +2376,7 @@ void process_command(int idx, const char *line, int line_len) {
                  invited_user_id);
 
         if (mysql_query(conn, check_query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1376,7 +2384,7 @@ void process_command(int idx, const char *line, int line_len) {
         check_res = mysql_store_result(conn);
         if (!check_res || mysql_num_rows(check_res) == 0) {
             if (check_res) mysql_free_result(check_res);
-            snprintf(response, sizeof(response), "404\r\n"); // User không tồn tại
+            snprintf(response, RESPONSE_SIZE, "404\r\n"); // User không tồn tại
             send_response(idx, response);
             return;
         }
@@ -1388,7 +2396,7 @@ void process_command(int idx, const char *line, int line_len) {
                  invited_user_id, group_id);
 
         if (mysql_query(conn, check_query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1397,7 +2405,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (check_res && mysql_num_rows(check_res) > 0) {
             // Đã là thành viên
             mysql_free_result(check_res);
-            snprintf(response, sizeof(response), "409\r\n");
+            snprintf(response, RESPONSE_SIZE, "409\r\n");
             send_response(idx, response);
             return;
         }
@@ -1410,7 +2418,7 @@ void process_command(int idx, const char *line, int line_len) {
                  invited_user_id, group_id);
 
         if (mysql_query(conn, check_query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1419,7 +2427,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (check_res && mysql_num_rows(check_res) > 0) {
             // Đã gửi lời mời trước đó
             mysql_free_result(check_res);
-            snprintf(response, sizeof(response), "423\r\n");
+            snprintf(response, RESPONSE_SIZE, "423\r\n");
             send_response(idx, response);
             return;
         }
@@ -1433,13 +2441,15 @@ void process_command(int idx, const char *line, int line_len) {
                  invited_user_id, group_id);
 
         if (mysql_query(conn, insert_query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         // Thành công
-        snprintf(response, sizeof(response), "200\r\n");
+        journal_log(admin_user_id, group_id, "invite_user %d", invited_user_id);
+        event_bus_publish_user(EVENT_INVITATION, invited_user_id, group_id);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
@@ -1451,7 +2461,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *username = next_token(&ptr);
 
         if (!username) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1466,7 +2476,7 @@ void process_command(int idx, const char *line, int line_len) {
                  escaped_username);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1474,7 +2484,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n"); // Username không tồn tại
+            snprintf(response, RESPONSE_SIZE, "404\r\n"); // Username không tồn tại
             send_response(idx, response);
             return;
         }
@@ -1484,7 +2494,7 @@ void process_command(int idx, const char *line, int line_len) {
         mysql_free_result(res);
 
         // Trả về user_id
-        snprintf(response, sizeof(response), "200 %d\r\n", user_id);
+        snprintf(response, RESPONSE_SIZE, "200 %d\r\n", user_id);
         send_response(idx, response);
         return;
     }
@@ -1496,7 +2506,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *token = next_token(&ptr);
 
         if (!token) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1505,7 +2515,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int requester_user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (requester_user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -1523,14 +2533,14 @@ void process_command(int idx, const char *line, int line_len) {
 
         if (mysql_query(conn, query) != 0) {
             fprintf(stderr, "MySQL Error: %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1566,7 +2576,7 @@ void process_command(int idx, const char *line, int line_len) {
         mysql_free_result(res);
 
         // Format: "200 [invitation_1] [invitation_2] ... <CRLF>"
-        snprintf(response, sizeof(response), "200 %s\r\n", invitations_str);
+        snprintf(response, RESPONSE_SIZE, "200 %s\r\n", invitations_str);
         send_response(idx, response);
         return;
     }
@@ -1581,14 +2591,14 @@ void process_command(int idx, const char *line, int line_len) {
         char *action = next_token(&ptr);
 
         if (!token || !request_id_str || !action) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         int request_id = atoi(request_id_str);
         if (request_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1597,14 +2607,14 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
 
         // Kiểm tra action hợp lệ
         if (strcasecmp(action, "accept") != 0 && strcasecmp(action, "reject") != 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1617,7 +2627,7 @@ void process_command(int idx, const char *line, int line_len) {
                  request_id, user_id);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1625,7 +2635,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n"); // Request không tồn tại
+            snprintf(response, RESPONSE_SIZE, "404\r\n"); // Request không tồn tại
             send_response(idx, response);
             return;
         }
@@ -1638,7 +2648,7 @@ void process_command(int idx, const char *line, int line_len) {
         // Kiểm tra request_type phải là 'invitation'
         if (strcmp(request_type, "invitation") != 0) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "403\r\n"); // Không phải invitation
+            snprintf(response, RESPONSE_SIZE, "403\r\n"); // Không phải invitation
             send_response(idx, response);
             return;
         }
@@ -1646,7 +2656,7 @@ void process_command(int idx, const char *line, int line_len) {
         // Kiểm tra status phải là 'pending'
         if (strcmp(status, "pending") != 0) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "409\r\n"); // Đã xử lý rồi
+            snprintf(response, RESPONSE_SIZE, "409\r\n"); // Đã xử lý rồi
             send_response(idx, response);
             return;
         }
@@ -1663,7 +2673,7 @@ void process_command(int idx, const char *line, int line_len) {
 
             if (mysql_query(conn, query) != 0) {
                 // Có thể đã là member rồi
-                snprintf(response, sizeof(response), "500\r\n");
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
@@ -1676,12 +2686,14 @@ void process_command(int idx, const char *line, int line_len) {
 
             if (mysql_query(conn, query) != 0) {
                 fprintf(stderr, "MySQL Error updating status to accepted: %s\n", mysql_error(conn));
-                snprintf(response, sizeof(response), "500\r\n");
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
 
-            snprintf(response, sizeof(response), "200\r\n"); // Đã chấp nhận
+            journal_log(user_id, group_id, "join_group");
+            event_bus_publish_group(EVENT_MEMBERS_CHANGED, group_id, 0);
+            snprintf(response, RESPONSE_SIZE, "200\r\n"); // Đã chấp nhận
         } else {
             // Từ chối lời mời: cập nhật status thành 'rejected'
             snprintf(query, sizeof(query),
@@ -1691,12 +2703,12 @@ void process_command(int idx, const char *line, int line_len) {
 
             if (mysql_query(conn, query) != 0) {
                 fprintf(stderr, "MySQL Error updating status to rejected: %s\n", mysql_error(conn));
-                snprintf(response, sizeof(response), "500\r\n");
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
 
-            snprintf(response, sizeof(response), "201\r\n"); // Đã từ chối
+            snprintf(response, RESPONSE_SIZE, "201\r\n"); // Đã từ chối
         }
 
         send_response(idx, response);
@@ -1712,7 +2724,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *type = next_token(&ptr);
 
         if (!token || !item_id_str || !type) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1721,21 +2733,21 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
 
         int item_id = atoi(item_id_str);
         if (item_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         // Validate type
         if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1757,7 +2769,7 @@ void process_command(int idx, const char *line, int line_len) {
         }
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1765,7 +2777,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -1777,37 +2789,72 @@ void process_command(int idx, const char *line, int line_len) {
         // Check if user is admin
         int is_admin = is_user_admin_of_group(user_id, group_id);
         if (is_admin < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (is_admin == 0) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Xoá và trừ số liệu tổng hợp của các thư mục cha trong cùng một giao dịch
+        int is_file = (strcasecmp(type, "F") == 0);
+        int parent_dir_id = 0;
+        AggTotals removed;
+        if (db_begin() != 0 ||
+            agg_item_totals(is_file, item_id, &parent_dir_id, &removed) != 0) {
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         // Soft delete the item
-        if (strcasecmp(type, "F") == 0) {
+        if (is_file) {
             // Delete single file
             snprintf(query, sizeof(query),
                      "UPDATE files SET is_deleted=1, deleted_at=NOW() WHERE file_id=%d",
                      item_id);
             if (mysql_query(conn, query) != 0) {
-                snprintf(response, sizeof(response), "500\r\n");
+                db_rollback();
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
+            file_cache_invalidate(item_id);
         } else {
             // Delete directory recursively (all files and subdirectories)
-            if (delete_directory_recursive(item_id) < 0) {
-                snprintf(response, sizeof(response), "500\r\n");
+            int rc = delete_directory_tree(group_id, item_id);
+            file_cache_invalidate_all();
+            if (rc < 0) {
+                db_rollback();
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
         }
 
-        snprintf(response, sizeof(response), "200\r\n");
+        if (agg_apply(group_id, parent_dir_id, &removed, -1) != 0 || db_commit() != 0) {
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        // File bị xoá có thể của nhiều người upload: đọc lại dung lượng user khi cần
+        quota_charge(0, group_id, -removed.bytes);
+        quota_invalidate_users();
+        if (is_file) {
+            dir_tree_touch(group_id, parent_dir_id);
+        } else {
+            dir_tree_removed(group_id, item_id);
+            event_bus_publish_group(EVENT_DIR_CHANGED, group_id, item_id);
+        }
+        event_bus_publish_group(EVENT_DIR_CHANGED, group_id, parent_dir_id);
+
+        journal_log(user_id, group_id, "delete_item %s %d", type, item_id);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
@@ -1822,7 +2869,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *type = next_token(&ptr);
 
         if (!token || !item_id_str || !new_name || !type) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1831,41 +2878,42 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
 
         int item_id = atoi(item_id_str);
         if (item_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         // Validate type
         if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
-        // Get group_id of the item
+        // Get group_id and parent directory of the item
         int group_id = -1;
+        int parent_dir_id = 0;
         char query[512];
 
         if (strcasecmp(type, "F") == 0) {
             snprintf(query, sizeof(query),
-                     "SELECT group_id FROM files WHERE file_id=%d AND is_deleted=0",
+                     "SELECT group_id, dir_id FROM files WHERE file_id=%d AND is_deleted=0",
                      item_id);
         } else {
             snprintf(query, sizeof(query),
-                     "SELECT group_id FROM directories WHERE dir_id=%d AND is_deleted=0",
+                     "SELECT group_id, COALESCE(parent_dir_id, 0) FROM directories WHERE dir_id=%d AND is_deleted=0",
                      item_id);
         }
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1873,24 +2921,25 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_ROW row = mysql_fetch_row(res);
         group_id = atoi(row[0]);
+        parent_dir_id = row[1] ? atoi(row[1]) : 0;
         mysql_free_result(res);
 
         // Check if user is admin
         int is_admin = is_user_admin_of_group(user_id, group_id);
         if (is_admin < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (is_admin == 0) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -1904,6 +2953,7 @@ void process_command(int idx, const char *line, int line_len) {
             snprintf(query, sizeof(query),
                      "UPDATE files SET file_name='%s', updated_at=NOW() WHERE file_id=%d",
                      escaped_name, item_id);
+            file_cache_invalidate(item_id);
         } else {
             snprintf(query, sizeof(query),
                      "UPDATE directories SET dir_name='%s', updated_at=NOW() WHERE dir_id=%d",
@@ -1911,12 +2961,20 @@ void process_command(int idx, const char *line, int line_len) {
         }
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
-        snprintf(response, sizeof(response), "200\r\n");
+        if (strcasecmp(type, "F") == 0) {
+            dir_tree_touch(group_id, parent_dir_id);
+        } else {
+            dir_tree_renamed(group_id, item_id, new_name);
+        }
+        event_bus_publish_group(EVENT_DIR_CHANGED, group_id, parent_dir_id);
+
+        journal_log(user_id, group_id, "rename_item %s %d %s", type, item_id, new_name);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
@@ -1931,7 +2989,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *type = next_token(&ptr);
 
         if (!token || !item_id_str || !target_dir_id_str || !type) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1940,7 +2998,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -1949,14 +3007,14 @@ void process_command(int idx, const char *line, int line_len) {
         int target_dir_id = atoi(target_dir_id_str);
 
         if (item_id <= 0 || target_dir_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         // Validate type
         if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -1976,7 +3034,7 @@ void process_command(int idx, const char *line, int line_len) {
         }
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -1984,7 +3042,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -1993,32 +3051,15 @@ void process_command(int idx, const char *line, int line_len) {
         item_group_id = atoi(row[0]);
         mysql_free_result(res);
 
-        // Get group_id of target directory
-        snprintf(query, sizeof(query),
-                 "SELECT group_id FROM directories WHERE dir_id=%d AND is_deleted=0",
-                 target_dir_id);
-
-        if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
-            send_response(idx, response);
-            return;
-        }
-
-        res = mysql_store_result(conn);
-        if (!res || mysql_num_rows(res) == 0) {
-            if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+        // Target directory must be a live directory of the same group
+        int target_valid = dir_tree_lookup(item_group_id, target_dir_id, NULL);
+        if (target_valid < 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
-
-        row = mysql_fetch_row(res);
-        int target_group_id = atoi(row[0]);
-        mysql_free_result(res);
-
-        // Check if both belong to same group
-        if (item_group_id != target_group_id) {
-            snprintf(response, sizeof(response), "403\r\n");
+        if (target_valid == 0) {
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -2026,34 +3067,71 @@ void process_command(int idx, const char *line, int line_len) {
         // Check if user is admin
         int is_admin = is_user_admin_of_group(user_id, item_group_id);
         if (is_admin < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (is_admin == 0) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Không cho chuyển thư mục vào chính nó hoặc thư mục con của nó
+        int is_file = (strcasecmp(type, "F") == 0);
+        if (!is_file) {
+            int cycle = dir_tree_is_within(item_group_id, target_dir_id, item_id);
+            if (cycle != 0) {
+                snprintf(response, RESPONSE_SIZE, cycle < 0 ? "500\r\n" : "409\r\n");
+                send_response(idx, response);
+                return;
+            }
+        }
+
+        // Số liệu tổng hợp chuyển từ các thư mục cha cũ sang thư mục đích
+        int old_parent_id = 0;
+        AggTotals moved;
+        if (db_begin() != 0 ||
+            agg_item_totals(is_file, item_id, &old_parent_id, &moved) != 0) {
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         // Move the item
-        if (strcasecmp(type, "F") == 0) {
+        if (is_file) {
             snprintf(query, sizeof(query),
                      "UPDATE files SET dir_id=%d, updated_at=NOW() WHERE file_id=%d",
                      target_dir_id, item_id);
+            file_cache_invalidate(item_id);
         } else {
             snprintf(query, sizeof(query),
                      "UPDATE directories SET parent_dir_id=%d, updated_at=NOW() WHERE dir_id=%d",
                      target_dir_id, item_id);
         }
 
-        if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+        if (mysql_query(conn, query) != 0 ||
+            agg_apply(item_group_id, old_parent_id, &moved, -1) != 0 ||
+            agg_apply(item_group_id, target_dir_id, &moved, 1) != 0 ||
+            db_commit() != 0) {
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
-        snprintf(response, sizeof(response), "200\r\n");
+        if (is_file) {
+            dir_tree_touch(item_group_id, old_parent_id);
+            dir_tree_touch(item_group_id, target_dir_id);
+        } else {
+            dir_tree_moved(item_group_id, item_id, target_dir_id);
+        }
+        event_bus_publish_group(EVENT_DIR_CHANGED, item_group_id, old_parent_id);
+        event_bus_publish_group(EVENT_DIR_CHANGED, item_group_id, target_dir_id);
+
+        journal_log(user_id, item_group_id, "move_item %s %d -> %d", type, item_id, target_dir_id);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
@@ -2068,7 +3146,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *type = next_token(&ptr);
 
         if (!token || !item_id_str || !target_dir_id_str || !type) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2077,7 +3155,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -2086,14 +3164,14 @@ void process_command(int idx, const char *line, int line_len) {
         int target_dir_id = atoi(target_dir_id_str);
 
         if (item_id <= 0 || target_dir_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         // Validate type
         if (strcasecmp(type, "F") != 0 && strcasecmp(type, "D") != 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2113,7 +3191,7 @@ void process_command(int idx, const char *line, int line_len) {
         }
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -2121,7 +3199,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2130,32 +3208,15 @@ void process_command(int idx, const char *line, int line_len) {
         item_group_id = atoi(row[0]);
         mysql_free_result(res);
 
-        // Get group_id of target directory
-        snprintf(query, sizeof(query),
-                 "SELECT group_id FROM directories WHERE dir_id=%d AND is_deleted=0",
-                 target_dir_id);
-
-        if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
-            send_response(idx, response);
-            return;
-        }
-
-        res = mysql_store_result(conn);
-        if (!res || mysql_num_rows(res) == 0) {
-            if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+        // Target directory must be a live directory of the same group
+        int target_valid = dir_tree_lookup(item_group_id, target_dir_id, NULL);
+        if (target_valid < 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
-
-        row = mysql_fetch_row(res);
-        int target_group_id = atoi(row[0]);
-        mysql_free_result(res);
-
-        // Check if both belong to same group
-        if (item_group_id != target_group_id) {
-            snprintf(response, sizeof(response), "403\r\n");
+        if (target_valid == 0) {
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -2163,43 +3224,344 @@ void process_command(int idx, const char *line, int line_len) {
         // Check if user is admin
         int is_admin = is_user_admin_of_group(user_id, item_group_id);
         if (is_admin < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (is_admin == 0) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Bản sao cộng thêm đúng số liệu của item gốc vào thư mục đích
+        int is_file = (strcasecmp(type, "F") == 0);
+        int src_parent_id = 0;
+        AggTotals copied;
+        if (db_begin() != 0 ||
+            agg_item_totals(is_file, item_id, &src_parent_id, &copied) != 0) {
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Bản sao được tính cho người copy: cũng phải nằm trong quota
+        QuotaDenial denial;
+        QuotaResult qr = quota_check(user_id, item_group_id, copied.bytes, &denial);
+        if (qr != QUOTA_OK) {
+            db_rollback();
+            if (qr == QUOTA_ERROR) {
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
+            } else {
+                quota_reply(response, RESPONSE_SIZE, qr, &denial);
+            }
             send_response(idx, response);
             return;
         }
 
         // Copy the item
-        if (strcasecmp(type, "F") == 0) {
+        DirCopy *copies = NULL;
+        int copy_count = 0;
+        int new_file_id = 0;
+        if (is_file) {
             // Copy single file - duplicate record in database
             snprintf(query, sizeof(query),
-                     "INSERT INTO files (file_name, file_path, file_size, file_type, dir_id, group_id, uploaded_by) "
-                     "SELECT file_name, file_path, file_size, file_type, %d, group_id, %d "
+                     "INSERT INTO files (file_name, file_path, file_size, file_type, dir_id, group_id, uploaded_by, content_sha256, pack_segment, pack_offset) "
+                     "SELECT file_name, file_path, file_size, file_type, %d, group_id, %d, content_sha256, pack_segment, pack_offset "
                      "FROM files WHERE file_id=%d",
                      target_dir_id, user_id, item_id);
             if (mysql_query(conn, query) != 0) {
-                snprintf(response, sizeof(response), "500\r\n");
+                db_rollback();
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
+            new_file_id = (int)mysql_insert_id(conn);
         } else {
             // Copy directory recursively (all files and subdirectories)
-            if (copy_directory_recursive(item_id, target_dir_id, user_id) < 0) {
-                snprintf(response, sizeof(response), "500\r\n");
+            copy_count = copy_directory_tree(item_group_id, item_id, target_dir_id, user_id, &copies);
+            if (copy_count < 0) {
+                db_rollback();
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
         }
 
-        snprintf(response, sizeof(response), "200\r\n");
+        if (agg_apply(item_group_id, target_dir_id, &copied, 1) != 0 || db_commit() != 0) {
+            db_rollback();
+            free(copies);
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        quota_charge(user_id, item_group_id, copied.bytes);
+
+        // Bản sao đang dùng chung blob với bản gốc: tách ra (reflink) ở nền
+        clone_queue_file(new_file_id);
+        for (int i = 0; i < copy_count; i++) {
+            clone_queue_dir(copies[i].new_id);
+        }
+
+        // Thêm các thư mục vừa tạo vào cây (cùng tên với thư mục gốc)
+        if (is_file) {
+            dir_tree_touch(item_group_id, target_dir_id);
+        }
+        for (int i = 0; i < copy_count; i++) {
+            DirInfo src;
+            if (dir_tree_lookup(item_group_id, copies[i].src_id, &src) == 1) {
+                dir_tree_added(item_group_id, copies[i].new_id, copies[i].new_parent_id, src.name);
+            } else {
+                dir_tree_invalidate(item_group_id);
+                break;
+            }
+        }
+        free(copies);
+        event_bus_publish_group(EVENT_DIR_CHANGED, item_group_id, target_dir_id);
+
+        journal_log(user_id, item_group_id, "copy_item %s %d -> %d", type, item_id, target_dir_id);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
 
+    // ============================
+    // DELETE_ITEMS token group_id items
+    // MOVE_ITEMS token group_id target_dir_id items
+    // COPY_ITEMS token group_id target_dir_id items
+    // items = F:<file_id>,D:<dir_id>,... (tối đa BATCH_MAX_ITEMS)
+    // Xác thực và kiểm tra quyền admin một lần, kiểm tra các item theo lô,
+    // áp dụng tất cả trong một giao dịch. Phản hồi:
+    //   "200|207 <số thành công>/<tổng> <mã 1>,<mã 2>,..."
+    // mã theo đúng thứ tự item gửi lên: 200 xong, 400 trùng lặp,
+    // 404 không có trong nhóm, 409 chuyển thư mục vào chính nó
+    // ============================
+    if (strcasecmp(cmd, "DELETE_ITEMS") == 0 ||
+        strcasecmp(cmd, "MOVE_ITEMS") == 0 ||
+        strcasecmp(cmd, "COPY_ITEMS") == 0) {
+        int op_delete = (strcasecmp(cmd, "DELETE_ITEMS") == 0);
+        int op_move = (strcasecmp(cmd, "MOVE_ITEMS") == 0);
+
+        char *token = next_token(&ptr);
+        char *group_id_str = next_token(&ptr);
+        char *target_dir_id_str = op_delete ? NULL : next_token(&ptr);
+        char *item_list = next_token(&ptr);
+
+        if (!token || !group_id_str || (!op_delete && !target_dir_id_str) || !item_list) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Verify token
+        char error_msg[256];
+        int user_id = verify_token(token, error_msg, sizeof(error_msg));
+        if (user_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int group_id = atoi(group_id_str);
+        int target_dir_id = target_dir_id_str ? atoi(target_dir_id_str) : 0;
+        if (group_id <= 0 || (!op_delete && target_dir_id <= 0)) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Check if user is admin
+        int is_admin = is_user_admin_of_group(user_id, group_id);
+        if (is_admin < 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        if (is_admin == 0) {
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        BatchItem *items = (BatchItem *)arena_alloc(arena, BATCH_MAX_ITEMS * sizeof(BatchItem));
+        int n = items ? parse_batch_items(item_list, items, BATCH_MAX_ITEMS) : -1;
+        if (n <= 0) {
+            snprintf(response, RESPONSE_SIZE, items ? "400\r\n" : "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Target directory must be a live directory of the group
+        if (!op_delete) {
+            int target_valid = dir_tree_lookup(group_id, target_dir_id, NULL);
+            if (target_valid <= 0) {
+                snprintf(response, RESPONSE_SIZE, target_valid < 0 ? "500\r\n" : "403\r\n");
+                send_response(idx, response);
+                return;
+            }
+        }
+
+        if (batch_resolve(group_id, items, n) != 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Không cho chuyển thư mục vào chính nó hoặc thư mục con của nó
+        if (op_move) {
+            for (int i = 0; i < n; i++) {
+                if (items[i].is_file || items[i].status != 0) continue;
+                int cycle = dir_tree_is_within(group_id, target_dir_id, items[i].item_id);
+                if (cycle < 0) {
+                    snprintf(response, RESPONSE_SIZE, "500\r\n");
+                    send_response(idx, response);
+                    return;
+                }
+                if (cycle == 1) items[i].status = 409;
+            }
+        }
+
+        // Bản sao được tính cho người copy: cả lô phải nằm trong quota
+        if (!op_delete && !op_move) {
+            long long need = 0;
+            for (int i = 0; i < n; i++) {
+                if (items[i].status != 0) continue;
+                if (items[i].is_file) {
+                    need += items[i].bytes;
+                } else {
+                    int parent_id;
+                    AggTotals t;
+                    if (agg_item_totals(0, items[i].item_id, &parent_id, &t) == 0) need += t.bytes;
+                }
+            }
+
+            QuotaDenial denial;
+            QuotaResult qr = quota_check(user_id, group_id, need, &denial);
+            if (qr != QUOTA_OK) {
+                if (qr == QUOTA_ERROR) {
+                    snprintf(response, RESPONSE_SIZE, "500\r\n");
+                } else {
+                    quota_reply(response, RESPONSE_SIZE, qr, &denial);
+                }
+                send_response(idx, response);
+                return;
+            }
+        }
+
+        BatchCopy *copies = NULL;
+        if (!op_delete && !op_move) {
+            copies = (BatchCopy *)arena_calloc(arena, (size_t)n, sizeof(BatchCopy));
+            if (!copies) {
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
+                send_response(idx, response);
+                return;
+            }
+        }
+
+        long long bytes = 0;
+        int rc;
+        if (db_begin() != 0) {
+            rc = -1;
+        } else if (op_delete) {
+            rc = batch_delete(group_id, items, n, &bytes);
+        } else if (op_move) {
+            rc = batch_move(group_id, items, n, target_dir_id);
+        } else {
+            rc = batch_copy(group_id, items, n, target_dir_id, user_id, copies, &bytes);
+        }
+        if (rc != 0 || db_commit() != 0) {
+            db_rollback();
+            for (int i = 0; copies && i < n; i++) free(copies[i].copies);
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Đã commit: cập nhật cache, cây thư mục, quota, sự kiện và nhật ký
+        int any_dir = 0;
+        for (int i = 0; i < n; i++) {
+            BatchItem *it = &items[i];
+            if (it->status != 0 && it->status != 200) continue;
+            it->status = 200;
+
+            if (it->is_file) {
+                if (op_delete || op_move) {
+                    file_cache_invalidate(it->item_id);
+                    dir_tree_touch(group_id, it->parent_id);
+                    event_bus_publish_group(EVENT_DIR_CHANGED, group_id, it->parent_id);
+                }
+            } else if (op_delete) {
+                any_dir = 1;
+                dir_tree_removed(group_id, it->item_id);
+                event_bus_publish_group(EVENT_DIR_CHANGED, group_id, it->item_id);
+                event_bus_publish_group(EVENT_DIR_CHANGED, group_id, it->parent_id);
+            } else if (op_move) {
+                dir_tree_moved(group_id, it->item_id, target_dir_id);
+                event_bus_publish_group(EVENT_DIR_CHANGED, group_id, it->parent_id);
+            } else {
+                for (int k = 0; k < copies[i].count; k++) {
+                    clone_queue_dir(copies[i].copies[k].new_id);
+                }
+                for (int k = 0; k < copies[i].count; k++) {
+                    DirInfo src;
+                    if (dir_tree_lookup(group_id, copies[i].copies[k].src_id, &src) == 1) {
+                        dir_tree_added(group_id, copies[i].copies[k].new_id,
+                                       copies[i].copies[k].new_parent_id, src.name);
+                    } else {
+                        dir_tree_invalidate(group_id);
+                        break;
+                    }
+                }
+                free(copies[i].copies);
+            }
+
+            const char *type = it->is_file ? "F" : "D";
+            if (op_delete) {
+                journal_log(user_id, group_id, "delete_item %s %d", type, it->item_id);
+            } else {
+                journal_log(user_id, group_id, "%s %s %d -> %d", op_move ? "move_item" : "copy_item",
+                            type, it->item_id, target_dir_id);
+            }
+        }
+        if (!op_delete && !op_move) {
+            // File copy vào thẳng thư mục đích: tách blob dùng chung ở nền
+            clone_queue_dir(target_dir_id);
+        }
+        if (!op_delete) {
+            dir_tree_touch(group_id, target_dir_id);
+            event_bus_publish_group(EVENT_DIR_CHANGED, group_id, target_dir_id);
+        }
+        if (op_delete) {
+            if (any_dir) file_cache_invalidate_all();
+            // File bị xoá có thể của nhiều người upload: đọc lại dung lượng user khi cần
+            quota_charge(0, group_id, -bytes);
+            quota_invalidate_users();
+        } else if (!op_move) {
+            quota_charge(user_id, group_id, bytes);
+        }
+
+        // "<200|207> ok/total code,code,..."
+        size_t reply_size = 32 + (size_t)n * 4;
+        char *reply = (char *)arena_alloc(arena, reply_size);
+        if (!reply) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        int ok = 0;
+        for (int i = 0; i < n; i++) {
+            if (items[i].status == 200) ok++;
+        }
+        int len = snprintf(reply, reply_size, "%d %d/%d ", ok == n ? 200 : 207, ok, n);
+        for (int i = 0; i < n; i++) {
+            len += snprintf(reply + len, reply_size - len, "%s%d", i ? "," : "", items[i].status);
+        }
+        snprintf(reply + len, reply_size - len, "\r\n");
+        send_response(idx, reply);
+        return;
+    }
+
     // ============================
     // LIST_GROUP_MEMBERS token group_id
     // ============================
@@ -2208,14 +3570,14 @@ void process_command(int idx, const char *line, int line_len) {
         char *group_id_str = next_token(&ptr);
 
         if (!token || !group_id_str) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
 
         int group_id = atoi(group_id_str);
         if (group_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2224,7 +3586,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -2236,7 +3598,7 @@ void process_command(int idx, const char *line, int line_len) {
 
         if (mysql_query(conn, query) != 0) {
             fprintf(stderr, "MySQL Error (check group): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500 LIST_GROUP_MEMBERS %d\r\n", group_id);
+            snprintf(response, RESPONSE_SIZE, "500 LIST_GROUP_MEMBERS %d\r\n", group_id);
             send_response(idx, response);
             return;
         }
@@ -2244,7 +3606,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res || mysql_num_rows(res) == 0) {
             if (res) mysql_free_result(res);
-            snprintf(response, sizeof(response), "404 LIST_GROUP_MEMBERS %d\r\n", group_id);
+            snprintf(response, RESPONSE_SIZE, "404 LIST_GROUP_MEMBERS %d\r\n", group_id);
             send_response(idx, response);
             return;
         }
@@ -2253,7 +3615,7 @@ void process_command(int idx, const char *line, int line_len) {
         // Check if user is member of the group
         int membership = user_in_group(user_id, group_id);
         if (membership != 1) {
-            snprintf(response, sizeof(response), "403 LIST_GROUP_MEMBERS %d\r\n", group_id);
+            snprintf(response, RESPONSE_SIZE, "403 LIST_GROUP_MEMBERS %d\r\n", group_id);
             send_response(idx, response);
             return;
         }
@@ -2269,7 +3631,7 @@ void process_command(int idx, const char *line, int line_len) {
 
         if (mysql_query(conn, query) != 0) {
             fprintf(stderr, "MySQL Error (get members): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500 LIST_GROUP_MEMBERS %d\r\n", group_id);
+            snprintf(response, RESPONSE_SIZE, "500 LIST_GROUP_MEMBERS %d\r\n", group_id);
             send_response(idx, response);
             return;
         }
@@ -2277,7 +3639,7 @@ void process_command(int idx, const char *line, int line_len) {
         res = mysql_store_result(conn);
         if (!res) {
             fprintf(stderr, "MySQL Error (store result): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500 LIST_GROUP_MEMBERS %d\r\n", group_id);
+            snprintf(response, RESPONSE_SIZE, "500 LIST_GROUP_MEMBERS %d\r\n", group_id);
             send_response(idx, response);
             return;
         }
@@ -2306,7 +3668,7 @@ void process_command(int idx, const char *line, int line_len) {
             strcpy(members_data, "");
         }
 
-        snprintf(response, sizeof(response), "200 %s %d\r\n",
+        snprintf(response, RESPONSE_SIZE, "200 %s %d\r\n",
                  members_data, group_id);
         send_response(idx, response);
         return;
@@ -2327,7 +3689,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *target_user_id_str = next_token(&ptr);
 
         if (!token || !group_id_str || !target_user_id_str) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2335,7 +3697,7 @@ void process_command(int idx, const char *line, int line_len) {
         int group_id = atoi(group_id_str);
         int target_user_id = atoi(target_user_id_str);
         if (group_id <= 0 || target_user_id <= 0) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2344,7 +3706,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int admin_user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (admin_user_id <= 0) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -2355,20 +3717,20 @@ void process_command(int idx, const char *line, int line_len) {
                  "SELECT 1 FROM `groups` WHERE group_id=%d LIMIT 1",
                  group_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (mysql_num_rows(res) == 0) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2379,20 +3741,20 @@ void process_command(int idx, const char *line, int line_len) {
                  "SELECT 1 FROM users WHERE user_id=%d LIMIT 1",
                  target_user_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (mysql_num_rows(res) == 0) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2401,12 +3763,12 @@ void process_command(int idx, const char *line, int line_len) {
         // Admin must be active admin of the group
         int is_admin = is_user_admin_of_group(admin_user_id, group_id);
         if (is_admin < 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (is_admin == 0) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -2416,14 +3778,14 @@ void process_command(int idx, const char *line, int line_len) {
                  "SELECT role FROM user_groups WHERE user_id=%d AND group_id=%d AND is_deleted=0",
                  target_user_id, group_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -2431,7 +3793,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_ROW row = mysql_fetch_row(res);
         if (!row) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2440,7 +3802,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (role && strcmp(role, "admin") == 0) {
             mysql_free_result(res);
             // Only allow removing members, not admins
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
@@ -2451,18 +3813,22 @@ void process_command(int idx, const char *line, int line_len) {
                  "UPDATE user_groups SET is_deleted=1 WHERE user_id=%d AND group_id=%d AND is_deleted=0",
                  target_user_id, group_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         if ((int)mysql_affected_rows(conn) == 0) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
 
-        snprintf(response, sizeof(response), "200\r\n");
+        journal_log(admin_user_id, group_id, "remove_member %d", target_user_id);
+        event_bus_drop_member(target_user_id, group_id);
+        event_bus_publish_user(EVENT_REMOVED, target_user_id, group_id);
+        event_bus_publish_group(EVENT_MEMBERS_CHANGED, group_id, 0);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
@@ -2481,14 +3847,14 @@ void process_command(int idx, const char *line, int line_len) {
         char *group_id_str = next_token(&ptr);
 
         if (!token || !group_id_str) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
 
         int group_id = atoi(group_id_str);
         if (group_id <= 0) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2497,7 +3863,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2508,20 +3874,20 @@ void process_command(int idx, const char *line, int line_len) {
                  "SELECT 1 FROM `groups` WHERE group_id=%d LIMIT 1",
                  group_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
         if (mysql_num_rows(res) == 0) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2532,14 +3898,14 @@ void process_command(int idx, const char *line, int line_len) {
                  "SELECT role FROM user_groups WHERE user_id=%d AND group_id=%d AND is_deleted=0",
                  user_id, group_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -2547,7 +3913,7 @@ void process_command(int idx, const char *line, int line_len) {
         MYSQL_ROW row = mysql_fetch_row(res);
         if (!row) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2556,7 +3922,7 @@ void process_command(int idx, const char *line, int line_len) {
         if (role && strcmp(role, "admin") == 0) {
             mysql_free_result(res);
             // Admin cannot leave group
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2567,32 +3933,112 @@ void process_command(int idx, const char *line, int line_len) {
                  "UPDATE user_groups SET is_deleted=1 WHERE user_id=%d AND group_id=%d AND is_deleted=0",
                  user_id, group_id);
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         if ((int)mysql_affected_rows(conn) == 0) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        journal_log(user_id, group_id, "leave_group");
+        event_bus_drop_member(user_id, group_id);
+        event_bus_publish_group(EVENT_MEMBERS_CHANGED, group_id, 0);
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
+    // SUBSCRIBE_GROUP token group_id
+    // SUBSCRIBE_USER token
+    // UNSUBSCRIBE token [group_id]
+    // Đăng ký nhận sự kiện (dòng "EVENT ...") trên chính kết nối này
+    // thay vì hỏi lại định kỳ; xem net/event_bus.h
+    // ============================
+    if (strcasecmp(cmd, "SUBSCRIBE_GROUP") == 0 ||
+        strcasecmp(cmd, "SUBSCRIBE_USER") == 0 ||
+        strcasecmp(cmd, "UNSUBSCRIBE") == 0) {
+        char *token = next_token(&ptr);
+        char *group_id_str = next_token(&ptr);
+        int by_group = (strcasecmp(cmd, "SUBSCRIBE_GROUP") == 0);
+
+        if (!token || (by_group && !group_id_str)) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char error_msg[256];
+        int user_id = verify_token(token, error_msg, sizeof(error_msg));
+        if (user_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
+        // Kết nối chỉ để nhận sự kiện: tính là đã đăng nhập (timeout rảnh dài hơn)
+        clients[idx].user_id = user_id;
+
+        int group_id = group_id_str ? atoi(group_id_str) : 0;
+
+        if (strcasecmp(cmd, "UNSUBSCRIBE") == 0) {
+            event_bus_unsubscribe(idx, group_id);
+        } else if (!by_group) {
+            event_bus_subscribe_user(idx, user_id);
+        } else {
+            if (group_id <= 0) {
+                snprintf(response, RESPONSE_SIZE, "400\r\n");
+                send_response(idx, response);
+                return;
+            }
+
+            int membership = user_in_group(user_id, group_id);
+            int is_admin = (membership == 1) ? is_user_admin_of_group(user_id, group_id) : 0;
+            if (membership < 0 || is_admin < 0) {
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
+                send_response(idx, response);
+                return;
+            }
+            if (membership != 1) {
+                snprintf(response, RESPONSE_SIZE, "403\r\n");
+                send_response(idx, response);
+                return;
+            }
+
+            if (event_bus_subscribe_group(idx, user_id, group_id, is_admin) != 0) {
+                snprintf(response, RESPONSE_SIZE, "409\r\n");    // đã theo dõi quá nhiều nhóm
+                send_response(idx, response);
+                return;
+            }
+        }
 
-        snprintf(response, sizeof(response), "200\r\n");
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         return;
     }
 
     // ============================
-    // LIST_FOLDER_CONTENT token group_id dir_id
+    // LIST_FOLDER_CONTENT token group_id dir_id [if_version=..]
     // ============================
     if (strcasecmp(cmd, "LIST_FOLDER_CONTENT") == 0) {
         char *token = next_token(&ptr);
         char *group_id_str = next_token(&ptr);
         char *dir_id_str = next_token(&ptr);
 
+        // if_version=<n>: client đã có bản liệt kê ở version n, trả 304 nếu chưa đổi
+        unsigned long long if_version = 0;
+        char *opt;
+        while ((opt = next_token(&ptr))) {
+            if (strncasecmp(opt, "if_version=", 11) == 0) {
+                if_version = strtoull(opt + 11, NULL, 10);
+            }
+        }
+
         if (!token || !group_id_str) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2601,7 +4047,7 @@ void process_command(int idx, const char *line, int line_len) {
         int dir_id = dir_id_str ? atoi(dir_id_str) : 0;
 
         if (group_id <= 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2610,7 +4056,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -2618,97 +4064,74 @@ void process_command(int idx, const char *line, int line_len) {
         // Check if user is member of the group
         int membership = user_in_group(user_id, group_id);
         if (membership != 1) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
 
         // If dir_id is 0, get root directory of the group
         if (dir_id == 0) {
-            char query[512];
-            snprintf(query, sizeof(query),
-                     "SELECT root_dir_id FROM `groups` WHERE group_id=%d", group_id);
-
-            if (mysql_query(conn, query) != 0) {
-                fprintf(stderr, "MySQL Error: %s\n", mysql_error(conn));
-                snprintf(response, sizeof(response), "500\r\n");
-                send_response(idx, response);
-                return;
-            }
-
-            MYSQL_RES *res = mysql_store_result(conn);
-            if (!res || mysql_num_rows(res) == 0) {
-                if (res) mysql_free_result(res);
-                snprintf(response, sizeof(response), "404\r\n");
+            dir_id = dir_tree_root(group_id);
+            if (dir_id < 0) {
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
-
-            MYSQL_ROW row = mysql_fetch_row(res);
-            if (row[0]) {
-                dir_id = atoi(row[0]);
-            }
-            mysql_free_result(res);
         }
 
-        // Get parent_dir_id of current directory
-        int parent_dir_id = 0;
-        char query[1024];
-        snprintf(query, sizeof(query),
-                 "SELECT parent_dir_id FROM directories WHERE dir_id=%d", dir_id);
+        // Current directory (and its parent) from the group's directory tree
+        DirInfo current;
+        int found = dir_id > 0 ? dir_tree_lookup(group_id, dir_id, &current) : 0;
+        if (found <= 0) {
+            snprintf(response, RESPONSE_SIZE, found < 0 ? "500\r\n" : "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+        int parent_dir_id = current.parent_id;
 
-        if (mysql_query(conn, query) == 0) {
-            MYSQL_RES *res = mysql_store_result(conn);
-            if (res && mysql_num_rows(res) > 0) {
-                MYSQL_ROW row = mysql_fetch_row(res);
-                if (row[0]) {
-                    parent_dir_id = atoi(row[0]);
-                }
-            }
-            if (res) mysql_free_result(res);
+        // Không có gì thay đổi kể từ bản client đang giữ: không cần truy vấn DB
+        if (if_version != 0 && if_version == current.version) {
+            snprintf(response, RESPONSE_SIZE, "304 %d %d version=%llu\r\n",
+                     dir_id, parent_dir_id, (unsigned long long)current.version);
+            send_response(idx, response);
+            return;
         }
 
         // Build response with directories and files
-        char content_data[BUFFER_SIZE * 8] = {0};
-
-        // Get subdirectories
-        snprintf(query, sizeof(query),
-                 "SELECT d.dir_id, d.dir_name, 'D' as type, 0 as file_size "
-                 "FROM directories d "
-                 "WHERE d.parent_dir_id=%d AND d.group_id=%d AND d.is_deleted=0 "
-                 "ORDER BY d.dir_name ASC",
-                 dir_id, group_id);
-
-        if (mysql_query(conn, query) != 0) {
-            fprintf(stderr, "MySQL Error (get dirs): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500\r\n");
+        char *content_data = (char *)arena_calloc(arena, 1, FOLDER_CONTENT_SIZE);
+        if (!content_data) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
-        MYSQL_RES *res = mysql_store_result(conn);
-        if (!res) {
-            fprintf(stderr, "MySQL Error (store dirs): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500\r\n");
+        // Get subdirectories (already sorted by name)
+        int dir_count = dir_tree_children(group_id, dir_id, NULL, 0);
+        DirInfo *subdirs = dir_count > 0
+                         ? (DirInfo *)arena_alloc(arena, (size_t)dir_count * sizeof(DirInfo))
+                         : NULL;
+        if (dir_count < 0 || (dir_count > 0 && !subdirs)) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
+        dir_tree_children(group_id, dir_id, subdirs, dir_count);
 
         int first = 1;
-        MYSQL_ROW row;
 
         // Format: D|dir_id|dir_name<SPACE>...
-        while ((row = mysql_fetch_row(res))) {
+        for (int i = 0; i < dir_count; i++) {
             if (!first) strcat(content_data, " ");
             first = 0;
 
             char entry[512];
-            snprintf(entry, sizeof(entry), "D|%s|%s",
-                     row[0] ? row[0] : "?",  // dir_id
-                     row[1] ? row[1] : "?"); // dir_name
+            snprintf(entry, sizeof(entry), "D|%d|%s", subdirs[i].dir_id, subdirs[i].name);
             strcat(content_data, entry);
         }
-        mysql_free_result(res);
+
+        char query[1024];
+        MYSQL_RES *res;
+        MYSQL_ROW row;
 
         // Get files in current directory
         snprintf(query, sizeof(query),
@@ -2720,7 +4143,7 @@ void process_command(int idx, const char *line, int line_len) {
 
         if (mysql_query(conn, query) != 0) {
             fprintf(stderr, "MySQL Error (get files): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -2728,7 +4151,7 @@ void process_command(int idx, const char *line, int line_len) {
         res = mysql_store_result(conn);
         if (!res) {
             fprintf(stderr, "MySQL Error (store files): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
@@ -2747,10 +4170,11 @@ void process_command(int idx, const char *line, int line_len) {
         }
         mysql_free_result(res);
 
-        // Response: "200 current_dir_id parent_dir_id D|dir_id|dir_name<SPACE>... F|file_id|file_name|file_size<SPACE>...<CRLF>"
-        snprintf(response, sizeof(response), "200 %d %d%s%s\r\n",
+        // Response: "200 current_dir_id parent_dir_id version=<n> D|dir_id|dir_name<SPACE>... F|file_id|file_name|file_size<SPACE>...<CRLF>"
+        snprintf(response, RESPONSE_SIZE, "200 %d %d version=%llu%s%s\r\n",
                  dir_id,
                  parent_dir_id,
+                 (unsigned long long)current.version,
                  strlen(content_data) > 0 ? " " : "",
                  content_data);
 
@@ -2768,7 +4192,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *folder_name = next_token(&ptr);
 
         if (!token || !group_id_str || !parent_dir_id_str || !folder_name) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2777,7 +4201,7 @@ void process_command(int idx, const char *line, int line_len) {
         int parent_dir_id = atoi(parent_dir_id_str);
 
         if (group_id <= 0 || parent_dir_id < 0) {
-            snprintf(response, sizeof(response), "400\r\n");
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
             send_response(idx, response);
             return;
         }
@@ -2786,7 +4210,7 @@ void process_command(int idx, const char *line, int line_len) {
         char error_msg[256];
         int user_id = verify_token(token, error_msg, sizeof(error_msg));
         if (user_id <= 0) {
-            snprintf(response, sizeof(response), "401\r\n");
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
             send_response(idx, response);
             return;
         }
@@ -2794,42 +4218,25 @@ void process_command(int idx, const char *line, int line_len) {
         // Check if user is member of the group
         int membership = user_in_group(user_id, group_id);
         if (membership != 1) {
-            snprintf(response, sizeof(response), "403\r\n");
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
             send_response(idx, response);
             return;
         }
 
         // If parent_dir_id is 0, get root directory
         if (parent_dir_id == 0) {
-            char query[512];
-            snprintf(query, sizeof(query),
-                     "SELECT root_dir_id FROM `groups` WHERE group_id=%d", group_id);
-
-            if (mysql_query(conn, query) != 0) {
-                snprintf(response, sizeof(response), "500\r\n");
+            parent_dir_id = dir_tree_root(group_id);
+            if (parent_dir_id < 0) {
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
                 send_response(idx, response);
                 return;
             }
-
-            MYSQL_RES *res = mysql_store_result(conn);
-            if (!res || mysql_num_rows(res) == 0) {
-                if (res) mysql_free_result(res);
-                snprintf(response, sizeof(response), "404\r\n");
-                send_response(idx, response);
-                return;
-            }
-
-            MYSQL_ROW row = mysql_fetch_row(res);
-            if (row[0]) {
-                parent_dir_id = atoi(row[0]);
-            }
-            mysql_free_result(res);
         }
 
         // Validate parent directory belongs to group
         int dir_valid = dir_belongs_to_group(parent_dir_id, group_id);
         if (dir_valid != 1) {
-            snprintf(response, sizeof(response), "404\r\n");
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
             send_response(idx, response);
             return;
         }
@@ -2841,21 +4248,21 @@ void process_command(int idx, const char *line, int line_len) {
                  parent_dir_id, folder_name);
 
         if (mysql_query(conn, query) != 0) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         MYSQL_RES *res = mysql_store_result(conn);
         if (!res) {
-            snprintf(response, sizeof(response), "500\r\n");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         if (mysql_num_rows(res) > 0) {
             mysql_free_result(res);
-            snprintf(response, sizeof(response), "409\r\n"); // Conflict
+            snprintf(response, RESPONSE_SIZE, "409\r\n"); // Conflict
             send_response(idx, response);
             return;
         }
@@ -2867,23 +4274,31 @@ void process_command(int idx, const char *line, int line_len) {
                  "VALUES ('%s', %d, %d, %d)",
                  folder_name, parent_dir_id, group_id, user_id);
 
-        if (mysql_query(conn, query) != 0) {
+        if (db_begin() != 0 || mysql_query(conn, query) != 0) {
             fprintf(stderr, "MySQL Error (create folder): %s\n", mysql_error(conn));
-            snprintf(response, sizeof(response), "500\r\n");
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
             send_response(idx, response);
             return;
         }
 
         int new_dir_id = (int)mysql_insert_id(conn);
 
-        // Log activity
-        snprintf(query, sizeof(query),
-                 "INSERT INTO activity_log (user_id, description, group_id) "
-                 "VALUES (%d, 'create_directory', %d)",
-                 user_id, group_id);
-        mysql_query(conn, query);
+        AggTotals added = { 0, 0, 1 };
+        if (agg_apply(group_id, parent_dir_id, &added, 1) != 0 || db_commit() != 0) {
+            db_rollback();
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        dir_tree_added(group_id, new_dir_id, parent_dir_id, folder_name);
+        event_bus_publish_group(EVENT_DIR_CHANGED, group_id, parent_dir_id);
+
+        // Ghi nhật ký hoạt động (ghi nền, không chờ DB)
+        journal_log(user_id, group_id, "create_directory");
 
-        snprintf(response, sizeof(response), "200\r\n");
+        snprintf(response, RESPONSE_SIZE, "200\r\n");
         send_response(idx, response);
         printf("[CREATE_FOLDER] Created folder '%s' with ID %d in parent_dir_id=%d\n",
                folder_name, new_dir_id, parent_dir_id);
@@ -2891,7 +4306,7 @@ void process_command(int idx, const char *line, int line_len) {
     }
 
     // ============================
-    // 8️⃣ UPLOAD_FILE token group_id dir_id file_name chunk_idx total_chunks payload
+    // 8️⃣ UPLOAD_FILE token group_id dir_id file_name chunk_idx total_chunks payload [codec=..] [crc=..] [size=..]
     // ============================
     if (strcasecmp(cmd, "UPLOAD_FILE") == 0) {
         char *token = next_token(&ptr);
@@ -2901,6 +4316,7 @@ void process_command(int idx, const char *line, int line_len) {
         char *chunk_idx_str = next_token(&ptr);
         char *total_chunks_str = next_token(&ptr);
         char *base64_payload = next_token(&ptr);
+        size_t payload_wire_len = base64_payload ? strlen(base64_payload) : 0;
 
         if (!token || !group_id_str || !dir_id_str || !file_name_raw ||
             !chunk_idx_str || !total_chunks_str || !base64_payload) {
@@ -2908,6 +4324,35 @@ void process_command(int idx, const char *line, int line_len) {
             return;
         }
 
+        // Tuỳ chọn mở rộng dạng key=value sau payload
+        //   codec=<lz4|zstd>: payload là chunk đã nén bằng codec đó
+        //   crc=<hex>: CRC32C của dữ liệu gốc (trước khi nén)
+        //   size=<bytes>: kích thước cả file, khai báo ở chunk 1 để kiểm tra quota
+        int chunk_codec = CODEC_NONE;
+        int have_crc = 0;
+        uint32_t expected_crc = 0;
+        long long declared_size = -1;
+        char *opt;
+        while ((opt = next_token(&ptr))) {
+            if (strncasecmp(opt, "codec=", 6) == 0) {
+                chunk_codec = codec_from_name(opt + 6);
+            } else if (strncasecmp(opt, "crc=", 4) == 0) {
+                if (crc32c_parse(opt + 4, &expected_crc) != 0) {
+                    send_upload_error(idx, "CRC không hợp lệ");
+                    return;
+                }
+                have_crc = 1;
+            } else if (strncasecmp(opt, "size=", 5) == 0) {
+                declared_size = atoll(opt + 5);
+            }
+        }
+        if (chunk_codec < 0 ||
+            (chunk_codec != CODEC_NONE &&
+             !(clients[idx].codec_mask & CODEC_MASK(chunk_codec)))) {
+            send_upload_error(idx, "Codec chưa được thương lượng");
+            return;
+        }
+
         int group_id = atoi(group_id_str);
         int dir_id = atoi(dir_id_str);
         int chunk_index = atoi(chunk_idx_str);
@@ -2960,49 +4405,534 @@ void process_command(int idx, const char *line, int line_len) {
             return;
         }
 
-        unsigned char *decoded = NULL;
+        unsigned char decoded[FILE_CHUNK_SIZE];
         size_t decoded_len = 0;
-        if (decode_base64_chunk(base64_payload, &decoded, &decoded_len) != 0) {
+        if (decode_base64_chunk(base64_payload, decoded, sizeof(decoded), &decoded_len) != 0) {
             send_upload_error(idx, "Giải mã base64 thất bại");
             return;
         }
 
-        if (write_chunk_file(temp_path, decoded, decoded_len, chunk_index) != 0) {
-            free(decoded);
-            send_upload_error(idx, "Ghi chunk xuống file tạm thất bại");
+        // Chunk nén: giải nén về dữ liệu gốc trước khi ghi
+        unsigned char raw_chunk[FILE_CHUNK_SIZE];
+        const unsigned char *chunk_data = decoded;
+        size_t chunk_len = decoded_len;
+        if (chunk_codec != CODEC_NONE) {
+            int raw_len = codec_decompress((CodecType)chunk_codec, decoded, decoded_len,
+                                           raw_chunk, sizeof(raw_chunk));
+            if (raw_len < 0) {
+                send_upload_error(idx, "Giải nén chunk thất bại");
+                return;
+            }
+            chunk_data = raw_chunk;
+            chunk_len = (size_t)raw_len;
+        }
+
+        // Chunk hỏng trên đường truyền: từ chối nhưng giữ trạng thái để client gửi lại
+        if (have_crc && crc32c(0, chunk_data, chunk_len) != expected_crc) {
+            send_upload_error(idx, "CRC chunk không khớp");
             return;
         }
-        free(decoded);
 
-        if (chunk_index == total_chunks) {
-            if (rename(temp_path, final_path) != 0) {
-                send_upload_error(idx, "Đổi tên file tạm thất bại");
+        UploadState *up = &upload_states[idx];
+        if (chunk_index == 1) {
+            // Một kết nối chỉ upload một thứ: phiên upload nhiều file dở dang bị huỷ
+            transfer_reset_bulk(idx);
+
+            // Giới hạn số upload đồng thời (max_concurrent_uploads trong rate_limits.conf)
+            if (!up->active && transfer_active_uploads() >= sched_max_uploads()) {
+                send_upload_error(idx, "Quá nhiều upload đồng thời");
                 return;
             }
+            transfer_reset_upload(idx);
 
-            long file_size = get_file_size(final_path);
-            if (file_size < 0) {
-                send_upload_error(idx, "Không đọc được kích thước file sau upload");
+            // Giữ chỗ quota theo kích thước khai báo trước khi ghi byte nào;
+            // client cũ không gửi size=: ước lượng theo số chunk
+            if (declared_size < 0) {
+                declared_size = (long long)total_chunks * FILE_CHUNK_SIZE;
+            }
+            QuotaDenial denial;
+            QuotaResult qr = quota_reserve(idx, user_id, group_id, declared_size, &denial);
+            if (qr == QUOTA_ERROR) {
+                send_upload_error(idx, "Không đọc được dung lượng đã dùng");
                 return;
             }
+            if (qr != QUOTA_OK) {
+                log_error(idx, user_id, "UPLOAD_FILE: vượt quota %s (%lld + %lld > %lld)",
+                          qr == QUOTA_USER ? "user" : "group",
+                          denial.used, declared_size, denial.limit);
+                quota_reply(response, RESPONSE_SIZE, qr, &denial);
+                send_response(idx, response);
+                return;
+            }
+
+            up->active = 1;
+            strcpy(up->temp_path, temp_path);
+            if (transfer_hash_start(&up->sha) != 0) {
+                log_error(idx, clients[idx].user_id, "UPLOAD_FILE: không khởi tạo được SHA-256");
+            }
+
+            // Client đã lấy mẫu entropy và nén chunk đầu: lưu blob dạng nén
+            if (COMPRESS_AT_REST && chunk_codec != CODEC_NONE) {
+                if (frame_writer_open(&up->writer, temp_path, (CodecType)chunk_codec) != 0) {
+                    transfer_reset_upload(idx);
+                    send_upload_error(idx, "Không tạo được file nén tạm");
+                    return;
+                }
+                up->at_rest = 1;
+            }
+        } else if (up->active &&
+                   (strcmp(up->temp_path, temp_path) != 0 || up->next_chunk != chunk_index)) {
+            transfer_reset_upload(idx);
+            send_upload_error(idx, "Chunk không đúng thứ tự");
+            return;
+        }
+
+        int write_rc = up->at_rest
+                           ? frame_writer_append(&up->writer, chunk_data, chunk_len)
+                           : write_chunk_file(up, temp_path, chunk_data, chunk_len, chunk_index);
+        if (write_rc != 0) {
+            transfer_reset_upload(idx);
+            send_upload_error(idx, "Ghi chunk xuống file tạm thất bại");
+            return;
+        }
+        up->next_chunk = chunk_index + 1;
+        transfer_hash_update(up->sha, chunk_data, chunk_len);
+
+        if (chunk_index == total_chunks) {
+            // Đối chiếu quota với kích thước thật (client có thể khai báo thiếu)
+            long long actual_size = up->at_rest ? (long long)up->writer.raw_size
+                                                : (long long)up->offset;
+            QuotaDenial denial;
+            QuotaResult qr = quota_check_final(idx, user_id, group_id, actual_size, &denial);
+            if (qr != QUOTA_OK) {
+                transfer_reset_upload(idx);
+                unlink(temp_path);
+                if (qr == QUOTA_ERROR) {
+                    send_upload_error(idx, "Không đọc được dung lượng đã dùng");
+                    return;
+                }
+                quota_reply(response, RESPONSE_SIZE, qr, &denial);
+                send_response(idx, response);
+                return;
+            }
+
+            char sha_hex[SHA256_HEX_LEN] = "";
+            if (up->sha && transfer_hash_hex(&up->sha, sha_hex) != 0) {
+                sha_hex[0] = '\0';
+            }
+
+            // Thư mục đã có file cùng tên: nội dung mới thành phiên bản mới của
+            // file đó. Không bao giờ ghi đè blob mà một file / phiên bản còn dùng
+            FileHead head;
+            int has_head = version_find_head(dir_id, safe_filename, &head);
+            if (has_head == 0 && version_free_path(final_path, final_path, sizeof(final_path)) != 0) {
+                has_head = -1;
+            }
+            if (has_head < 0) {
+                transfer_reset_upload(idx);
+                send_upload_error(idx, "Không kiểm tra được file cùng tên");
+                return;
+            }
+            // Có file cùng tên: blob nằm lại ở file tạm, versions đưa vào chỗ
+            const char *blob_path = has_head ? temp_path : final_path;
+
+            // File nhỏ vào pack segment thay vì thành một file riêng
+            long file_size;
+            PackRef pack = { 0, 0 };
+            int compressed = up->at_rest;
+            if (up->at_rest) {
+                file_size = (long)up->writer.raw_size;
+                if (frame_writer_finish(&up->writer) != 0 ||
+                    (!pack_small_blob(temp_path, 1, file_size, &pack) && !has_head &&
+                     frame_store_commit(temp_path, final_path) != 0)) {
+                    transfer_reset_upload(idx);
+                    send_upload_error(idx, "Ghi file nén thất bại");
+                    return;
+                }
+                up->at_rest = 0;
+            } else {
+                fd_cache_close(up->fdh);
+                up->fdh = -1;
+                file_size = (long)up->offset;
+                if (!pack_small_blob(temp_path, 0, file_size, &pack)) {
+                    if (!has_head) {
+                        if (rename(temp_path, final_path) != 0) {
+                            transfer_reset_upload(idx);
+                            send_upload_error(idx, "Đổi tên file tạm thất bại");
+                            return;
+                        }
+                        // Blob cũ không còn dùng ở đường dẫn này có thể đã được lưu dạng nén
+                        frame_store_drop_index(final_path);
+                    }
+
+                    file_size = get_file_size(blob_path);
+                }
+            }
+            transfer_reset_upload(idx);
 
-            if (insert_file_metadata(safe_filename, final_path, file_size,
-                                     group_id, dir_id, user_id) != 0) {
-                send_upload_error(idx, "Ghi metadata file vào DB thất bại");
+            if (file_size < 0) {
+                send_upload_error(idx, "Không đọc được kích thước file sau upload");
                 return;
             }
 
-            snprintf(response, sizeof(response), "200 %d/%d\r\n", chunk_index, total_chunks);
+            if (has_head) {
+                // Bản cũ vào file_versions, dòng files giữ file_id (cùng giao dịch với số liệu tổng hợp)
+                VersionContent content = { pack.segment > 0 ? NULL : temp_path, compressed, NULL,
+                                           pack, file_size, sha_hex, user_id };
+                int archived = version_replace_content(&head, dir_path, &content);
+                if (archived < 0) {
+                    send_upload_error(idx, "Ghi phiên bản mới vào DB thất bại");
+                    return;
+                }
+                // Bản cũ có thể của người upload khác: đọc lại dung lượng user khi cần
+                quota_charge(0, group_id, file_size - head.size);
+                quota_invalidate_users();
+                journal_log(user_id, group_id, "upload_file %s (version %d)", safe_filename, archived + 1);
+            } else {
+                // Metadata và số liệu tổng hợp của các thư mục cha ghi cùng một giao dịch
+                AggTotals added = { file_size, 1, 0 };
+                if (db_begin() != 0 ||
+                    insert_file_metadata(safe_filename, final_path, file_size,
+                                         group_id, dir_id, user_id, sha_hex, &pack) != 0 ||
+                    agg_apply(group_id, dir_id, &added, 1) != 0 ||
+                    db_commit() != 0) {
+                    db_rollback();
+                    send_upload_error(idx, "Ghi metadata file vào DB thất bại");
+                    return;
+                }
+                quota_charge(user_id, group_id, file_size);
+                journal_log(user_id, group_id, "upload_file %s", safe_filename);
+            }
+            dir_tree_touch(group_id, dir_id);
+            event_bus_publish_group(EVENT_DIR_CHANGED, group_id, dir_id);
+
+            snprintf(response, RESPONSE_SIZE, "200 %d/%d\r\n", chunk_index, total_chunks);
         } else {
-            snprintf(response, sizeof(response), "202 %d/%d\r\n", chunk_index, total_chunks);
+            snprintf(response, RESPONSE_SIZE, "202 %d/%d\r\n", chunk_index, total_chunks);
+        }
+
+        // ACK của chunk là dữ liệu bulk: tính cả chunk vừa nhận vào token bucket
+        sched_mark_bulk(idx, user_id, group_id, (int)payload_wire_len);
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
+    // UPLOAD_BULK_BEGIN token group_id dir_id file_count
+    // Mở phiên upload nhiều file: token, quyền và thư mục chỉ kiểm tra một
+    // lần cho cả phiên. Tiếp theo là manifest (UPLOAD_BULK_ENTRY), dữ liệu
+    // (UPLOAD_BULK_DATA, không phản hồi từng chunk) và UPLOAD_BULK_END.
+    // dir_id = 0: thư mục gốc của nhóm
+    // ============================
+    if (strcasecmp(cmd, "UPLOAD_BULK_BEGIN") == 0) {
+        char *token = next_token(&ptr);
+        char *group_id_str = next_token(&ptr);
+        char *dir_id_str = next_token(&ptr);
+        char *count_str = next_token(&ptr);
+
+        if (!token || !group_id_str || !dir_id_str || !count_str) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int group_id = atoi(group_id_str);
+        int dir_id = atoi(dir_id_str);
+        int file_count = atoi(count_str);
+        if (group_id <= 0 || dir_id < 0 || file_count <= 0 || file_count > BULK_MAX_FILES) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char error_msg[256];
+        int user_id = verify_token(token, error_msg, sizeof(error_msg));
+        if (user_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int membership = user_in_group(user_id, group_id);
+        if (membership != 1) {
+            snprintf(response, RESPONSE_SIZE, membership < 0 ? "500\r\n" : "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        if (dir_id == 0) {
+            dir_id = dir_tree_root(group_id);
+        }
+        int found = dir_id > 0 ? dir_tree_lookup(group_id, dir_id, NULL) : dir_id;
+        if (found <= 0) {
+            snprintf(response, RESPONSE_SIZE, found < 0 ? "500\r\n" : "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Cả phiên chiếm một suất upload đồng thời
+        BulkUpload *b = &bulk_uploads[idx];
+        if (!b->active && !upload_states[idx].active &&
+            transfer_active_uploads() >= sched_max_uploads()) {
+            log_error(idx, user_id, "UPLOAD_BULK: quá nhiều upload đồng thời");
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
         }
 
+        // Phiên cũ (hoặc upload dở) trên kết nối này bị huỷ
+        transfer_reset_bulk(idx);
+        transfer_reset_upload(idx);
+
+        b->files = calloc(file_count, sizeof(BulkFile));
+        if (!b->files) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        b->active = 1;
+        b->user_id = user_id;
+        b->group_id = group_id;
+        b->dir_id = dir_id;
+        b->file_count = file_count;
+        b->current = -1;
+
+        snprintf(response, RESPONSE_SIZE, "200 %d\r\n", file_count);
         send_response(idx, response);
         return;
     }
 
     // ============================
-    // 9️⃣ DOWNLOAD_FILE token file_id chunk_idx
+    // UPLOAD_BULK_ENTRY <size>:<sha256|->:<path>,...
+    // Một phần manifest của phiên. path tương đối so với dir_id của phiên,
+    // phân tách bằng '/', các ký tự ' ' ',' '%' được mã hoá %XX.
+    // Phản hồi "202 <đã khai báo>/<tổng>"; khi đủ manifest: giữ chỗ quota
+    // cho cả manifest, tạo các thư mục còn thiếu trong một giao dịch rồi
+    // trả "200 <n>/<n> dirs=<số thư mục tạo mới>"
+    // ============================
+    if (strcasecmp(cmd, "UPLOAD_BULK_ENTRY") == 0) {
+        char *list = next_token(&ptr);
+        BulkUpload *b = &bulk_uploads[idx];
+
+        if (!list || !b->active || b->ready) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char *save = NULL;
+        for (char *entry = strtok_r(list, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+            if (b->declared == b->file_count ||
+                bulk_parse_entry(entry, &b->files[b->declared]) != 0) {
+                // Manifest hỏng: huỷ cả phiên
+                transfer_reset_bulk(idx);
+                snprintf(response, RESPONSE_SIZE, "400\r\n");
+                send_response(idx, response);
+                return;
+            }
+            b->declared++;
+        }
+
+        if (b->declared < b->file_count) {
+            snprintf(response, RESPONSE_SIZE, "202 %d/%d\r\n", b->declared, b->file_count);
+            send_response(idx, response);
+            return;
+        }
+
+        // Giữ chỗ quota trước khi tạo thư mục hay ghi byte nào
+        long long total = 0;
+        for (int i = 0; i < b->file_count; i++) {
+            total += b->files[i].size;
+        }
+        QuotaDenial denial;
+        QuotaResult qr = quota_reserve(idx, b->user_id, b->group_id, total, &denial);
+        if (qr != QUOTA_OK) {
+            log_error(idx, b->user_id, "UPLOAD_BULK: vượt quota %s (%lld + %lld > %lld)",
+                      qr == QUOTA_USER ? "user" : "group", denial.used, total, denial.limit);
+            transfer_reset_bulk(idx);
+            if (qr == QUOTA_ERROR) {
+                snprintf(response, RESPONSE_SIZE, "500\r\n");
+            } else {
+                quota_reply(response, RESPONSE_SIZE, qr, &denial);
+            }
+            send_response(idx, response);
+            return;
+        }
+
+        int created = bulk_resolve_manifest(b);
+        if (created < 0) {
+            log_error(idx, b->user_id, "UPLOAD_BULK: tạo thư mục của manifest thất bại");
+            transfer_reset_bulk(idx);
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        bulk_refuse_duplicates(b);
+
+        for (int i = 0; i < b->file_count; i++) {
+            if (b->files[i].status == 0 && b->files[i].size == 0) {
+                bulk_store_empty(b, &b->files[i]);
+            }
+        }
+        b->ready = 1;
+
+        snprintf(response, RESPONSE_SIZE, "200 %d/%d dirs=%d\r\n",
+                 b->declared, b->file_count, created);
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
+    // UPLOAD_BULK_DATA file_no payload [codec=..] [crc=..]
+    // Chunk tiếp theo (tối đa FILE_CHUNK_SIZE byte gốc) của file thứ file_no
+    // (từ 1) trong manifest; các file gửi lần lượt. Không có phản hồi: lỗi
+    // của từng file được báo ở UPLOAD_BULK_END. Đủ số byte đã khai báo thì
+    // file được kiểm tra hash và lưu; metadata ghi theo lô BULK_FLUSH_FILES file
+    // ============================
+    if (strcasecmp(cmd, "UPLOAD_BULK_DATA") == 0) {
+        char *file_no_str = next_token(&ptr);
+        char *base64_payload = next_token(&ptr);
+        BulkUpload *b = &bulk_uploads[idx];
+
+        if (!file_no_str || !base64_payload || !b->active || !b->ready) {
+            log_error(idx, clients[idx].user_id, "UPLOAD_BULK_DATA: không thuộc phiên upload nào");
+            return;
+        }
+
+        int i = atoi(file_no_str) - 1;
+        // File đã lỗi (hoặc đã đủ dữ liệu): bỏ qua các chunk còn lại của nó
+        if (i < 0 || i >= b->file_count || b->files[i].status != 0) {
+            return;
+        }
+        BulkFile *f = &b->files[i];
+        b->wire_bytes += (long long)strlen(base64_payload);
+
+        int chunk_codec = CODEC_NONE;
+        int have_crc = 0;
+        int bad_crc = 0;
+        uint32_t expected_crc = 0;
+        char *opt;
+        while ((opt = next_token(&ptr))) {
+            if (strncasecmp(opt, "codec=", 6) == 0) {
+                chunk_codec = codec_from_name(opt + 6);
+            } else if (strncasecmp(opt, "crc=", 4) == 0) {
+                bad_crc = crc32c_parse(opt + 4, &expected_crc) != 0;
+                have_crc = 1;
+            }
+        }
+        if (bad_crc || chunk_codec < 0 ||
+            (chunk_codec != CODEC_NONE &&
+             !(clients[idx].codec_mask & CODEC_MASK(chunk_codec)))) {
+            bulk_fail_file(idx, b, i, 400);
+            return;
+        }
+
+        if (b->current != i) {
+            // File trước chưa đủ dữ liệu đã chuyển sang file khác
+            if (b->current >= 0) {
+                bulk_fail_current(idx, b, 400);
+            }
+            if (bulk_start_file(idx, b, i, chunk_codec) != 0) {
+                bulk_fail_current(idx, b, 500);
+                return;
+            }
+        }
+
+        unsigned char decoded[FILE_CHUNK_SIZE];
+        size_t decoded_len = 0;
+        if (decode_base64_chunk(base64_payload, decoded, sizeof(decoded), &decoded_len) != 0) {
+            bulk_fail_current(idx, b, 400);
+            return;
+        }
+
+        unsigned char raw_chunk[FILE_CHUNK_SIZE];
+        const unsigned char *chunk_data = decoded;
+        size_t chunk_len = decoded_len;
+        if (chunk_codec != CODEC_NONE) {
+            int raw_len = codec_decompress((CodecType)chunk_codec, decoded, decoded_len,
+                                           raw_chunk, sizeof(raw_chunk));
+            if (raw_len < 0) {
+                bulk_fail_current(idx, b, 400);
+                return;
+            }
+            chunk_data = raw_chunk;
+            chunk_len = (size_t)raw_len;
+        }
+
+        // Không có lượt gửi lại trong phiên: chunk hỏng làm hỏng cả file
+        if ((have_crc && crc32c(0, chunk_data, chunk_len) != expected_crc) ||
+            f->received + (long long)chunk_len > f->size) {
+            bulk_fail_current(idx, b, 400);
+            return;
+        }
+
+        UploadState *up = &upload_states[idx];
+        char temp_path[PATH_MAX];
+        snprintf(temp_path, sizeof(temp_path), "%s%s", f->path, TMP_SUFFIX);
+        int write_rc = up->at_rest
+                           ? frame_writer_append(&up->writer, chunk_data, chunk_len)
+                           : write_chunk_file(up, temp_path, chunk_data, chunk_len, up->next_chunk);
+        if (write_rc != 0) {
+            bulk_fail_current(idx, b, 500);
+            return;
+        }
+        up->next_chunk++;
+        transfer_hash_update(up->sha, chunk_data, chunk_len);
+        f->received += (long long)chunk_len;
+
+        if (f->received == f->size &&
+            bulk_finish_file(idx, b) == 0 && b->stored >= BULK_FLUSH_FILES) {
+            bulk_flush(idx, b);
+        }
+        return;
+    }
+
+    // ============================
+    // UPLOAD_BULK_END
+    // Kết thúc phiên: ghi nốt metadata các file đã lưu. Phản hồi
+    // "200 <ok>/<n>", hoặc "207 <ok>/<n> <mã file 1>,<mã file 2>,..." nếu có
+    // file lỗi (400 = thiếu/sai dữ liệu hoặc hash, 409 = trùng đường dẫn, 500)
+    // ============================
+    if (strcasecmp(cmd, "UPLOAD_BULK_END") == 0) {
+        BulkUpload *b = &bulk_uploads[idx];
+        if (!b->active || !b->ready) {
+            transfer_reset_bulk(idx);
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        if (b->current >= 0) {
+            bulk_fail_current(idx, b, 400);
+        }
+        bulk_flush(idx, b);
+
+        int ok = 0;
+        for (int i = 0; i < b->file_count; i++) {
+            BulkFile *f = &b->files[i];
+            if (f->status == 0) f->status = 400;        // thiếu dữ liệu
+            if (f->status == 202) f->status = 500;      // không ghi được metadata
+            if (f->status == 200) ok++;
+        }
+
+        int len = snprintf(response, RESPONSE_SIZE, "%d %d/%d",
+                           ok == b->file_count ? 200 : 207, ok, b->file_count);
+        for (int i = 0; ok < b->file_count && i < b->file_count; i++) {
+            len += snprintf(response + len, RESPONSE_SIZE - len, "%c%d",
+                            i ? ',' : ' ', b->files[i].status);
+        }
+        snprintf(response + len, RESPONSE_SIZE - len, "\r\n");
+
+        // Dữ liệu cả phiên tính vào token bucket cùng phản hồi này
+        long long wire = b->wire_bytes;
+        sched_mark_bulk(idx, b->user_id, b->group_id, wire > INT_MAX ? INT_MAX : (int)wire);
+        transfer_reset_bulk(idx);
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
+    // 9️⃣ DOWNLOAD_FILE token file_id chunk_idx [codec=<lz4|zstd>] [crc=1]
     // ============================
     if (strcasecmp(cmd, "DOWNLOAD_FILE") == 0) {
         char *token = next_token(&ptr);
@@ -3014,6 +4944,22 @@ void process_command(int idx, const char *line, int line_len) {
             return;
         }
 
+        // codec=<...>: client chấp nhận chunk nén bằng codec đã thương lượng
+        // crc=1: gửi kèm CRC32C của dữ liệu gốc trong mỗi chunk
+        int wire_codec = CODEC_NONE;
+        int want_crc = 0;
+        char *opt;
+        while ((opt = next_token(&ptr))) {
+            if (strncasecmp(opt, "codec=", 6) == 0) {
+                int c = codec_from_name(opt + 6);
+                if (c > CODEC_NONE && (clients[idx].codec_mask & CODEC_MASK(c))) {
+                    wire_codec = c;
+                }
+            } else if (strcasecmp(opt, "crc=1") == 0) {
+                want_crc = 1;
+            }
+        }
+
         int file_id = atoi(file_id_str);
         int chunk_index = atoi(chunk_idx_str);
 
@@ -3029,19 +4975,33 @@ void process_command(int idx, const char *line, int line_len) {
             return;
         }
 
-        char file_name[MAX_FILENAME_LEN];
-        char file_path[PATH_MAX];
-        long file_size = 0;
-        int dir_id = 0;
-        int group_id = 0;
-
-        int fetch_res = fetch_file_metadata(file_id, file_name, sizeof(file_name),
-                                            file_path, sizeof(file_path),
-                                            &file_size, &dir_id, &group_id);
-        if (fetch_res <= 0) {
-            send_download_error(idx, "File không tồn tại");
-            return;
+        // Metadata lấy từ cache nếu còn hợp lệ, tránh một query mỗi chunk
+        FileMeta meta;
+        const FileMeta *cached_meta = file_cache_get_meta(file_id);
+        if (cached_meta) {
+            meta = *cached_meta;
+        } else {
+            PackRef fetched_pack;
+            int fetch_res = fetch_file_metadata(file_id, meta.name, sizeof(meta.name),
+                                                meta.path, sizeof(meta.path),
+                                                &meta.size, &meta.dir_id, &meta.group_id,
+                                                meta.sha256, sizeof(meta.sha256),
+                                                &fetched_pack);
+            if (fetch_res <= 0) {
+                send_download_error(idx, "File không tồn tại");
+                return;
+            }
+            meta.pack_segment = fetched_pack.segment;
+            meta.pack_offset = fetched_pack.offset;
+            file_cache_put_meta(file_id, &meta);
         }
+        PackRef pack = { meta.pack_segment, meta.pack_offset };
+
+        const char *file_name = meta.name;
+        const char *file_path = meta.path;
+        long file_size = meta.size;
+        int group_id = meta.group_id;
+        const char *stored_sha = meta.sha256;
 
         int membership = user_in_group(user_id, group_id);
         if (membership != 1) {
@@ -3058,18 +5018,26 @@ void process_command(int idx, const char *line, int line_len) {
             return;
         }
 
-        FILE *fp = fopen(file_path, "rb");
-        if (!fp) {
-            send_download_error(idx, "Mở file để đọc thất bại");
-            return;
-        }
+        DownloadState *down = &download_states[idx];
+        int new_transfer = (down->file_id != file_id || chunk_index == 1);
+        if (new_transfer) {
+            transfer_reset_download(idx);
+            down->file_id = file_id;
 
-        if (file_size > 0) {
-            if (fseek(fp, (chunk_index - 1) * FILE_CHUNK_SIZE, SEEK_SET) != 0) {
-                fclose(fp);
-                send_download_error(idx, "Dịch chuyển con trỏ file thất bại");
+            // File nóng được phục vụ từ bộ nhớ; còn lại giữ fd/reader mở suốt lượt tải
+            down->cached = file_cache_begin_read(file_id);
+            if (!down->cached && transfer_open_download(down, file_path, &pack) != 0) {
+                transfer_reset_download(idx);
+                send_download_error(idx, "Mở file để đọc thất bại");
                 return;
             }
+
+            // Chỉ kiểm tra được khi đọc tuần tự từ chunk 1 và file có hash lưu sẵn
+            if (VERIFY_ON_READ && chunk_index == 1 && stored_sha[0] &&
+                transfer_hash_start(&down->sha) == 0) {
+                strcpy(down->expected_sha, stored_sha);
+                down->next_chunk = 1;
+            }
         }
 
         // Đọc chunk từ file
@@ -3085,37 +5053,413 @@ void process_command(int idx, const char *line, int line_len) {
 
         size_t bytes_read = 0;
         if (file_size > 0) {
-            bytes_read = fread(chunk_buffer, 1, bytes_to_read, fp);
-            if (bytes_read == 0 && ferror(fp)) {
-                fclose(fp);
+            uint64_t offset = (uint64_t)(chunk_index - 1) * FILE_CHUNK_SIZE;
+            long n = -1;
+            if (down->cached) {
+                n = file_cache_read(file_id, chunk_buffer, bytes_to_read, offset);
+                if (n < 0) {
+                    // Nội dung bị đẩy khỏi cache giữa lượt tải: quay về đọc từ đĩa
+                    down->cached = 0;
+                    if (transfer_open_download(down, file_path, &pack) != 0) {
+                        transfer_reset_download(idx);
+                        send_download_error(idx, "Mở file để đọc thất bại");
+                        return;
+                    }
+                }
+            }
+            if (n < 0 && down->reader_open) {
+                // Blob lưu dạng nén: chỉ giải nén frame chứa chunk này
+                n = frame_reader_pread(&down->reader, chunk_buffer, bytes_to_read, offset);
+            } else if (n < 0 && down->pack_fd >= 0) {
+                n = pread(down->pack_fd, chunk_buffer, bytes_to_read, (off_t)(down->base + offset));
+            } else if (n < 0) {
+                n = fd_cache_pread(down->fdh, chunk_buffer, bytes_to_read, down->base + offset);
+            }
+            if (n < 0) {
+                transfer_reset_download(idx);
                 send_download_error(idx, "Đọc chunk từ file thất bại");
                 return;
             }
+            bytes_read = (size_t)n;
+        }
+
+        if (down->sha) {
+            if (chunk_index == down->next_chunk) {
+                transfer_hash_update(down->sha, chunk_buffer, bytes_read);
+                down->next_chunk = chunk_index + 1;
+            } else {
+                // Client nhảy chunk: hash không còn đại diện cho cả file
+                transfer_hash_drop(&down->sha);
+            }
+        }
+
+        if (down->sha && chunk_index == total_chunks) {
+            char actual_sha[SHA256_HEX_LEN];
+            if (transfer_hash_hex(&down->sha, actual_sha) == 0 &&
+                strcmp(actual_sha, down->expected_sha) != 0) {
+                log_error(idx, clients[idx].user_id,
+                          "DOWNLOAD_FILE: file_id=%d hỏng trên đĩa (sha256 %s, mong đợi %s)",
+                          file_id, actual_sha, down->expected_sha);
+                transfer_reset_download(idx);
+                send_download_error(idx, "Checksum SHA-256 không khớp");
+                return;
+            }
+        }
+
+        // Lấy mẫu entropy ở chunk đầu: bỏ qua nén với dữ liệu đã nén sẵn
+        if (new_transfer) {
+            down->compress = codec_should_compress(chunk_buffer, bytes_read);
+        }
+
+        unsigned char packed[FILE_CHUNK_SIZE];
+        const unsigned char *payload = chunk_buffer;
+        size_t payload_len = bytes_read;
+        int sent_codec = CODEC_NONE;
+        if (wire_codec != CODEC_NONE && down->compress && bytes_read > 0) {
+            int n = codec_compress((CodecType)wire_codec, chunk_buffer, bytes_read,
+                                   packed, sizeof(packed));
+            // Chỉ gửi bản nén khi thực sự nhỏ hơn
+            if (n > 0 && (size_t)n < bytes_read) {
+                payload = packed;
+                payload_len = (size_t)n;
+                sent_codec = wire_codec;
+            }
+        }
+
+        if (chunk_index == total_chunks) {
+            transfer_reset_download(idx);
         }
-        fclose(fp);
 
         // Encode chunk thành base64
         char base64_output[BASE64_CHUNK_SIZE];
-        int encoded_len = encode_base64_chunk(chunk_buffer, bytes_read, base64_output, sizeof(base64_output));
+        int encoded_len = encode_base64_chunk(payload, payload_len, base64_output, sizeof(base64_output));
         if (encoded_len < 0) {
             send_download_error(idx, "Mã hoá chunk thất bại");
             return;
         }
 
-        // Gửi response: "200 chunk_idx/total_chunks file_name base64_data\r\n" hoặc "202 chunk_idx/total_chunks file_name base64_data\r\n"
+        // Gửi response: "200 chunk_idx/total_chunks file_name base64_data[ codec][ crc=<hex>]\r\n" hoặc "202 ..."
+        // codec chỉ xuất hiện khi payload là chunk đã nén, crc khi client yêu cầu
+        const char *codec_suffix = (sent_codec != CODEC_NONE) ? " " : "";
+        const char *codec_label = (sent_codec != CODEC_NONE) ? codec_name((CodecType)sent_codec) : "";
+        char crc_suffix[16] = "";
+        if (want_crc) {
+            snprintf(crc_suffix, sizeof(crc_suffix), " crc=%08x",
+                     (unsigned int)crc32c(0, chunk_buffer, bytes_read));
+        }
         if (chunk_index == total_chunks) {
-            snprintf(response, sizeof(response), "200 %d/%ld %s %s\r\n", chunk_index, total_chunks, file_name, base64_output);
+            snprintf(response, RESPONSE_SIZE, "200 %d/%ld %s %s%s%s%s\r\n", chunk_index, total_chunks, file_name, base64_output, codec_suffix, codec_label, crc_suffix);
         } else {
-            snprintf(response, sizeof(response), "202 %d/%ld %s %s\r\n", chunk_index, total_chunks, file_name, base64_output);
+            snprintf(response, RESPONSE_SIZE, "202 %d/%ld %s %s%s%s%s\r\n", chunk_index, total_chunks, file_name, base64_output, codec_suffix, codec_label, crc_suffix);
+        }
+
+        sched_mark_bulk(idx, user_id, group_id, 0);
+        send_response(idx, response);
+        return;
+    }
+
+    // ============================
+    // LIST_VERSIONS token file_id
+    // Các phiên bản cũ của file, mới nhất trước. Phản hồi
+    // "200 file_id current_no size V|version_no|file_size|created_at|uploader|storage ..."
+    // (current_no: số của nội dung hiện tại, created_at: unix time, storage: full|delta)
+    // ============================
+    if (strcasecmp(cmd, "LIST_VERSIONS") == 0) {
+        char *token = next_token(&ptr);
+        char *file_id_str = next_token(&ptr);
+
+        if (!token || !file_id_str) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int file_id = atoi(file_id_str);
+        if (file_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char error_msg[256];
+        int user_id = verify_token(token, error_msg, sizeof(error_msg));
+        if (user_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        FileHead head;
+        int found = version_load_head(file_id, &head);
+        if (found <= 0) {
+            snprintf(response, RESPONSE_SIZE, found < 0 ? "500\r\n" : "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+        if (user_in_group(user_id, head.group_id) != 1) {
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char query[512];
+        snprintf(query, sizeof(query),
+                 "SELECT v.version_no, v.file_size, COALESCE(UNIX_TIMESTAMP(v.created_at), 0), "
+                 "COALESCE(u.username, '?'), v.storage "
+                 "FROM file_versions v LEFT JOIN users u ON u.user_id=v.uploaded_by "
+                 "WHERE v.file_id=%d ORDER BY v.version_no DESC LIMIT %d",
+                 file_id, VERSION_LIST_MAX);
+        MYSQL_RES *res = (mysql_query(conn, query) == 0) ? mysql_store_result(conn) : NULL;
+        if (!res) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Format: V|version_no|file_size|created_at|uploader|storage<SPACE>...
+        // (chừa chỗ cho phần đầu phản hồi)
+        char entries[RESPONSE_SIZE - 64];
+        size_t len = 0;
+        int current_no = 0;
+        MYSQL_ROW row;
+        entries[0] = '\0';
+        while ((row = mysql_fetch_row(res))) {
+            if (current_no == 0) current_no = (row[0] ? atoi(row[0]) : 0) + 1;
+            int w = snprintf(entries + len, sizeof(entries) - len, " V|%s|%s|%s|%s|%s",
+                             row[0] ? row[0] : "?", row[1] ? row[1] : "0", row[2] ? row[2] : "0",
+                             row[3] ? row[3] : "?", row[4] ? row[4] : "full");
+            if (w < 0 || (size_t)w >= sizeof(entries) - len) {
+                entries[len] = '\0';
+                break;
+            }
+            len += (size_t)w;
         }
+        mysql_free_result(res);
 
+        snprintf(response, RESPONSE_SIZE, "200 %d %d %lld%s\r\n",
+                 file_id, current_no > 0 ? current_no : 1, head.size, entries);
         send_response(idx, response);
         return;
     }
 
+    // ============================
+    // RESTORE_VERSION token file_id version_no
+    // Nội dung của phiên bản version_no thành nội dung hiện tại; nội dung
+    // đang có được lưu thành phiên bản mới như khi upload đè.
+    // Phản hồi "200 current_no"
+    // ============================
+    if (strcasecmp(cmd, "RESTORE_VERSION") == 0) {
+        char *token = next_token(&ptr);
+        char *file_id_str = next_token(&ptr);
+        char *version_str = next_token(&ptr);
+
+        if (!token || !file_id_str || !version_str) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int file_id = atoi(file_id_str);
+        int version_no = atoi(version_str);
+        if (file_id <= 0 || version_no <= 0) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char error_msg[256];
+        int user_id = verify_token(token, error_msg, sizeof(error_msg));
+        if (user_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        FileHead head;
+        int found = version_load_head(file_id, &head);
+        if (found <= 0) {
+            snprintf(response, RESPONSE_SIZE, found < 0 ? "500\r\n" : "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+        if (user_in_group(user_id, head.group_id) != 1) {
+            snprintf(response, RESPONSE_SIZE, "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        char query[256];
+        snprintf(query, sizeof(query),
+                 "SELECT storage, file_path, file_size, content_sha256 FROM file_versions "
+                 "WHERE file_id=%d AND version_no=%d",
+                 file_id, version_no);
+        MYSQL_RES *res = (mysql_query(conn, query) == 0) ? mysql_store_result(conn) : NULL;
+        if (!res) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        MYSQL_ROW row = mysql_fetch_row(res);
+        int is_delta = 0;
+        char version_path[512] = "";
+        long long version_size = 0;
+        char version_sha[SHA256_HEX_LEN] = "";
+        if (row) {
+            is_delta = row[0] && strcasecmp(row[0], "delta") == 0;
+            snprintf(version_path, sizeof(version_path), "%s", row[1] ? row[1] : "");
+            version_size = row[2] ? atoll(row[2]) : 0;
+            snprintf(version_sha, sizeof(version_sha), "%s", row[3] ? row[3] : "");
+        }
+        mysql_free_result(res);
+        if (!row) {
+            snprintf(response, RESPONSE_SIZE, "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Nội dung khôi phục được tính vào quota như một lần upload
+        if (version_size > head.size) {
+            QuotaDenial denial;
+            QuotaResult qr = quota_check(user_id, head.group_id, version_size - head.size, &denial);
+            if (qr != QUOTA_OK) {
+                if (qr == QUOTA_ERROR || !quota_reply(response, RESPONSE_SIZE, qr, &denial)) {
+                    snprintf(response, RESPONSE_SIZE, "500\r\n");
+                }
+                send_response(idx, response);
+                return;
+            }
+        }
+
+        char dir_path[PATH_MAX];
+        if (prepare_storage_directory(head.group_id, head.dir_id, dir_path, sizeof(dir_path)) != 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Phiên bản nguyên vẹn: file dùng chung blob của nó
+        if (!is_delta) {
+            VersionContent content = { NULL, 0, version_path, { 0, 0 }, version_size, version_sha, user_id };
+            restore_commit(idx, &head, dir_path, &content, version_no);
+            return;
+        }
+
+        // Phiên bản delta: thread của versions dựng lại từ nội dung mới hơn
+        // vào file tạm; phản hồi gửi khi xong (restore_rebuilt), trong lúc
+        // đó kết nối không nhận lệnh mới
+        PendingRestore *r = &pending_restores[idx];
+        r->file_id = file_id;
+        r->version_no = version_no;
+        r->user_id = user_id;
+        r->size = version_size;
+        snprintf(r->sha256, sizeof(r->sha256), "%s", version_sha);
+        snprintf(r->dir_path, sizeof(r->dir_path), "%s", dir_path);
+        snprintf(r->temp_path, sizeof(r->temp_path), "%s/restore_%d_%d_%d%s",
+                 dir_path, file_id, version_no, idx, TMP_SUFFIX);
+        if (version_restore_start(idx, file_id, version_no, r->temp_path, restore_rebuilt) != 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        clients[idx].state = CONN_WAITING;
+        server_timers_version_wanted();
+        return;
+    }
+
+    // ============================
+    // DOWNLOAD_FOLDER token group_id dir_id [codec=zstd]
+    // Cả thư mục (kèm thư mục con) dưới dạng một file tar, tạo dần trong
+    // lúc gửi. Phản hồi "200 <tên>.tar files=<n> bytes=<b>[ codec=zstd]",
+    // sau đó là các đoạn "<len>\r\n<dữ liệu>" và kết thúc "0 <mã>\r\n"
+    // (xem protocol/archive.h). dir_id = 0: thư mục gốc của nhóm
+    // ============================
+    if (strcasecmp(cmd, "DOWNLOAD_FOLDER") == 0) {
+        char *token = next_token(&ptr);
+        char *group_id_str = next_token(&ptr);
+        char *dir_id_str = next_token(&ptr);
+
+        // codec=zstd: nén cả archive thành một luồng zstd
+        CodecType archive_codec = CODEC_NONE;
+        char *opt;
+        while ((opt = next_token(&ptr))) {
+            if (strcasecmp(opt, "codec=zstd") == 0 &&
+                (clients[idx].codec_mask & CODEC_MASK(CODEC_ZSTD))) {
+                archive_codec = CODEC_ZSTD;
+            }
+        }
+
+        if (!token || !group_id_str || !dir_id_str) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int group_id = atoi(group_id_str);
+        int dir_id = atoi(dir_id_str);
+        if (group_id <= 0 || dir_id < 0) {
+            snprintf(response, RESPONSE_SIZE, "400\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Verify token
+        char error_msg[256];
+        int user_id = verify_token(token, error_msg, sizeof(error_msg));
+        if (user_id <= 0) {
+            snprintf(response, RESPONSE_SIZE, "401\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        int membership = user_in_group(user_id, group_id);
+        if (membership != 1) {
+            snprintf(response, RESPONSE_SIZE, membership < 0 ? "500\r\n" : "403\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        if (dir_id == 0) {
+            dir_id = dir_tree_root(group_id);
+        }
+        int found = dir_id > 0 ? dir_tree_lookup(group_id, dir_id, NULL) : dir_id;
+        if (found <= 0) {
+            snprintf(response, RESPONSE_SIZE, found < 0 ? "500\r\n" : "404\r\n");
+            send_response(idx, response);
+            return;
+        }
+
+        // Từ đây kết nối chỉ gửi archive; event loop gửi tiếp từng phần
+        if (archive_start(idx, user_id, group_id, dir_id, archive_codec) != 0) {
+            snprintf(response, RESPONSE_SIZE, "500\r\n");
+            send_response(idx, response);
+            return;
+        }
+        log_send(idx, user_id, "200 DOWNLOAD_FOLDER");
+        return;
+    }
+
     // ============================
     // ⓴ Command không tồn tại
     // ============================
-    snprintf(response, sizeof(response), "ERR UNKNOWN_COMMAND %s\r\n", cmd);
+    snprintf(response, RESPONSE_SIZE, "ERR UNKNOWN_COMMAND %s\r\n", cmd);
     send_response(idx, response);
 }
+
+void process_command(int idx, const char *line, int line_len) {
+    Arena *arena = arena_thread();
+    uint64_t slabs_before = arena->slab_mallocs;
+    long long mallocs_before = alloc_count();
+
+    run_command(idx, line, line_len, arena);
+
+    // Trạng thái ổn định: không cấp phát thêm slab, không gọi malloc
+    // (malloc chỉ đếm được khi build với COUNT_ALLOCS=1)
+    long long mallocs = (mallocs_before >= 0) ? alloc_count() - mallocs_before : 0;
+    if (arena->slab_mallocs != slabs_before || mallocs > 0) {
+        log_info(idx, clients[idx].user_id,
+                 "Command allocated: arena %zu bytes (peak %zu, slabs +%llu), malloc calls %lld",
+                 arena->used, arena->peak,
+                 (unsigned long long)(arena->slab_mallocs - slabs_before), mallocs);
+    }
+    arena_reset(arena);
+}
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE     // nftw
+#include "transfer.h"
+#include "../storage/quota.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+UploadState upload_states[MAX_CLIENTS];
+DownloadState download_states[MAX_CLIENTS];
+BulkUpload bulk_uploads[MAX_CLIENTS];
+
+void transfer_init() {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        memset(&upload_states[i], 0, sizeof(upload_states[i]));
+        upload_states[i].writer.fd = -1;
+        upload_states[i].fdh = -1;
+        memset(&download_states[i], 0, sizeof(download_states[i]));
+        download_states[i].reader.fd = -1;
+        download_states[i].fdh = -1;
+        download_states[i].pack_fd = -1;
+        memset(&bulk_uploads[i], 0, sizeof(bulk_uploads[i]));
+        bulk_uploads[i].current = -1;
+    }
+}
+
+void transfer_reset_upload(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    UploadState *up = &upload_states[idx];
+
+    if (up->at_rest) {
+        // Unfinished compressed upload: the temp blob is useless without its index
+        frame_writer_abort(&up->writer);
+        if (up->temp_path[0]) {
+            unlink(up->temp_path);
+        }
+    }
+    fd_cache_close(up->fdh);
+    transfer_hash_drop(&up->sha);
+    // A bulk session's reservation covers all its files
+    if (!bulk_uploads[idx].active) {
+        quota_release(idx);
+    }
+
+    memset(up, 0, sizeof(*up));
+    up->writer.fd = -1;
+    up->fdh = -1;
+}
+
+static void unlink_part(const char *path) {
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s%s", path, TMP_SUFFIX);
+    unlink(temp);
+    snprintf(temp, sizeof(temp), "%s%s%s", path, TMP_SUFFIX, FRAME_INDEX_SUFFIX);
+    unlink(temp);
+}
+
+void transfer_reset_bulk(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    BulkUpload *b = &bulk_uploads[idx];
+    if (!b->active) return;
+
+    if (b->current >= 0) {
+        transfer_reset_upload(idx);
+    }
+    for (int i = 0; i < b->file_count && b->files; i++) {
+        const BulkFile *f = &b->files[i];
+        // Stored but never committed, or cut off mid-file: nothing refers to it
+        if (f->path[0] && (f->status == 202 || (i == b->current && f->status == 0))) {
+            unlink_part(f->path);
+        }
+    }
+    free(b->files);
+    quota_release(idx);
+
+    memset(b, 0, sizeof(*b));
+    b->current = -1;
+}
+
+void transfer_reset_download(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    DownloadState *down = &download_states[idx];
+
+    if (down->reader_open) {
+        frame_reader_close(&down->reader);
+    }
+    fd_cache_close(down->fdh);
+    if (down->pack_fd >= 0) {
+        close(down->pack_fd);
+    }
+    transfer_hash_drop(&down->sha);
+
+    memset(down, 0, sizeof(*down));
+    down->reader.fd = -1;
+    down->fdh = -1;
+    down->pack_fd = -1;
+}
+
+int transfer_open_download(DownloadState *down, const char *path, const PackRef *pack) {
+    if (down->reader_open || down->fdh >= 0 || down->pack_fd >= 0) return 0;
+
+    if (pack && pack->segment > 0) {
+        char segment_path[PATH_MAX];
+        if (pack_segment_path(pack->segment, segment_path, sizeof(segment_path)) != 0) return -1;
+        down->pack_fd = open(segment_path, O_RDONLY | O_CLOEXEC);
+        down->base = pack->offset;
+        return down->pack_fd >= 0 ? 0 : -1;
+    }
+
+    if (frame_store_is_compressed(path)) {
+        if (frame_reader_open(&down->reader, path) != 0) return -1;
+        down->reader_open = 1;
+        return 0;
+    }
+
+    down->fdh = fd_cache_open(path, O_RDONLY, 0);
+    return down->fdh >= 0 ? 0 : -1;
+}
+
+int transfer_hash_start(EVP_MD_CTX **ctx) {
+    transfer_hash_drop(ctx);
+
+    *ctx = EVP_MD_CTX_new();
+    if (!*ctx) return -1;
+    if (EVP_DigestInit_ex(*ctx, EVP_sha256(), NULL) != 1) {
+        transfer_hash_drop(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+void transfer_hash_update(EVP_MD_CTX *ctx, const unsigned char *data, size_t len) {
+    if (ctx && len > 0) {
+        EVP_DigestUpdate(ctx, data, len);
+    }
+}
+
+int transfer_hash_hex(EVP_MD_CTX **ctx, char *out) {
+    if (!ctx || !*ctx || !out) return -1;
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    int rc = EVP_DigestFinal_ex(*ctx, digest, &digest_len);
+    transfer_hash_drop(ctx);
+    if (rc != 1 || digest_len * 2 + 1 > SHA256_HEX_LEN) return -1;
+
+    for (unsigned int i = 0; i < digest_len; i++) {
+        sprintf(out + i * 2, "%02x", digest[i]);
+    }
+    out[digest_len * 2] = '\0';
+    return 0;
+}
+
+void transfer_hash_drop(EVP_MD_CTX **ctx) {
+    if (ctx && *ctx) {
+        EVP_MD_CTX_free(*ctx);
+        *ctx = NULL;
+    }
+}
+
+static time_t gc_cutoff;
+static int gc_removed;
+static int gc_max_remove;
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int part_in_use(const char *path) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const UploadState *up = &upload_states[i];
+        if (!up->temp_path[0]) continue;
+
+        size_t n = strlen(up->temp_path);
+        // the temp blob itself or its "<temp>.zidx" index
+        if (strncmp(path, up->temp_path, n) == 0 &&
+            (path[n] == '\0' || strcmp(path + n, FRAME_INDEX_SUFFIX) == 0)) {
+            return 1;
+        }
+    }
+    // finished bulk upload blobs waiting for their row
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const BulkUpload *b = &bulk_uploads[i];
+        for (int k = 0; b->active && k < b->file_count; k++) {
+            const BulkFile *f = &b->files[k];
+            size_t n = strlen(f->path);
+            if (f->status == 202 && strncmp(path, f->path, n) == 0 &&
+                strncmp(path + n, TMP_SUFFIX, strlen(TMP_SUFFIX)) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int gc_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F) return 0;
+    if (!ends_with(path, TMP_SUFFIX) && !ends_with(path, TMP_SUFFIX FRAME_INDEX_SUFFIX)) return 0;
+    if (st->st_mtime > gc_cutoff || part_in_use(path)) return 0;
+
+    if (unlink(path) == 0) {
+        gc_removed++;
+    }
+    return gc_removed >= gc_max_remove;     // non-zero stops the walk
+}
+
+int transfer_gc_stale_parts(const char *root, time_t max_age, int max_remove) {
+    gc_cutoff = time(NULL) - max_age;
+    gc_removed = 0;
+    gc_max_remove = max_remove;
+    nftw(root, gc_visit, 16, FTW_PHYS);
+    return gc_removed;
+}
+
+int transfer_active_uploads(void) {
+    int n = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (upload_states[i].active || bulk_uploads[i].active) n++;
+    }
+    return n;
+}
+
+int transfer_active_downloads(void) {
+    int n = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const DownloadState *down = &download_states[i];
+        if (down->fdh >= 0 || down->pack_fd >= 0 || down->reader_open ||
+            clients[i].state == CONN_STREAMING) n++;
+    }
+    return n;
+}
+
+void transfer_release(int idx) {
+    transfer_reset_bulk(idx);
+    transfer_reset_upload(idx);
+    transfer_reset_download(idx);
+}
@@ -0,0 +1,133 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <limits.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include "../net/client.h"
+#include "../storage/frame_store.h"
+#include "../storage/fd_cache.h"
+#include "../storage/pack_store.h"
+#include "../utils/compress.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define STORAGE_ROOT "./storage"
+#define TMP_SUFFIX ".part"
+
+// Hex SHA-256 as stored in files.content_sha256, plus NUL
+#define SHA256_HEX_LEN 65
+
+// Per-connection state of the upload in progress. UPLOAD_FILE chunks
+// arrive one command at a time; whatever must survive between chunks lives here.
+typedef struct {
+    int active;
+    char temp_path[PATH_MAX];
+    int next_chunk;         // chunk index expected next
+    int at_rest;            // 1 = blob is being stored compressed through writer
+    FrameWriter writer;
+    int fdh;                // fd_cache handle of the plain temp file (-1 = none)
+    uint64_t offset;        // where the next plain chunk is written
+    EVP_MD_CTX *sha;        // whole-file SHA-256, fed in chunk order; NULL if
+                            // the upload did not start at chunk 1 on this connection
+} UploadState;
+
+// Per-connection state of the download in progress
+typedef struct {
+    int file_id;            // 0 = no download in progress
+    int compress;           // sampled on the first chunk served
+    int reader_open;        // 1 = file is stored compressed, served through reader
+    FrameReader reader;
+    int fdh;                // fd_cache handle of a plain blob (-1 = none)
+    int pack_fd;            // packed file: its segment, opened directly (-1 = none)
+    uint64_t base;          // where the file starts (packed: in its segment)
+    int cached;             // 1 = served from the hot-file cache
+    EVP_MD_CTX *sha;        // verify-on-read: hash of the chunks served so far
+    int next_chunk;         // chunk expected next for the hash to stay valid
+    char expected_sha[SHA256_HEX_LEN];
+} DownloadState;
+
+// Bulk upload session (UPLOAD_BULK_*): a manifest of many files, then
+// their data back-to-back on the connection without per-chunk replies.
+// Files are written one at a time through the connection's UploadState;
+// a finished blob stays under its temp name until its `files` row is
+// inserted with the next batch of rows. The session holds one quota
+// reservation for the whole manifest.
+#define BULK_MAX_FILES 1000
+#define BULK_FLUSH_FILES 64         // finished files per row INSERT / transaction
+#define BULK_PATH_LEN 512
+#define BULK_NAME_LEN 256
+
+typedef struct {
+    char rel_path[BULK_PATH_LEN];   // as declared, '/'-separated, last part = file name
+    char name[BULK_NAME_LEN];       // sanitized file name, the row's file_name
+    char path[BULK_PATH_LEN];       // blob path once the manifest is resolved
+    int replaces;                   // a live file of that name exists: becomes its next version
+    long long size;                 // declared; more data than this is refused
+    long long received;
+    char sha256[SHA256_HEX_LEN];    // declared ("" = none), then the computed one
+    int dir_id;
+    int at_rest;                    // blob stored compressed (frame index beside it)
+    PackRef pack;                   // small file: where it went in the pack store
+    int status;                     // 0 = waiting for data, 202 = stored, row pending,
+                                    // 200 = committed, else the error code
+} BulkFile;
+
+typedef struct {
+    int active;
+    int user_id;
+    int group_id;
+    int dir_id;                     // where the manifest paths start
+    BulkFile *files;
+    int file_count;                 // announced by UPLOAD_BULK_BEGIN
+    int declared;                   // manifest entries received so far
+    int ready;                      // manifest complete: directories exist, quota reserved
+    int current;                    // file whose data is arriving (-1 = none)
+    int stored;                     // files in status 202
+    long long wire_bytes;           // payload received, charged to the scheduler at the end
+} BulkUpload;
+
+extern UploadState upload_states[MAX_CLIENTS];
+extern DownloadState download_states[MAX_CLIENTS];
+extern BulkUpload bulk_uploads[MAX_CLIENTS];
+
+void transfer_init();
+void transfer_reset_upload(int idx);
+void transfer_reset_download(int idx);
+
+// End the connection's bulk upload session: uncommitted blobs are removed
+// and the quota reservation dropped
+void transfer_reset_bulk(int idx);
+
+// Open what a download reads from: frame reader for compressed blobs,
+// an fd_cache handle for plain ones. A packed file gets a descriptor of
+// its own on the segment (base at its offset): fd_cache reopens by path,
+// and the compactor may remove the segment while the download is paused,
+// but an open descriptor keeps the old bytes readable. Kept until
+// transfer_reset_download.
+int transfer_open_download(DownloadState *down, const char *path, const PackRef *pack);
+
+// Streaming SHA-256 over a transfer. transfer_hash_hex finalises into
+// out (SHA256_HEX_LEN bytes) and frees the context.
+int transfer_hash_start(EVP_MD_CTX **ctx);
+void transfer_hash_update(EVP_MD_CTX *ctx, const unsigned char *data, size_t len);
+int transfer_hash_hex(EVP_MD_CTX **ctx, char *out);
+void transfer_hash_drop(EVP_MD_CTX **ctx);
+
+// Uploads (and bulk upload sessions) in progress on all connections
+int transfer_active_uploads(void);
+
+// Downloads holding a file open, plus DOWNLOAD_FOLDER streams
+int transfer_active_downloads(void);
+
+// Remove TMP_SUFFIX files (and their frame index) under root that no
+// upload is writing and that were last modified more than max_age
+// seconds ago, stopping after max_remove. Returns the number removed.
+int transfer_gc_stale_parts(const char *root, time_t max_age, int max_remove);
+
+// Drop every transfer resource held by a connection (called on disconnect)
+void transfer_release(int idx);
+
+#endif
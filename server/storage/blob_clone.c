@@ -0,0 +1,390 @@
+#define _GNU_SOURCE     // copy_file_range
+#include "blob_clone.h"
+#include "file_cache.h"
+#include "frame_store.h"
+#include "../protocol/transfer.h"
+#include "../database/db.h"
+#include "../utils/logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+typedef struct {
+    int dir_id;                      // > 0: every file of the directory after file_id
+    int file_id;
+} CloneTarget;
+
+typedef struct {
+    int file_id;
+    int compressed;                  // frame index copied along
+    int ok;                          // set by the copier
+    char src[512];
+    char tmp[520];
+    char dst[512];
+} CloneJob;
+
+// Event loop side
+static CloneTarget targets[CLONE_QUEUE_LEN];
+static int target_head = 0;
+static int target_count = 0;
+
+// Shared with the copier thread, under copy_lock
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t copy_thread;
+static int copy_running = 0;
+static int copy_stopping = 0;
+static CloneJob jobs[CLONE_COPY_QUEUE];
+static int job_state[CLONE_COPY_QUEUE];   // 0 free, 1 waiting, 2 copying, 3 done
+
+static void queue_target(int dir_id, int file_id) {
+    if (target_count == CLONE_QUEUE_LEN) return;      // stays shared
+    CloneTarget *t = &targets[(target_head + target_count) % CLONE_QUEUE_LEN];
+    t->dir_id = dir_id;
+    t->file_id = file_id;
+    target_count++;
+}
+
+void clone_queue_file(int file_id) {
+    if (file_id > 0) queue_target(0, file_id);
+}
+
+void clone_queue_dir(int dir_id) {
+    if (dir_id > 0) queue_target(dir_id, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Cloning / copying one blob
+// ---------------------------------------------------------------------------
+
+static int unsupported(int err) {
+    return err == EOPNOTSUPP || err == EXDEV || err == EINVAL || err == ENOTTY || err == ENOSYS;
+}
+
+// Reflink src to dst. 0, 1 if the filesystem cannot do it, -1 on error
+static int reflink_one(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int rc = ioctl(out, FICLONE, in);
+    int err = errno;
+    close(in);
+    close(out);
+    if (rc == 0) return 0;
+    unlink(dst);
+    return unsupported(err) ? 1 : -1;
+}
+
+// Copy src to dst byte for byte (copier thread). 0 or -1
+static int copy_one(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct stat st;
+    if (out < 0 || fstat(in, &st) != 0) {
+        if (out >= 0) close(out);
+        close(in);
+        return -1;
+    }
+
+    // In-kernel copy (server-side on NFS); plain read/write where it is
+    // not available
+    off_t done = 0;
+    int use_range = 1;
+    char buf[64 * 1024];
+    while (done < st.st_size) {
+        ssize_t n;
+        if (use_range) {
+            size_t want = (st.st_size - done < CLONE_COPY_CHUNK) ? (size_t)(st.st_size - done)
+                                                                 : CLONE_COPY_CHUNK;
+            n = copy_file_range(in, NULL, out, NULL, want, 0);
+            if (n < 0 && unsupported(errno) && done == 0) {
+                use_range = 0;
+                continue;
+            }
+        } else {
+            n = pread(in, buf, sizeof(buf), done);
+            if (n > 0 && pwrite(out, buf, (size_t)n, done) != n) n = -1;
+        }
+        if (n <= 0) break;
+        done += n;
+    }
+
+    close(in);
+    close(out);
+    if (done != st.st_size) {
+        unlink(dst);
+        return -1;
+    }
+    return 0;
+}
+
+// The blob and, when compressed, its frame index. 0 / 1 / -1 as reflink_one
+static int clone_blob(const char *src, const char *dst, int compressed, int reflink) {
+    if (compressed) {
+        char src_index[1024];
+        char dst_index[1024];
+        if (frame_index_path(src, src_index, sizeof(src_index)) != 0 ||
+            frame_index_path(dst, dst_index, sizeof(dst_index)) != 0) {
+            return -1;
+        }
+        int rc = reflink ? reflink_one(src_index, dst_index) : copy_one(src_index, dst_index);
+        if (rc != 0) return rc;
+    }
+
+    int rc = reflink ? reflink_one(src, dst) : copy_one(src, dst);
+    if (rc != 0 && compressed) {
+        frame_store_drop_index(dst);
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Copier thread
+// ---------------------------------------------------------------------------
+
+static void *copy_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&copy_lock);
+    for (;;) {
+        int k = -1;
+        for (int i = 0; i < CLONE_COPY_QUEUE && k < 0; i++) {
+            if (job_state[i] == 1) k = i;
+        }
+        if (copy_stopping) break;
+        if (k < 0) {
+            pthread_cond_wait(&copy_cond, &copy_lock);
+            continue;
+        }
+
+        job_state[k] = 2;
+        CloneJob *job = &jobs[k];
+        pthread_mutex_unlock(&copy_lock);
+
+        job->ok = clone_blob(job->src, job->tmp, job->compressed, 0) == 0;
+
+        pthread_mutex_lock(&copy_lock);
+        job_state[k] = 3;
+    }
+    pthread_mutex_unlock(&copy_lock);
+    return NULL;
+}
+
+int clone_start(void) {
+    pthread_mutex_lock(&copy_lock);
+    copy_stopping = 0;
+    memset(job_state, 0, sizeof(job_state));
+    int rc = pthread_create(&copy_thread, NULL, copy_main, NULL);
+    copy_running = (rc == 0);
+    pthread_mutex_unlock(&copy_lock);
+
+    if (rc != 0) {
+        fprintf(stderr, "[CLONE] Cannot start copier thread: %s\n", strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+void clone_stop(void) {
+    pthread_mutex_lock(&copy_lock);
+    if (!copy_running) {
+        pthread_mutex_unlock(&copy_lock);
+        return;
+    }
+    copy_stopping = 1;
+    pthread_cond_signal(&copy_cond);
+    pthread_mutex_unlock(&copy_lock);
+
+    // A copy in progress finishes first; its temp blob is left to the
+    // .part reaper
+    pthread_join(copy_thread, NULL);
+    copy_running = 0;
+}
+
+// Hand a copy to the thread. 0, or -1 if it is not running / queue full
+static int submit_copy(const CloneJob *job) {
+    pthread_mutex_lock(&copy_lock);
+    int k = -1;
+    for (int i = 0; copy_running && i < CLONE_COPY_QUEUE && k < 0; i++) {
+        if (job_state[i] == 0) k = i;
+    }
+    if (k >= 0) {
+        jobs[k] = *job;
+        job_state[k] = 1;
+        pthread_cond_signal(&copy_cond);
+    }
+    pthread_mutex_unlock(&copy_lock);
+    return k >= 0 ? 0 : -1;
+}
+
+// ---------------------------------------------------------------------------
+// Event loop side
+// ---------------------------------------------------------------------------
+
+// Move the finished blob into place and point the row at it
+static void switch_row(const CloneJob *job) {
+    int moved = job->compressed ? frame_store_commit(job->tmp, job->dst) == 0
+                                : rename(job->tmp, job->dst) == 0;
+    if (!moved) {
+        unlink(job->tmp);
+        frame_store_drop_index(job->tmp);
+        return;
+    }
+
+    char src[1024];
+    char dst[1024];
+    char query[2300];
+    mysql_real_escape_string(conn, src, job->src, strlen(job->src));
+    mysql_real_escape_string(conn, dst, job->dst, strlen(job->dst));
+    // Only if nothing moved the row to another blob meanwhile; the file
+    // itself did not change, so updated_at stays
+    snprintf(query, sizeof(query),
+             "UPDATE files SET file_path='%s', updated_at=updated_at "
+             "WHERE file_id=%d AND file_path='%s' AND pack_segment IS NULL",
+             dst, job->file_id, src);
+    if (mysql_query(conn, query) != 0 || mysql_affected_rows(conn) != 1) {
+        unlink(job->dst);
+        frame_store_drop_index(job->dst);
+        return;
+    }
+    file_cache_invalidate(job->file_id);
+}
+
+static int ensure_dir(const char *path) {
+    return (mkdir(path, 0755) == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+static void unshare_file(int file_id) {
+    char query[1200];
+    snprintf(query, sizeof(query),
+             "SELECT file_path, group_id, dir_id FROM files "
+             "WHERE file_id=%d AND is_deleted=0 AND pack_segment IS NULL",
+             file_id);
+    if (mysql_query(conn, query) != 0) return;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return;
+
+    CloneJob job;
+    memset(&job, 0, sizeof(job));
+    job.file_id = file_id;
+    int group_id = 0, dir_id = 0;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (row) {
+        snprintf(job.src, sizeof(job.src), "%s", row[0] ? row[0] : "");
+        group_id = row[1] ? atoi(row[1]) : 0;
+        dir_id = row[2] ? atoi(row[2]) : 0;
+    }
+    mysql_free_result(res);
+    if (!row || !job.src[0]) return;
+
+    // Only rows still sharing their blob with another one
+    char escaped[1024];
+    mysql_real_escape_string(conn, escaped, job.src, strlen(job.src));
+    snprintf(query, sizeof(query),
+             "SELECT COUNT(*) FROM files WHERE file_path='%s' AND pack_segment IS NULL", escaped);
+    if (mysql_query(conn, query) != 0) return;
+    res = mysql_store_result(conn);
+    if (!res) return;
+    row = mysql_fetch_row(res);
+    int sharing = (row && row[0]) ? atoi(row[0]) : 0;
+    mysql_free_result(res);
+    if (sharing < 2) return;
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s/group_%d", STORAGE_ROOT, group_id);
+    if (ensure_dir(STORAGE_ROOT) != 0 || ensure_dir(dir) != 0) return;
+    snprintf(dir, sizeof(dir), "%s/group_%d/dir_%d", STORAGE_ROOT, group_id, dir_id);
+    if (ensure_dir(dir) != 0) return;
+
+    snprintf(job.dst, sizeof(job.dst), "%s/copy_%d", dir, file_id);
+    snprintf(job.tmp, sizeof(job.tmp), "%s%s", job.dst, TMP_SUFFIX);
+    job.compressed = frame_store_is_compressed(job.src);
+
+    int rc = clone_blob(job.src, job.tmp, job.compressed, 1);
+    if (rc == 0) {
+        switch_row(&job);
+    } else if (rc == 1 && submit_copy(&job) != 0) {
+        log_info(-1, 0, "Copy queue full: file_id=%d keeps sharing %s", file_id, job.src);
+    }
+}
+
+// Copies the thread has finished
+static void collect_copies(void) {
+    pthread_mutex_lock(&copy_lock);
+    for (int i = 0; i < CLONE_COPY_QUEUE; i++) {
+        if (job_state[i] != 3) continue;
+        CloneJob job = jobs[i];
+        job_state[i] = 0;
+        pthread_mutex_unlock(&copy_lock);
+
+        if (job.ok) {
+            switch_row(&job);
+        } else {
+            log_error(-1, 0, "Copying %s for file_id=%d failed, it stays shared", job.src, job.file_id);
+        }
+
+        pthread_mutex_lock(&copy_lock);
+    }
+    pthread_mutex_unlock(&copy_lock);
+}
+
+static int copies_pending(void) {
+    pthread_mutex_lock(&copy_lock);
+    int busy = 0;
+    for (int i = 0; i < CLONE_COPY_QUEUE && !busy; i++) {
+        busy = job_state[i] != 0;
+    }
+    pthread_mutex_unlock(&copy_lock);
+    return busy;
+}
+
+int clone_poll(void) {
+    collect_copies();
+
+    int budget = CLONE_BATCH;
+    while (budget > 0 && target_count > 0) {
+        CloneTarget *t = &targets[target_head];
+        if (t->dir_id == 0) {
+            unshare_file(t->file_id);
+            budget--;
+        } else {
+            // A directory a page at a time, remembering where it got to
+            char query[256];
+            snprintf(query, sizeof(query),
+                     "SELECT file_id FROM files WHERE dir_id=%d AND file_id>%d AND is_deleted=0 "
+                     "AND pack_segment IS NULL ORDER BY file_id LIMIT %d",
+                     t->dir_id, t->file_id, budget);
+            MYSQL_RES *res = (mysql_query(conn, query) == 0) ? mysql_store_result(conn) : NULL;
+            int ids[CLONE_BATCH];
+            int n = 0;
+            MYSQL_ROW row;
+            while (res && n < budget && (row = mysql_fetch_row(res))) {
+                ids[n++] = row[0] ? atoi(row[0]) : 0;
+            }
+            if (res) mysql_free_result(res);
+
+            for (int i = 0; i < n; i++) {
+                unshare_file(ids[i]);
+                t->file_id = ids[i];
+            }
+            budget -= n;
+            if (n > 0 && budget == 0) break;      // maybe more in this directory
+        }
+        target_head = (target_head + 1) % CLONE_QUEUE_LEN;
+        target_count--;
+    }
+    return (target_count > 0 || copies_pending()) ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef BLOB_CLONE_H
+#define BLOB_CLONE_H
+
+// COPY_ITEM / COPY_ITEMS commit rows that share the original's file_path,
+// so the copy is instant whatever its size. Afterwards every copied file
+// is given a blob of its own, "<dir>/copy_<file_id>" in the storage
+// directory of its new row:
+//
+//   - ioctl(FICLONE) first, from the event loop: on reflink filesystems
+//     (XFS, btrfs) this shares extents copy-on-write, instant and taking
+//     no space until one side changes
+//   - otherwise a copier thread streams the bytes with copy_file_range()
+//     and the event loop switches the row over once it is done
+//
+// The row only moves to the new path if it still names the old one, and
+// a compressed blob's frame index is cloned with it. Packed files stay
+// shared: their entry lives in a segment, not in a file of their own.
+// Nothing depends on the unsharing having happened (GC still checks for
+// shared paths), so when a queue is full a copy simply stays shared.
+#define CLONE_QUEUE_LEN 1024         // files / directories waiting to be unshared
+#define CLONE_BATCH 32               // files unshared per clone_poll()
+#define CLONE_COPY_QUEUE 256         // files waiting for the copier thread
+#define CLONE_COPY_CHUNK (1024 * 1024)
+
+// Start / stop the copier thread. Blobs it has not finished stay shared
+int clone_start(void);
+void clone_stop(void);
+
+// A copy was committed: unshare file_id, or every file of dir_id
+void clone_queue_file(int file_id);
+void clone_queue_dir(int dir_id);
+
+// Event loop: clone what is queued, switch over finished copies. 1 if
+// work is left, 0 when idle
+int clone_poll(void);
+
+#endif
@@ -0,0 +1,487 @@
+#include "dir_tree.h"
+#include "../database/db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct {
+    int dir_id;
+    int parent_id;
+    int alive;                 // 0 once removed (the slot stays until reload)
+    char *name;
+    uint64_t version;
+    int parent;                // node index, -1 = none / not loaded
+    int first_child;           // children are kept sorted by name
+    int next_sibling;
+} DirNode;
+
+typedef struct {
+    int group_id;              // 0 = free slot
+    int root_id;
+    uint64_t version;
+    uint64_t used;             // LRU tick
+    DirNode *nodes;
+    int count;
+    int cap;
+    int dead;
+    int *slots;                // open addressing on dir_id: node index + 1, 0 = empty
+    int slot_cap;              // power of two
+} GroupTree;
+
+static GroupTree trees[DIR_TREE_MAX_GROUPS];
+static uint64_t lru_tick = 0;
+// Shared by every tree and never reused, so a version seen before an
+// eviction or restart does not come back for different contents
+static uint64_t version_clock = 0;
+
+static uint64_t next_version(void) {
+    return ++version_clock;
+}
+
+// ---------------------------------------------------------------------------
+// Node storage
+// ---------------------------------------------------------------------------
+
+static int find_node(const GroupTree *t, int dir_id) {
+    if (!t->slot_cap) return -1;
+    unsigned int mask = (unsigned int)t->slot_cap - 1;
+    for (unsigned int h = ((unsigned int)dir_id * 2654435761u) & mask;; h = (h + 1) & mask) {
+        int s = t->slots[h];
+        if (s == 0) return -1;
+        if (t->nodes[s - 1].dir_id == dir_id) return s - 1;
+    }
+}
+
+static int live_node(const GroupTree *t, int dir_id) {
+    int i = find_node(t, dir_id);
+    return (i >= 0 && t->nodes[i].alive) ? i : -1;
+}
+
+static void slot_insert(GroupTree *t, int node) {
+    unsigned int mask = (unsigned int)t->slot_cap - 1;
+    unsigned int h = ((unsigned int)t->nodes[node].dir_id * 2654435761u) & mask;
+    while (t->slots[h]) h = (h + 1) & mask;
+    t->slots[h] = node + 1;
+}
+
+static int reserve_nodes(GroupTree *t, int need) {
+    if (need > t->cap) {
+        int cap = t->cap ? t->cap : 64;
+        while (cap < need) cap *= 2;
+        DirNode *nodes = (DirNode *)realloc(t->nodes, (size_t)cap * sizeof(DirNode));
+        if (!nodes) return -1;
+        t->nodes = nodes;
+        t->cap = cap;
+    }
+
+    // Keep the hash at most half full
+    if (need * 2 > t->slot_cap) {
+        int cap = t->slot_cap ? t->slot_cap : 128;
+        while (cap < need * 2) cap *= 2;
+        int *slots = (int *)calloc((size_t)cap, sizeof(int));
+        if (!slots) return -1;
+        free(t->slots);
+        t->slots = slots;
+        t->slot_cap = cap;
+        for (int i = 0; i < t->count; i++) slot_insert(t, i);
+    }
+    return 0;
+}
+
+static int append_node(GroupTree *t, int dir_id, int parent_id, const char *name) {
+    if (reserve_nodes(t, t->count + 1) != 0) return -1;
+
+    char *copy = strdup(name ? name : "");
+    if (!copy) return -1;
+
+    int i = t->count++;
+    DirNode *n = &t->nodes[i];
+    memset(n, 0, sizeof(*n));
+    n->dir_id = dir_id;
+    n->parent_id = parent_id;
+    n->alive = 1;
+    n->name = copy;
+    n->version = next_version();
+    n->parent = -1;
+    n->first_child = -1;
+    n->next_sibling = -1;
+    slot_insert(t, i);
+    return i;
+}
+
+// Insert node into its parent's child list, keeping the list sorted
+static void link_child(GroupTree *t, int node) {
+    DirNode *n = &t->nodes[node];
+    int p = n->parent_id ? live_node(t, n->parent_id) : -1;
+    n->parent = p;
+    n->next_sibling = -1;
+    if (p < 0) return;
+
+    int *link = &t->nodes[p].first_child;
+    while (*link >= 0 && strcasecmp(t->nodes[*link].name, n->name) <= 0) {
+        link = &t->nodes[*link].next_sibling;
+    }
+    n->next_sibling = *link;
+    *link = node;
+}
+
+static void unlink_child(GroupTree *t, int node) {
+    int p = t->nodes[node].parent;
+    if (p < 0) return;
+
+    int *link = &t->nodes[p].first_child;
+    while (*link >= 0 && *link != node) link = &t->nodes[*link].next_sibling;
+    if (*link == node) *link = t->nodes[node].next_sibling;
+    t->nodes[node].parent = -1;
+    t->nodes[node].next_sibling = -1;
+}
+
+static void touch_node(GroupTree *t, int node) {
+    if (node >= 0) t->nodes[node].version = next_version();
+    t->version = next_version();
+}
+
+static void free_tree(GroupTree *t) {
+    for (int i = 0; i < t->count; i++) free(t->nodes[i].name);
+    free(t->nodes);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+// ---------------------------------------------------------------------------
+// Loading
+// ---------------------------------------------------------------------------
+
+static const GroupTree *sort_tree;
+
+static int by_name_desc(const void *a, const void *b) {
+    const DirNode *x = &sort_tree->nodes[*(const int *)a];
+    const DirNode *y = &sort_tree->nodes[*(const int *)b];
+    return strcasecmp(y->name, x->name);
+}
+
+// Returns 1 loaded, 0 group does not exist, -1 DB error
+static int load_tree(GroupTree *t, int group_id) {
+    char query[256];
+    snprintf(query, sizeof(query),
+             "SELECT root_dir_id FROM `groups` WHERE group_id=%d", group_id);
+    if (mysql_query(conn, query) != 0) return -1;
+
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (!row) {
+        mysql_free_result(res);
+        return 0;
+    }
+    int root_id = row[0] ? atoi(row[0]) : 0;
+    mysql_free_result(res);
+
+    snprintf(query, sizeof(query),
+             "SELECT dir_id, COALESCE(parent_dir_id, 0), dir_name FROM directories "
+             "WHERE group_id=%d AND is_deleted=0",
+             group_id);
+    if (mysql_query(conn, query) != 0) return -1;
+    res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    memset(t, 0, sizeof(*t));
+    t->group_id = group_id;
+    t->root_id = root_id;
+
+    int rows = (int)mysql_num_rows(res);
+    if (reserve_nodes(t, rows > 0 ? rows : 1) != 0) {
+        mysql_free_result(res);
+        free_tree(t);
+        return -1;
+    }
+    while ((row = mysql_fetch_row(res))) {
+        if (append_node(t, atoi(row[0]), atoi(row[1]), row[2]) < 0) {
+            mysql_free_result(res);
+            free_tree(t);
+            return -1;
+        }
+    }
+    mysql_free_result(res);
+
+    // Link in descending name order with push-front: lists come out sorted
+    int *order = (int *)malloc((size_t)(t->count > 0 ? t->count : 1) * sizeof(int));
+    if (!order) {
+        free_tree(t);
+        return -1;
+    }
+    for (int i = 0; i < t->count; i++) order[i] = i;
+    sort_tree = t;
+    qsort(order, (size_t)t->count, sizeof(int), by_name_desc);
+    for (int k = 0; k < t->count; k++) {
+        DirNode *n = &t->nodes[order[k]];
+        n->parent = n->parent_id ? live_node(t, n->parent_id) : -1;
+        if (n->parent >= 0) {
+            n->next_sibling = t->nodes[n->parent].first_child;
+            t->nodes[n->parent].first_child = order[k];
+        }
+    }
+    free(order);
+
+    t->version = next_version();
+    return 1;
+}
+
+static GroupTree *loaded_tree(int group_id) {
+    for (int i = 0; i < DIR_TREE_MAX_GROUPS; i++) {
+        if (trees[i].group_id == group_id) {
+            trees[i].used = ++lru_tick;
+            return &trees[i];
+        }
+    }
+    return NULL;
+}
+
+// Tree of the group, loading it if needed. NULL with *rc = 0 when the
+// group does not exist, -1 on DB error.
+static GroupTree *get_tree(int group_id, int *rc) {
+    *rc = -1;
+    if (group_id <= 0) {
+        *rc = 0;
+        return NULL;
+    }
+
+    GroupTree *t = loaded_tree(group_id);
+    if (t) return t;
+
+    GroupTree *slot = &trees[0];
+    for (int i = 0; i < DIR_TREE_MAX_GROUPS; i++) {
+        if (trees[i].group_id == 0) {
+            slot = &trees[i];
+            break;
+        }
+        if (trees[i].used < slot->used) slot = &trees[i];
+    }
+    free_tree(slot);
+
+    *rc = load_tree(slot, group_id);
+    if (*rc <= 0) return NULL;
+    slot->used = ++lru_tick;
+    return slot;
+}
+
+static void fill_info(const DirNode *n, DirInfo *out) {
+    out->dir_id = n->dir_id;
+    out->parent_id = n->parent_id;
+    out->name = n->name;
+    out->version = n->version;
+}
+
+// ---------------------------------------------------------------------------
+// Queries
+// ---------------------------------------------------------------------------
+
+void dir_tree_init(void) {
+    for (int i = 0; i < DIR_TREE_MAX_GROUPS; i++) free_tree(&trees[i]);
+    lru_tick = 0;
+    version_clock = (uint64_t)time(NULL) << 20;
+}
+
+int dir_tree_root(int group_id) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    return t ? t->root_id : rc;
+}
+
+int dir_tree_lookup(int group_id, int dir_id, DirInfo *out) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    if (!t) return rc;
+
+    int i = live_node(t, dir_id);
+    if (i < 0) return 0;
+    if (out) fill_info(&t->nodes[i], out);
+    return 1;
+}
+
+int dir_tree_is_within(int group_id, int dir_id, int ancestor_id) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    if (!t) return rc;
+
+    int i = live_node(t, dir_id);
+    for (int depth = 0; i >= 0 && depth < DIR_TREE_MAX_DEPTH; depth++) {
+        if (t->nodes[i].dir_id == ancestor_id) return 1;
+        i = t->nodes[i].parent;
+    }
+    return 0;
+}
+
+int dir_tree_children(int group_id, int dir_id, DirInfo *out, int max) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    if (!t) return -1;
+
+    int i = live_node(t, dir_id);
+    if (i < 0) return -1;
+
+    int n = 0;
+    for (int c = t->nodes[i].first_child; c >= 0; c = t->nodes[c].next_sibling) {
+        if (n < max) fill_info(&t->nodes[c], &out[n]);
+        n++;
+    }
+    return n;
+}
+
+int dir_tree_subtree(int group_id, int dir_id, int *out, int max) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    if (!t) return -1;
+
+    int start = live_node(t, dir_id);
+    if (start < 0) return -1;
+
+    // Pre-order walk over the child / sibling links, no stack needed
+    int n = 0;
+    int i = start;
+    while (i >= 0) {
+        if (n < max) out[n] = t->nodes[i].dir_id;
+        n++;
+
+        if (t->nodes[i].first_child >= 0) {
+            i = t->nodes[i].first_child;
+            continue;
+        }
+        while (i != start && t->nodes[i].next_sibling < 0) i = t->nodes[i].parent;
+        i = (i == start) ? -1 : t->nodes[i].next_sibling;
+    }
+    return n;
+}
+
+int dir_tree_path(int group_id, int dir_id, char *buf, size_t size) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    if (!t || size == 0) return -1;
+
+    int chain[DIR_TREE_MAX_DEPTH];
+    int depth = 0;
+    for (int i = live_node(t, dir_id); i >= 0; i = t->nodes[i].parent) {
+        if (depth == DIR_TREE_MAX_DEPTH) return -1;
+        chain[depth++] = i;
+    }
+    if (depth == 0) return -1;
+
+    size_t len = 0;
+    buf[0] = '\0';
+    while (depth-- > 0) {
+        int w = snprintf(buf + len, size - len, "/%s", t->nodes[chain[depth]].name);
+        if (w < 0 || (size_t)w >= size - len) return -1;
+        len += (size_t)w;
+    }
+    return (int)len;
+}
+
+uint64_t dir_tree_group_version(int group_id) {
+    int rc;
+    GroupTree *t = get_tree(group_id, &rc);
+    return t ? t->version : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Write-through
+// ---------------------------------------------------------------------------
+
+void dir_tree_added(int group_id, int dir_id, int parent_id, const char *name) {
+    GroupTree *t = loaded_tree(group_id);
+    if (!t) return;
+
+    if (find_node(t, dir_id) >= 0) {
+        // Should not happen (ids are never reused): start over from the DB
+        dir_tree_invalidate(group_id);
+        return;
+    }
+
+    int i = append_node(t, dir_id, parent_id, name);
+    if (i < 0) {
+        dir_tree_invalidate(group_id);
+        return;
+    }
+    link_child(t, i);
+    touch_node(t, t->nodes[i].parent);
+}
+
+void dir_tree_renamed(int group_id, int dir_id, const char *name) {
+    GroupTree *t = loaded_tree(group_id);
+    if (!t) return;
+
+    int i = live_node(t, dir_id);
+    char *copy = strdup(name ? name : "");
+    if (i < 0 || !copy) {
+        free(copy);
+        dir_tree_invalidate(group_id);
+        return;
+    }
+
+    unlink_child(t, i);
+    free(t->nodes[i].name);
+    t->nodes[i].name = copy;
+    link_child(t, i);
+    touch_node(t, i);
+    touch_node(t, t->nodes[i].parent);
+}
+
+void dir_tree_moved(int group_id, int dir_id, int new_parent_id) {
+    GroupTree *t = loaded_tree(group_id);
+    if (!t) return;
+
+    int i = live_node(t, dir_id);
+    if (i < 0) {
+        dir_tree_invalidate(group_id);
+        return;
+    }
+
+    int old_parent = t->nodes[i].parent;
+    unlink_child(t, i);
+    t->nodes[i].parent_id = new_parent_id;
+    link_child(t, i);
+    touch_node(t, old_parent);
+    touch_node(t, t->nodes[i].parent);
+}
+
+void dir_tree_removed(int group_id, int dir_id) {
+    GroupTree *t = loaded_tree(group_id);
+    if (!t) return;
+
+    int start = live_node(t, dir_id);
+    if (start < 0) return;
+
+    int parent = t->nodes[start].parent;
+    unlink_child(t, start);
+
+    // Same walk as dir_tree_subtree; the links of dead nodes stay intact
+    int i = start;
+    while (i >= 0) {
+        t->nodes[i].alive = 0;
+        t->dead++;
+        if (t->nodes[i].first_child >= 0) {
+            i = t->nodes[i].first_child;
+            continue;
+        }
+        while (i != start && t->nodes[i].next_sibling < 0) i = t->nodes[i].parent;
+        i = (i == start) ? -1 : t->nodes[i].next_sibling;
+    }
+    touch_node(t, parent);
+
+    // Mostly tombstones: cheaper to read the group again when needed
+    if (t->dead > 64 && t->dead * 2 > t->count) free_tree(t);
+}
+
+void dir_tree_touch(int group_id, int dir_id) {
+    GroupTree *t = loaded_tree(group_id);
+    if (!t) return;
+    touch_node(t, live_node(t, dir_id));
+}
+
+void dir_tree_invalidate(int group_id) {
+    for (int i = 0; i < DIR_TREE_MAX_GROUPS; i++) {
+        if (trees[i].group_id == group_id) free_tree(&trees[i]);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef DIR_TREE_H
+#define DIR_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-memory index of each group's live directories: dir_id -> node with
+// parent, children and name. A group's tree is read from the DB in one
+// query the first time it is needed and kept until evicted (LRU over
+// DIR_TREE_MAX_GROUPS); the handlers that change `directories` update
+// it write-through after their transaction commits, so ancestry checks,
+// path resolution and subtree enumeration never touch the DB.
+//
+// Every directory carries a version that is bumped whenever what a
+// listing of it shows changes (a child directory or file added, removed
+// or renamed); each group has a version bumped on any change in it.
+#define DIR_TREE_MAX_GROUPS 64
+#define DIR_TREE_MAX_DEPTH 1024     // deeper chains are treated as corrupt
+
+typedef struct {
+    int dir_id;
+    int parent_id;                  // 0 = group root
+    const char *name;               // valid until the next dir_tree_* call
+    uint64_t version;
+} DirInfo;
+
+void dir_tree_init(void);
+
+// Root directory of the group: > 0, 0 if the group does not exist, -1 on DB error
+int dir_tree_root(int group_id);
+
+// 1 and *out filled if dir_id is a live directory of the group, 0 if not,
+// -1 on DB error. out may be NULL.
+int dir_tree_lookup(int group_id, int dir_id, DirInfo *out);
+
+// 1 if dir_id is ancestor_id or lies below it, 0 if not, -1 on DB error
+int dir_tree_is_within(int group_id, int dir_id, int ancestor_id);
+
+// Live child directories of dir_id, sorted by name (case-insensitive).
+// Returns how many there are (at most max are stored), -1 on error.
+int dir_tree_children(int group_id, int dir_id, DirInfo *out, int max);
+
+// dir_id and every directory below it, parents before children.
+// Returns the count (at most max are stored), -1 on error.
+int dir_tree_subtree(int group_id, int dir_id, int *out, int max);
+
+// "/<root>/a/b" into buf. Returns its length, -1 on error / too long.
+int dir_tree_path(int group_id, int dir_id, char *buf, size_t size);
+
+// Group version (0 on error)
+uint64_t dir_tree_group_version(int group_id);
+
+// Write-through, called after the change is committed. Groups not
+// loaded are left alone (they are read fresh when next needed).
+void dir_tree_added(int group_id, int dir_id, int parent_id, const char *name);
+void dir_tree_renamed(int group_id, int dir_id, const char *name);
+void dir_tree_moved(int group_id, int dir_id, int new_parent_id);
+void dir_tree_removed(int group_id, int dir_id);     // with its subtree
+void dir_tree_touch(int group_id, int dir_id);       // files inside changed
+
+// Forget the group's tree (e.g. a transaction that already updated it
+// rolled back); it is read again on next use
+void dir_tree_invalidate(int group_id);
+
+#endif
@@ -0,0 +1,167 @@
+#include "fd_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+typedef struct {
+    int in_use;
+    int fd;                    // -1 while closed
+    int flags;                 // flags for reopening
+    mode_t mode;
+    time_t last_used;
+    char path[4096];
+} FdSlot;
+
+static FdSlot slots[FD_CACHE_HANDLES];
+static int open_count = 0;
+
+static void close_slot_fd(FdSlot *s) {
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+        open_count--;
+    }
+}
+
+// Close the least recently used descriptor if the budget is spent
+static void make_room(void) {
+    while (open_count >= FD_CACHE_BUDGET) {
+        FdSlot *victim = NULL;
+        for (int i = 0; i < FD_CACHE_HANDLES; i++) {
+            if (slots[i].in_use && slots[i].fd >= 0 &&
+                (!victim || slots[i].last_used < victim->last_used)) {
+                victim = &slots[i];
+            }
+        }
+        if (!victim) return;
+        close_slot_fd(victim);
+    }
+}
+
+static int slot_open(FdSlot *s, int flags) {
+    make_room();
+
+    int fd;
+    do {
+        fd = open(s->path, flags, s->mode);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) return -1;
+
+    s->fd = fd;
+    s->last_used = time(NULL);
+    open_count++;
+    return 0;
+}
+
+static FdSlot *get_slot(int handle) {
+    if (handle < 0 || handle >= FD_CACHE_HANDLES || !slots[handle].in_use) {
+        return NULL;
+    }
+    return &slots[handle];
+}
+
+void fd_cache_init(void) {
+    for (int i = 0; i < FD_CACHE_HANDLES; i++) {
+        memset(&slots[i], 0, sizeof(slots[i]));
+        slots[i].fd = -1;
+    }
+    open_count = 0;
+}
+
+int fd_cache_open(const char *path, int flags, mode_t mode) {
+    if (!path || strlen(path) >= sizeof(slots[0].path)) return -1;
+
+    for (int i = 0; i < FD_CACHE_HANDLES; i++) {
+        FdSlot *s = &slots[i];
+        if (s->in_use) continue;
+
+        strcpy(s->path, path);
+        s->mode = mode;
+        s->fd = -1;
+        if (slot_open(s, flags) != 0) {
+            return -1;
+        }
+        s->in_use = 1;
+        s->flags = flags & ~(O_CREAT | O_TRUNC | O_EXCL);
+        return i;
+    }
+    return -1;
+}
+
+void fd_cache_close(int handle) {
+    FdSlot *s = get_slot(handle);
+    if (!s) return;
+
+    close_slot_fd(s);
+    s->in_use = 0;
+    s->path[0] = '\0';
+}
+
+int fd_cache_fd(int handle) {
+    FdSlot *s = get_slot(handle);
+    if (!s) return -1;
+
+    if (s->fd < 0 && slot_open(s, s->flags) != 0) {
+        return -1;
+    }
+    s->last_used = time(NULL);
+    return s->fd;
+}
+
+long fd_cache_pread(int handle, void *buf, size_t len, uint64_t offset) {
+    int fd = fd_cache_fd(handle);
+    if (fd < 0) return -1;
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (unsigned char *)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (long)done;
+}
+
+int fd_cache_pwrite(int handle, const void *buf, size_t len, uint64_t offset) {
+    int fd = fd_cache_fd(handle);
+    if (fd < 0) return -1;
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const unsigned char *)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+long fd_cache_size(int handle) {
+    int fd = fd_cache_fd(handle);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    return (long)st.st_size;
+}
+
+void fd_cache_close_idle(time_t now) {
+    for (int i = 0; i < FD_CACHE_HANDLES; i++) {
+        FdSlot *s = &slots[i];
+        if (s->in_use && s->fd >= 0 && now - s->last_used >= FD_CACHE_IDLE_SECONDS) {
+            close_slot_fd(s);
+        }
+    }
+}
+
+int fd_cache_open_count(void) {
+    return open_count;
+}
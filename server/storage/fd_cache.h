@@ -0,0 +1,43 @@
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Table of file handles kept open for the lifetime of a transfer.
+// A handle remembers its path, so the descriptor behind it can be
+// closed at any time (idle timeout, fd budget) and is reopened
+// transparently on the next access. At most FD_CACHE_BUDGET
+// descriptors are open at once; the least recently used one is closed
+// to make room.
+#define FD_CACHE_HANDLES 64
+#define FD_CACHE_BUDGET 32
+#define FD_CACHE_IDLE_SECONDS 30
+
+void fd_cache_init(void);
+
+// Open path and return a handle, or -1. O_CREAT/O_TRUNC/O_EXCL only
+// apply to this first open, never to a later reopen.
+int fd_cache_open(const char *path, int flags, mode_t mode);
+void fd_cache_close(int handle);
+
+// Descriptor behind handle, reopened if it had been closed; -1 on error
+int fd_cache_fd(int handle);
+
+// Positioned I/O. pread returns bytes read (short only at EOF) or -1;
+// pwrite writes everything or returns -1
+long fd_cache_pread(int handle, void *buf, size_t len, uint64_t offset);
+int fd_cache_pwrite(int handle, const void *buf, size_t len, uint64_t offset);
+
+// Current size of the file behind handle, or -1
+long fd_cache_size(int handle);
+
+// Close descriptors unused for FD_CACHE_IDLE_SECONDS (handles stay valid)
+void fd_cache_close_idle(time_t now);
+
+// Descriptors currently open
+int fd_cache_open_count(void);
+
+#endif
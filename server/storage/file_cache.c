@@ -0,0 +1,264 @@
+#include "file_cache.h"
+#include "frame_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+} BlobStamp;
+
+typedef struct {
+    int file_id;               // 0 = free slot
+    unsigned int generation;   // meta_generation when meta was loaded
+    FileMeta meta;
+    int ref;                   // CLOCK reference bit
+    int reads;                 // downloads started while in the table
+    unsigned char *data;       // resident content (NULL = not cached)
+    size_t data_len;
+    BlobStamp stamp;           // blob the content was read from
+} FileCacheEntry;
+
+static FileCacheEntry entries[FILE_CACHE_SLOTS];
+static unsigned int meta_generation = 1;
+static int clock_hand = 0;
+static size_t resident_bytes = 0;
+
+static FileCacheEntry *find_entry(int file_id) {
+    // The table is small; a linear scan of the ids costs less than
+    // the single syscall it saves
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++) {
+        if (entries[i].file_id == file_id) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_content(FileCacheEntry *e) {
+    if (e->data) {
+        resident_bytes -= e->data_len;
+        free(e->data);
+        e->data = NULL;
+        e->data_len = 0;
+    }
+}
+
+static void clear_entry(FileCacheEntry *e) {
+    drop_content(e);
+    memset(e, 0, sizeof(*e));
+}
+
+// Advance the hand until an entry without its reference bit turns up.
+// With content_only set, only entries holding content qualify and only
+// their content is dropped.
+static FileCacheEntry *clock_evict(int content_only) {
+    for (int step = 0; step < 2 * FILE_CACHE_SLOTS; step++) {
+        FileCacheEntry *e = &entries[clock_hand];
+        clock_hand = (clock_hand + 1) % FILE_CACHE_SLOTS;
+
+        if (e->file_id == 0) {
+            if (!content_only) return e;
+            continue;
+        }
+        if (content_only && !e->data) continue;
+
+        if (e->ref) {
+            e->ref = 0;
+            continue;
+        }
+
+        if (content_only) {
+            drop_content(e);
+        } else {
+            clear_entry(e);
+        }
+        return e;
+    }
+    return NULL;
+}
+
+static int stamp_blob(const char *path, BlobStamp *out) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+
+    memset(out, 0, sizeof(*out));
+    out->dev = st.st_dev;
+    out->ino = st.st_ino;
+    out->size = st.st_size;
+    out->mtime = st.st_mtime;
+    out->ctime = st.st_ctime;
+    return 0;
+}
+
+static int same_stamp(const BlobStamp *a, const BlobStamp *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+static int read_raw_blob(const char *path, unsigned char *buf, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, (off_t)done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+    return done == len ? 0 : -1;
+}
+
+static int load_content(FileCacheEntry *e) {
+    size_t len = (size_t)e->meta.size;
+    if (len > FILE_CACHE_MAX_FILE) return -1;
+
+    while (resident_bytes + len > FILE_CACHE_BUDGET) {
+        if (!clock_evict(1)) return -1;
+    }
+
+    BlobStamp stamp;
+    if (stamp_blob(e->meta.path, &stamp) != 0) return -1;
+
+    unsigned char *data = (unsigned char *)malloc(len > 0 ? len : 1);
+    if (!data) return -1;
+
+    int rc;
+    if (frame_store_is_compressed(e->meta.path)) {
+        FrameReader r;
+        rc = frame_reader_open(&r, e->meta.path);
+        if (rc == 0) {
+            long n = (len > 0) ? frame_reader_pread(&r, data, len, 0) : 0;
+            rc = (n == (long)len) ? 0 : -1;
+            frame_reader_close(&r);
+        }
+    } else {
+        rc = ((off_t)len == stamp.size) ? read_raw_blob(e->meta.path, data, len) : -1;
+    }
+
+    if (rc != 0) {
+        free(data);
+        return -1;
+    }
+
+    e->data = data;
+    e->data_len = len;
+    e->stamp = stamp;
+    resident_bytes += len;
+    return 0;
+}
+
+void file_cache_init(void) {
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++) {
+        clear_entry(&entries[i]);
+    }
+    meta_generation = 1;
+    clock_hand = 0;
+    resident_bytes = 0;
+}
+
+const FileMeta *file_cache_get_meta(int file_id) {
+    if (file_id <= 0) return NULL;
+
+    FileCacheEntry *e = find_entry(file_id);
+    if (!e || e->generation != meta_generation) return NULL;
+
+    e->ref = 1;
+    return &e->meta;
+}
+
+void file_cache_put_meta(int file_id, const FileMeta *meta) {
+    if (file_id <= 0 || !meta) return;
+
+    FileCacheEntry *e = find_entry(file_id);
+    if (e) {
+        // Stale entry refreshed: content may belong to another path/size
+        if (strcmp(e->meta.path, meta->path) != 0 || e->meta.size != meta->size) {
+            drop_content(e);
+        }
+    } else {
+        e = clock_evict(0);
+        if (!e) return;
+        e->file_id = file_id;
+    }
+
+    e->meta = *meta;
+    e->generation = meta_generation;
+    e->ref = 1;
+}
+
+void file_cache_invalidate(int file_id) {
+    FileCacheEntry *e = find_entry(file_id);
+    if (e) {
+        clear_entry(e);
+    }
+}
+
+void file_cache_invalidate_all(void) {
+    // Metadata goes stale lazily; content is still checked against its stamp
+    meta_generation++;
+}
+
+int file_cache_begin_read(int file_id) {
+    FileCacheEntry *e = find_entry(file_id);
+    if (!e || e->generation != meta_generation) return 0;
+
+    e->ref = 1;
+    e->reads++;
+
+    // Packed files are one pread from a segment the page cache already holds
+    if (e->meta.pack_segment > 0) return 0;
+
+    if (e->data) {
+        BlobStamp now;
+        if (stamp_blob(e->meta.path, &now) == 0 && same_stamp(&now, &e->stamp)) {
+            return 1;
+        }
+        // Blob replaced or removed under us (e.g. re-upload to the same name)
+        drop_content(e);
+    }
+
+    if (e->reads >= FILE_CACHE_ADMIT_HITS && e->meta.size <= FILE_CACHE_MAX_FILE) {
+        return load_content(e) == 0;
+    }
+    return 0;
+}
+
+long file_cache_read(int file_id, void *buf, size_t len, uint64_t offset) {
+    FileCacheEntry *e = find_entry(file_id);
+    if (!e || !e->data || e->generation != meta_generation) return -1;
+
+    e->ref = 1;
+    if (offset >= e->data_len) return 0;
+
+    size_t avail = e->data_len - (size_t)offset;
+    if (len > avail) len = avail;
+    memcpy(buf, e->data + offset, len);
+    return (long)len;
+}
+
+size_t file_cache_bytes(void) {
+    return resident_bytes;
+}
+
+int file_cache_entries(void) {
+    int n = 0;
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++) {
+        if (entries[i].file_id != 0) n++;
+    }
+    return n;
+}
@@ -0,0 +1,62 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Bounded in-memory cache of file metadata and small file contents,
+// keyed by file_id. Metadata entries carry the generation they were
+// loaded under; any command that changes rows in `files` invalidates
+// them. Content carries a stamp of the on-disk blob (inode, size,
+// mtime) and is revalidated when a download starts.
+//
+// Replacement is CLOCK over a fixed slot table. Content is only
+// admitted on the second download of a file and only up to
+// FILE_CACHE_MAX_FILE, so one-off or large downloads never push the
+// hot set out.
+#define FILE_CACHE_SLOTS 256
+#define FILE_CACHE_MAX_FILE (1024 * 1024)
+#define FILE_CACHE_BUDGET (64 * 1024 * 1024)
+#define FILE_CACHE_ADMIT_HITS 2
+
+#define FILE_CACHE_NAME_LEN 256
+#define FILE_CACHE_PATH_LEN 4096
+#define FILE_CACHE_SHA_LEN 65
+
+typedef struct {
+    char name[FILE_CACHE_NAME_LEN];
+    char path[FILE_CACHE_PATH_LEN];
+    long size;
+    int dir_id;
+    int group_id;
+    char sha256[FILE_CACHE_SHA_LEN];
+    int pack_segment;          // > 0: packed, data at pack_offset in that segment
+    uint64_t pack_offset;
+} FileMeta;
+
+void file_cache_init(void);
+
+// Cached metadata of file_id, or NULL on miss / stale entry
+const FileMeta *file_cache_get_meta(int file_id);
+void file_cache_put_meta(int file_id, const FileMeta *meta);
+
+// Drop one file / every file (after DELETE, RENAME, MOVE of rows in `files`)
+void file_cache_invalidate(int file_id);
+void file_cache_invalidate_all(void);
+
+// Called once per download (chunk 1 or a new file_id on the connection):
+// revalidates cached content against the blob on disk, counts the access
+// and loads the content once the file has proven hot.
+// Returns 1 if content is resident, 0 otherwise.
+int file_cache_begin_read(int file_id);
+
+// Copy len bytes at offset from cached content. Returns bytes copied,
+// or -1 if the content is not resident (caller reads from disk)
+long file_cache_read(int file_id, void *buf, size_t len, uint64_t offset);
+
+// Resident content bytes / slots in use (for logging)
+size_t file_cache_bytes(void);
+int file_cache_entries(void);
+
+#endif
@@ -0,0 +1,347 @@
+#include "frame_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define FRAME_INDEX_MAGIC "FIDX"
+#define FRAME_INDEX_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t codec;
+    uint32_t frame_size;
+    uint64_t raw_size;
+    uint64_t frame_count;
+} FrameIndexHeader;
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all_at(int fd, void *buf, size_t len, uint64_t offset) {
+    unsigned char *p = (unsigned char *)buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+int frame_index_path(const char *path, char *out, size_t out_size) {
+    int written = snprintf(out, out_size, "%s%s", path, FRAME_INDEX_SUFFIX);
+    if (written <= 0 || written >= (int)out_size) {
+        return -1;
+    }
+    return 0;
+}
+
+int frame_store_is_compressed(const char *path) {
+    char index_path[4096];
+    if (frame_index_path(path, index_path, sizeof(index_path)) != 0) {
+        return 0;
+    }
+    return access(index_path, F_OK) == 0;
+}
+
+// ============================
+// Writer
+// ============================
+
+int frame_writer_open(FrameWriter *w, const char *path, CodecType codec) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+
+    if (codec == CODEC_NONE) return -1;
+    if (strlen(path) >= sizeof(w->path)) return -1;
+
+    w->codec = codec;
+    w->frame = (unsigned char *)malloc(FRAME_RAW_SIZE);
+    w->scratch_cap = codec_bound(codec, FRAME_RAW_SIZE);
+    w->scratch = (unsigned char *)malloc(w->scratch_cap);
+    w->offsets_cap = 16;
+    w->offsets = (uint64_t *)malloc(w->offsets_cap * sizeof(uint64_t));
+    if (!w->frame || !w->scratch || !w->offsets) {
+        frame_writer_abort(w);
+        return -1;
+    }
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        frame_writer_abort(w);
+        return -1;
+    }
+    strcpy(w->path, path);
+    return 0;
+}
+
+static int flush_frame(FrameWriter *w) {
+    if (w->frame_len == 0) return 0;
+
+    int n = codec_compress(w->codec, w->frame, w->frame_len, w->scratch, w->scratch_cap);
+    if (n < 0) return -1;
+
+    if (w->frame_count == w->offsets_cap) {
+        size_t new_cap = w->offsets_cap * 2;
+        uint64_t *grown = (uint64_t *)realloc(w->offsets, new_cap * sizeof(uint64_t));
+        if (!grown) return -1;
+        w->offsets = grown;
+        w->offsets_cap = new_cap;
+    }
+
+    if (write_all(w->fd, w->scratch, (size_t)n) != 0) return -1;
+
+    w->offsets[w->frame_count++] = w->data_size;
+    w->data_size += (uint64_t)n;
+    w->frame_len = 0;
+    return 0;
+}
+
+int frame_writer_append(FrameWriter *w, const void *data, size_t len) {
+    if (w->fd < 0) return -1;
+
+    const unsigned char *p = (const unsigned char *)data;
+    while (len > 0) {
+        size_t room = FRAME_RAW_SIZE - w->frame_len;
+        size_t take = len < room ? len : room;
+        memcpy(w->frame + w->frame_len, p, take);
+        w->frame_len += take;
+        w->raw_size += take;
+        p += take;
+        len -= take;
+
+        if (w->frame_len == FRAME_RAW_SIZE && flush_frame(w) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int frame_writer_finish(FrameWriter *w) {
+    if (w->fd < 0) return -1;
+    if (flush_frame(w) != 0) {
+        frame_writer_abort(w);
+        return -1;
+    }
+
+    close(w->fd);
+    w->fd = -1;
+
+    char index_path[4096];
+    if (frame_index_path(w->path, index_path, sizeof(index_path)) != 0) {
+        frame_writer_abort(w);
+        return -1;
+    }
+
+    int fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        frame_writer_abort(w);
+        return -1;
+    }
+
+    FrameIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FRAME_INDEX_MAGIC, 4);
+    hdr.version = FRAME_INDEX_VERSION;
+    hdr.codec = (uint32_t)w->codec;
+    hdr.frame_size = FRAME_RAW_SIZE;
+    hdr.raw_size = w->raw_size;
+    hdr.frame_count = w->frame_count;
+
+    // Trailing sentinel = total compressed size, so frame i spans [off[i], off[i+1])
+    int rc = write_all(fd, &hdr, sizeof(hdr));
+    if (rc == 0 && w->frame_count > 0) {
+        rc = write_all(fd, w->offsets, w->frame_count * sizeof(uint64_t));
+    }
+    if (rc == 0) {
+        rc = write_all(fd, &w->data_size, sizeof(w->data_size));
+    }
+    close(fd);
+
+    free(w->frame);
+    free(w->scratch);
+    free(w->offsets);
+    w->frame = NULL;
+    w->scratch = NULL;
+    w->offsets = NULL;
+
+    if (rc != 0) {
+        unlink(index_path);
+        unlink(w->path);
+        return -1;
+    }
+    return 0;
+}
+
+void frame_writer_abort(FrameWriter *w) {
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    free(w->frame);
+    free(w->scratch);
+    free(w->offsets);
+    w->frame = NULL;
+    w->scratch = NULL;
+    w->offsets = NULL;
+    w->frame_len = 0;
+}
+
+int frame_store_commit(const char *temp_path, const char *final_path) {
+    char temp_index[4096];
+    char final_index[4096];
+    if (frame_index_path(temp_path, temp_index, sizeof(temp_index)) != 0 ||
+        frame_index_path(final_path, final_index, sizeof(final_index)) != 0) {
+        return -1;
+    }
+
+    // Index first: a data file without its index would be served as plain bytes
+    if (rename(temp_index, final_index) != 0) {
+        return -1;
+    }
+    if (rename(temp_path, final_path) != 0) {
+        unlink(final_index);
+        return -1;
+    }
+    return 0;
+}
+
+void frame_store_drop_index(const char *path) {
+    char index_path[4096];
+    if (frame_index_path(path, index_path, sizeof(index_path)) == 0) {
+        unlink(index_path);
+    }
+}
+
+// ============================
+// Reader
+// ============================
+
+int frame_reader_open(FrameReader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->cached_frame = -1;
+
+    char index_path[4096];
+    if (frame_index_path(path, index_path, sizeof(index_path)) != 0) {
+        return -1;
+    }
+
+    int ifd = open(index_path, O_RDONLY);
+    if (ifd < 0) return -1;
+
+    FrameIndexHeader hdr;
+    if (read_all_at(ifd, &hdr, sizeof(hdr), 0) != 0 ||
+        memcmp(hdr.magic, FRAME_INDEX_MAGIC, 4) != 0 ||
+        hdr.version != FRAME_INDEX_VERSION ||
+        hdr.frame_size == 0 || hdr.frame_size > FRAME_RAW_SIZE) {
+        close(ifd);
+        return -1;
+    }
+
+    size_t count = (size_t)hdr.frame_count;
+    r->offsets = (uint64_t *)malloc((count + 1) * sizeof(uint64_t));
+    if (!r->offsets ||
+        read_all_at(ifd, r->offsets, (count + 1) * sizeof(uint64_t), sizeof(hdr)) != 0) {
+        close(ifd);
+        frame_reader_close(r);
+        return -1;
+    }
+    close(ifd);
+
+    r->codec = (CodecType)hdr.codec;
+    r->frame_size = hdr.frame_size;
+    r->raw_size = hdr.raw_size;
+    r->frame_count = count;
+    r->cache = (unsigned char *)malloc(r->frame_size);
+    r->scratch_cap = codec_bound(r->codec, r->frame_size);
+    r->scratch = (unsigned char *)malloc(r->scratch_cap);
+    if (!r->cache || !r->scratch) {
+        frame_reader_close(r);
+        return -1;
+    }
+
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        frame_reader_close(r);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_frame(FrameReader *r, size_t frame) {
+    if ((long)frame == r->cached_frame) return 0;
+
+    uint64_t start = r->offsets[frame];
+    uint64_t end = r->offsets[frame + 1];
+    if (end < start || end - start > r->scratch_cap) return -1;
+
+    size_t comp_len = (size_t)(end - start);
+    if (read_all_at(r->fd, r->scratch, comp_len, start) != 0) return -1;
+
+    int n = codec_decompress(r->codec, r->scratch, comp_len, r->cache, r->frame_size);
+    if (n < 0) return -1;
+
+    r->cached_frame = (long)frame;
+    r->cached_len = (size_t)n;
+    return 0;
+}
+
+long frame_reader_pread(FrameReader *r, void *buf, size_t len, uint64_t offset) {
+    if (r->fd < 0) return -1;
+    if (offset >= r->raw_size) return 0;
+    if (len > r->raw_size - offset) len = (size_t)(r->raw_size - offset);
+
+    unsigned char *out = (unsigned char *)buf;
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        size_t frame = (size_t)(pos / r->frame_size);
+        if (frame >= r->frame_count || load_frame(r, frame) != 0) {
+            return -1;
+        }
+
+        size_t in_frame = (size_t)(pos % r->frame_size);
+        if (in_frame >= r->cached_len) return -1;
+
+        size_t take = r->cached_len - in_frame;
+        if (take > len - done) take = len - done;
+        memcpy(out + done, r->cache + in_frame, take);
+        done += take;
+    }
+    return (long)done;
+}
+
+void frame_reader_close(FrameReader *r) {
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    free(r->offsets);
+    free(r->cache);
+    free(r->scratch);
+    r->offsets = NULL;
+    r->cache = NULL;
+    r->scratch = NULL;
+    r->cached_frame = -1;
+}
@@ -0,0 +1,67 @@
+#ifndef FRAME_STORE_H
+#define FRAME_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../utils/compress.h"
+
+// Blobs stored compressed on disk are cut into independently compressed
+// frames of FRAME_RAW_SIZE raw bytes. A side index "<path>.zidx" records
+// where every frame starts, so any byte range can be served by
+// decompressing only the frames that cover it.
+#define FRAME_RAW_SIZE (64 * 1024)
+#define FRAME_INDEX_SUFFIX ".zidx"
+
+typedef struct {
+    int fd;
+    CodecType codec;
+    unsigned char *frame;      // raw bytes of the frame being filled
+    size_t frame_len;
+    unsigned char *scratch;    // compressed output of one frame
+    size_t scratch_cap;
+    uint64_t *offsets;         // compressed offset of each frame start
+    size_t frame_count;
+    size_t offsets_cap;
+    uint64_t raw_size;
+    uint64_t data_size;
+    char path[4096];
+} FrameWriter;
+
+typedef struct {
+    int fd;
+    CodecType codec;
+    uint32_t frame_size;
+    uint64_t raw_size;
+    uint64_t *offsets;         // frame_count + 1 entries
+    size_t frame_count;
+    unsigned char *cache;      // last decompressed frame
+    long cached_frame;
+    size_t cached_len;
+    unsigned char *scratch;
+    size_t scratch_cap;
+} FrameReader;
+
+// "<path>.zidx"
+int frame_index_path(const char *path, char *out, size_t out_size);
+
+// 1 if path has a frame index (stored compressed), 0 otherwise
+int frame_store_is_compressed(const char *path);
+
+// Writer: path is the (temporary) data file; its index goes next to it
+int frame_writer_open(FrameWriter *w, const char *path, CodecType codec);
+int frame_writer_append(FrameWriter *w, const void *data, size_t len);
+int frame_writer_finish(FrameWriter *w);
+void frame_writer_abort(FrameWriter *w);
+
+// Move a finished temp blob and its index to their final names
+int frame_store_commit(const char *temp_path, const char *final_path);
+
+// Remove the index of path if any (used when a plain upload replaces a compressed one)
+void frame_store_drop_index(const char *path);
+
+// Reader: random access by raw offset
+int frame_reader_open(FrameReader *r, const char *path);
+long frame_reader_pread(FrameReader *r, void *buf, size_t len, uint64_t offset);
+void frame_reader_close(FrameReader *r);
+
+#endif
@@ -0,0 +1,790 @@
+#include "fsck.h"
+#include "frame_store.h"
+#include "pack_store.h"
+#include "../protocol/transfer.h"
+#include "../database/db.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#define FSCK_IO_SIZE (64 * 1024)
+#define FSCK_CLAIM 32                // rows a worker takes at a time
+
+typedef enum {
+    ROW_OK = 0,
+    ROW_MISSING,                     // no blob / no pack entry
+    ROW_SIZE,                        // holds a different number of bytes
+    ROW_HASH,                        // content differs from content_sha256
+    ROW_IO_ERROR                     // could not be checked
+} RowVerdict;
+
+typedef struct {
+    int file_id;
+    long long size;
+    int pack_segment;
+    long long pack_offset;
+    char sha256[SHA256_HEX_LEN];
+    char path[512];
+    RowVerdict verdict;
+} FsckRow;
+
+// Per worker: the pack segment last read stays open, rows of one upload
+// burst sit next to each other in file_id order and in the segment
+typedef struct {
+    int segment;
+    int fd;
+    long long segment_size;
+    unsigned char buf[FSCK_IO_SIZE];
+} WorkerCtx;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;             // a page was handed out, or stopping
+    pthread_cond_t done;             // the page is finished
+    FsckRow *rows;
+    int count;
+    int next;
+    int finished;
+    int stopping;
+    int verify_hash;
+} Pool;
+
+// Online check state (event loop thread, except where noted)
+static volatile sig_atomic_t online_requested = 0;
+static pthread_mutex_t online_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t online_thread;
+static int online_running = 0;      // started and not joined yet
+static int online_done = 0;         // under online_lock
+static int online_stopping = 0;     // under online_lock
+
+static int stop_requested(void) {
+    pthread_mutex_lock(&online_lock);
+    int stop = online_stopping;
+    pthread_mutex_unlock(&online_lock);
+    return stop;
+}
+
+// ---------------------------------------------------------------------------
+// Checking one row (worker threads: no DB access here)
+// ---------------------------------------------------------------------------
+
+// SHA-256 of size bytes read through r, or from fd at base. 0, or -1 on
+// read error
+static int hash_content(WorkerCtx *ctx, FrameReader *r, int fd, long long base,
+                        long long size, char *hex) {
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    if (!md || EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(md);
+        return -1;
+    }
+
+    long long done = 0;
+    while (done < size) {
+        size_t want = (size - done < FSCK_IO_SIZE) ? (size_t)(size - done) : FSCK_IO_SIZE;
+        long n = r ? frame_reader_pread(r, ctx->buf, want, (uint64_t)done)
+                   : (long)pread(fd, ctx->buf, want, (off_t)(base + done));
+        if (n <= 0) break;
+        EVP_DigestUpdate(md, ctx->buf, (size_t)n);
+        done += n;
+    }
+
+    unsigned char digest[32];
+    unsigned int len = 0;
+    int ok = done == size && EVP_DigestFinal_ex(md, digest, &len) == 1 && len == sizeof(digest);
+    EVP_MD_CTX_free(md);
+    if (!ok) return -1;
+
+    for (unsigned int i = 0; i < len; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+static RowVerdict verdict_of_hash(WorkerCtx *ctx, const FsckRow *row, FrameReader *r, int fd,
+                                  long long base) {
+    char hex[SHA256_HEX_LEN];
+    if (hash_content(ctx, r, fd, base, row->size, hex) != 0) return ROW_IO_ERROR;
+    return strcasecmp(hex, row->sha256) == 0 ? ROW_OK : ROW_HASH;
+}
+
+static RowVerdict check_packed(WorkerCtx *ctx, const FsckRow *row, int verify_hash) {
+    if (ctx->segment != row->pack_segment) {
+        if (ctx->fd >= 0) close(ctx->fd);
+        ctx->segment = 0;
+
+        char path[256];
+        struct stat st;
+        pack_segment_path(row->pack_segment, path, sizeof(path));
+        ctx->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (ctx->fd < 0) return errno == ENOENT ? ROW_MISSING : ROW_IO_ERROR;
+        if (fstat(ctx->fd, &st) != 0) {
+            close(ctx->fd);
+            ctx->fd = -1;
+            return ROW_IO_ERROR;
+        }
+        ctx->segment = row->pack_segment;
+        ctx->segment_size = (long long)st.st_size;
+    }
+
+    // The entry header right before the data says how long it is
+    PackEntryHeader h;
+    long long header_at = row->pack_offset - (long long)sizeof(h);
+    if (header_at < 0 || row->pack_offset + row->size > ctx->segment_size) return ROW_MISSING;
+    if (pread(ctx->fd, &h, sizeof(h), (off_t)header_at) != (ssize_t)sizeof(h)) return ROW_IO_ERROR;
+    if (memcmp(h.magic, PACK_ENTRY_MAGIC, sizeof(h.magic)) != 0) return ROW_MISSING;
+    if ((long long)h.length != row->size) return ROW_SIZE;
+
+    if (verify_hash && row->sha256[0]) {
+        return verdict_of_hash(ctx, row, NULL, ctx->fd, row->pack_offset);
+    }
+    return ROW_OK;
+}
+
+static RowVerdict check_blob(WorkerCtx *ctx, const FsckRow *row, int verify_hash) {
+    if (frame_store_is_compressed(row->path)) {
+        FrameReader r;
+        if (frame_reader_open(&r, row->path) != 0) {
+            return access(row->path, F_OK) != 0 && errno == ENOENT ? ROW_MISSING : ROW_IO_ERROR;
+        }
+        RowVerdict v = ((long long)r.raw_size != row->size) ? ROW_SIZE : ROW_OK;
+        if (v == ROW_OK && verify_hash && row->sha256[0]) {
+            v = verdict_of_hash(ctx, row, &r, -1, 0);
+        }
+        frame_reader_close(&r);
+        return v;
+    }
+
+    struct stat st;
+    if (stat(row->path, &st) != 0) return errno == ENOENT ? ROW_MISSING : ROW_IO_ERROR;
+    if (!S_ISREG(st.st_mode)) return ROW_MISSING;
+    if ((long long)st.st_size != row->size) return ROW_SIZE;
+
+    if (verify_hash && row->sha256[0]) {
+        int fd = open(row->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return ROW_IO_ERROR;
+        RowVerdict v = verdict_of_hash(ctx, row, NULL, fd, 0);
+        close(fd);
+        return v;
+    }
+    return ROW_OK;
+}
+
+static void check_row(WorkerCtx *ctx, FsckRow *row, int verify_hash) {
+    row->verdict = (row->pack_segment > 0) ? check_packed(ctx, row, verify_hash)
+                                           : check_blob(ctx, row, verify_hash);
+}
+
+// ---------------------------------------------------------------------------
+// Worker pool
+// ---------------------------------------------------------------------------
+
+static void *worker_main(void *arg) {
+    Pool *p = (Pool *)arg;
+    WorkerCtx *ctx = (WorkerCtx *)malloc(sizeof(WorkerCtx));
+    if (ctx) {
+        ctx->segment = 0;
+        ctx->fd = -1;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stopping && p->next >= p->count) {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+        if (p->stopping) break;
+
+        int first = p->next;
+        int last = (first + FSCK_CLAIM < p->count) ? first + FSCK_CLAIM : p->count;
+        p->next = last;
+        FsckRow *rows = p->rows;
+        int verify_hash = p->verify_hash;
+        pthread_mutex_unlock(&p->lock);
+
+        for (int i = first; i < last; i++) {
+            if (ctx) {
+                check_row(ctx, &rows[i], verify_hash);
+            } else {
+                rows[i].verdict = ROW_IO_ERROR;
+            }
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->finished += last - first;
+        if (p->finished == p->count) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (ctx) {
+        if (ctx->fd >= 0) close(ctx->fd);
+        free(ctx);
+    }
+    return NULL;
+}
+
+static void pool_submit(Pool *p, FsckRow *rows, int count) {
+    pthread_mutex_lock(&p->lock);
+    p->rows = rows;
+    p->count = count;
+    p->next = 0;
+    p->finished = 0;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pool_wait(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->finished < p->count) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// ---------------------------------------------------------------------------
+// Rows
+// ---------------------------------------------------------------------------
+
+static void fill_row(FsckRow *r, MYSQL_ROW row) {
+    r->file_id = row[0] ? atoi(row[0]) : 0;
+    snprintf(r->path, sizeof(r->path), "%s", row[1] ? row[1] : "");
+    r->size = row[2] ? atoll(row[2]) : 0;
+    r->pack_segment = row[3] ? atoi(row[3]) : 0;
+    r->pack_offset = row[4] ? atoll(row[4]) : 0;
+    snprintf(r->sha256, sizeof(r->sha256), "%s", row[5] ? row[5] : "");
+    r->verdict = ROW_OK;
+}
+
+#define ROW_COLUMNS "file_id, file_path, file_size, pack_segment, pack_offset, content_sha256"
+
+// Next keyset page of live rows after *last_id. Rows read, or -1
+static int fetch_page(MYSQL *db, int *last_id, FsckRow *rows) {
+    char query[256];
+    snprintf(query, sizeof(query),
+             "SELECT " ROW_COLUMNS " FROM files WHERE file_id>%d AND is_deleted=0 "
+             "ORDER BY file_id LIMIT %d",
+             *last_id, FSCK_PAGE_ROWS);
+    if (mysql_query(db, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(db);
+    if (!res) return -1;
+
+    int n = 0;
+    MYSQL_ROW row;
+    while (n < FSCK_PAGE_ROWS && (row = mysql_fetch_row(res))) {
+        fill_row(&rows[n], row);
+        *last_id = rows[n].file_id;
+        n++;
+    }
+    mysql_free_result(res);
+    return n;
+}
+
+static void report_rows(const FsckRow *rows, int n, FILE *plan, FsckStats *stats) {
+    static const char *reasons[] = { "", "missing", "size", "hash", "" };
+    for (int i = 0; i < n; i++) {
+        const FsckRow *r = &rows[i];
+        stats->rows++;
+        switch (r->verdict) {
+            case ROW_OK:
+                continue;
+            case ROW_MISSING: stats->missing++; break;
+            case ROW_SIZE: stats->size_mismatch++; break;
+            case ROW_HASH: stats->hash_mismatch++; break;
+            case ROW_IO_ERROR:
+                stats->errors++;
+                fprintf(plan, "# file_id %d: cannot read %s\n", r->file_id, r->path);
+                continue;
+        }
+        fprintf(plan, "delete-row %d %s %s\n", r->file_id, reasons[r->verdict], r->path);
+    }
+}
+
+static int check_rows(MYSQL *db, const FsckOptions *opt, FILE *plan, FsckStats *stats) {
+    int workers = opt->workers;
+    if (workers < 1) workers = 1;
+    if (workers > FSCK_MAX_WORKERS) workers = FSCK_MAX_WORKERS;
+
+    // One page is checked while the next one is read
+    FsckRow *cur = (FsckRow *)malloc(FSCK_PAGE_ROWS * sizeof(FsckRow));
+    FsckRow *next = (FsckRow *)malloc(FSCK_PAGE_ROWS * sizeof(FsckRow));
+    if (!cur || !next) {
+        free(cur);
+        free(next);
+        return -1;
+    }
+
+    Pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.verify_hash = opt->verify_hash;
+
+    pthread_t threads[FSCK_MAX_WORKERS];
+    int started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, worker_main, &pool) == 0) {
+        started++;
+    }
+
+    int rc = (started > 0) ? 0 : -1;
+    int last_id = 0;
+    int n = (rc == 0) ? fetch_page(db, &last_id, cur) : 0;
+    if (n < 0) rc = -1;
+
+    while (rc == 0 && n > 0) {
+        if (stop_requested()) {
+            rc = -1;
+            break;
+        }
+        pool_submit(&pool, cur, n);
+        int next_n = (n == FSCK_PAGE_ROWS) ? fetch_page(db, &last_id, next) : 0;
+        pool_wait(&pool);
+        report_rows(cur, n, plan, stats);
+
+        if (next_n < 0) rc = -1;
+        FsckRow *tmp = cur;
+        cur = next;
+        next = tmp;
+        n = next_n;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work);
+    pthread_cond_destroy(&pool.done);
+
+    free(cur);
+    free(next);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Orphans
+// ---------------------------------------------------------------------------
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Changed too recently to be called an orphan
+static int too_young(const struct stat *st, time_t now) {
+    time_t changed = (st->st_ctime > st->st_mtime) ? st->st_ctime : st->st_mtime;
+    return now - changed < FSCK_ORPHAN_GRACE_S;
+}
+
+// Names of the blobs rows and versions use in dir (sorted, caller
+// frees). Count, or -1
+static int referenced_names(MYSQL *db, const char *dir, char ***out) {
+    char escaped[1024];
+    mysql_real_escape_string(db, escaped, dir, strlen(dir));
+
+    // LIKE prefix: '_' and '%' of the path are literal
+    char pattern[2100];
+    size_t len = 0;
+    for (const char *p = escaped; *p && len + 3 < sizeof(pattern); p++) {
+        if (*p == '_' || *p == '%') pattern[len++] = '\\';
+        pattern[len++] = *p;
+    }
+    pattern[len] = '\0';
+
+    char query[4400];
+    snprintf(query, sizeof(query),
+             "SELECT file_path FROM files WHERE file_path LIKE '%s/%%' "
+             "AND pack_segment IS NULL "
+             "UNION SELECT file_path FROM file_versions WHERE file_path LIKE '%s/%%'",
+             pattern, pattern);
+    if (mysql_query(db, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(db);
+    if (!res) return -1;
+
+    int cap = (int)mysql_num_rows(res);
+    char **names = (char **)malloc((cap > 0 ? cap : 1) * sizeof(char *));
+    if (!names) {
+        mysql_free_result(res);
+        return -1;
+    }
+
+    size_t dir_len = strlen(dir);
+    int n = 0;
+    MYSQL_ROW row;
+    while (n < cap && (row = mysql_fetch_row(res))) {
+        if (!row[0] || strncmp(row[0], dir, dir_len) != 0 || row[0][dir_len] != '/') continue;
+        const char *name = row[0] + dir_len + 1;
+        if (strchr(name, '/')) continue;
+        names[n] = strdup(name);
+        if (names[n]) n++;
+    }
+    mysql_free_result(res);
+
+    qsort(names, n, sizeof(char *), cmp_str);
+    *out = names;
+    return n;
+}
+
+static int check_dir(MYSQL *db, const char *dir, time_t now, FILE *plan, FsckStats *stats) {
+    char **names = NULL;
+    int count = referenced_names(db, dir, &names);
+    if (count < 0) return -1;
+
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        // Partial uploads are the .part reaper's; an index goes with its blob
+        if (name[0] == '.' || ends_with(name, TMP_SUFFIX) ||
+            ends_with(name, TMP_SUFFIX FRAME_INDEX_SUFFIX) || ends_with(name, FRAME_INDEX_SUFFIX)) {
+            continue;
+        }
+        if (bsearch(&name, names, count, sizeof(char *), cmp_str)) continue;
+
+        char path[1024];
+        struct stat st;
+        int w = snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (w < 0 || (size_t)w >= sizeof(path)) continue;
+        if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || too_young(&st, now)) continue;
+
+        stats->orphans++;
+        stats->orphan_bytes += (long long)st.st_size;
+        fprintf(plan, "unlink %lld %s\n", (long long)st.st_size, path);
+    }
+    if (d) closedir(d);
+
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+// Every storage/group_G/dir_D directory
+static int check_orphan_blobs(MYSQL *db, FILE *plan, FsckStats *stats) {
+    DIR *root = opendir(STORAGE_ROOT);
+    if (!root) return 0;                // nothing stored yet
+
+    time_t now = time(NULL);
+    int rc = 0;
+    struct dirent *g;
+    while (rc == 0 && (g = readdir(root)) != NULL) {
+        if (strncmp(g->d_name, "group_", 6) != 0) continue;
+
+        char group_dir[512];
+        snprintf(group_dir, sizeof(group_dir), "%s/%s", STORAGE_ROOT, g->d_name);
+        DIR *gd = opendir(group_dir);
+        struct dirent *de;
+        while (rc == 0 && gd && (de = readdir(gd)) != NULL) {
+            if (strncmp(de->d_name, "dir_", 4) != 0) continue;
+
+            char dir[800];
+            snprintf(dir, sizeof(dir), "%s/%s", group_dir, de->d_name);
+            rc = check_dir(db, dir, now, plan, stats);
+            if (rc == 0 && stop_requested()) rc = -1;
+        }
+        if (gd) closedir(gd);
+    }
+    closedir(root);
+    return rc;
+}
+
+static int check_orphan_segments(MYSQL *db, FILE *plan, FsckStats *stats) {
+    if (mysql_query(db, "SELECT DISTINCT pack_segment FROM files WHERE pack_segment IS NOT NULL") != 0) {
+        return -1;
+    }
+    MYSQL_RES *res = mysql_store_result(db);
+    if (!res) return -1;
+
+    int cap = (int)mysql_num_rows(res);
+    int *used = (int *)malloc((cap > 0 ? cap : 1) * sizeof(int));
+    if (!used) {
+        mysql_free_result(res);
+        return -1;
+    }
+    int count = 0;
+    MYSQL_ROW row;
+    while (count < cap && (row = mysql_fetch_row(res))) {
+        used[count++] = row[0] ? atoi(row[0]) : 0;
+    }
+    mysql_free_result(res);
+    qsort(used, count, sizeof(int), cmp_int);
+
+    DIR *d = opendir(PACK_DIR);
+    int newest = 0;
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        int id = pack_segment_id(de->d_name);
+        if (id > newest) newest = id;
+    }
+
+    time_t now = time(NULL);
+    if (d) rewinddir(d);
+    while (d && (de = readdir(d)) != NULL) {
+        int id = pack_segment_id(de->d_name);
+        // The newest one may be the segment the server is appending to
+        if (id == 0 || id == newest || bsearch(&id, used, count, sizeof(int), cmp_int)) continue;
+
+        char path[256];
+        struct stat st;
+        pack_segment_path(id, path, sizeof(path));
+        if (stat(path, &st) != 0 || too_young(&st, now)) continue;
+
+        stats->orphans++;
+        stats->orphan_bytes += (long long)st.st_size;
+        fprintf(plan, "unlink-segment %d\n", id);
+    }
+    if (d) closedir(d);
+    free(used);
+    return 0;
+}
+
+int fsck_run(MYSQL *db, const FsckOptions *opt, FILE *plan, FsckStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    time_t started = time(NULL);
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+    fprintf(plan, "# fsck plan, %s%s\n", when, opt->verify_hash ? ", content verified" : "");
+
+    int rc = check_rows(db, opt, plan, stats);
+    if (rc == 0 && opt->check_orphans) {
+        rc = check_orphan_blobs(db, plan, stats);
+        if (rc == 0) rc = check_orphan_segments(db, plan, stats);
+    }
+
+    fprintf(plan, "# %lld rows: %lld missing, %lld size, %lld hash, %lld unreadable; "
+                  "%lld orphans (%lld bytes); %ld s%s\n",
+            stats->rows, stats->missing, stats->size_mismatch, stats->hash_mismatch,
+            stats->errors, stats->orphans, stats->orphan_bytes, (long)(time(NULL) - started),
+            rc == 0 ? "" : "; INCOMPLETE");
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Applying a plan: every action is checked again first
+// ---------------------------------------------------------------------------
+
+// 1 applied, 0 skipped, -1 DB error
+static int apply_delete_row(MYSQL *db, int file_id, const char *reason) {
+    char query[256];
+    snprintf(query, sizeof(query),
+             "SELECT " ROW_COLUMNS " FROM files WHERE file_id=%d AND is_deleted=0", file_id);
+    if (mysql_query(db, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(db);
+    if (!res) return -1;
+
+    MYSQL_ROW row = mysql_fetch_row(res);
+    FsckRow r;
+    if (row) fill_row(&r, row);
+    mysql_free_result(res);
+    if (!row) return 0;
+
+    WorkerCtx *ctx = (WorkerCtx *)malloc(sizeof(WorkerCtx));
+    if (!ctx) return 0;
+    ctx->segment = 0;
+    ctx->fd = -1;
+    check_row(ctx, &r, strcmp(reason, "hash") == 0);
+    if (ctx->fd >= 0) close(ctx->fd);
+    free(ctx);
+    if (r.verdict != ROW_MISSING && r.verdict != ROW_SIZE && r.verdict != ROW_HASH) return 0;
+
+    // Soft delete like DELETE_ITEM; the aggregate reconciler corrects the
+    // directory totals on its next pass and GC purges the row later
+    snprintf(query, sizeof(query),
+             "UPDATE files SET is_deleted=1, deleted_at=NOW() WHERE file_id=%d AND is_deleted=0",
+             file_id);
+    if (mysql_query(db, query) != 0) return -1;
+    return mysql_affected_rows(db) > 0;
+}
+
+static int apply_unlink(MYSQL *db, const char *path) {
+    if (strncmp(path, STORAGE_ROOT "/", strlen(STORAGE_ROOT) + 1) != 0 || strstr(path, "/..")) {
+        return 0;
+    }
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || too_young(&st, time(NULL))) return 0;
+
+    char escaped[2048];
+    char query[4300];
+    mysql_real_escape_string(db, escaped, path, strlen(path));
+    snprintf(query, sizeof(query),
+             "SELECT 1 FROM files WHERE file_path='%s' AND pack_segment IS NULL "
+             "UNION ALL SELECT 1 FROM file_versions WHERE file_path='%s' LIMIT 1",
+             escaped, escaped);
+    if (mysql_query(db, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(db);
+    if (!res) return -1;
+    int referenced = mysql_num_rows(res) > 0;
+    mysql_free_result(res);
+    if (referenced || unlink(path) != 0) return 0;
+
+    frame_store_drop_index(path);
+    return 1;
+}
+
+static int apply_unlink_segment(MYSQL *db, int segment) {
+    char path[256];
+    struct stat st;
+    if (segment <= 0 || pack_segment_path(segment, path, sizeof(path)) != 0) return 0;
+    if (stat(path, &st) != 0 || too_young(&st, time(NULL))) return 0;
+
+    // Never the newest segment: it may be the one being appended to
+    DIR *d = opendir(PACK_DIR);
+    struct dirent *de;
+    int newer = 0;
+    while (d && !newer && (de = readdir(d)) != NULL) {
+        newer = pack_segment_id(de->d_name) > segment;
+    }
+    if (d) closedir(d);
+    if (!newer) return 0;
+
+    char query[128];
+    snprintf(query, sizeof(query), "SELECT 1 FROM files WHERE pack_segment=%d LIMIT 1", segment);
+    if (mysql_query(db, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(db);
+    if (!res) return -1;
+    int referenced = mysql_num_rows(res) > 0;
+    mysql_free_result(res);
+
+    return (!referenced && unlink(path) == 0) ? 1 : 0;
+}
+
+int fsck_apply(MYSQL *db, FILE *plan, int *skipped) {
+    char line[2048];
+    int applied = 0;
+    *skipped = 0;
+
+    while (fgets(line, sizeof(line), plan)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        int rc = 0;
+        int id = 0;
+        int off = 0;
+        long long bytes = 0;
+        char reason[16];
+        if (sscanf(line, "delete-row %d %15s", &id, reason) == 2) {
+            rc = apply_delete_row(db, id, reason);
+        } else if (sscanf(line, "unlink-segment %d", &id) == 1) {
+            rc = apply_unlink_segment(db, id);
+        } else if (sscanf(line, "unlink %lld %n", &bytes, &off) == 1 && off > 0) {
+            rc = apply_unlink(db, line + off);
+        }
+
+        if (rc < 0) return -1;
+        if (rc > 0) applied++;
+        else (*skipped)++;
+    }
+    return applied;
+}
+
+// ---------------------------------------------------------------------------
+// Online check
+// ---------------------------------------------------------------------------
+
+static void *online_main(void *arg) {
+    (void)arg;
+    mysql_thread_init();
+
+    MYSQL *db = db_connect();
+    if (db) {
+        const char *tmp = FSCK_PLAN_PATH ".tmp";
+        FILE *plan = fopen(tmp, "w");
+        if (plan) {
+            FsckOptions opt = { FSCK_DEFAULT_WORKERS, 0, 1 };
+            FsckStats stats;
+            int rc = fsck_run(db, &opt, plan, &stats);
+            fclose(plan);
+            if (rc == 0 && rename(tmp, FSCK_PLAN_PATH) == 0) {
+                fprintf(stderr, "[FSCK] %lld rows checked: %lld missing, %lld size, %lld unreadable, "
+                                "%lld orphans (%lld bytes); plan in %s\n",
+                        stats.rows, stats.missing, stats.size_mismatch, stats.errors,
+                        stats.orphans, stats.orphan_bytes, FSCK_PLAN_PATH);
+            } else {
+                unlink(tmp);
+                fprintf(stderr, "[FSCK] Check did not complete: %s\n", mysql_error(db));
+            }
+        } else {
+            fprintf(stderr, "[FSCK] Cannot write %s: %s\n", tmp, strerror(errno));
+        }
+        mysql_close(db);
+    }
+
+    pthread_mutex_lock(&online_lock);
+    online_done = 1;
+    pthread_mutex_unlock(&online_lock);
+    mysql_thread_end();
+    return NULL;
+}
+
+void fsck_request(void) {
+    online_requested = 1;
+}
+
+void fsck_poll_request(void) {
+    if (online_running) {
+        pthread_mutex_lock(&online_lock);
+        int done = online_done;
+        pthread_mutex_unlock(&online_lock);
+        if (done) {
+            pthread_join(online_thread, NULL);
+            online_running = 0;
+        }
+    }
+
+    if (!online_requested) return;
+    online_requested = 0;
+    if (online_running) {
+        fprintf(stderr, "[FSCK] A check is already running\n");
+        return;
+    }
+
+    pthread_mutex_lock(&online_lock);
+    online_done = 0;
+    online_stopping = 0;
+    pthread_mutex_unlock(&online_lock);
+
+    int rc = pthread_create(&online_thread, NULL, online_main, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "[FSCK] Cannot start check thread: %s\n", strerror(rc));
+        return;
+    }
+    online_running = 1;
+    fprintf(stderr, "[FSCK] Storage check started\n");
+}
+
+void fsck_stop(void) {
+    if (!online_running) return;
+
+    pthread_mutex_lock(&online_lock);
+    online_stopping = 1;
+    pthread_mutex_unlock(&online_lock);
+
+    pthread_join(online_thread, NULL);
+    online_running = 0;
+}
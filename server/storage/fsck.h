@@ -0,0 +1,67 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdio.h>
+#include <mysql/mysql.h>
+
+// Consistency check of the `files` table against storage/. Live rows are
+// streamed in keyset pages (file_id order) and their blobs checked by a
+// pool of worker threads while the next page is read: the blob or pack
+// entry must exist and hold file_size bytes, and with verify_hash its
+// content must match content_sha256. Afterwards every storage/group_G/
+// dir_D directory and every pack segment is compared with the paths
+// rows and file versions still use, which finds blobs nothing refers to
+// (e.g. a rename whose row INSERT failed).
+//
+// Nothing is changed while checking; problems are written as a repair
+// plan, one action per line:
+//
+//   delete-row <file_id> missing|size|hash <path>    soft-delete the row
+//   unlink <bytes> <path>                           blob without a row
+//   unlink-segment <segment>                        segment without a row
+//
+// fsck_apply() carries a plan out, checking every action again first, so
+// a plan made while the server was running is safe to apply later.
+// Blobs changed less than FSCK_ORPHAN_GRACE_S ago are never orphans:
+// an upload in flight may not have its row yet.
+//
+// Offline: the storage_fsck tool. Online: SIGUSR1 makes the server run a
+// check in a background thread with its own connection, writing
+// FSCK_PLAN_PATH (it never repairs anything itself).
+#define FSCK_PAGE_ROWS 4096
+#define FSCK_DEFAULT_WORKERS 8
+#define FSCK_MAX_WORKERS 64
+#define FSCK_ORPHAN_GRACE_S (15 * 60)
+#define FSCK_PLAN_PATH "./fsck_plan.txt"
+
+typedef struct {
+    int workers;
+    int verify_hash;                 // read and hash every blob (slow)
+    int check_orphans;
+} FsckOptions;
+
+typedef struct {
+    long long rows;
+    long long missing;
+    long long size_mismatch;
+    long long hash_mismatch;
+    long long orphans;
+    long long orphan_bytes;
+    long long errors;                // could not be checked (I/O errors)
+} FsckStats;
+
+// Check everything on connection db and write the plan. 0, or -1 on DB
+// error / stop request (the plan is then incomplete)
+int fsck_run(MYSQL *db, const FsckOptions *opt, FILE *plan, FsckStats *stats);
+
+// Apply a plan. Returns the number of actions carried out (*skipped: no
+// longer true, or malformed), or -1 on DB error
+int fsck_apply(MYSQL *db, FILE *plan, int *skipped);
+
+// Online check (server). fsck_request() is safe in a signal handler; the
+// event loop calls fsck_poll_request() to start the thread.
+void fsck_request(void);
+void fsck_poll_request(void);
+void fsck_stop(void);
+
+#endif
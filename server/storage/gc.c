@@ -0,0 +1,253 @@
+#include "gc.h"
+#include "file_cache.h"
+#include "frame_store.h"
+#include "versions.h"
+#include "../protocol/transfer.h"
+#include "../database/db.h"
+#include "../utils/logger.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    int file_id;
+    int packed;
+    char path[512];
+} PurgedFile;
+
+typedef struct {
+    int dir_id;
+    int group_id;
+} PurgedDir;
+
+typedef struct {
+    int version_id;
+    char path[512];
+} PurgedVersion;
+
+// Comma-separated ids into out. 0, or -1 if they do not fit
+static int id_list(const int *ids, int n, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        int w = snprintf(out + len, size - len, "%s%d", i ? "," : "", ids[i]);
+        if (w < 0 || (size_t)w >= size - len) return -1;
+        len += (size_t)w;
+    }
+    return 0;
+}
+
+// Is path still the blob of some row (live, deleted, or a copy) or of
+// some version? 1, 0, -1
+static int path_referenced(const char *path) {
+    char escaped[1024];
+    char query[2300];
+    mysql_real_escape_string(conn, escaped, path, strlen(path));
+    snprintf(query, sizeof(query),
+             "SELECT 1 FROM files WHERE file_path='%s' AND pack_segment IS NULL "
+             "UNION ALL SELECT 1 FROM file_versions WHERE file_path='%s' LIMIT 1",
+             escaped, escaped);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+    int found = mysql_num_rows(res) > 0;
+    mysql_free_result(res);
+    return found;
+}
+
+// The rows are gone now: whatever still names the path keeps it
+static void unlink_unreferenced(const char *path, int *unlinked) {
+    if (!path[0] || path_referenced(path) != 0) return;
+    if (unlink(path) == 0) {
+        (*unlinked)++;
+    }
+    frame_store_drop_index(path);
+}
+
+// Version rows matching where (up to max), deleted. Count (*out, caller
+// frees), or -1
+static int take_versions(const char *where, int max, PurgedVersion **out) {
+    char query[1024];
+    snprintf(query, sizeof(query),
+             "SELECT v.version_id, v.file_path FROM file_versions v %s "
+             "ORDER BY v.version_id LIMIT %d",
+             where, max);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    int cap = (int)mysql_num_rows(res);
+    PurgedVersion *versions = (PurgedVersion *)malloc((cap > 0 ? cap : 1) * sizeof(PurgedVersion));
+    int *ids = (int *)malloc((cap > 0 ? cap : 1) * sizeof(int));
+    int n = 0;
+    MYSQL_ROW row;
+    while (versions && ids && n < cap && (row = mysql_fetch_row(res))) {
+        versions[n].version_id = row[0] ? atoi(row[0]) : 0;
+        snprintf(versions[n].path, sizeof(versions[n].path), "%s", row[1] ? row[1] : "");
+        ids[n] = versions[n].version_id;
+        n++;
+    }
+    mysql_free_result(res);
+
+    size_t list_size = (size_t)(n > 0 ? n : 1) * 12;
+    char *list = (char *)malloc(list_size);
+    char *delete_query = (char *)malloc(list_size + 64);
+    int rc = (versions && ids && list && delete_query) ? 0 : -1;
+    if (rc == 0 && n > 0) {
+        rc = id_list(ids, n, list, list_size);
+        if (rc == 0) {
+            snprintf(delete_query, list_size + 64,
+                     "DELETE FROM file_versions WHERE version_id IN (%s)", list);
+            rc = mysql_query(conn, delete_query) == 0 ? 0 : -1;
+        }
+    }
+    free(delete_query);
+    free(list);
+    free(ids);
+    if (rc != 0) {
+        free(versions);
+        return -1;
+    }
+    *out = versions;
+    return n;
+}
+
+// Versions past retention: beyond the newest VERSION_KEEP of their file,
+// or archived more than VERSION_MAX_AGE_DAYS ago. Oldest first, so a
+// delta never outlives the newer version it is based on. Rows purged, or -1
+static int purge_versions(int budget, int *unlinked) {
+    char where[512];
+    snprintf(where, sizeof(where),
+             "JOIN (SELECT file_id, MAX(version_no) AS newest FROM file_versions "
+             "GROUP BY file_id) t ON t.file_id=v.file_id "
+             "WHERE v.version_no <= t.newest - %d "
+             "OR v.archived_at < NOW() - INTERVAL %d DAY",
+             VERSION_KEEP, VERSION_MAX_AGE_DAYS);
+    PurgedVersion *versions = NULL;
+    int n = take_versions(where, budget, &versions);
+    for (int i = 0; i < n; i++) {
+        unlink_unreferenced(versions[i].path, unlinked);
+    }
+    free(versions);
+    return n;
+}
+
+// Purge up to budget expired file rows and unlink the blobs left without
+// a row. Rows purged, or -1
+static int purge_files(int budget, int *unlinked) {
+    char query[512];
+    snprintf(query, sizeof(query),
+             "SELECT file_id, file_path, pack_segment FROM files "
+             "WHERE is_deleted=1 AND deleted_at < NOW() - INTERVAL %d DAY "
+             "ORDER BY file_id LIMIT %d",
+             GC_RETENTION_DAYS, budget);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    PurgedFile rows[GC_BUDGET];
+    int ids[GC_BUDGET];
+    int n = 0;
+    MYSQL_ROW row;
+    while (n < budget && (row = mysql_fetch_row(res))) {
+        PurgedFile *f = &rows[n];
+        f->file_id = row[0] ? atoi(row[0]) : 0;
+        snprintf(f->path, sizeof(f->path), "%s", row[1] ? row[1] : "");
+        f->packed = row[2] != NULL;
+        ids[n++] = f->file_id;
+    }
+    mysql_free_result(res);
+    if (n == 0) return 0;
+
+    // Their versions go first (they refer to the rows), in the same transaction
+    char list[GC_BUDGET * 12];
+    char where[GC_BUDGET * 12 + 64];
+    if (id_list(ids, n, list, sizeof(list)) != 0) return -1;
+    snprintf(where, sizeof(where), "WHERE v.file_id IN (%s)", list);
+    if (db_begin() != 0) return -1;
+    PurgedVersion *versions = NULL;
+    int version_count = take_versions(where, INT_MAX, &versions);
+    snprintf(query, sizeof(query), "DELETE FROM files WHERE file_id IN (%s)", list);
+    if (version_count < 0 || mysql_query(conn, query) != 0 || db_commit() != 0) {
+        db_rollback();
+        free(versions);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        file_cache_invalidate(rows[i].file_id);
+        if (!rows[i].packed) unlink_unreferenced(rows[i].path, unlinked);
+    }
+    for (int i = 0; i < version_count; i++) {
+        unlink_unreferenced(versions[i].path, unlinked);
+    }
+    free(versions);
+    return n;
+}
+
+// Purge up to budget expired directory rows nothing points at any more.
+// Rows purged, or -1
+static int purge_dirs(int budget) {
+    char query[640];
+    snprintf(query, sizeof(query),
+             "SELECT d.dir_id, d.group_id FROM directories d "
+             "WHERE d.is_deleted=1 AND d.deleted_at < NOW() - INTERVAL %d DAY "
+             "AND NOT EXISTS (SELECT 1 FROM files f WHERE f.dir_id=d.dir_id) "
+             "AND NOT EXISTS (SELECT 1 FROM directories c WHERE c.parent_dir_id=d.dir_id) "
+             "ORDER BY d.dir_id LIMIT %d",
+             GC_RETENTION_DAYS, budget);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    PurgedDir dirs[GC_BUDGET];
+    int ids[GC_BUDGET];
+    int n = 0;
+    MYSQL_ROW row;
+    while (n < budget && (row = mysql_fetch_row(res))) {
+        dirs[n].dir_id = row[0] ? atoi(row[0]) : 0;
+        dirs[n].group_id = row[1] ? atoi(row[1]) : 0;
+        ids[n] = dirs[n].dir_id;
+        n++;
+    }
+    mysql_free_result(res);
+    if (n == 0) return 0;
+
+    // Children are purged in an earlier run than their parent, so the
+    // self-reference never blocks this
+    char list[GC_BUDGET * 12];
+    if (id_list(ids, n, list, sizeof(list)) != 0) return -1;
+    snprintf(query, sizeof(query), "DELETE FROM directories WHERE dir_id IN (%s)", list);
+    if (mysql_query(conn, query) != 0) return -1;
+
+    for (int i = 0; i < n; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/group_%d/dir_%d", STORAGE_ROOT,
+                 dirs[i].group_id, dirs[i].dir_id);
+        rmdir(path);                 // only if empty; ENOENT for most
+    }
+    return n;
+}
+
+int gc_step(int budget) {
+    if (budget <= 0) return 0;
+    if (budget > GC_BUDGET) budget = GC_BUDGET;
+
+    int unlinked = 0;
+    int versions = purge_versions(budget, &unlinked);
+    int files = (versions >= 0) ? purge_files(budget, &unlinked) : -1;
+    int dirs = (files >= 0) ? purge_dirs(budget) : -1;
+    if (versions < 0 || files < 0 || dirs < 0) {
+        log_error(-1, 0, "GC: purge failed: %s", mysql_error(conn));
+        return -1;
+    }
+
+    if (versions > 0 || files > 0 || dirs > 0) {
+        log_info(-1, 0, "GC: purged %d versions, %d file rows (%d blobs removed), %d directory rows",
+                 versions, files, unlinked, dirs);
+    }
+    return (versions == budget || files == budget || dirs == budget) ? 1 : 0;
+}
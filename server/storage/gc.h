@@ -0,0 +1,31 @@
+#ifndef GC_H
+#define GC_H
+
+// Collector for soft-deleted content, run from a timer. DELETE_ITEM only
+// marks rows; once a row has been deleted for GC_RETENTION_DAYS it is
+// removed from `files` / `directories` here, so listings stop walking
+// past it in the indexes.
+//
+// A purged file's versions go with it. Versions past retention
+// (storage/versions.h) are purged here too, oldest first.
+//
+// A purged file's blob is unlinked once no row or version refers to its
+// path any more (COPY_ITEM rows share the path of the original). Packed
+// files have no blob of their own: their bytes become dead space in the
+// segment and the pack compactor reclaims them. A directory row goes
+// once no file row and no subdirectory row points at it, along with its
+// empty directory under STORAGE_ROOT.
+//
+// Every run is bounded by a budget of rows (hence at most as many
+// unlinks); the caller passes a smaller one while transfers are in
+// progress so the collector never competes with them for the disk.
+#define GC_RETENTION_DAYS 7
+#define GC_BUDGET 32                 // rows per run on an idle server
+#define GC_BUSY_BUDGET 4             // rows per run while transfers are running
+
+// One collector run purging at most budget expired versions, budget file
+// rows (with their versions) and budget directory rows. Returns 1 if rows are still waiting, 0 if caught up,
+// -1 on DB error
+int gc_step(int budget);
+
+#endif
@@ -0,0 +1,315 @@
+#include "pack_store.h"
+#include "frame_store.h"
+#include "file_cache.h"
+#include "../database/db.h"
+#include "../utils/logger.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static int open_id = 0;            // segment being appended to (0 = none yet)
+static int open_fd = -1;
+static uint64_t open_size = 0;
+static int max_id = 0;             // highest segment id seen
+
+static int compacting = 0;         // sealed segment being emptied (0 = none)
+
+// Entry data goes through here (one thread: uploads and the compactor
+// both run from the event loop)
+static unsigned char io_buf[PACK_MAX_FILE];
+
+int pack_segment_path(int segment, char *out, size_t size) {
+    int n = snprintf(out, size, "%s/seg_%06d.pack", PACK_DIR, segment);
+    return (n > 0 && (size_t)n < size) ? 0 : -1;
+}
+
+int pack_segment_id(const char *name) {
+    int id = 0;
+    int end = 0;
+    if (sscanf(name, "seg_%d.pack%n", &id, &end) != 1 || name[end] != '\0') return 0;
+    return id > 0 ? id : 0;
+}
+
+void pack_store_init(void) {
+    mkdir("./storage", 0755);
+    mkdir(PACK_DIR, 0755);
+
+    DIR *d = opendir(PACK_DIR);
+    if (!d) {
+        log_error(-1, 0, "Cannot open %s: %s", PACK_DIR, strerror(errno));
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        int id = pack_segment_id(de->d_name);
+        if (id > max_id) max_id = id;
+    }
+    closedir(d);
+    if (max_id == 0) return;
+
+    // Keep filling the last segment if it has room; a torn entry at its
+    // end (crash mid-append) is only dead bytes
+    char path[256];
+    struct stat st;
+    pack_segment_path(max_id, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size < PACK_SEGMENT_SIZE) {
+        open_fd = fd;
+        open_id = max_id;
+        open_size = (uint64_t)st.st_size;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    log_info(-1, 0, "Pack store: %d segments, appending to %d", max_id, open_id);
+}
+
+// Seal the open segment and start a new one. 0 or -1
+static int start_segment(void) {
+    if (open_fd >= 0) {
+        close(open_fd);
+        open_fd = -1;
+        open_id = 0;
+    }
+
+    char path[256];
+    for (int tries = 0; tries < 16; tries++) {
+        int id = ++max_id;
+        pack_segment_path(id, path, sizeof(path));
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            open_fd = fd;
+            open_id = id;
+            open_size = 0;
+            return 0;
+        }
+        if (errno != EEXIST) break;
+    }
+    log_error(-1, 0, "Cannot create pack segment %s: %s", path, strerror(errno));
+    return -1;
+}
+
+int pack_store_append(const void *data, size_t len, PackRef *out) {
+    if (!out || len > PACK_MAX_FILE || (len > 0 && !data)) return -1;
+
+    uint64_t need = sizeof(PackEntryHeader) + len;
+    if ((open_fd < 0 || open_size + need > PACK_SEGMENT_SIZE) && start_segment() != 0) {
+        return -1;
+    }
+
+    PackEntryHeader h;
+    memcpy(h.magic, PACK_ENTRY_MAGIC, sizeof(h.magic));
+    h.reserved = 0;
+    h.length = len;
+
+    // Header and data in one write; a short write leaves bytes past
+    // open_size that the next append overwrites
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { (void *)data, len }
+    };
+    ssize_t n = pwritev(open_fd, iov, len > 0 ? 2 : 1, (off_t)open_size);
+    if (n != (ssize_t)need) return -1;
+
+    out->segment = open_id;
+    out->offset = open_size + sizeof(h);
+    open_size += need;
+    return 0;
+}
+
+int pack_store_append_file(const char *path, int compressed, uint64_t size, PackRef *out) {
+    if (!path || size > PACK_MAX_FILE) return -1;
+
+    uint64_t got = 0;
+    if (compressed) {
+        FrameReader r;
+        if (frame_reader_open(&r, path) != 0) return -1;
+        while (r.raw_size == size && got < size) {
+            long n = frame_reader_pread(&r, io_buf + got, size - got, got);
+            if (n <= 0) break;
+            got += (uint64_t)n;
+        }
+        frame_reader_close(&r);
+    } else {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        while (got < size) {
+            ssize_t n = pread(fd, io_buf + got, size - got, (off_t)got);
+            if (n <= 0) break;
+            got += (uint64_t)n;
+        }
+        close(fd);
+    }
+    if (got != size) return -1;
+
+    return pack_store_append(io_buf, (size_t)size, out);
+}
+
+typedef struct {
+    int segment;
+    long long live;
+} SegmentLive;
+
+// Sealed segment with the smallest live share below PACK_COMPACT_LIVE_PCT,
+// 0 if there is none, -1 on error
+static int pick_segment(long long *live_out, long long *size_out) {
+    // Copies share an entry: count each (segment, offset) once
+    const char *query =
+        "SELECT pack_segment, SUM(file_size) FROM "
+        "(SELECT DISTINCT pack_segment, pack_offset, file_size FROM files "
+        " WHERE pack_segment IS NOT NULL AND is_deleted=0) live "
+        "GROUP BY pack_segment";
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    int count = (int)mysql_num_rows(res);
+    SegmentLive *live = malloc(sizeof(SegmentLive) * (count > 0 ? count : 1));
+    if (!live) {
+        mysql_free_result(res);
+        return -1;
+    }
+    count = 0;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res))) {
+        live[count].segment = row[0] ? atoi(row[0]) : 0;
+        live[count].live = row[1] ? atoll(row[1]) : 0;
+        count++;
+    }
+    mysql_free_result(res);
+
+    DIR *d = opendir(PACK_DIR);
+    if (!d) {
+        free(live);
+        return -1;
+    }
+
+    int best = 0;
+    double best_share = 1.0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        int id = pack_segment_id(de->d_name);
+        if (id == 0 || id == open_id) continue;
+
+        char path[256];
+        struct stat st;
+        pack_segment_path(id, path, sizeof(path));
+        if (stat(path, &st) != 0) continue;
+
+        long long bytes = 0;
+        for (int i = 0; i < count; i++) {
+            if (live[i].segment == id) {
+                bytes = live[i].live;
+                break;
+            }
+        }
+        double share = st.st_size > 0 ? (double)bytes / (double)st.st_size : 0.0;
+        if (share * 100.0 < PACK_COMPACT_LIVE_PCT && (best == 0 || share < best_share)) {
+            best = id;
+            best_share = share;
+            *live_out = bytes;
+            *size_out = (long long)st.st_size;
+        }
+    }
+    closedir(d);
+    free(live);
+    return best;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} LiveEntry;
+
+// Move up to PACK_COMPACT_BATCH live entries of `compacting` into the
+// open segment. 1 if some were moved, 0 once the segment has no live
+// entry left (it is removed), -1 on error
+static int move_batch(void) {
+    char query[512];
+    snprintf(query, sizeof(query),
+             "SELECT DISTINCT pack_offset, file_size FROM files "
+             "WHERE pack_segment=%d AND is_deleted=0 ORDER BY pack_offset LIMIT %d",
+             compacting, PACK_COMPACT_BATCH);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    LiveEntry entries[PACK_COMPACT_BATCH];
+    int n = 0;
+    MYSQL_ROW row;
+    while (n < PACK_COMPACT_BATCH && (row = mysql_fetch_row(res))) {
+        entries[n].offset = row[0] ? strtoull(row[0], NULL, 10) : 0;
+        entries[n].size = row[1] ? strtoull(row[1], NULL, 10) : 0;
+        n++;
+    }
+    mysql_free_result(res);
+
+    char path[256];
+    pack_segment_path(compacting, path, sizeof(path));
+    if (n == 0) {
+        unlink(path);
+        log_info(-1, 0, "Pack segment %d compacted and removed", compacting);
+        compacting = 0;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error(-1, 0, "Cannot open pack segment %s: %s", path, strerror(errno));
+        compacting = 0;
+        return -1;
+    }
+
+    int ok = db_begin() == 0;
+    for (int i = 0; ok && i < n; i++) {
+        const LiveEntry *e = &entries[i];
+        PackRef moved;
+        ok = e->size <= PACK_MAX_FILE &&
+             pread(fd, io_buf, e->size, (off_t)e->offset) == (ssize_t)e->size &&
+             pack_store_append(io_buf, (size_t)e->size, &moved) == 0;
+        if (!ok) {
+            log_error(-1, 0, "Pack segment %d: cannot move entry at %llu",
+                      compacting, (unsigned long long)e->offset);
+            break;
+        }
+
+        // Every row sharing the entry (copies, deleted rows) moves with it;
+        // updated_at is kept, the file itself did not change
+        snprintf(query, sizeof(query),
+                 "UPDATE files SET pack_segment=%d, pack_offset=%llu, updated_at=updated_at "
+                 "WHERE pack_segment=%d AND pack_offset=%llu",
+                 moved.segment, (unsigned long long)moved.offset,
+                 compacting, (unsigned long long)e->offset);
+        ok = mysql_query(conn, query) == 0;
+    }
+    close(fd);
+
+    if (!ok || db_commit() != 0) {
+        // What was copied is dead bytes in the open segment
+        db_rollback();
+        compacting = 0;
+        return -1;
+    }
+
+    // Cached metadata still points at the old place
+    file_cache_invalidate_all();
+    return 1;
+}
+
+int pack_store_compact_step(void) {
+    if (compacting == 0) {
+        long long live = 0, size = 0;
+        int id = pick_segment(&live, &size);
+        if (id <= 0) return id;
+
+        compacting = id;
+        log_info(-1, 0, "Compacting pack segment %d (%lld of %lld bytes live)", id, live, size);
+    }
+    return move_batch();
+}
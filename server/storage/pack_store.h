@@ -0,0 +1,63 @@
+#ifndef PACK_STORE_H
+#define PACK_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Small files do not get an inode of their own: uploads of at most
+// PACK_MAX_FILE bytes are appended to large append-only segment files
+// and their row records where (files.pack_segment, files.pack_offset;
+// the length is file_size). Readers pread or sendfile that range of the
+// segment. Packed bytes are stored raw, whatever the upload codec.
+//
+// Segments are PACK_DIR/seg_<id>.pack. One is open for appending at a
+// time and is sealed once it would grow past PACK_SEGMENT_SIZE. Every
+// entry is preceded by a PackEntryHeader, so a segment can be walked
+// without the DB.
+//
+// Deleting a file only marks its row, so dead entries pile up in the
+// segments. The compactor, run from a timer, picks a sealed segment
+// whose live bytes fell below PACK_COMPACT_LIVE_PCT percent, copies its
+// live entries into the open segment PACK_COMPACT_BATCH at a time
+// (repointing every row that shares an entry in the same transaction)
+// and removes it once nothing live is left in it.
+#define PACK_DIR "./storage/packs"
+#define PACK_MAX_FILE (64 * 1024)
+#define PACK_SEGMENT_SIZE (256LL * 1024 * 1024)
+#define PACK_COMPACT_LIVE_PCT 50
+#define PACK_COMPACT_BATCH 64              // entries moved per compactor run
+#define PACK_ENTRY_MAGIC "PKE1"
+
+typedef struct {
+    char magic[4];                         // PACK_ENTRY_MAGIC
+    uint32_t reserved;
+    uint64_t length;                       // data bytes that follow
+} PackEntryHeader;
+
+typedef struct {
+    int segment;                           // 0 = not packed
+    uint64_t offset;                       // first data byte (after the header)
+} PackRef;
+
+// Find the existing segments and reopen the last one for appending
+void pack_store_init(void);
+
+// "PACK_DIR/seg_<id>.pack" into out. 0, or -1 if it does not fit
+int pack_segment_path(int segment, char *out, size_t size);
+
+// Segment id of a PACK_DIR entry name, 0 if it is not a segment
+int pack_segment_id(const char *name);
+
+// Append len bytes (at most PACK_MAX_FILE) to the open segment. 0 and
+// *out set, or -1
+int pack_store_append(const void *data, size_t len, PackRef *out);
+
+// Append a finished temp blob of size bytes, plain or stored compressed
+// (frame index next to it). The blob is left in place. 0 or -1
+int pack_store_append_file(const char *path, int compressed, uint64_t size, PackRef *out);
+
+// One compactor run. Returns 1 if work is left for another run soon,
+// 0 if there is nothing to compact, -1 on error
+int pack_store_compact_step(void);
+
+#endif
@@ -0,0 +1,301 @@
+#include "quota.h"
+#include "../net/client.h"
+#include "../database/db.h"
+#include "../utils/logger.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct {
+    int id;
+    long long limit;
+} QuotaPolicy;
+
+typedef struct {
+    long long default_limit;
+    QuotaPolicy entries[QUOTA_MAX_POLICIES];
+    int count;
+} QuotaTable;
+
+typedef struct {
+    int id;
+    long long used;                  // bytes stored, as last read + charges since
+    time_t loaded_at;
+} Usage;
+
+typedef struct {
+    Usage items[QUOTA_MAX_USAGE];
+    int count;
+} UsageTable;
+
+typedef struct {
+    int user_id;
+    int group_id;
+    long long bytes;                 // 0 = no upload reserved on this connection
+} Reservation;
+
+typedef enum { KIND_USER, KIND_GROUP } QuotaKind;
+
+static QuotaTable limits[2];
+static UsageTable usage[2];
+static Reservation reservations[MAX_CLIENTS];
+static volatile sig_atomic_t reload_requested = 0;
+
+static int add_policy(QuotaTable *t, int id, long long limit) {
+    for (int i = 0; i < t->count; i++) {
+        if (t->entries[i].id == id) {
+            t->entries[i].limit = limit;
+            return 0;
+        }
+    }
+    if (t->count >= QUOTA_MAX_POLICIES) return -1;
+
+    t->entries[t->count].id = id;
+    t->entries[t->count].limit = limit;
+    t->count++;
+    return 0;
+}
+
+static long long lookup_limit(QuotaKind kind, int id) {
+    const QuotaTable *t = &limits[kind];
+    for (int i = 0; i < t->count; i++) {
+        if (t->entries[i].id == id) return t->entries[i].limit;
+    }
+    return t->default_limit;
+}
+
+// Returns 0 on success, -1 if the file cannot be read, or the number of
+// the first malformed line
+static int parse_config(const char *path, QuotaTable *users, QuotaTable *groups) {
+    memset(users, 0, sizeof(*users));
+    memset(groups, 0, sizeof(*groups));
+
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char line[256];
+    int line_no = 0;
+    int bad_line = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char key[32], kind[32];
+        int id;
+        long long limit;
+
+        if (sscanf(line, " %31s", key) != 1) continue;   // blank / comment
+
+        if (strcasecmp(key, "default") == 0 &&
+            sscanf(line, " %*s %31s %lld", kind, &limit) == 2 && limit >= 0) {
+            QuotaTable *t = (strcasecmp(kind, "user") == 0) ? users
+                          : (strcasecmp(kind, "group") == 0) ? groups : NULL;
+            if (!t) {
+                if (!bad_line) bad_line = line_no;
+                continue;
+            }
+            t->default_limit = limit;
+        } else if ((strcasecmp(key, "user") == 0 || strcasecmp(key, "group") == 0) &&
+                   sscanf(line, " %*s %d %lld", &id, &limit) == 2 && id > 0 && limit >= 0) {
+            QuotaTable *t = (strcasecmp(key, "user") == 0) ? users : groups;
+            if (add_policy(t, id, limit) != 0 && !bad_line) {
+                bad_line = line_no;
+            }
+        } else if (!bad_line) {
+            bad_line = line_no;
+        }
+    }
+
+    fclose(f);
+    return bad_line;
+}
+
+static void load_config(void) {
+    QuotaTable users, groups;
+    int rc = parse_config(QUOTA_CONFIG_PATH, &users, &groups);
+    if (rc < 0 && errno != ENOENT) {
+        log_error(-1, 0, "Cannot read %s (%s), keeping current quotas",
+                  QUOTA_CONFIG_PATH, strerror(errno));
+        return;
+    }
+    if (rc > 0) {
+        log_error(-1, 0, "%s:%d: invalid quota line ignored", QUOTA_CONFIG_PATH, rc);
+    }
+
+    limits[KIND_USER] = users;
+    limits[KIND_GROUP] = groups;
+    log_info(-1, 0, "Quotas loaded: users=%d groups=%d", users.count, groups.count);
+}
+
+static void poll_reload(void) {
+    if (!reload_requested) return;
+    reload_requested = 0;
+    load_config();
+}
+
+// Stored bytes straight from the DB; -1 on error
+static long long read_usage(QuotaKind kind, int id) {
+    char query[256];
+    if (kind == KIND_GROUP) {
+        snprintf(query, sizeof(query),
+                 "SELECT total_bytes FROM `groups` WHERE group_id=%d", id);
+    } else {
+        snprintf(query, sizeof(query),
+                 "SELECT COALESCE(SUM(file_size), 0) FROM files "
+                 "WHERE uploaded_by=%d AND is_deleted=0", id);
+    }
+
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    MYSQL_ROW row = mysql_fetch_row(res);
+    long long used = (row && row[0]) ? atoll(row[0]) : 0;
+    mysql_free_result(res);
+    return used;
+}
+
+static Usage *find_usage(QuotaKind kind, int id) {
+    UsageTable *t = &usage[kind];
+    for (int i = 0; i < t->count; i++) {
+        if (t->items[i].id == id) return &t->items[i];
+    }
+    return NULL;
+}
+
+// Current usage of id, read from the DB when unknown or stale
+static long long get_usage(QuotaKind kind, int id) {
+    time_t now = time(NULL);
+    Usage *u = find_usage(kind, id);
+    if (u && now - u->loaded_at < QUOTA_REFRESH_S) return u->used;
+
+    long long used = read_usage(kind, id);
+    if (used < 0) return -1;
+
+    if (!u) {
+        UsageTable *t = &usage[kind];
+        if (t->count < QUOTA_MAX_USAGE) {
+            u = &t->items[t->count++];
+        } else {
+            // Table full: recycle the counter read longest ago
+            u = &t->items[0];
+            for (int i = 1; i < t->count; i++) {
+                if (t->items[i].loaded_at < u->loaded_at) u = &t->items[i];
+            }
+        }
+    }
+    u->id = id;
+    u->used = used;
+    u->loaded_at = now;
+    return used;
+}
+
+static long long reserved_by_others(QuotaKind kind, int id, int except_idx) {
+    long long sum = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i == except_idx || reservations[i].bytes <= 0) continue;
+        int owner = (kind == KIND_GROUP) ? reservations[i].group_id : reservations[i].user_id;
+        if (owner == id) sum += reservations[i].bytes;
+    }
+    return sum;
+}
+
+static QuotaResult check_one(QuotaKind kind, int id, long long bytes, int except_idx,
+                             QuotaDenial *denial) {
+    long long limit = lookup_limit(kind, id);
+    if (limit <= 0 || id <= 0) return QUOTA_OK;
+
+    long long used = get_usage(kind, id);
+    if (used < 0) return QUOTA_ERROR;
+    used += reserved_by_others(kind, id, except_idx);
+
+    if (used + bytes <= limit) return QUOTA_OK;
+    if (denial) {
+        denial->limit = limit;
+        denial->used = used;
+    }
+    return (kind == KIND_GROUP) ? QUOTA_GROUP : QUOTA_USER;
+}
+
+static QuotaResult check_both(int user_id, int group_id, long long bytes, int except_idx,
+                              QuotaDenial *denial) {
+    poll_reload();
+
+    QuotaResult r = check_one(KIND_GROUP, group_id, bytes, except_idx, denial);
+    if (r != QUOTA_OK) return r;
+    return check_one(KIND_USER, user_id, bytes, except_idx, denial);
+}
+
+void quota_init(void) {
+    memset(usage, 0, sizeof(usage));
+    memset(reservations, 0, sizeof(reservations));
+    load_config();
+}
+
+void quota_request_reload(void) {
+    reload_requested = 1;
+}
+
+QuotaResult quota_check(int user_id, int group_id, long long bytes, QuotaDenial *denial) {
+    return check_both(user_id, group_id, bytes, -1, denial);
+}
+
+QuotaResult quota_reserve(int idx, int user_id, int group_id, long long declared,
+                          QuotaDenial *denial) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return QUOTA_ERROR;
+    quota_release(idx);
+
+    if (declared < 0) declared = 0;
+    QuotaResult r = check_both(user_id, group_id, declared, idx, denial);
+    if (r == QUOTA_OK) {
+        reservations[idx].user_id = user_id;
+        reservations[idx].group_id = group_id;
+        reservations[idx].bytes = declared;
+    }
+    return r;
+}
+
+QuotaResult quota_check_final(int idx, int user_id, int group_id, long long actual,
+                              QuotaDenial *denial) {
+    return check_both(user_id, group_id, actual, idx, denial);
+}
+
+void quota_release(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    memset(&reservations[idx], 0, sizeof(reservations[idx]));
+}
+
+void quota_shrink(int idx, long long bytes) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    reservations[idx].bytes -= bytes;
+    if (reservations[idx].bytes < 0) reservations[idx].bytes = 0;
+}
+
+void quota_charge(int user_id, int group_id, long long bytes) {
+    Usage *u = find_usage(KIND_GROUP, group_id);
+    if (u) {
+        u->used += bytes;
+        if (u->used < 0) u->used = 0;
+    }
+    u = find_usage(KIND_USER, user_id);
+    if (u) {
+        u->used += bytes;
+        if (u->used < 0) u->used = 0;
+    }
+}
+
+void quota_invalidate_users(void) {
+    usage[KIND_USER].count = 0;
+}
+
+int quota_reply(char *buf, int size, QuotaResult r, const QuotaDenial *denial) {
+    int n = snprintf(buf, size, "507 quota=%s limit=%lld used=%lld\r\n",
+                     (r == QUOTA_USER) ? "user" : "group", denial->limit, denial->used);
+    return (n > 0 && n < size) ? n : 0;
+}
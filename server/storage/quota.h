@@ -0,0 +1,72 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+// Per-group and per-user storage quotas.
+//
+// Usage is kept in memory: a group's comes from the groups.total_bytes
+// rollup, a user's from the live files they uploaded, each read on first
+// use and again every QUOTA_REFRESH_S (the aggregate reconciler may have
+// corrected it meanwhile). Handlers keep the counters current between
+// reads. Uploads reserve their declared size on chunk 1; the reservation
+// is released when the upload finishes or is abandoned.
+//
+// Limits come from QUOTA_CONFIG_PATH, re-read on SIGHUP:
+//
+//   default user|group <bytes>
+//   user <user_id> <bytes>
+//   group <group_id> <bytes>
+//
+// A limit of 0 means unlimited.
+#define QUOTA_CONFIG_PATH "./quotas.conf"
+#define QUOTA_REFRESH_S 300
+#define QUOTA_MAX_POLICIES 64        // explicit user/group entries
+#define QUOTA_MAX_USAGE 256          // cached usage counters per kind
+
+typedef enum {
+    QUOTA_OK = 0,
+    QUOTA_GROUP = 1,                 // group limit would be exceeded
+    QUOTA_USER = 2,                  // user limit would be exceeded
+    QUOTA_ERROR = -1                 // usage could not be read
+} QuotaResult;
+
+// Which limit refused a request, for the reply
+typedef struct {
+    long long limit;
+    long long used;                  // stored + reserved by other uploads
+} QuotaDenial;
+
+void quota_init(void);
+
+// Async-signal-safe: re-read the limits before the next check
+void quota_request_reload(void);
+
+// Would bytes more fit for user_id in group_id?
+QuotaResult quota_check(int user_id, int group_id, long long bytes, QuotaDenial *denial);
+
+// Upload on connection idx starts with a declared size: check and reserve
+QuotaResult quota_reserve(int idx, int user_id, int group_id, long long declared,
+                          QuotaDenial *denial);
+
+// Final size of idx's upload is known: does it still fit? Bytes covered
+// by its own reservation count as already granted.
+QuotaResult quota_check_final(int idx, int user_id, int group_id, long long actual,
+                              QuotaDenial *denial);
+
+// Drop idx's reservation (upload finished or abandoned)
+void quota_release(int idx);
+
+// bytes of idx's reservation were stored and charged (bulk upload
+// committing part of its manifest): hold that much less
+void quota_shrink(int idx, long long bytes);
+
+// Stored bytes changed (upload committed, copy, delete, ...)
+void quota_charge(int user_id, int group_id, long long bytes);
+
+// Per-user usage is no longer known (e.g. a directory of files from many
+// uploaders was deleted): read again on next use
+void quota_invalidate_users(void);
+
+// "507 quota=<group|user> limit=<n> used=<n>\r\n"
+int quota_reply(char *buf, int size, QuotaResult r, const QuotaDenial *denial);
+
+#endif
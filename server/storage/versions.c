@@ -0,0 +1,1003 @@
+#include "versions.h"
+#include "file_cache.h"
+#include "frame_store.h"
+#include "../protocol/transfer.h"
+#include "../database/aggregates.h"
+#include "../database/db.h"
+#include "../utils/cdc.h"
+#include "../utils/logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define VERSION_MAX_NAME_TRIES 100
+
+// A whole content to read from: plain blob, compressed blob (frame
+// index) or pack entry
+typedef struct {
+    int fd;
+    int framed;
+    FrameReader reader;
+    uint64_t base;                   // pack entry: first byte in the segment
+    uint64_t size;
+} BlobSrc;
+
+// Reading a BlobSrc chunk by chunk
+typedef struct {
+    BlobSrc *src;
+    unsigned char *buf;              // VERSION_IO_SIZE
+    size_t start;
+    size_t end;
+    uint64_t pos;                    // stream offset of buf[start]
+    uint64_t read_off;               // next offset to read from src
+} ChunkStream;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t len;
+} BaseChunk;
+
+// Delta being written: a run of copies or of literals is held back so
+// that neighbours merge into one operation
+typedef struct {
+    FILE *out;
+    uint64_t written;
+    uint64_t limit;                  // not worth it past this many bytes
+    uint64_t copy_off;
+    uint64_t copy_len;
+    unsigned char *lit;              // VERSION_IO_SIZE
+    size_t lit_len;
+} DeltaOut;
+
+typedef struct {
+    int version_no;
+    int delta;
+    long long size;
+    char path[512];
+    char sha256[SHA256_HEX_LEN];
+} ChainLink;
+
+typedef struct {
+    int version_id;
+    int file_id;
+    char target[512];                // the version's whole blob
+    long long target_size;
+    char base[512];                  // next newer content
+    PackRef base_pack;
+    long long base_size;
+    char out[512];                   // delta, written under TMP_SUFFIX
+    int result;                      // 0 encoded, 1 not worth it, -1 failed
+} DeltaJob;
+
+// A version and what it is rebuilt from
+typedef struct {
+    ChainLink *links;                // version_no first, then newer ones
+    int count;
+    int top;                         // first whole link; count = the file's content
+    FileHead head;                   // that content when top == count
+} Chain;
+
+// RESTORE_VERSION of a delta version, one per connection
+typedef struct {
+    int file_id;
+    int version_no;
+    Chain chain;
+    char out[512];
+    version_restored_fn done;
+    int dropped;                     // connection gone: discard the result
+    int result;                      // 0 rebuilt, -1 failed, -2 SHA-256 mismatch
+} RestoreJob;
+
+// Shared with the encoder thread, under delta_lock
+static pthread_mutex_t delta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delta_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t delta_thread;
+static int delta_running = 0;
+static int delta_stopping = 0;
+static DeltaJob job;
+static int job_state = 0;            // 0 free, 1 waiting, 2 encoding, 3 done
+static RestoreJob restores[MAX_CLIENTS];
+static int restore_state[MAX_CLIENTS];   // 0 free, 1 waiting, 2 building, 3 done
+
+// ---------------------------------------------------------------------------
+// Reading and writing content (no DB access: used by the encoder thread)
+// ---------------------------------------------------------------------------
+
+static int src_open(BlobSrc *s, const char *path, const PackRef *pack, uint64_t size) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->reader.fd = -1;
+    s->size = size;
+
+    if (pack && pack->segment > 0) {
+        char segment[256];
+        if (pack_segment_path(pack->segment, segment, sizeof(segment)) != 0) return -1;
+        s->fd = open(segment, O_RDONLY | O_CLOEXEC);
+        s->base = pack->offset;
+        return s->fd >= 0 ? 0 : -1;
+    }
+
+    if (frame_store_is_compressed(path)) {
+        if (frame_reader_open(&s->reader, path) != 0) return -1;
+        s->framed = 1;
+        return s->reader.raw_size == size ? 0 : -1;
+    }
+
+    struct stat st;
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0 || fstat(s->fd, &st) != 0) return -1;
+    return (uint64_t)st.st_size == size ? 0 : -1;
+}
+
+static void src_close(BlobSrc *s) {
+    if (s->framed) frame_reader_close(&s->reader);
+    if (s->fd >= 0) close(s->fd);
+    s->framed = 0;
+    s->fd = -1;
+}
+
+// Up to len bytes at offset; fewer only at the end. Bytes read, or -1
+static long src_pread(BlobSrc *s, void *buf, size_t len, uint64_t offset) {
+    if (offset >= s->size) return 0;
+    if (len > s->size - offset) len = (size_t)(s->size - offset);
+    if (s->framed) return frame_reader_pread(&s->reader, buf, len, offset);
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(s->fd, (char *)buf + done, len - done, (off_t)(s->base + offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return (long)done;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Whole content of s into a plain file, hashed into sha if given. 0 or -1
+static int copy_src(BlobSrc *s, const char *out_path, EVP_MD_CTX *sha) {
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    unsigned char *buf = (unsigned char *)malloc(VERSION_IO_SIZE);
+    int rc = (out >= 0 && buf) ? 0 : -1;
+
+    for (uint64_t off = 0; rc == 0 && off < s->size;) {
+        long n = src_pread(s, buf, VERSION_IO_SIZE, off);
+        if (n <= 0 || write_all(out, buf, (size_t)n) != 0) {
+            rc = -1;
+            break;
+        }
+        if (sha) transfer_hash_update(sha, buf, (size_t)n);
+        off += (uint64_t)n;
+    }
+
+    free(buf);
+    if (out >= 0 && close(out) != 0) rc = -1;
+    if (rc != 0) unlink(out_path);
+    return rc;
+}
+
+static void stream_init(ChunkStream *cs, BlobSrc *src, unsigned char *buf) {
+    memset(cs, 0, sizeof(*cs));
+    cs->src = src;
+    cs->buf = buf;
+}
+
+// Next content-defined chunk. 1, 0 at the end, -1 on read error
+static int next_chunk(ChunkStream *cs, const unsigned char **data, size_t *len, uint64_t *offset) {
+    // Keep at least a maximal chunk buffered until the end of the stream
+    if (cs->end - cs->start < CDC_MAX_CHUNK && cs->read_off < cs->src->size) {
+        memmove(cs->buf, cs->buf + cs->start, cs->end - cs->start);
+        cs->end -= cs->start;
+        cs->start = 0;
+        long n = src_pread(cs->src, cs->buf + cs->end, VERSION_IO_SIZE - cs->end, cs->read_off);
+        if (n <= 0) return -1;
+        cs->end += (size_t)n;
+        cs->read_off += (uint64_t)n;
+    }
+    if (cs->start == cs->end) return 0;
+
+    size_t n = cdc_next_chunk(cs->buf + cs->start, cs->end - cs->start);
+    *data = cs->buf + cs->start;
+    *len = n;
+    *offset = cs->pos;
+    cs->start += n;
+    cs->pos += n;
+    return 1;
+}
+
+static int cmp_chunk(const void *a, const void *b) {
+    uint64_t ha = ((const BaseChunk *)a)->hash;
+    uint64_t hb = ((const BaseChunk *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Offset of a base chunk holding exactly data. 1 (*offset set), 0, -1
+static int find_match(BlobSrc *base, const BaseChunk *chunks, size_t count,
+                      const unsigned char *data, size_t len, unsigned char *scratch,
+                      uint64_t *offset) {
+    uint64_t h = cdc_hash(data, len);
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunks[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < count && chunks[i].hash == h; i++) {
+        if (chunks[i].len != len) continue;
+        long n = src_pread(base, scratch, len, chunks[i].offset);
+        if (n < 0) return -1;
+        if ((size_t)n == len && memcmp(scratch, data, len) == 0) {
+            *offset = chunks[i].offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 0, 1 once the delta grew past its limit, -1 on write error
+static int delta_put(DeltaOut *d, const void *data, size_t len) {
+    if (fwrite(data, 1, len, d->out) != len) return -1;
+    d->written += len;
+    return d->written > d->limit ? 1 : 0;
+}
+
+static int flush_copy(DeltaOut *d) {
+    while (d->copy_len > 0) {
+        uint32_t len = d->copy_len > UINT32_MAX ? UINT32_MAX : (uint32_t)d->copy_len;
+        unsigned char op[13];
+        op[0] = 'C';
+        memcpy(op + 1, &d->copy_off, 8);
+        memcpy(op + 9, &len, 4);
+        int rc = delta_put(d, op, sizeof(op));
+        if (rc != 0) return rc;
+        d->copy_off += len;
+        d->copy_len -= len;
+    }
+    return 0;
+}
+
+static int flush_literal(DeltaOut *d) {
+    if (d->lit_len == 0) return 0;
+    unsigned char op[5];
+    uint32_t len = (uint32_t)d->lit_len;
+    op[0] = 'L';
+    memcpy(op + 1, &len, 4);
+    d->lit_len = 0;
+    int rc = delta_put(d, op, sizeof(op));
+    return rc != 0 ? rc : delta_put(d, d->lit, len);
+}
+
+static int add_copy(DeltaOut *d, uint64_t offset, size_t len) {
+    int rc = flush_literal(d);
+    if (rc != 0) return rc;
+    if (d->copy_len > 0 && d->copy_off + d->copy_len == offset) {
+        d->copy_len += len;
+        return 0;
+    }
+    rc = flush_copy(d);
+    d->copy_off = offset;
+    d->copy_len = len;
+    return rc;
+}
+
+static int add_literal(DeltaOut *d, const unsigned char *data, size_t len) {
+    int rc = flush_copy(d);
+    if (rc == 0 && d->lit_len + len > VERSION_IO_SIZE) rc = flush_literal(d);
+    if (rc != 0) return rc;
+    memcpy(d->lit + d->lit_len, data, len);
+    d->lit_len += len;
+    return 0;
+}
+
+// Encode target against base into out_path. 0, 1 if the delta would not
+// be worth keeping, -1 on error (out_path removed unless 0)
+static int encode_delta(BlobSrc *base, BlobSrc *target, const char *out_path) {
+    unsigned char *buf = (unsigned char *)malloc(VERSION_IO_SIZE);
+    unsigned char *lit = (unsigned char *)malloc(VERSION_IO_SIZE);
+    unsigned char *scratch = (unsigned char *)malloc(CDC_MAX_CHUNK);
+    BaseChunk *chunks = NULL;
+    size_t count = 0, cap = 0;
+    FILE *out = NULL;
+    int rc = -1;
+    if (!buf || !lit || !scratch) goto done;
+
+    // Index the base by chunk fingerprint
+    ChunkStream cs;
+    const unsigned char *data;
+    size_t len;
+    uint64_t offset;
+    int r;
+    stream_init(&cs, base, buf);
+    while ((r = next_chunk(&cs, &data, &len, &offset)) == 1) {
+        if (count == cap) {
+            size_t grown = cap ? cap * 2 : 1024;
+            BaseChunk *more = (BaseChunk *)realloc(chunks, grown * sizeof(BaseChunk));
+            if (!more) goto done;
+            chunks = more;
+            cap = grown;
+        }
+        chunks[count].hash = cdc_hash(data, len);
+        chunks[count].offset = offset;
+        chunks[count].len = (uint32_t)len;
+        count++;
+    }
+    if (r < 0) goto done;
+    qsort(chunks, count, sizeof(BaseChunk), cmp_chunk);
+
+    out = fopen(out_path, "wb");
+    if (!out) goto done;
+
+    DeltaHeader header;
+    memcpy(header.magic, VERSION_DELTA_MAGIC, 4);
+    header.reserved = 0;
+    header.base_size = base->size;
+    header.target_size = target->size;
+
+    DeltaOut d = { out, 0, target->size / 100 * VERSION_DELTA_MAX_PCT, 0, 0, lit, 0 };
+    int w = delta_put(&d, &header, sizeof(header));
+
+    // Walk the target: chunks the base also has become copies
+    stream_init(&cs, target, buf);
+    while (w == 0 && (r = next_chunk(&cs, &data, &len, &offset)) == 1) {
+        uint64_t match;
+        int m = find_match(base, chunks, count, data, len, scratch, &match);
+        if (m < 0) {
+            w = -1;
+            break;
+        }
+        w = m ? add_copy(&d, match, len) : add_literal(&d, data, len);
+    }
+    if (w == 0 && r < 0) w = -1;
+    if (w == 0) w = flush_literal(&d);
+    if (w == 0) w = flush_copy(&d);
+    rc = w;
+
+done:
+    if (out && fclose(out) != 0 && rc == 0) rc = -1;
+    if (rc != 0 && out) unlink(out_path);
+    free(chunks);
+    free(scratch);
+    free(lit);
+    free(buf);
+    return rc;
+}
+
+// Rebuild a content from its base and delta into a plain file, hashed
+// into sha if given. 0 or -1 (out_path removed)
+static int apply_delta(BlobSrc *base, const char *delta_path, const char *out_path, EVP_MD_CTX *sha) {
+    FILE *in = fopen(delta_path, "rb");
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    unsigned char *buf = (unsigned char *)malloc(VERSION_IO_SIZE);
+    DeltaHeader header;
+    uint64_t produced = 0;
+    int rc = -1;
+
+    if (!in || out < 0 || !buf || fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, VERSION_DELTA_MAGIC, 4) != 0 || header.base_size != base->size) {
+        goto done;
+    }
+
+    int op;
+    while ((op = fgetc(in)) != EOF) {
+        uint64_t offset = 0;
+        uint32_t len = 0;
+        if (op == 'C') {
+            if (fread(&offset, 8, 1, in) != 1 || fread(&len, 4, 1, in) != 1) goto done;
+        } else if (op != 'L' || fread(&len, 4, 1, in) != 1) {
+            goto done;
+        }
+
+        while (len > 0) {
+            size_t n = len < VERSION_IO_SIZE ? len : VERSION_IO_SIZE;
+            if (op == 'C') {
+                if (src_pread(base, buf, n, offset) != (long)n) goto done;
+                offset += n;
+            } else if (fread(buf, 1, n, in) != n) {
+                goto done;
+            }
+            if (write_all(out, buf, n) != 0) goto done;
+            if (sha) transfer_hash_update(sha, buf, n);
+            produced += n;
+            len -= (uint32_t)n;
+        }
+    }
+    rc = (!ferror(in) && produced == header.target_size) ? 0 : -1;
+
+done:
+    if (in) fclose(in);
+    if (out >= 0 && close(out) != 0) rc = -1;
+    if (rc != 0) unlink(out_path);
+    free(buf);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Encoder thread
+// ---------------------------------------------------------------------------
+
+static int build_chain(const Chain *c, const char *out_path);
+
+static void *delta_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&delta_lock);
+    for (;;) {
+        if (delta_stopping) break;
+
+        // A client is waiting on a rebuild: it goes before the next delta
+        int r = 0;
+        while (r < MAX_CLIENTS && restore_state[r] != 1) r++;
+        if (r < MAX_CLIENTS) {
+            restore_state[r] = 2;
+            pthread_mutex_unlock(&delta_lock);
+            restores[r].result = build_chain(&restores[r].chain, restores[r].out);
+            pthread_mutex_lock(&delta_lock);
+            restore_state[r] = 3;
+            continue;
+        }
+
+        if (job_state != 1) {
+            pthread_cond_wait(&delta_cond, &delta_lock);
+            continue;
+        }
+        job_state = 2;
+        pthread_mutex_unlock(&delta_lock);
+
+        BlobSrc base, target;
+        int opened = src_open(&base, job.base, &job.base_pack, (uint64_t)job.base_size) == 0;
+        opened = src_open(&target, job.target, NULL, (uint64_t)job.target_size) == 0 && opened;
+        char tmp[600];
+        snprintf(tmp, sizeof(tmp), "%s%s", job.out, TMP_SUFFIX);
+        job.result = opened ? encode_delta(&base, &target, tmp) : -1;
+        src_close(&base);
+        src_close(&target);
+
+        pthread_mutex_lock(&delta_lock);
+        job_state = 3;
+    }
+    pthread_mutex_unlock(&delta_lock);
+    return NULL;
+}
+
+int version_start(void) {
+    pthread_mutex_lock(&delta_lock);
+    delta_stopping = 0;
+    job_state = 0;
+    int rc = pthread_create(&delta_thread, NULL, delta_main, NULL);
+    delta_running = (rc == 0);
+    pthread_mutex_unlock(&delta_lock);
+
+    if (rc != 0) {
+        fprintf(stderr, "[VERSIONS] Cannot start delta encoder thread: %s\n", strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+void version_stop(void) {
+    pthread_mutex_lock(&delta_lock);
+    if (!delta_running) {
+        pthread_mutex_unlock(&delta_lock);
+        return;
+    }
+    delta_stopping = 1;
+    pthread_cond_signal(&delta_cond);
+    pthread_mutex_unlock(&delta_lock);
+
+    // A delta or rebuild in progress is finished first; temp files are
+    // left to the .part reaper
+    pthread_join(delta_thread, NULL);
+    delta_running = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Event loop side
+// ---------------------------------------------------------------------------
+
+// Does any row or version still use path as its blob? 1, 0, -1
+static int blob_referenced(const char *path) {
+    char escaped[1024];
+    char query[2300];
+    mysql_real_escape_string(conn, escaped, path, strlen(path));
+    snprintf(query, sizeof(query),
+             "SELECT 1 FROM files WHERE file_path='%s' AND pack_segment IS NULL "
+             "UNION ALL SELECT 1 FROM file_versions WHERE file_path='%s' LIMIT 1",
+             escaped, escaped);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+    int found = mysql_num_rows(res) > 0;
+    mysql_free_result(res);
+    return found;
+}
+
+int version_free_path(const char *path, char *out, size_t size) {
+    char suffixed[1024];
+    const char *candidate = path;
+
+    for (int n = 0; n <= VERSION_MAX_NAME_TRIES; n++) {
+        // A suffixed name must not exist at all, not just be unused
+        if (n > 0) {
+            snprintf(suffixed, sizeof(suffixed), "%s~%d", path, n);
+            if (access(suffixed, F_OK) == 0) continue;
+            candidate = suffixed;
+        }
+        int used = blob_referenced(candidate);
+        if (used < 0) return -1;
+        if (!used) {
+            size_t len = strlen(candidate);
+            if (len >= size) return -1;
+            memmove(out, candidate, len + 1);      // out may be path itself
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int read_head(const char *where, FileHead *head) {
+    char query[1400];
+    snprintf(query, sizeof(query),
+             "SELECT file_id, group_id, dir_id, file_size, file_path, pack_segment, pack_offset "
+             "FROM files WHERE %s AND is_deleted=0 ORDER BY file_id DESC LIMIT 1",
+             where);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (row) {
+        head->file_id = row[0] ? atoi(row[0]) : 0;
+        head->group_id = row[1] ? atoi(row[1]) : 0;
+        head->dir_id = row[2] ? atoi(row[2]) : 0;
+        head->size = row[3] ? atoll(row[3]) : 0;
+        snprintf(head->path, sizeof(head->path), "%s", row[4] ? row[4] : "");
+        head->pack.segment = row[5] ? atoi(row[5]) : 0;
+        head->pack.offset = row[6] ? strtoull(row[6], NULL, 10) : 0;
+    }
+    mysql_free_result(res);
+    return row ? 1 : 0;
+}
+
+int version_find_head(int dir_id, const char *name, FileHead *head) {
+    char escaped[512];
+    char where[600];
+    mysql_real_escape_string(conn, escaped, name, strlen(name));
+    snprintf(where, sizeof(where), "dir_id=%d AND file_name='%s'", dir_id, escaped);
+    return read_head(where, head);
+}
+
+int version_load_head(int file_id, FileHead *head) {
+    char where[64];
+    snprintf(where, sizeof(where), "file_id=%d", file_id);
+    return read_head(where, head);
+}
+
+static int next_version_no(int file_id) {
+    char query[160];
+    snprintf(query, sizeof(query),
+             "SELECT COALESCE(MAX(version_no), 0) + 1 FROM file_versions WHERE file_id=%d", file_id);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    int next = (row && row[0]) ? atoi(row[0]) : -1;
+    mysql_free_result(res);
+    return next;
+}
+
+static void drop_blob(const char *path) {
+    unlink(path);
+    frame_store_drop_index(path);
+}
+
+int version_replace_content(const FileHead *head, const char *dir_path, const VersionContent *c) {
+    char name[1024];
+    char kept[512];
+    char path[512];
+    int copied = 0, moved = 0;
+
+    int no = next_version_no(head->file_id);
+    if (no < 0) goto fail;
+
+    // The old content stays where it is, unless it lives in a segment
+    if (head->pack.segment > 0) {
+        BlobSrc src;
+        snprintf(name, sizeof(name), "%s/ver_%d_%d", dir_path, head->file_id, no);
+        if (version_free_path(name, kept, sizeof(kept)) != 0) goto fail;
+        int rc = src_open(&src, NULL, &head->pack, (uint64_t)head->size) == 0
+                     ? copy_src(&src, kept, NULL) : -1;
+        src_close(&src);
+        if (rc != 0) goto fail;
+        copied = 1;
+    } else {
+        snprintf(kept, sizeof(kept), "%s", head->path);
+    }
+
+    // The new content never overwrites a blob in use
+    if (c->pack.segment > 0) {
+        snprintf(path, sizeof(path), "%s", head->path);   // only a name then
+    } else if (c->shared_path) {
+        snprintf(path, sizeof(path), "%s", c->shared_path);
+    } else {
+        snprintf(name, sizeof(name), "%s/rev_%d_%d", dir_path, head->file_id, no);
+        if (version_free_path(name, path, sizeof(path)) != 0) goto fail;
+        int rc = c->compressed ? frame_store_commit(c->temp_path, path) : rename(c->temp_path, path);
+        if (rc != 0) goto fail;
+        moved = 1;
+    }
+
+    char kept_sql[1024];
+    char path_sql[1024];
+    mysql_real_escape_string(conn, kept_sql, kept, strlen(kept));
+    mysql_real_escape_string(conn, path_sql, path, strlen(path));
+
+    char sha_value[SHA256_HEX_LEN + 2] = "NULL";
+    if (c->sha256 && c->sha256[0]) {
+        snprintf(sha_value, sizeof(sha_value), "'%s'", c->sha256);
+    }
+    char pack_segment[16] = "NULL";
+    char pack_offset[32] = "NULL";
+    if (c->pack.segment > 0) {
+        snprintf(pack_segment, sizeof(pack_segment), "%d", c->pack.segment);
+        snprintf(pack_offset, sizeof(pack_offset), "%llu", (unsigned long long)c->pack.offset);
+    }
+
+    // The version keeps who uploaded it and when (the row's updated_at)
+    char query[2600];
+    AggTotals changed = { c->size - head->size, 0, 0 };
+    if (db_begin() != 0) goto fail;
+    snprintf(query, sizeof(query),
+             "INSERT INTO file_versions (file_id, version_no, storage, file_path, file_size, "
+             "content_sha256, uploaded_by, created_at) "
+             "SELECT file_id, %d, 'full', '%s', file_size, content_sha256, uploaded_by, updated_at "
+             "FROM files WHERE file_id=%d AND is_deleted=0",
+             no, kept_sql, head->file_id);
+    if (mysql_query(conn, query) != 0 || mysql_affected_rows(conn) != 1) goto rollback;
+    snprintf(query, sizeof(query),
+             "UPDATE files SET file_path='%s', file_size=%lld, content_sha256=%s, "
+             "pack_segment=%s, pack_offset=%s, uploaded_by=%d, updated_at=NOW() "
+             "WHERE file_id=%d",
+             path_sql, c->size, sha_value, pack_segment, pack_offset, c->user_id, head->file_id);
+    if (mysql_query(conn, query) != 0 ||
+        agg_apply(head->group_id, head->dir_id, &changed, 1) != 0 ||
+        db_commit() != 0) {
+        goto rollback;
+    }
+
+    file_cache_invalidate(head->file_id);
+    return no;
+
+rollback:
+    db_rollback();
+fail:
+    if (moved) {
+        drop_blob(path);
+    } else if (c->temp_path) {
+        drop_blob(c->temp_path);
+    }
+    if (copied) unlink(kept);
+    return -1;
+}
+
+// The chain from version_no up to the nearest whole content, read on the
+// event loop so that the rebuild itself needs no DB access
+static int load_chain(int file_id, int version_no, Chain *c) {
+    memset(c, 0, sizeof(*c));
+    char query[256];
+    snprintf(query, sizeof(query),
+             "SELECT version_no, storage, file_path, file_size, content_sha256 FROM file_versions "
+             "WHERE file_id=%d AND version_no>=%d ORDER BY version_no",
+             file_id, version_no);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+
+    int count = (int)mysql_num_rows(res);
+    ChainLink *links = (ChainLink *)calloc(count > 0 ? count : 1, sizeof(ChainLink));
+    MYSQL_ROW row;
+    for (int i = 0; links && i < count && (row = mysql_fetch_row(res)); i++) {
+        links[i].version_no = row[0] ? atoi(row[0]) : 0;
+        links[i].delta = row[1] && strcmp(row[1], "delta") == 0;
+        snprintf(links[i].path, sizeof(links[i].path), "%s", row[2] ? row[2] : "");
+        links[i].size = row[3] ? atoll(row[3]) : 0;
+        snprintf(links[i].sha256, sizeof(links[i].sha256), "%s", row[4] ? row[4] : "");
+    }
+    mysql_free_result(res);
+    if (!links || count == 0 || links[0].version_no != version_no) {
+        free(links);
+        return -1;
+    }
+
+    // Start from the nearest whole content above: a version, or the file
+    int top = 0;
+    while (top < count && links[top].delta) top++;
+    if (top == count && version_load_head(file_id, &c->head) != 1) {
+        free(links);
+        return -1;
+    }
+    c->links = links;
+    c->count = count;
+    c->top = top;
+    return 0;
+}
+
+// Rebuild the chain's version at out_path (no DB access: also run by the
+// encoder thread). 0, -1, or -2 if the result does not match its SHA-256
+static int build_chain(const Chain *c, const char *out_path) {
+    const ChainLink *links = c->links;
+    int top = c->top;
+    BlobSrc src;
+    memset(&src, 0, sizeof(src));
+    src.fd = -1;
+    int rc;
+    if (top < c->count) {
+        rc = src_open(&src, links[top].path, NULL, (uint64_t)links[top].size);
+    } else {
+        rc = src_open(&src, c->head.path, &c->head.pack, (uint64_t)c->head.size);
+    }
+
+    EVP_MD_CTX *sha = NULL;
+    transfer_hash_start(&sha);
+    char prev[600] = "";
+    if (rc == 0 && top == 0) {
+        rc = copy_src(&src, out_path, sha);
+    }
+
+    // Then apply the deltas down to version_no, through temp files
+    for (int i = top - 1; rc == 0 && i >= 0; i--) {
+        char step[600];
+        if (i > 0) {
+            snprintf(step, sizeof(step), "%s.%d%s", out_path, links[i].version_no, TMP_SUFFIX);
+        } else {
+            snprintf(step, sizeof(step), "%s", out_path);
+        }
+        rc = apply_delta(&src, links[i].path, step, i == 0 ? sha : NULL);
+        src_close(&src);
+        if (prev[0]) unlink(prev);
+        snprintf(prev, sizeof(prev), "%s", step);
+        if (rc == 0 && i > 0) rc = src_open(&src, step, NULL, (uint64_t)links[i].size);
+    }
+    src_close(&src);
+    if (rc != 0 && prev[0] && strcmp(prev, out_path) != 0) unlink(prev);
+
+    // The rebuilt content must be the one that was archived
+    char hex[SHA256_HEX_LEN] = "";
+    if (sha && transfer_hash_hex(&sha, hex) != 0) hex[0] = '\0';
+    transfer_hash_drop(&sha);
+    if (rc == 0 && hex[0] && links[0].sha256[0] && strcmp(hex, links[0].sha256) != 0) {
+        unlink(out_path);
+        rc = -2;
+    }
+    return rc;
+}
+
+int version_restore_start(int idx, int file_id, int version_no, const char *out_path,
+                          version_restored_fn done) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return -1;
+    pthread_mutex_lock(&delta_lock);
+    int busy = restore_state[idx] != 0;
+    pthread_mutex_unlock(&delta_lock);
+    if (busy) return -1;
+
+    RestoreJob r;
+    memset(&r, 0, sizeof(r));
+    if (load_chain(file_id, version_no, &r.chain) != 0) return -1;
+    r.file_id = file_id;
+    r.version_no = version_no;
+    r.done = done;
+    snprintf(r.out, sizeof(r.out), "%s", out_path);
+
+    // No thread: rebuild here, the result is still handed over by version_poll()
+    pthread_mutex_lock(&delta_lock);
+    int threaded = delta_running;
+    pthread_mutex_unlock(&delta_lock);
+    if (!threaded) {
+        r.result = build_chain(&r.chain, r.out);
+    }
+
+    pthread_mutex_lock(&delta_lock);
+    restores[idx] = r;
+    restore_state[idx] = threaded ? 1 : 3;
+    if (threaded) pthread_cond_signal(&delta_cond);
+    pthread_mutex_unlock(&delta_lock);
+    return 0;
+}
+
+void version_restore_cancel(int idx) {
+    if (idx < 0 || idx >= MAX_CLIENTS) return;
+    pthread_mutex_lock(&delta_lock);
+    if (restore_state[idx] == 1) {
+        free(restores[idx].chain.links);
+        restore_state[idx] = 0;
+    } else if (restore_state[idx] != 0) {
+        restores[idx].dropped = 1;      // its file is removed once built
+    }
+    pthread_mutex_unlock(&delta_lock);
+}
+
+// Hand finished rebuilds to their connection. Returns how many are
+// still waiting or being built
+static int collect_restores(void) {
+    int pending = 0;
+    pthread_mutex_lock(&delta_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (restore_state[i] != 3) {
+            if (restore_state[i] != 0) pending++;
+            continue;
+        }
+        RestoreJob r = restores[i];
+        restore_state[i] = 0;
+        pthread_mutex_unlock(&delta_lock);
+
+        if (r.result == -2) {
+            log_error(-1, 0, "Version %d of file_id=%d does not match its SHA-256",
+                      r.version_no, r.file_id);
+        }
+        if (r.dropped) {
+            if (r.result == 0) unlink(r.out);
+        } else {
+            r.done(i, r.result == 0 ? 0 : -1);
+        }
+        free(r.chain.links);
+
+        pthread_mutex_lock(&delta_lock);
+    }
+    pthread_mutex_unlock(&delta_lock);
+    return pending;
+}
+
+// Commit what the thread encoded: the version points at its delta, and
+// its whole blob goes once nothing else uses it
+static void commit_delta(const DeltaJob *j) {
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s%s", j->out, TMP_SUFFIX);
+
+    char query[2400];
+    if (j->result != 0) {
+        unlink(tmp);
+        if (j->result < 0) {
+            log_error(-1, 0, "Delta encoding of %s failed, the version stays whole", j->target);
+        }
+        snprintf(query, sizeof(query),
+                 "UPDATE file_versions SET delta_tried=1 WHERE version_id=%d", j->version_id);
+        mysql_query(conn, query);
+        return;
+    }
+    if (rename(tmp, j->out) != 0) {
+        unlink(tmp);
+        return;
+    }
+
+    // Only if the version is still the one that was encoded
+    char out_sql[1024];
+    char target_sql[1024];
+    mysql_real_escape_string(conn, out_sql, j->out, strlen(j->out));
+    mysql_real_escape_string(conn, target_sql, j->target, strlen(j->target));
+    snprintf(query, sizeof(query),
+             "UPDATE file_versions SET storage='delta', file_path='%s', delta_tried=1 "
+             "WHERE version_id=%d AND storage='full' AND file_path='%s'",
+             out_sql, j->version_id, target_sql);
+    if (mysql_query(conn, query) != 0 || mysql_affected_rows(conn) != 1) {
+        unlink(j->out);
+        return;
+    }
+
+    struct stat st;
+    long long delta_size = (stat(j->out, &st) == 0) ? (long long)st.st_size : 0;
+    log_info(-1, 0, "Version version_id=%d of file_id=%d stored as a delta (%lld -> %lld bytes)",
+             j->version_id, j->file_id, j->target_size, delta_size);
+    if (blob_referenced(j->target) == 0) {
+        drop_blob(j->target);
+    }
+}
+
+// Next whole version worth encoding, with its base. 1 (job filled), 0, -1
+static int pick_version(DeltaJob *j) {
+    char query[700];
+    snprintf(query, sizeof(query),
+             "SELECT v.version_id, v.file_id, v.version_no, v.file_path, v.file_size "
+             "FROM file_versions v JOIN files f ON f.file_id=v.file_id "
+             "WHERE v.storage='full' AND v.delta_tried=0 AND v.file_size>=%d AND f.is_deleted=0 "
+             "ORDER BY v.version_id LIMIT 1",
+             VERSION_DELTA_MIN);
+    if (mysql_query(conn, query) != 0) return -1;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return -1;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    int version_no = 0;
+    if (row) {
+        memset(j, 0, sizeof(*j));
+        j->version_id = row[0] ? atoi(row[0]) : 0;
+        j->file_id = row[1] ? atoi(row[1]) : 0;
+        version_no = row[2] ? atoi(row[2]) : 0;
+        snprintf(j->target, sizeof(j->target), "%s", row[3] ? row[3] : "");
+        j->target_size = row[4] ? atoll(row[4]) : 0;
+    }
+    mysql_free_result(res);
+    if (!row) return 0;
+
+    // Base: the next newer version, or the file's content for the newest
+    snprintf(query, sizeof(query),
+             "SELECT storage, file_path, file_size FROM file_versions "
+             "WHERE file_id=%d AND version_no>%d ORDER BY version_no LIMIT 1",
+             j->file_id, version_no);
+    if (mysql_query(conn, query) != 0) return -1;
+    res = mysql_store_result(conn);
+    if (!res) return -1;
+    row = mysql_fetch_row(res);
+    int base_is_delta = 0;
+    if (row) {
+        base_is_delta = row[0] && strcmp(row[0], "delta") == 0;
+        snprintf(j->base, sizeof(j->base), "%s", row[1] ? row[1] : "");
+        j->base_size = row[2] ? atoll(row[2]) : 0;
+    }
+    mysql_free_result(res);
+
+    FileHead head;
+    if (!row) {
+        int found = version_load_head(j->file_id, &head);
+        if (found < 0) return -1;
+        if (found == 0) return 0;
+        snprintf(j->base, sizeof(j->base), "%s", head.path);
+        j->base_pack = head.pack;
+        j->base_size = head.size;
+    }
+
+    // A delta base would have to be rebuilt first: leave the version whole
+    const char *slash = strrchr(j->target, '/');
+    if (base_is_delta || !slash) {
+        snprintf(query, sizeof(query),
+                 "UPDATE file_versions SET delta_tried=1 WHERE version_id=%d", j->version_id);
+        return mysql_query(conn, query) == 0 ? 0 : -1;
+    }
+    snprintf(j->out, sizeof(j->out), "%.*s/delta_%d", (int)(slash - j->target), j->target,
+             j->version_id);
+    return 1;
+}
+
+int version_poll(void) {
+    int restoring = collect_restores();
+
+    pthread_mutex_lock(&delta_lock);
+    int state = job_state;
+    pthread_mutex_unlock(&delta_lock);
+
+    // Committing a delta may remove a whole blob a rebuild reads from
+    if (state == 3 && restoring == 0) {
+        commit_delta(&job);
+        state = 0;
+    }
+    if (state == 0 && delta_running) {
+        DeltaJob next;
+        int picked = pick_version(&next);
+        if (picked < 0) {
+            log_error(-1, 0, "Versions: cannot pick a version to encode: %s", mysql_error(conn));
+        }
+        pthread_mutex_lock(&delta_lock);
+        if (picked > 0) {
+            job = next;
+            pthread_cond_signal(&delta_cond);
+        }
+        job_state = picked > 0 ? 1 : 0;
+        state = job_state;
+        pthread_mutex_unlock(&delta_lock);
+    }
+    if (restoring > 0) return 2;
+    return state != 0 ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+#ifndef VERSIONS_H
+#define VERSIONS_H
+
+#include <stddef.h>
+#include "pack_store.h"
+
+// File versions. Uploading a file under the name of a live file in the
+// same directory replaces that file's content instead of adding a second
+// row: the old content is archived as the next row of `file_versions`
+// (version_no 1, 2, ...) and the `files` row keeps its file_id. Its new
+// blob never overwrites the old one: it goes to "<dir>/rev_<file_id>_<n>"
+// (or into a pack segment), and a packed old content is copied out to
+// "<dir>/ver_<file_id>_<n>" since segments are compacted behind the
+// rows' back.
+//
+// Versions are stored as reverse deltas. The current content is always
+// whole; a background job re-encodes an archived version as a delta
+// against the next newer one (or the current content for the newest),
+// matching content-defined chunks (utils/cdc.h), and unlinks its blob
+// once nothing else uses it. Reading version n therefore starts from the
+// nearest whole content above it and applies the deltas down to n, and
+// dropping the oldest versions never breaks a chain.
+//
+// Delta file: a DeltaHeader, then operations in host byte order
+//
+//   'C' u64 offset u32 length     copy length bytes of the base
+//   'L' u32 length <bytes>        literal bytes
+//
+// Retention (storage/gc.c): a file keeps its last VERSION_KEEP versions,
+// none archived more than VERSION_MAX_AGE_DAYS ago.
+#define VERSION_KEEP 10
+#define VERSION_MAX_AGE_DAYS 30
+#define VERSION_DELTA_MIN (256 * 1024)   // smaller versions stay whole
+#define VERSION_DELTA_MAX_PCT 80         // keep whole unless the delta is smaller
+#define VERSION_IO_SIZE (1024 * 1024)
+#define VERSION_DELTA_MAGIC "CDV1"
+
+typedef struct {
+    char magic[4];                   // VERSION_DELTA_MAGIC
+    uint32_t reserved;
+    uint64_t base_size;
+    uint64_t target_size;
+} DeltaHeader;
+
+// The live row whose content is being replaced
+typedef struct {
+    int file_id;
+    int group_id;
+    int dir_id;
+    long long size;
+    PackRef pack;
+    char path[512];
+} FileHead;
+
+// New content: exactly one of temp_path (finished blob, moved into place),
+// shared_path (an existing blob the row will share) or pack
+typedef struct {
+    const char *temp_path;
+    int compressed;                  // temp_path has a frame index
+    const char *shared_path;
+    PackRef pack;
+    long long size;
+    const char *sha256;              // hex, "" if unknown
+    int user_id;
+} VersionContent;
+
+// Newest live file called name in dir_id. 1 found, 0 none, -1 DB error
+int version_find_head(int dir_id, const char *name, FileHead *head);
+
+// Live file file_id. 1 found, 0 none, -1 DB error
+int version_load_head(int file_id, FileHead *head);
+
+// path, or "path~<n>" if some row or version still uses path (a new
+// upload must not overwrite it). 0, or -1 on DB error / no free name
+int version_free_path(const char *path, char *out, size_t size);
+
+// Archive head's content as its next version and give it c instead, in
+// one transaction with the directory aggregates. Returns the version_no
+// archived, or -1 (the new content's temp blob is then removed)
+int version_replace_content(const FileHead *head, const char *dir_path, const VersionContent *c);
+
+// Rebuild version_no of file_id as a plain file at out_path, checked
+// against its SHA-256, for connection idx (RESTORE_VERSION). Off the
+// event loop: the chain is read now, the encoder thread rebuilds it ahead
+// of any delta still to encode, and version_poll() then calls
+// done(idx, 0 or -1). One per connection. 0 queued, -1 (DB error, idx
+// already waiting)
+typedef void (*version_restored_fn)(int idx, int rc);
+int version_restore_start(int idx, int file_id, int version_no, const char *out_path,
+                          version_restored_fn done);
+
+// Connection idx closed: no callback, its rebuilt file is removed
+void version_restore_cancel(int idx);
+
+// Delta encoder thread. Versions it has not encoded stay whole
+int version_start(void);
+void version_stop(void);
+
+// Event loop: hand finished rebuilds over, commit a finished delta, hand
+// the next version to the thread. 2 while a rebuild is pending, 1 if
+// other work is left, 0 when idle
+int version_poll(void);
+
+#endif
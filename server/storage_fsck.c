@@ -0,0 +1,90 @@
+// storage_fsck: kiểm tra offline bảng files với thư mục storage/ (chạy từ
+// thư mục server, cùng chỗ với ./storage)
+//
+//   ./storage_fsck [-j workers] [--verify] [--no-orphans] [-o plan]
+//   ./storage_fsck --apply plan
+//
+// Mã thoát: 0 = không có vấn đề, 2 = có vấn đề (xem plan), 1 = lỗi
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "database/db.h"
+#include "storage/fsck.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-j workers] [--verify] [--no-orphans] [-o plan]\n"
+            "       %s --apply plan\n", prog, prog);
+}
+
+int main(int argc, char **argv) {
+    FsckOptions opt = { FSCK_DEFAULT_WORKERS, 0, 1 };
+    const char *plan_path = FSCK_PLAN_PATH;
+    const char *apply_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opt.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            opt.verify_hash = 1;
+        } else if (strcmp(argv[i], "--no-orphans") == 0) {
+            opt.check_orphans = 0;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            plan_path = argv[++i];
+        } else if (strcmp(argv[i], "--apply") == 0 && i + 1 < argc) {
+            apply_path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    MYSQL *db = db_connect();
+    if (!db) return 1;
+
+    // Thực hiện plan đã có: mỗi hành động được kiểm tra lại trước khi làm
+    if (apply_path) {
+        FILE *plan = fopen(apply_path, "r");
+        if (!plan) {
+            perror(apply_path);
+            mysql_close(db);
+            return 1;
+        }
+        int skipped = 0;
+        int applied = fsck_apply(db, plan, &skipped);
+        fclose(plan);
+        if (applied < 0) {
+            fprintf(stderr, "Apply failed: %s\n", mysql_error(db));
+            mysql_close(db);
+            return 1;
+        }
+        printf("%d action(s) applied, %d skipped\n", applied, skipped);
+        mysql_close(db);
+        return 0;
+    }
+
+    FILE *plan = fopen(plan_path, "w");
+    if (!plan) {
+        perror(plan_path);
+        mysql_close(db);
+        return 1;
+    }
+    FsckStats stats;
+    int rc = fsck_run(db, &opt, plan, &stats);
+    fclose(plan);
+    if (rc != 0) {
+        fprintf(stderr, "Check failed: %s\n", mysql_error(db));
+    }
+    mysql_close(db);
+
+    printf("%lld rows: %lld missing, %lld size mismatch, %lld hash mismatch, %lld unreadable\n"
+           "%lld orphan(s), %lld bytes\n"
+           "Plan: %s\n",
+           stats.rows, stats.missing, stats.size_mismatch, stats.hash_mismatch, stats.errors,
+           stats.orphans, stats.orphan_bytes, plan_path);
+
+    if (rc != 0) return 1;
+    long long problems = stats.missing + stats.size_mismatch + stats.hash_mismatch + stats.orphans;
+    return problems > 0 ? 2 : 0;
+}
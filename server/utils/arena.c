@@ -0,0 +1,136 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ArenaSlab {
+    ArenaSlab *next;
+    size_t size;               // usable bytes in data
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+static _Thread_local Arena thread_arena;
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static ArenaSlab *slab_new(Arena *a, size_t min_size) {
+    size_t size = (min_size > ARENA_SLAB_SIZE) ? align_up(min_size) : ARENA_SLAB_SIZE;
+    ArenaSlab *s = (ArenaSlab *)malloc(sizeof(ArenaSlab) + size);
+    if (!s) return NULL;
+
+    s->next = NULL;
+    s->size = size;
+    s->used = 0;
+    a->slab_mallocs++;
+    return s;
+}
+
+Arena *arena_thread(void) {
+    return &thread_arena;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = align_up(size ? size : 1);
+
+    if (!a->cur) {
+        if (!a->first) {
+            a->first = slab_new(a, size);
+            if (!a->first) return NULL;
+        }
+        a->cur = a->first;
+    }
+
+    // Later slabs were kept from earlier, bigger requests: reuse them first
+    while (a->cur->used + size > a->cur->size) {
+        if (!a->cur->next) {
+            a->cur->next = slab_new(a, size);
+            if (!a->cur->next) return NULL;
+        }
+        a->cur = a->cur->next;
+    }
+
+    void *p = a->cur->data + a->cur->used;
+    a->cur->used += size;
+
+    a->allocs++;
+    a->used += size;
+    if (a->used > a->peak) a->peak = a->used;
+    return p;
+}
+
+void *arena_calloc(Arena *a, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+
+    void *p = arena_alloc(a, count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    size_t len = strnlen(s, n);
+    char *p = (char *)arena_alloc(a, len + 1);
+    if (!p) return NULL;
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+void arena_reset(Arena *a) {
+    for (ArenaSlab *s = a->first; s; s = s->next) {
+        s->used = 0;
+    }
+    a->cur = a->first;
+    a->used = 0;
+    a->resets++;
+}
+
+void arena_destroy(Arena *a) {
+    ArenaSlab *s = a->first;
+    while (s) {
+        ArenaSlab *next = s->next;
+        free(s);
+        s = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+#ifdef COUNT_ALLOCS
+
+// Linked with -Wl,--wrap=malloc,... (see Makefile): every call from our
+// objects lands here first. Allocations made inside shared libraries
+// (libmysqlclient, OpenSSL) are not seen.
+static long long malloc_calls = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    malloc_calls++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    malloc_calls++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    malloc_calls++;
+    return __real_realloc(ptr, size);
+}
+
+long long alloc_count(void) {
+    return malloc_calls;
+}
+
+#else
+
+long long alloc_count(void) {
+    return -1;
+}
+
+#endif
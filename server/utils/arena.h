@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for memory that lives exactly as long as one command.
+// Allocation is a pointer bump inside the current slab; arena_reset
+// rewinds to the first slab without freeing anything, so once the slabs
+// have grown to what the busiest command needs, handling a command
+// costs no malloc at all. Each thread gets its own arena.
+#define ARENA_SLAB_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaSlab ArenaSlab;
+
+typedef struct {
+    ArenaSlab *first;
+    ArenaSlab *cur;
+    size_t used;               // bytes handed out since the last reset
+    size_t peak;               // largest `used` seen
+    uint64_t allocs;           // arena_alloc calls
+    uint64_t slab_mallocs;     // slabs malloc'd (0 growth = steady state)
+    uint64_t resets;
+} Arena;
+
+// The calling thread's arena
+Arena *arena_thread(void);
+
+// Never fails for sizes that fit in memory; returns NULL only if malloc does
+void *arena_alloc(Arena *a, size_t size);
+void *arena_calloc(Arena *a, size_t count, size_t size);
+char *arena_strndup(Arena *a, const char *s, size_t n);
+
+// Invalidate everything allocated, keep the slabs
+void arena_reset(Arena *a);
+void arena_destroy(Arena *a);
+
+// malloc/calloc/realloc calls made by the server's own code since
+// startup. Counted only in a `make COUNT_ALLOCS=1` build; -1 otherwise.
+long long alloc_count(void);
+
+#endif
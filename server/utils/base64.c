@@ -0,0 +1,380 @@
+#include "base64.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_HAVE_X86 1
+#endif
+
+static const char encode_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const signed char decode_table[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// A SIMD kernel consumes whole blocks from the front of the buffer and
+// returns how far it got; the scalar code finishes the tail (and the
+// padded last quantum), so kernels never deal with '='.
+typedef size_t (*encode_kernel)(const unsigned char *in, size_t len, char *out);
+typedef size_t (*decode_kernel)(const unsigned char *in, size_t len,
+                                unsigned char *out, size_t out_size, size_t *out_pos);
+
+// ============================
+// Scalar (no block kernel: the generic loop does everything)
+// ============================
+
+static size_t encode_scalar(const unsigned char *in, size_t len, char *out) {
+    (void)in; (void)len; (void)out;
+    return 0;
+}
+
+static size_t decode_scalar(const unsigned char *in, size_t len,
+                            unsigned char *out, size_t out_size, size_t *out_pos) {
+    (void)in; (void)len; (void)out; (void)out_size;
+    *out_pos = 0;
+    return 0;
+}
+
+// ============================
+// SSSE3 / AVX2
+// ============================
+
+#ifdef BASE64_HAVE_X86
+
+// 6-bit indices -> ASCII (Muła, "pshufb improved" lookup)
+__attribute__((target("ssse3")))
+static inline __m128i enc_lookup_sse(__m128i idx) {
+    const __m128i shift_lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+    r = _mm_shuffle_epi8(shift_lut, r);
+    return _mm_add_epi8(r, idx);
+}
+
+// 12 input bytes (in the low 12 of 16) -> 16 six-bit indices
+__attribute__((target("ssse3")))
+static inline __m128i enc_split_sse(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                           4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const unsigned char *in, size_t len, char *out) {
+    size_t i = 0;
+    size_t o = 0;
+    // Each step reads 16 bytes but only consumes 12
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + o), enc_lookup_sse(enc_split_sse(v)));
+        i += 12;
+        o += 16;
+    }
+    return i;
+}
+
+// ASCII -> 6-bit values; returns 0 if any byte is outside the alphabet
+__attribute__((target("ssse3")))
+static inline int dec_translate_sse(__m128i in, __m128i *values) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+    __m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+    __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                 _mm_or_si128(_mm_or_si128(digit, plus), slash));
+    if (_mm_movemask_epi8(valid) != 0xFFFF) {
+        return 0;
+    }
+
+    __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-65));
+    shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(-71)));
+    shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(4)));
+    shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(19)));
+    shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(16)));
+    *values = _mm_add_epi8(in, shift);
+    return 1;
+}
+
+// 16 six-bit values -> 12 bytes in the low part of the register
+__attribute__((target("ssse3")))
+static inline __m128i dec_pack_sse(__m128i values) {
+    __m128i ab_cd = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i abcd = _mm_madd_epi16(ab_cd, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const unsigned char *in, size_t len,
+                           unsigned char *out, size_t out_size, size_t *out_pos) {
+    size_t i = 0;
+    size_t o = 0;
+    // Keep the last quantum for the scalar path (it may hold padding);
+    // each store writes 16 bytes of which 12 are kept
+    while (i + 16 + 4 <= len && o + 16 <= out_size) {
+        __m128i values;
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        if (!dec_translate_sse(v, &values)) break;
+        _mm_storeu_si128((__m128i *)(out + o), dec_pack_sse(values));
+        i += 16;
+        o += 12;
+    }
+    *out_pos = o;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const unsigned char *in, size_t len, char *out) {
+    const __m256i split_shuffle = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift_lut = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+
+    size_t i = 0;
+    size_t o = 0;
+    // 24 bytes -> 32 characters; the second lane loads 16 bytes at +12
+    while (i + 28 <= len) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + i))),
+            _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+
+        v = _mm256_shuffle_epi8(v, split_shuffle);
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t1, t3);
+
+        __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+        r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        r = _mm256_shuffle_epi8(shift_lut, r);
+        _mm256_storeu_si256((__m256i *)(out + o), _mm256_add_epi8(r, idx));
+
+        i += 24;
+        o += 32;
+    }
+
+    // Hand remaining full blocks to the 128-bit kernel
+    return i + encode_ssse3(in + i, len - i, out + o);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const unsigned char *in, size_t len,
+                          unsigned char *out, size_t out_size, size_t *out_pos) {
+    const __m256i pack_shuffle = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t i = 0;
+    size_t o = 0;
+    while (i + 32 + 4 <= len && o + 32 <= out_size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        __m256i plus = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+        __m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+                                        _mm256_or_si256(_mm256_or_si256(digit, plus), slash));
+        if ((unsigned int)_mm256_movemask_epi8(valid) != 0xFFFFFFFFu) break;
+
+        __m256i shift = _mm256_and_si256(upper, _mm256_set1_epi8(-65));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(lower, _mm256_set1_epi8(-71)));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(digit, _mm256_set1_epi8(4)));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(plus, _mm256_set1_epi8(19)));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(slash, _mm256_set1_epi8(16)));
+        __m256i values = _mm256_add_epi8(v, shift);
+
+        __m256i ab_cd = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i abcd = _mm256_madd_epi16(ab_cd, _mm256_set1_epi32(0x00011000));
+        __m256i packed = _mm256_shuffle_epi8(abcd, pack_shuffle);
+        // Close the 4-byte gap between the two 12-byte lanes
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256((__m256i *)(out + o), packed);
+
+        i += 32;
+        o += 24;
+    }
+
+    size_t tail_out = 0;
+    size_t used = decode_ssse3(in + i, len - i, out + o, out_size - o, &tail_out);
+    *out_pos = o + tail_out;
+    return i + used;
+}
+
+#endif
+
+// ============================
+// Runtime dispatch
+// ============================
+
+static encode_kernel active_encode = NULL;
+static decode_kernel active_decode = NULL;
+static const char *active_name = "scalar";
+
+static void select_kernels(void) {
+    active_encode = encode_scalar;
+    active_decode = decode_scalar;
+    active_name = "scalar";
+
+#ifdef BASE64_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        active_encode = encode_avx2;
+        active_decode = decode_avx2;
+        active_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        active_encode = encode_ssse3;
+        active_decode = decode_ssse3;
+        active_name = "ssse3";
+    }
+#endif
+}
+
+const char *base64_impl_name(void) {
+    if (!active_encode) select_kernels();
+    return active_name;
+}
+
+int base64_select_impl(const char *name) {
+    if (!name) return -1;
+    if (strcmp(name, "scalar") == 0) {
+        active_encode = encode_scalar;
+        active_decode = decode_scalar;
+        active_name = "scalar";
+        return 0;
+    }
+#ifdef BASE64_HAVE_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+        active_encode = encode_ssse3;
+        active_decode = decode_ssse3;
+        active_name = "ssse3";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        active_encode = encode_avx2;
+        active_decode = decode_avx2;
+        active_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+int base64_encode(const unsigned char *data, size_t len, char *out, size_t out_size) {
+    if (!out || out_size == 0) return -1;
+    if (!data && len > 0) return -1;
+
+    size_t encoded_len = BASE64_ENCODED_LEN(len);
+    if (encoded_len + 1 > out_size) return -1;
+
+    if (!active_encode) select_kernels();
+
+    size_t i = active_encode(data, len, out);
+    size_t j = (i / 3) * 4;
+
+    while (i + 2 < len) {
+        out[j++] = encode_table[(data[i] >> 2) & 0x3F];
+        out[j++] = encode_table[((data[i] & 0x3) << 4) | ((data[i + 1] >> 4) & 0xF)];
+        out[j++] = encode_table[((data[i + 1] & 0xF) << 2) | ((data[i + 2] >> 6) & 0x3)];
+        out[j++] = encode_table[data[i + 2] & 0x3F];
+        i += 3;
+    }
+
+    if (i < len) {
+        out[j++] = encode_table[(data[i] >> 2) & 0x3F];
+        if (i + 1 == len) {
+            out[j++] = encode_table[(data[i] & 0x3) << 4];
+            out[j++] = '=';
+        } else {
+            out[j++] = encode_table[((data[i] & 0x3) << 4) | ((data[i + 1] >> 4) & 0xF)];
+            out[j++] = encode_table[(data[i + 1] & 0xF) << 2];
+        }
+        out[j++] = '=';
+    }
+
+    out[j] = '\0';
+    return (int)encoded_len;
+}
+
+int base64_decode(const char *in, size_t in_len,
+                  unsigned char *out, size_t out_size, size_t *out_len) {
+    if (!in || !out_len) return -1;
+    if (in_len == 0) {
+        *out_len = 0;
+        return 0;
+    }
+    if (!out || in_len % 4 != 0) return -1;
+
+    if (!active_decode) select_kernels();
+
+    const unsigned char *src = (const unsigned char *)in;
+    size_t o = 0;
+    size_t i = active_decode(src, in_len, out, out_size, &o);
+
+    for (; i < in_len; i += 4) {
+        int a = decode_table[src[i]];
+        int b = decode_table[src[i + 1]];
+        if (a < 0 || b < 0) return -1;
+
+        int last = (i + 4 == in_len);
+        int pad3 = last && src[i + 3] == '=';
+        int pad2 = pad3 && src[i + 2] == '=';
+
+        int c = pad2 ? 0 : decode_table[src[i + 2]];
+        int d = pad3 ? 0 : decode_table[src[i + 3]];
+        if (c < 0 || d < 0) return -1;
+
+        size_t n = pad2 ? 1 : (pad3 ? 2 : 3);
+        if (o + n > out_size) return -1;
+
+        out[o++] = (unsigned char)((a << 2) | (b >> 4));
+        if (n > 1) out[o++] = (unsigned char)(((b & 0x0F) << 4) | (c >> 2));
+        if (n > 2) out[o++] = (unsigned char)(((c & 0x03) << 6) | d);
+    }
+
+    *out_len = o;
+    return 0;
+}
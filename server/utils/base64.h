@@ -0,0 +1,31 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <stddef.h>
+
+// Shared base64 codec for the text transfer path (server and client).
+// Picks an AVX2 or SSSE3 kernel at runtime when the CPU has one and
+// falls back to a scalar loop otherwise. Nothing here allocates.
+
+// Encoded length of len bytes, without the terminating NUL
+#define BASE64_ENCODED_LEN(len) ((((len) + 2) / 3) * 4)
+
+// Upper bound of decoded bytes for in_len base64 characters
+#define BASE64_DECODED_MAX(in_len) (((in_len) / 4) * 3)
+
+// Encode len bytes into out (NUL terminated). Returns encoded length or -1
+int base64_encode(const unsigned char *data, size_t len, char *out, size_t out_size);
+
+// Decode in_len characters into the caller's buffer. Returns 0 or -1 on
+// malformed input / short buffer; *out_len receives the decoded length
+int base64_decode(const char *in, size_t in_len,
+                  unsigned char *out, size_t out_size, size_t *out_len);
+
+// Name of the kernel selected for this CPU ("avx2", "ssse3", "scalar")
+const char *base64_impl_name(void);
+
+// Force a kernel by name (base64_bench). 0, or -1 if unknown or this
+// CPU lacks it
+int base64_select_impl(const char *name);
+
+#endif
@@ -0,0 +1,50 @@
+#include "cdc.h"
+#include <pthread.h>
+
+#define CDC_MASK ((1ULL << CDC_AVG_BITS) - 1)
+
+// ============================
+// Gear table: one random 64-bit value per byte value
+// ============================
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// splitmix64, fixed seed: boundaries must not change between runs
+static void build_gear(void) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 256; i++) {
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_next_chunk(const unsigned char *data, size_t len) {
+    pthread_once(&gear_once, build_gear);
+
+    if (len <= CDC_MIN_CHUNK) return len;
+    size_t limit = (len < CDC_MAX_CHUNK) ? len : CDC_MAX_CHUNK;
+
+    // Bytes before the minimum size cannot end a chunk: skip hashing them
+    // except for the 64 the hash still remembers
+    uint64_t h = 0;
+    for (size_t i = CDC_MIN_CHUNK - 64; i < limit; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (i >= CDC_MIN_CHUNK && (h & CDC_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+uint64_t cdc_hash(const unsigned char *data, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
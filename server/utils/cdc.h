@@ -0,0 +1,25 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-defined chunking (gear hash, as in FastCDC). A boundary falls
+// where the rolling hash of the last bytes matches a mask, so an insert
+// or delete only moves the boundaries around it: the chunks of two
+// revisions of a file line up again right after the edit, whatever its
+// offset. Used to delta-encode old file versions (storage/versions.h).
+#define CDC_MIN_CHUNK (2 * 1024)
+#define CDC_AVG_BITS 13              // boundary on average every 8 KiB
+#define CDC_MAX_CHUNK (64 * 1024)
+
+// Length of the chunk starting at data. With fewer than CDC_MAX_CHUNK
+// bytes left the caller must pass all that remain of the stream (the
+// last chunk may be cut short), or refill first.
+size_t cdc_next_chunk(const unsigned char *data, size_t len);
+
+// Fingerprint of a chunk (64-bit FNV-1a); equal chunks are still
+// confirmed byte for byte
+uint64_t cdc_hash(const unsigned char *data, size_t len);
+
+#endif
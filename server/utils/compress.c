@@ -0,0 +1,162 @@
+#include "compress.h"
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <zstd.h>
+#include <lz4.h>
+
+// Chunks are small (2 KB), so a low level keeps compression well under
+// the cost of the base64 step while still catching repetitive text
+#define ZSTD_TRANSFER_LEVEL 3
+
+// Sample at most this many bytes when estimating entropy
+#define ENTROPY_SAMPLE_MAX 4096
+
+// Above this many bits/byte the data is treated as already compressed
+#define ENTROPY_THRESHOLD 7.2
+
+const char *codec_name(CodecType codec) {
+    switch (codec) {
+        case CODEC_LZ4:  return "lz4";
+        case CODEC_ZSTD: return "zstd";
+        default:         return "none";
+    }
+}
+
+int codec_from_name(const char *name) {
+    if (!name) return -1;
+    if (strcasecmp(name, "none") == 0 || strcasecmp(name, "raw") == 0) return CODEC_NONE;
+    if (strcasecmp(name, "lz4") == 0) return CODEC_LZ4;
+    if (strcasecmp(name, "zstd") == 0) return CODEC_ZSTD;
+    return -1;
+}
+
+int codec_parse_list(const char *list) {
+    if (!list) return 0;
+
+    int mask = 0;
+    char name[16];
+    const char *p = list;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > 0 && len < sizeof(name)) {
+            memcpy(name, p, len);
+            name[len] = '\0';
+            int codec = codec_from_name(name);
+            if (codec > CODEC_NONE) {
+                mask |= CODEC_MASK(codec);
+            }
+        }
+        if (!end) break;
+        p = end + 1;
+    }
+    return mask & CODEC_SUPPORTED_MASK;
+}
+
+CodecType codec_pick(int mask) {
+    if (mask & CODEC_MASK(CODEC_ZSTD)) return CODEC_ZSTD;
+    if (mask & CODEC_MASK(CODEC_LZ4)) return CODEC_LZ4;
+    return CODEC_NONE;
+}
+
+size_t codec_bound(CodecType codec, size_t src_len) {
+    switch (codec) {
+        case CODEC_LZ4:  return (size_t)LZ4_compressBound((int)src_len);
+        case CODEC_ZSTD: return ZSTD_compressBound(src_len);
+        default:         return src_len;
+    }
+}
+
+int codec_compress(CodecType codec, const void *src, size_t src_len,
+                   void *dst, size_t dst_cap) {
+    if (!src || !dst) return -1;
+
+    switch (codec) {
+        case CODEC_LZ4: {
+            int n = LZ4_compress_default((const char *)src, (char *)dst,
+                                         (int)src_len, (int)dst_cap);
+            return n > 0 ? n : -1;
+        }
+        case CODEC_ZSTD: {
+            size_t n = ZSTD_compress(dst, dst_cap, src, src_len, ZSTD_TRANSFER_LEVEL);
+            return ZSTD_isError(n) ? -1 : (int)n;
+        }
+        default:
+            if (src_len > dst_cap) return -1;
+            memcpy(dst, src, src_len);
+            return (int)src_len;
+    }
+}
+
+int codec_decompress(CodecType codec, const void *src, size_t src_len,
+                     void *dst, size_t dst_cap) {
+    if (!src || !dst) return -1;
+
+    switch (codec) {
+        case CODEC_LZ4: {
+            int n = LZ4_decompress_safe((const char *)src, (char *)dst,
+                                        (int)src_len, (int)dst_cap);
+            return n >= 0 ? n : -1;
+        }
+        case CODEC_ZSTD: {
+            size_t n = ZSTD_decompress(dst, dst_cap, src, src_len);
+            return ZSTD_isError(n) ? -1 : (int)n;
+        }
+        default:
+            if (src_len > dst_cap) return -1;
+            memcpy(dst, src, src_len);
+            return (int)src_len;
+    }
+}
+
+// Magic numbers of formats that never shrink further
+static int has_compressed_magic(const unsigned char *p, size_t len) {
+    static const struct { unsigned char magic[4]; size_t len; } formats[] = {
+        {{0x1f, 0x8b}, 2},               // gzip
+        {{'P', 'K', 0x03, 0x04}, 4},     // zip, docx, jar, apk
+        {{0x28, 0xb5, 0x2f, 0xfd}, 4},   // zstd
+        {{0x04, 0x22, 0x4d, 0x18}, 4},   // lz4 frame
+        {{0xfd, '7', 'z', 'X'}, 4},      // xz
+        {{'B', 'Z', 'h'}, 3},            // bzip2
+        {{'7', 'z', 0xbc, 0xaf}, 4},     // 7z
+        {{0x89, 'P', 'N', 'G'}, 4},      // png
+        {{0xff, 0xd8, 0xff}, 3},         // jpeg
+        {{'G', 'I', 'F', '8'}, 4},       // gif
+        {{'R', 'a', 'r', '!'}, 4},       // rar
+    };
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (len >= formats[i].len && memcmp(p, formats[i].magic, formats[i].len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int codec_should_compress(const unsigned char *sample, size_t len) {
+    if (!sample || len < 64) {
+        // Too small to be worth the framing overhead
+        return 0;
+    }
+    if (has_compressed_magic(sample, len)) {
+        return 0;
+    }
+
+    if (len > ENTROPY_SAMPLE_MAX) len = ENTROPY_SAMPLE_MAX;
+
+    unsigned int counts[256] = {0};
+    for (size_t i = 0; i < len; i++) {
+        counts[sample[i]]++;
+    }
+
+    // Shannon entropy in bits per byte
+    double entropy = 0.0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        double p = (double)counts[i] / (double)len;
+        entropy -= p * log2(p);
+    }
+
+    return entropy < ENTROPY_THRESHOLD;
+}
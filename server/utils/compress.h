@@ -0,0 +1,42 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Codecs for per-chunk transfer compression (also used for blobs stored compressed)
+typedef enum {
+    CODEC_NONE = 0,
+    CODEC_LZ4  = 1,
+    CODEC_ZSTD = 2
+} CodecType;
+
+// Bitmask of codecs, as negotiated with HELLO
+#define CODEC_MASK(c) (1 << (c))
+#define CODEC_SUPPORTED_MASK (CODEC_MASK(CODEC_LZ4) | CODEC_MASK(CODEC_ZSTD))
+
+// Protocol name of a codec ("none", "lz4", "zstd")
+const char *codec_name(CodecType codec);
+
+// Codec from its protocol name, -1 if unknown
+int codec_from_name(const char *name);
+
+// Parse a comma separated list ("zstd,lz4") into a mask of supported codecs
+int codec_parse_list(const char *list);
+
+// Best codec in a mask (zstd > lz4), CODEC_NONE if the mask is empty
+CodecType codec_pick(int mask);
+
+// Worst-case compressed size for src_len bytes
+size_t codec_bound(CodecType codec, size_t src_len);
+
+// Compress/decompress one independent block. Returns output length or -1
+int codec_compress(CodecType codec, const void *src, size_t src_len,
+                   void *dst, size_t dst_cap);
+int codec_decompress(CodecType codec, const void *src, size_t src_len,
+                     void *dst, size_t dst_cap);
+
+// Sample the first block of a transfer: 1 if worth compressing,
+// 0 for already-compressed formats or high-entropy data
+int codec_should_compress(const unsigned char *sample, size_t len);
+
+#endif
@@ -0,0 +1,161 @@
+#include "crc32c.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_HAVE_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_HAVE_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u  // reflected Castagnoli polynomial
+
+typedef uint32_t (*crc_kernel)(uint32_t crc, const unsigned char *p, size_t len);
+
+// ============================
+// Table (slicing-by-8)
+// ============================
+
+static uint32_t crc_table[8][256];
+static int table_ready = 0;
+
+static void build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+    table_ready = 1;
+}
+
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                             (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+                      (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+// ============================
+// Hardware
+// ============================
+
+#ifdef CRC32C_HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#if defined(__x86_64__)
+    uint64_t c64 = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c64;
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_HAVE_ARM
+static uint32_t crc_armv8(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// ============================
+// Dispatch
+// ============================
+
+static crc_kernel active_kernel = NULL;
+static const char *active_name = "table";
+
+static void select_kernel(void) {
+    active_kernel = crc_sw;
+    active_name = "table";
+
+#if defined(CRC32C_HAVE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        active_kernel = crc_sse42;
+        active_name = "sse4.2";
+    }
+#elif defined(CRC32C_HAVE_ARM)
+    active_kernel = crc_armv8;
+    active_name = "armv8";
+#endif
+
+    if (active_kernel == crc_sw && !table_ready) {
+        build_table();
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    if (!active_kernel) select_kernel();
+    if (!data || len == 0) return crc;
+    return ~active_kernel(~crc, (const unsigned char *)data, len);
+}
+
+const char *crc32c_impl_name(void) {
+    if (!active_kernel) select_kernel();
+    return active_name;
+}
+
+int crc32c_parse(const char *hex, uint32_t *out) {
+    if (!hex || !out) return -1;
+
+    size_t len = strlen(hex);
+    if (len == 0 || len > 8) return -1;
+
+    char *end = NULL;
+    unsigned long v = strtoul(hex, &end, 16);
+    if (!end || *end != '\0') return -1;
+
+    *out = (uint32_t)v;
+    return 0;
+}
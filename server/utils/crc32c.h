@@ -0,0 +1,21 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) used to check every transfer chunk end to end.
+// Uses the SSE4.2 / ARMv8 crc instructions when available, a
+// slicing-by-8 table otherwise.
+
+// Extend crc with len bytes. Start with crc = 0; the result can be fed
+// back in to checksum data that arrives in pieces.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// Name of the implementation in use ("sse4.2", "armv8", "table")
+const char *crc32c_impl_name(void);
+
+// Parse the 8-digit hex form used on the wire ("crc=%08x"). Returns 0 or -1
+int crc32c_parse(const char *hex, uint32_t *out);
+
+#endif
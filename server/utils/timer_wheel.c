@@ -0,0 +1,171 @@
+#include "timer_wheel.h"
+#include <string.h>
+#include <time.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static void list_init(Timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static int list_empty(const Timer *head) {
+    return head->next == head;
+}
+
+static void list_push(Timer *head, Timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+// Move every timer of src onto dst (dst must be empty)
+static void list_take(Timer *dst, Timer *src) {
+    list_init(dst);
+    if (list_empty(src)) return;
+
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    list_init(src);
+}
+
+static void place(TimerWheel *w, Timer *t) {
+    uint64_t e = t->expires;
+    uint64_t delta = (e > w->now_tick) ? e - w->now_tick : 0;
+
+    if (delta == 0) {
+        // Due now (only from a cascade, which runs before the current
+        // level-0 slot is expired)
+        e = w->now_tick;
+        t->expires = e;
+    }
+
+    int level = 0;
+    while (level < TW_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (TW_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    uint64_t max_delta = ((uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+    if (delta > max_delta) {
+        // Beyond the top level: park at the furthest slot, re-placed on cascade
+        e = w->now_tick + max_delta;
+    }
+
+    int slot = (int)((e >> (TW_SLOT_BITS * level)) & TW_MASK);
+    list_push(&w->slots[level][slot], t);
+}
+
+// Re-place the timers of one higher-level slot; returns the slot index
+static int cascade(TimerWheel *w, int level) {
+    int slot = (int)((w->now_tick >> (TW_SLOT_BITS * level)) & TW_MASK);
+
+    Timer pending;
+    list_take(&pending, &w->slots[level][slot]);
+    while (!list_empty(&pending)) {
+        Timer *t = pending.next;
+        list_unlink(t);
+        place(w, t);
+    }
+    return slot;
+}
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(TimerWheel *w, uint32_t tick_ms, uint64_t now_ms) {
+    memset(w, 0, sizeof(*w));
+    w->origin_ms = now_ms;
+    w->tick_ms = tick_ms ? tick_ms : 1;
+    for (int l = 0; l < TW_LEVELS; l++) {
+        for (int s = 0; s < TW_SLOTS; s++) {
+            list_init(&w->slots[l][s]);
+        }
+    }
+}
+
+void timer_init(Timer *t, timer_fn fn, void *arg) {
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+int timer_armed(const Timer *t) {
+    return t->next != NULL;
+}
+
+void timer_wheel_add(TimerWheel *w, Timer *t, uint64_t delay_ms) {
+    if (timer_armed(t)) {
+        list_unlink(t);
+        w->count--;
+    }
+
+    uint64_t ticks = (delay_ms + w->tick_ms - 1) / w->tick_ms;
+    t->expires = w->now_tick + (ticks ? ticks : 1);
+    place(w, t);
+    w->count++;
+}
+
+void timer_wheel_cancel(TimerWheel *w, Timer *t) {
+    if (timer_armed(t)) {
+        list_unlink(t);
+        w->count--;
+    }
+}
+
+void timer_wheel_advance(TimerWheel *w, uint64_t now_ms) {
+    uint64_t target = (now_ms > w->origin_ms) ? (now_ms - w->origin_ms) / w->tick_ms : 0;
+
+    while (w->now_tick < target) {
+        w->now_tick++;
+
+        // Lower wheel wrapped: pull the next slot of each level above down
+        if ((w->now_tick & TW_MASK) == 0) {
+            for (int l = 1; l < TW_LEVELS; l++) {
+                if (cascade(w, l) != 0) break;
+            }
+        }
+
+        Timer due;
+        list_take(&due, &w->slots[0][w->now_tick & TW_MASK]);
+        while (!list_empty(&due)) {
+            Timer *t = due.next;
+            list_unlink(t);
+            w->count--;
+            if (t->fn) {
+                t->fn(t, t->arg);
+            }
+        }
+    }
+}
+
+long timer_wheel_next_ms(const TimerWheel *w, uint64_t now_ms) {
+    if (w->count == 0) return -1;
+
+    // Ticks until the next cascade, which may bring timers down to level 0
+    uint64_t limit = TW_SLOTS - (w->now_tick & TW_MASK);
+
+    uint64_t ticks = limit;
+    for (uint64_t k = 1; k < limit; k++) {
+        if (!list_empty(&w->slots[0][(w->now_tick + k) & TW_MASK])) {
+            ticks = k;
+            break;
+        }
+    }
+
+    uint64_t due_ms = w->origin_ms + (w->now_tick + ticks) * w->tick_ms;
+    return (due_ms > now_ms) ? (long)(due_ms - now_ms) : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel: TW_LEVELS levels of TW_SLOTS slots, each
+// level 64x coarser than the one below. Adding, cancelling and
+// expiring a timer is O(1); timers further out are cascaded down a
+// level when the wheel below wraps.
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+
+typedef struct Timer Timer;
+typedef void (*timer_fn)(Timer *t, void *arg);
+
+// Embedded in the owner's struct; must stay at a fixed address while armed
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires;          // absolute tick
+    timer_fn fn;
+    void *arg;
+};
+
+typedef struct {
+    uint64_t origin_ms;        // monotonic time of tick 0
+    uint32_t tick_ms;
+    uint64_t now_tick;
+    int count;                 // armed timers
+    Timer slots[TW_LEVELS][TW_SLOTS];   // list heads
+} TimerWheel;
+
+// Monotonic clock in milliseconds
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(TimerWheel *w, uint32_t tick_ms, uint64_t now_ms);
+void timer_init(Timer *t, timer_fn fn, void *arg);
+
+// Arm t to fire delay_ms from the wheel's current time (re-arms if armed)
+void timer_wheel_add(TimerWheel *w, Timer *t, uint64_t delay_ms);
+void timer_wheel_cancel(TimerWheel *w, Timer *t);
+int timer_armed(const Timer *t);
+
+// Run every timer due at now_ms. Callbacks may add or cancel timers.
+void timer_wheel_advance(TimerWheel *w, uint64_t now_ms);
+
+// Milliseconds until the wheel next needs advancing, -1 if nothing is armed
+long timer_wheel_next_ms(const TimerWheel *w, uint64_t now_ms);
+
+#endif
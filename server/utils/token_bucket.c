@@ -0,0 +1,44 @@
+#include "token_bucket.h"
+
+void token_bucket_init(TokenBucket *b, double rate, double burst, uint64_t now_ms) {
+    b->rate = (rate > 0) ? rate : 0;
+    b->burst = (burst > 0) ? burst : b->rate;
+    b->tokens = b->burst;
+    b->last_ms = now_ms;
+}
+
+void token_bucket_set(TokenBucket *b, double rate, double burst, uint64_t now_ms) {
+    token_bucket_refill(b, now_ms);
+    b->rate = (rate > 0) ? rate : 0;
+    b->burst = (burst > 0) ? burst : b->rate;
+    if (b->tokens > b->burst) {
+        b->tokens = b->burst;
+    }
+}
+
+void token_bucket_refill(TokenBucket *b, uint64_t now_ms) {
+    if (now_ms <= b->last_ms) return;
+
+    b->tokens += b->rate * (double)(now_ms - b->last_ms) / 1000.0;
+    if (b->tokens > b->burst) {
+        b->tokens = b->burst;
+    }
+    b->last_ms = now_ms;
+}
+
+int token_bucket_ready(TokenBucket *b, uint64_t now_ms) {
+    if (b->rate <= 0) return 1;
+    token_bucket_refill(b, now_ms);
+    return b->tokens >= 0;
+}
+
+void token_bucket_charge(TokenBucket *b, double bytes) {
+    if (b->rate <= 0) return;
+    b->tokens -= bytes;
+}
+
+long token_bucket_wait_ms(TokenBucket *b, uint64_t now_ms) {
+    if (token_bucket_ready(b, now_ms)) return 0;
+    // Round up so the caller does not wake a hair too early
+    return (long)(-b->tokens * 1000.0 / b->rate) + 1;
+}
@@ -0,0 +1,32 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+// Byte-rate limiter. Tokens refill at `rate` per second up to `burst`.
+// A charge may take the bucket below zero: a large transfer is let
+// through whole and the debt is paid back before the next one.
+typedef struct {
+    double rate;            // bytes per second, 0 = unlimited
+    double burst;
+    double tokens;
+    uint64_t last_ms;
+} TokenBucket;
+
+// burst 0 = one second worth of rate
+void token_bucket_init(TokenBucket *b, double rate, double burst, uint64_t now_ms);
+
+// Change rate/burst, keeping the tokens already earned (capped at the new burst)
+void token_bucket_set(TokenBucket *b, double rate, double burst, uint64_t now_ms);
+
+void token_bucket_refill(TokenBucket *b, uint64_t now_ms);
+
+// 1 if the bucket is not in debt (always for unlimited buckets)
+int token_bucket_ready(TokenBucket *b, uint64_t now_ms);
+
+void token_bucket_charge(TokenBucket *b, double bytes);
+
+// Milliseconds until the bucket is ready again, 0 if it is now
+long token_bucket_wait_ms(TokenBucket *b, uint64_t now_ms);
+
+#endif